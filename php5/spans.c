@@ -23,6 +23,10 @@ long tw_span_create(char *category, size_t category_len TSRMLS_DC)
 		return -1;
 	}
 
+	if (TWG(span_stack_depth) > 0) {
+		parent = TWG(span_stack)[TWG(span_stack_depth) - 1];
+	}
+
 	MAKE_STD_ZVAL(span);
 	MAKE_STD_ZVAL(starts);
 	MAKE_STD_ZVAL(stops);
@@ -132,3 +136,107 @@ void tw_span_annotate_string(long spanId, char *key, char *value, int copy TSRML
 
 	add_assoc_stringl_ex(*span_annotations, key, strlen(key)+1, value, len, copy);
 }
+
+/**
+ * Collect all closed timers of all spans, the root span only when with_root
+ * is set, into an emalloc'ed array ordered by span. Returns the number of
+ * intervals collected.
+ */
+int tw_span_intervals(tw_span_interval **intervals, int with_root TSRMLS_DC)
+{
+	zval **span, **category, **starts, **stops, **start, **stop, **parent;
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong idx;
+	uint i, timers;
+	int count = 0, size = 0;
+
+	*intervals = NULL;
+
+	if (TWG(spans) == NULL) {
+		return 0;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(TWG(spans)), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(TWG(spans)), (void **) &span, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(TWG(spans)), &pos)) {
+
+		if (zend_hash_get_current_key_ex(Z_ARRVAL_P(TWG(spans)), &key, &key_len, &idx, 0, &pos) != HASH_KEY_IS_LONG ||
+				(idx == 0 && !with_root) || Z_TYPE_PP(span) != IS_ARRAY) {
+			continue;
+		}
+
+		if (zend_hash_find(Z_ARRVAL_PP(span), "n", sizeof("n"), (void **) &category) == FAILURE ||
+				zend_hash_find(Z_ARRVAL_PP(span), "b", sizeof("b"), (void **) &starts) == FAILURE ||
+				zend_hash_find(Z_ARRVAL_PP(span), "e", sizeof("e"), (void **) &stops) == FAILURE ||
+				Z_TYPE_PP(category) != IS_STRING) {
+			continue;
+		}
+
+		if (zend_hash_find(Z_ARRVAL_PP(span), "p", sizeof("p"), (void **) &parent) == FAILURE) {
+			parent = NULL;
+		}
+
+		timers = MIN(zend_hash_num_elements(Z_ARRVAL_PP(starts)), zend_hash_num_elements(Z_ARRVAL_PP(stops)));
+
+		for (i = 0; i < timers; i++) {
+			if (zend_hash_index_find(Z_ARRVAL_PP(starts), i, (void **) &start) == FAILURE ||
+					zend_hash_index_find(Z_ARRVAL_PP(stops), i, (void **) &stop) == FAILURE ||
+					Z_LVAL_PP(stop) < Z_LVAL_PP(start)) {
+				continue;
+			}
+
+			if (count == size) {
+				size = size > 0 ? size * 2 : 64;
+				*intervals = erealloc(*intervals, size * sizeof(tw_span_interval));
+			}
+
+			(*intervals)[count].category = Z_STRVAL_PP(category);
+			(*intervals)[count].span = idx;
+			(*intervals)[count].parent = parent != NULL ? Z_LVAL_PP(parent) : (idx > 0 ? 0 : -1);
+			(*intervals)[count].start = Z_LVAL_PP(start);
+			(*intervals)[count].end = Z_LVAL_PP(stop);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Call callback with every string annotation of a span.
+ */
+void tw_span_annotations(long spanId, tw_span_annotation_callback callback, void *context TSRMLS_DC)
+{
+	zval **span, **span_annotations, **value;
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong num_key;
+
+	if (spanId == -1 || TWG(spans) == NULL) {
+		return;
+	}
+
+	if (zend_hash_index_find(Z_ARRVAL_P(TWG(spans)), spanId, (void **) &span) == FAILURE) {
+		return;
+	}
+
+	if (zend_hash_find(Z_ARRVAL_PP(span), "a", sizeof("a"), (void **) &span_annotations) == FAILURE ||
+			Z_TYPE_PP(span_annotations) != IS_ARRAY) {
+		return;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_PP(span_annotations), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_PP(span_annotations), (void **) &value, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_PP(span_annotations), &pos)) {
+
+		if (zend_hash_get_current_key_ex(Z_ARRVAL_PP(span_annotations), &key, &key_len, &num_key, 0, &pos) != HASH_KEY_IS_STRING ||
+				Z_TYPE_PP(value) != IS_STRING) {
+			continue;
+		}
+
+		callback(key, key_len - 1, Z_STRVAL_PP(value), Z_STRLEN_PP(value), context);
+	}
+}
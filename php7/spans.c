@@ -23,6 +23,10 @@ long tw_span_create(char *category, size_t category_len TSRMLS_DC)
 		return -1;
 	}
 
+	if (TWG(span_stack_depth) > 0) {
+		parent = TWG(span_stack)[TWG(span_stack_depth) - 1];
+	}
+
 	array_init(&span);
 	array_init(&starts);
 	array_init(&stops);
@@ -137,3 +141,95 @@ void tw_span_annotate_string(long spanId, char *key, char *value, int copy)
 		add_assoc_str_ex(span_annotations, key, key_len, value_trunc);
 	}
 }
+
+/**
+ * Collect all closed timers of all spans, the root span only when with_root
+ * is set, into an emalloc'ed array ordered by span. Returns the number of
+ * intervals collected.
+ */
+int tw_span_intervals(tw_span_interval **intervals, int with_root TSRMLS_DC)
+{
+	zval *span, *category, *starts, *stops, *start, *stop, *parent;
+	zend_ulong idx;
+	uint32_t i, timers;
+	int count = 0, size = 0;
+
+	*intervals = NULL;
+
+	if (Z_TYPE(TWG(spans)) != IS_ARRAY) {
+		return 0;
+	}
+
+	ZEND_HASH_FOREACH_NUM_KEY_VAL(Z_ARRVAL(TWG(spans)), idx, span) {
+		if ((idx == 0 && !with_root) || Z_TYPE_P(span) != IS_ARRAY) {
+			continue;
+		}
+
+		category = zend_hash_str_find(Z_ARRVAL_P(span), "n", sizeof("n") - 1);
+		starts = zend_hash_str_find(Z_ARRVAL_P(span), "b", sizeof("b") - 1);
+		stops = zend_hash_str_find(Z_ARRVAL_P(span), "e", sizeof("e") - 1);
+		parent = zend_hash_str_find(Z_ARRVAL_P(span), "p", sizeof("p") - 1);
+
+		if (category == NULL || starts == NULL || stops == NULL || Z_TYPE_P(category) != IS_STRING) {
+			continue;
+		}
+
+		timers = MIN(zend_hash_num_elements(Z_ARRVAL_P(starts)), zend_hash_num_elements(Z_ARRVAL_P(stops)));
+
+		for (i = 0; i < timers; i++) {
+			start = zend_hash_index_find(Z_ARRVAL_P(starts), i);
+			stop = zend_hash_index_find(Z_ARRVAL_P(stops), i);
+
+			if (start == NULL || stop == NULL || Z_LVAL_P(stop) < Z_LVAL_P(start)) {
+				continue;
+			}
+
+			if (count == size) {
+				size = size > 0 ? size * 2 : 64;
+				*intervals = erealloc(*intervals, size * sizeof(tw_span_interval));
+			}
+
+			(*intervals)[count].category = Z_STRVAL_P(category);
+			(*intervals)[count].span = idx;
+			(*intervals)[count].parent = parent != NULL ? Z_LVAL_P(parent) : (idx > 0 ? 0 : -1);
+			(*intervals)[count].start = Z_LVAL_P(start);
+			(*intervals)[count].end = Z_LVAL_P(stop);
+			count++;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	return count;
+}
+
+/**
+ * Call callback with every string annotation of a span.
+ */
+void tw_span_annotations(long spanId, tw_span_annotation_callback callback, void *context TSRMLS_DC)
+{
+	zval *span, *span_annotations, *value;
+	zend_string *key;
+
+	if (spanId == -1 || Z_TYPE(TWG(spans)) != IS_ARRAY) {
+		return;
+	}
+
+	span = zend_hash_index_find(Z_ARRVAL(TWG(spans)), spanId);
+
+	if (span == NULL) {
+		return;
+	}
+
+	span_annotations = zend_hash_str_find(Z_ARRVAL_P(span), "a", sizeof("a") - 1);
+
+	if (span_annotations == NULL || Z_TYPE_P(span_annotations) != IS_ARRAY) {
+		return;
+	}
+
+	ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(span_annotations), key, value) {
+		if (key == NULL || Z_TYPE_P(value) != IS_STRING) {
+			continue;
+		}
+
+		callback(ZSTR_VAL(key), ZSTR_LEN(key), Z_STRVAL_P(value), Z_STRLEN_P(value), context);
+	} ZEND_HASH_FOREACH_END();
+}
@@ -55,6 +55,10 @@ extern zend_module_entry tideways_module_entry;
 #define TIDEWAYS_FLAGS_NO_COMPILE    0x0010 /* do not profile require/include/eval */
 #define TIDEWAYS_FLAGS_NO_SPANS      0x0020
 #define TIDEWAYS_FLAGS_NO_HIERACHICAL 0x0040
+#define TIDEWAYS_FLAGS_ALLOCATIONS   0x0080 /* count allocations for funcs, PHP 7 only */
+#define TIDEWAYS_FLAGS_HISTOGRAMS    0x0100 /* wall time histogram per function */
+#define TIDEWAYS_FLAGS_CCT           0x0200 /* calling context tree instead of edges */
+#define TIDEWAYS_FLAGS_TRACE         0x0400 /* record every call in a ring buffer */
 
 /* Constant for ignoring functions, transparent to hierarchical profile */
 #define TIDEWAYS_MAX_FILTERED_FUNCTIONS  256
@@ -62,6 +66,18 @@ extern zend_module_entry tideways_module_entry;
 			   ((TIDEWAYS_MAX_FILTERED_FUNCTIONS + 7)/8)
 #define TIDEWAYS_MAX_ARGUMENT_LEN 256
 
+/* Value of CURLOPT_URL, curl.h is not available to the extension */
+#define TIDEWAYS_CURLOPT_URL 10002
+
+/* Maximum number of Twig template classes whose name is remembered */
+#define TIDEWAYS_TEMPLATE_NAMES_SIZE 1024
+
+/* Value of Redis::PIPELINE passed to Redis::multi() */
+#define TIDEWAYS_REDIS_PIPELINE 2
+
+/* Value of Memcached::RES_SUCCESS returned by Memcached::getResultCode() */
+#define TIDEWAYS_MEMCACHED_RES_SUCCESS 0
+
 
 #if defined( _WIN32 ) || defined( _WIN64 )
 typedef unsigned __int64 tick_t;
@@ -98,6 +114,11 @@ typedef zend_uint uint32_t;
  * *****************************
  */
 
+/* Called with the return value of an internal function, for trace callbacks
+ * that need the result of the call, see tw_trace_callback_return(). */
+struct hp_entry_t;
+typedef void (*tw_trace_return_callback)(struct hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC);
+
 /* Tideways maintains a stack of entries being profiled. The memory for the entry
  * is passed by the layer that invokes BEGIN_PROFILING(), e.g. the hp_execute()
  * function. Often, this is just C-stack memory.
@@ -112,16 +133,179 @@ typedef struct hp_entry_t {
 	uint64					cpu_start;		   /* start value for CPU clock timer */
 	long int                mu_start_hprof;                    /* memory usage */
 	long int                pmu_start_hprof;              /* peak memory usage */
+	uint64                  alloc_bytes_start;        /* bytes allocated so far */
+	uint64                  alloc_count_start;  /* allocations made so far */
 	struct hp_entry_t      *prev_hprof;    /* ptr to prev entry being profiled */
 	uint8                   hash_code;     /* hash_code for the function name  */
 	long int				span_id; /* span id of this entry if any, otherwise -1 */
+	tw_trace_return_callback return_cb; /* called with the return value if set */
+	int                     cct_node; /* calling context of this entry, or -1 */
+	uint32                  trace_function; /* function id in the trace buffer */
+	uint64                  calls_start;   /* calls made so far, including this one */
 } hp_entry_t;
 
+/* Executions of one SQL fingerprint below the same parent frame, counted
+ * per fingerprint and frame to detect N+1 query patterns */
+typedef struct tw_sql_repeat {
+	hp_entry_t *frame;
+	uint64 frame_start;
+	long count;
+	long max;
+} tw_sql_repeat;
+
+/* Log-linear latency histogram in microseconds: values below 16 get their
+ * own bucket, every power of two above is split into 8 buckets, so a bucket
+ * is at most 12.5% wide. Values above 2^35us share the last bucket. */
+#define TIDEWAYS_HISTOGRAM_LINEAR 16
+#define TIDEWAYS_HISTOGRAM_SUB_BITS 3
+#define TIDEWAYS_HISTOGRAM_MAX_EXP 35
+#define TIDEWAYS_HISTOGRAM_BUCKETS (TIDEWAYS_HISTOGRAM_LINEAR + (TIDEWAYS_HISTOGRAM_MAX_EXP - 3) * (1 << TIDEWAYS_HISTOGRAM_SUB_BITS))
+
+typedef struct tw_histogram {
+	uint32 counts[TIDEWAYS_HISTOGRAM_BUCKETS];
+	long count;
+	long max;
+} tw_histogram;
+
+/* Function name interned for the calling context tree, numbered from 1 in
+ * the order the names are first seen */
+typedef struct tw_cct_name {
+	char *name;
+	int id;
+} tw_cct_name;
+
+/* Node of the calling context tree, one per distinct call path. Nodes live
+ * in one array and link each other by index, children always come after
+ * their parent. Names are interned, equal names share the pointer and the
+ * function id. */
+typedef struct tw_cct_node {
+	char *name;
+	int function_id;
+	zend_ulong hash;
+	int parent;
+	int first_child;
+	int last_child;
+	int next_sibling;
+	long ct;
+	long wt;
+	long cpu;
+} tw_cct_node;
+
+/* Estimated bytes of one edge next to its key: bucket, metrics array */
+#define TIDEWAYS_EDGE_BYTES 400
+
+/* Degradation steps when the profiler overhead exceeds its budget */
+#define TIDEWAYS_OVERHEAD_FULL        0
+#define TIDEWAYS_OVERHEAD_NO_BUILTINS 1
+#define TIDEWAYS_OVERHEAD_SPANS_ONLY  2
+
+/* Weight of the last request in the decayed overhead average */
+#define TIDEWAYS_OVERHEAD_DECAY 0.2
+
+/* Flags that change the work done per call, calibrated separately */
+#define TIDEWAYS_CALIBRATION_FLAGS (TIDEWAYS_FLAGS_CPU | TIDEWAYS_FLAGS_MEMORY | TIDEWAYS_FLAGS_NO_SPANS | \
+	TIDEWAYS_FLAGS_NO_HIERACHICAL | TIDEWAYS_FLAGS_ALLOCATIONS | TIDEWAYS_FLAGS_HISTOGRAMS | \
+	TIDEWAYS_FLAGS_CCT | TIDEWAYS_FLAGS_TRACE)
+#define TIDEWAYS_CALIBRATIONS       16
+#define TIDEWAYS_CALIBRATION_CALLS  1000
+#define TIDEWAYS_CALIBRATION_ROUNDS 3
+
+/* Cost of one profiled call to its callers in microseconds */
+typedef struct tw_calibration {
+	uint32 flags;
+	double wt;
+	double cpu;
+} tw_calibration;
+
+/* Per function metrics summed over the profiles of all workers forked from
+ * one master, in a shared memory table of tideways.shm_functions slots.
+ * Slots are claimed by hash with compare and swap and only ever added to.
+ * Names are truncated to TIDEWAYS_SHM_NAME_LEN - 1 bytes before hashing and
+ * comparing, functions sharing that prefix share a slot. */
+#define TIDEWAYS_SHM_NAME_LEN 128
+#define TIDEWAYS_SHM_PROBES   32
+
+typedef struct tw_shm_function {
+	volatile zend_ulong hash; /* 0 while the slot is free */
+	volatile int ready;       /* name is written */
+	char name[TIDEWAYS_SHM_NAME_LEN];
+	volatile int64_t ct;
+	volatile int64_t wt;
+	volatile int64_t cpu;
+	volatile int64_t excl_wt;
+	volatile int64_t excl_cpu;
+} tw_shm_function;
+
+typedef struct tw_shm_table {
+	long size;
+	volatile int64_t profiles;
+	volatile int64_t dropped; /* functions that found no free slot */
+	tw_shm_function functions[1];
+} tw_shm_table;
+
+/* Whether the full profile of a request is kept, see tw_retention_decide() */
+#define TIDEWAYS_RETENTION_OFF     0
+#define TIDEWAYS_RETENTION_DROPPED 1
+#define TIDEWAYS_RETENTION_LATENCY 2
+#define TIDEWAYS_RETENTION_ERROR   3
+#define TIDEWAYS_RETENTION_SPANS   4
+
+/* Function enter or exit in the trace ring buffer, 16 bytes */
+#define TIDEWAYS_TRACE_EXIT 0x80000000
+#define TIDEWAYS_TRACE_BUFFER_MAX 16777216
+
+typedef struct tw_trace_record {
+	uint64 timestamp; /* microseconds since the profiler started */
+	uint32 function;  /* function id, TIDEWAYS_TRACE_EXIT set on exit */
+	uint32 memory;    /* memory usage with TIDEWAYS_FLAGS_MEMORY, otherwise 0 */
+} tw_trace_record;
+
+/* Fetch calls attributed to the span of a PDO statement, written to the
+ * span as fetch_wt and rows annotations by tw_pdo_fetch_flush() */
+typedef struct tw_pdo_fetch {
+	uint64 tsc;
+	long rows;
+} tw_pdo_fetch;
+
+/* Counters of cache spans, written to the span as annotations by
+ * tw_span_counts_flush(). Only counters named in set are written. */
+#define TIDEWAYS_COUNT_KEYS     0x01
+#define TIDEWAYS_COUNT_HITS     0x02
+#define TIDEWAYS_COUNT_COMMANDS 0x04
+
+typedef struct tw_span_counts {
+	long keys;
+	long hits;
+	long misses;
+	long commands;
+	int set;
+} tw_span_counts;
+
+/* Namespace of a MongoCollection or MongoCursor object, looked up once */
+typedef struct tw_mongo_object {
+	zend_class_entry *ce; /* class of the object the entry was created for */
+	char ns[128];
+	int has_ns;
+	int queried; /* cursor ran its query and got a span already */
+} tw_mongo_object;
+
+/* Commands queued on a Redis object between multi()/pipeline() and exec() */
+typedef struct tw_redis_batch {
+	long commands;
+	int pipeline;
+} tw_redis_batch;
+
 typedef struct hp_function_map {
 	char **names;
 	uint8 filter[TIDEWAYS_FILTERED_FUNCTION_SIZE];
 } hp_function_map;
 
+/* Wall time spent in spans of one category, overlapping spans counted once */
+typedef struct tw_span_category {
+	char *name;
+	long  wt;
+} tw_span_category;
+
 typedef struct tw_watch_callback {
 	zend_fcall_info fci;
 	zend_fcall_info_cache fcic;
@@ -156,6 +340,14 @@ ZEND_BEGIN_MODULE_GLOBALS(hp)
 #endif
 	long			current_span_id;
 	uint64			start_time;
+	uint64			start_timestamp; /* microseconds since the epoch */
+	unsigned char	trace_id[16];
+	uint64			trace_id_state; /* private generator for trace ids */
+
+	/* Stack of currently open span ids, innermost span on top */
+	long			*span_stack;
+	int				span_stack_depth;
+	int				span_stack_size;
 
 	zval			*backtrace;
 
@@ -185,9 +377,105 @@ ZEND_BEGIN_MODULE_GLOBALS(hp)
 
 	hp_function_map *filtered_functions;
 
+	/* Budget for the hierarchical profile, 0 means unlimited */
+	long max_edges;
+	long max_bytes;
+
+	/* Edges and estimated bytes used by the hierarchical profile, calls
+	 * folded into (overflow) edges once the budget was reached */
+	long stats_edges;
+	long stats_bytes;
+	long stats_overflow;
+
+	/* Wall time histograms by function name, with TIDEWAYS_FLAGS_HISTOGRAMS */
+	HashTable *histograms;
+
+	/* Calling context tree, with TIDEWAYS_FLAGS_CCT */
+	tw_cct_node *cct_nodes;
+	int cct_count;
+	int cct_size;
+	HashTable *cct_names;
+
+	/* Ring buffer of calls with TIDEWAYS_FLAGS_TRACE, trace_count records
+	 * were written and all but the last trace_size are overwritten */
+	tw_trace_record *trace_records;
+	long trace_size;
+	long trace_count;
+	long trace_buffer_size;
+	HashTable *trace_functions;
+
+	/* Last function id looked up per name hash code, saves the hash lookup
+	 * of trace_functions for most calls */
+	char *trace_function_names[256];
+	uint32 trace_function_ids[256];
+
+	/* Allocations made since profiling started, with TIDEWAYS_FLAGS_ALLOCATIONS */
+	uint64 alloc_bytes;
+	uint64 alloc_count;
+#if PHP_VERSION_ID >= 70000
+	zend_mm_heap *mm_heap;
+	void *(*mm_malloc)(size_t);
+	void (*mm_free)(void *);
+	void *(*mm_realloc)(void *, size_t);
+#endif
+
 	HashTable *trace_watch_callbacks;
 	HashTable *trace_callbacks;
 	HashTable *span_cache;
+	HashTable *sql_repeats;
+	HashTable *sql_statements;
+	HashTable *pdo_statements;
+	HashTable *pdo_fetches;
+	HashTable *span_counts;
+	HashTable *curl_handles;
+	HashTable *curl_multi_spans;
+	HashTable *mongo_objects;
+	HashTable *redis_batches;
+
+	/* Template name by compiled template class, kept across requests */
+	HashTable *template_names;
+
+	/* Return callback requested by the trace callback currently running */
+	tw_trace_return_callback pending_return_cb;
+
+	/* Repetitions of a query below one frame before its span is flagged n+1 */
+	long n_plus_one_threshold;
+
+	/* Time spent in the profiler callbacks during this request and the
+	 * decayed overhead in percent of wall time over the requests of this
+	 * worker, which is kept below overhead_budget by degrading the flags */
+	uint64 overhead_tsc;
+	double overhead_ewma;
+	double overhead_budget;
+	int overhead_level;
+
+	/* Calls profiled so far and the calibrated cost of one call, which is
+	 * subtracted from the callers for the corrected corr_wt and corr_cpu
+	 * metrics when calibrate is enabled. Calibrations are kept per worker. */
+	uint64 calls;
+	int calibrate;
+	tw_calibration *calibration;
+	tw_calibration calibrations[TIDEWAYS_CALIBRATIONS];
+	int calibrations_count;
+
+	/* Annotate http spans with the phases of the transfer, which costs a
+	 * curl_getinfo() call per transfer and is therefore off by default */
+	int http_timings;
+
+	/* Tail based retention thresholds and the decision of the last profile */
+	long retention_threshold;
+	long retention_spans;
+	int retention_reason;
+
+	/* PG(last_error_*) when profiling started, errors raised before that
+	 * stay set for the whole request and do not count for retention */
+	char *error_message_start;
+	int error_type_start;
+	int error_lineno_start;
+
+	/* Per category time breakdown of the spans, computed in hp_stop() */
+	tw_span_category *span_categories;
+	int span_categories_count;
 
 	uint32_t gc_runs; /* number of garbage collection runs */
 	uint32_t gc_collected; /* number of collected items in garbage run */
@@ -221,9 +509,18 @@ PHP_FUNCTION(tideways_prepend_overwritten);
 PHP_FUNCTION(tideways_last_detected_exception);
 PHP_FUNCTION(tideways_last_fatal_error);
 PHP_FUNCTION(tideways_sql_minify);
+PHP_FUNCTION(tideways_object_census);
+PHP_FUNCTION(tideways_cct_export);
+PHP_FUNCTION(tideways_trace_dump);
+PHP_FUNCTION(tideways_retention_reason);
+PHP_FUNCTION(tideways_overhead);
+PHP_FUNCTION(tideways_shm_stats);
 
 PHP_FUNCTION(tideways_span_create);
 PHP_FUNCTION(tideways_get_spans);
+PHP_FUNCTION(tideways_span_breakdown);
+PHP_FUNCTION(tideways_get_histograms);
+PHP_FUNCTION(tideways_span_export);
 PHP_FUNCTION(tideways_span_timer_start);
 PHP_FUNCTION(tideways_span_timer_stop);
 PHP_FUNCTION(tideways_span_annotate);
@@ -1,7 +1,21 @@
 #ifndef TIDEWAYS_SPANS_H
 #define TIDEWAYS_SPANS_H
+
+/* A single start/stop timer pair of a span */
+typedef struct tw_span_interval {
+	char *category;
+	long span;
+	long parent; /* parent span, -1 for the root span */
+	long start;
+	long end;
+} tw_span_interval;
+
+typedef void (*tw_span_annotation_callback)(char *key, size_t key_len, char *value, size_t value_len, void *context);
+
 long tw_span_create(char *category, size_t category_len TSRMLS_DC);
 void tw_span_annotate(long spanId, zval *annotations TSRMLS_DC);
 void tw_span_annotate_long(long spanId, char *key, long value TSRMLS_DC);
 void tw_span_annotate_string(long spanId, char *key, char *value, int copy TSRMLS_DC);
+int tw_span_intervals(tw_span_interval **intervals, int with_root TSRMLS_DC);
+void tw_span_annotations(long spanId, tw_span_annotation_callback callback, void *context TSRMLS_DC);
 #endif
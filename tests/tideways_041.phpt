@@ -0,0 +1,52 @@
+--TEST--
+Tideways: Per Function Inclusive and Exclusive Metrics
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function bar() {
+  return 1;
+}
+
+function foo($x) {
+  $sum = 0;
+  for ($idx = 0; $idx < $x; $idx++) {
+     $sum += bar();
+  }
+  return $sum;
+}
+
+tideways_enable(TIDEWAYS_FLAGS_CPU);
+foo(3);
+foo(2);
+$output = tideways_disable(array('functions' => true));
+
+echo "Edges\n";
+print_canonical($output['edges']);
+echo "\n";
+
+echo "Functions\n";
+print_canonical($output['functions']);
+echo "\n";
+
+$functions = $output['functions'];
+$edges = $output['edges'];
+var_dump($functions['foo']['wt'] === $edges['main()==>foo']['wt']);
+var_dump($functions['foo']['excl_wt'] === $edges['main()==>foo']['wt'] - $edges['foo==>bar']['wt']);
+?>
+--EXPECT--
+Edges
+foo==>bar                               : cpu=*; ct=       5; wt=*;
+main()                                  : cpu=*; ct=       1; wt=*;
+main()==>foo                            : cpu=*; ct=       2; wt=*;
+main()==>tideways_disable               : cpu=*; ct=       1; wt=*;
+
+Functions
+bar                                     : cpu=*; ct=       5; excl_cpu=*; excl_wt=*; wt=*;
+foo                                     : cpu=*; ct=       2; excl_cpu=*; excl_wt=*; wt=*;
+main()                                  : cpu=*; ct=       1; excl_cpu=*; excl_wt=*; wt=*;
+tideways_disable                        : cpu=*; ct=       1; excl_cpu=*; excl_wt=*; wt=*;
+
+bool(true)
+bool(true)
@@ -0,0 +1,61 @@
+--TEST--
+Tideways: Prune Profile to the Most Expensive Edges
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function a() {
+    usleep(20000);
+    b();
+}
+
+function b() {
+    usleep(10000);
+}
+
+function c() {
+}
+
+function d() {
+}
+
+function run($options) {
+    tideways_enable();
+    a();
+    c();
+    d();
+    print_canonical(tideways_disable($options));
+    echo "\n";
+}
+
+echo "top_n=1\n";
+run(array('top_n' => 1));
+
+echo "top_n=2 metric=excl_wt\n";
+run(array('top_n' => 2, 'metric' => 'excl_wt'));
+
+echo "min_share=0.5\n";
+run(array('min_share' => 0.5));
+?>
+--EXPECT--
+top_n=1
+a==>(other)                             : ct=       2; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>(other)                        : ct=       3; wt=*;
+main()==>a                              : ct=       1; wt=*;
+
+top_n=2 metric=excl_wt
+a==>b                                   : ct=       1; wt=*;
+a==>usleep                              : ct=       1; wt=*;
+b==>usleep                              : ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>(other)                        : ct=       3; wt=*;
+main()==>a                              : ct=       1; wt=*;
+
+min_share=0.5
+a==>(other)                             : ct=       1; wt=*;
+a==>usleep                              : ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>(other)                        : ct=       3; wt=*;
+main()==>a                              : ct=       1; wt=*;
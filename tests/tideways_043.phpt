@@ -0,0 +1,54 @@
+--TEST--
+Tideways: Edge Budget folds new Edges into (overflow) and stays within max_edges
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function a() {
+}
+
+function b() {
+}
+
+function c() {
+    a();
+    b();
+}
+
+tideways_enable(0, array('max_edges' => 3));
+a();
+b();
+c();
+a();
+$output = tideways_disable(array('profiler' => true));
+
+print_canonical($output['edges']);
+echo "\n";
+
+$profiler = $output['profiler'];
+printf("edges=%d overflow=%d max_edges=%d max_bytes=%d\n", $profiler['edges'], $profiler['overflow'], $profiler['max_edges'], $profiler['max_bytes']);
+var_dump($profiler['bytes'] > 0);
+
+tideways_enable(0, array('max_edges' => 10));
+foreach (array('abs', 'ceil', 'floor', 'round', 'sqrt', 'exp', 'log', 'sin', 'cos', 'tan',
+        'asin', 'acos', 'atan', 'sinh', 'cosh', 'tanh', 'deg2rad', 'rad2deg', 'decbin', 'dechex') as $function) {
+    $function(1);
+}
+$output = tideways_disable(array('profiler' => true));
+
+printf(
+    "edges=%d within=%s caller_overflow=%d\n",
+    $output['profiler']['edges'],
+    count($output['edges']) <= 10 ? 'yes' : 'no',
+    $output['edges']['main()==>(overflow)']['ct']
+);
+?>
+--EXPECT--
+(overflow)                              : ct=       5; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>a                              : ct=       2; wt=*;
+
+edges=3 overflow=5 max_edges=3 max_bytes=0
+bool(true)
+edges=9 within=yes caller_overflow=14
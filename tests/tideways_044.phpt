@@ -0,0 +1,39 @@
+--TEST--
+Tideways: Allocation bytes and counts per edge
+--SKIPIF--
+<?php
+if (PHP_VERSION_ID < 70300) {
+    die('skip: allocation hooks require PHP 7.3');
+}
+--FILE--
+<?php
+
+function churn() {
+    for ($i = 0; $i < 100; $i++) {
+        $data = str_repeat('x', 10000);
+        unset($data);
+    }
+}
+
+function idle() {
+}
+
+tideways_enable(XHPROF_FLAGS_ALLOCATIONS);
+churn();
+idle();
+$output = tideways_disable();
+
+$churn = $output['main()==>churn'];
+$idle = $output['main()==>idle'];
+
+echo "churn bytes: " . ($churn['alloc_bytes'] >= 100 * 10000 ? 'ok' : $churn['alloc_bytes']) . "\n";
+echo "churn count: " . ($churn['alloc_count'] >= 100 ? 'ok' : $churn['alloc_count']) . "\n";
+echo "idle less than churn: " . ($idle['alloc_bytes'] < $churn['alloc_bytes'] ? 'ok' : 'fail') . "\n";
+echo "main includes churn: " . ($output['main()']['alloc_bytes'] >= $churn['alloc_bytes'] ? 'ok' : 'fail') . "\n";
+echo "no memory metrics: " . (isset($churn['mu']) ? 'fail' : 'ok') . "\n";
+--EXPECT--
+churn bytes: ok
+churn count: ok
+idle less than churn: ok
+main includes churn: ok
+no memory metrics: ok
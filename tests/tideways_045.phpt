@@ -0,0 +1,42 @@
+--TEST--
+Tideways: Object census counts live objects by class
+--FILE--
+<?php
+
+class Small
+{
+}
+
+class Large
+{
+    public $a = 1, $b = 2, $c = 3, $d = 4, $e = 5, $f = 6, $g = 7, $h = 8;
+}
+
+$objects = array();
+
+for ($i = 0; $i < 100; $i++) {
+    $objects[] = new Small();
+}
+
+for ($i = 0; $i < 50; $i++) {
+    $objects[] = new Large();
+}
+
+$freed = new Small();
+unset($freed);
+
+$census = tideways_object_census();
+
+printf("Small: %d\n", $census['Small']['count']);
+printf("Large: %d\n", $census['Large']['count']);
+echo "Large first: " . (key($census) === 'Large' ? 'ok' : 'fail') . "\n";
+echo "Large bigger: " . ($census['Large']['bytes'] > $census['Small']['bytes'] ? 'ok' : 'fail') . "\n";
+
+$census = tideways_object_census(1);
+echo "limit: " . implode(",", array_keys($census)) . "\n";
+--EXPECT--
+Small: 100
+Large: 50
+Large first: ok
+Large bigger: ok
+limit: Large
@@ -0,0 +1,53 @@
+--TEST--
+Tideways: Latency histograms per function and span category
+--FILE--
+<?php
+
+function fast() {
+    usleep(1000);
+}
+
+function slow() {
+    usleep(50000);
+}
+
+tideways_enable(XHPROF_FLAGS_HISTOGRAMS);
+
+for ($i = 0; $i < 20; $i++) {
+    fast();
+}
+slow();
+
+$span = tideways_span_create('sql');
+for ($i = 0; $i < 3; $i++) {
+    tideways_span_timer_start($span);
+    usleep(2000);
+    tideways_span_timer_stop($span);
+}
+
+tideways_disable();
+
+$histograms = tideways_get_histograms();
+$fast = $histograms['functions']['fast'];
+$slow = $histograms['functions']['slow'];
+$sql = $histograms['spans']['sql'];
+
+echo "keys: " . implode(",", array_keys($fast)) . "\n";
+echo "fast count: " . $fast['count'] . "\n";
+echo "fast p50: " . ($fast['p50'] >= 875 && $fast['p50'] <= $fast['max'] ? 'ok' : $fast['p50']) . "\n";
+echo "fast ordered: " . ($fast['p50'] <= $fast['p95'] && $fast['p95'] <= $fast['p99'] ? 'ok' : 'fail') . "\n";
+echo "slow count: " . $slow['count'] . "\n";
+echo "slow p99: " . ($slow['p99'] >= 43750 ? 'ok' : $slow['p99']) . "\n";
+echo "main: " . $histograms['functions']['main()']['count'] . "\n";
+echo "sql count: " . $sql['count'] . "\n";
+echo "sql p50: " . ($sql['p50'] >= 1750 ? 'ok' : $sql['p50']) . "\n";
+--EXPECT--
+keys: count,p50,p95,p99,max
+fast count: 20
+fast p50: ok
+fast ordered: ok
+slow count: 1
+slow p99: ok
+main: 1
+sql count: 3
+sql p50: ok
@@ -0,0 +1,63 @@
+--TEST--
+Tideways: Calling context tree export as collapsed stacks, callgrind and gzip'd pprof
+--FILE--
+<?php
+
+function leaf() {
+    usleep(1000);
+}
+
+function a() {
+    leaf();
+}
+
+function b() {
+    leaf();
+    leaf();
+}
+
+tideways_enable(XHPROF_FLAGS_CCT | XHPROF_FLAGS_NO_BUILTINS);
+
+a();
+b();
+b();
+
+$edges = tideways_disable();
+
+echo "edges: " . count($edges) . "\n";
+
+foreach (explode("\n", trim(tideways_cct_export('collapsed'))) as $line) {
+    list($stack, $wt) = explode(' ', $line);
+    if (substr($stack, -5) === ';leaf') {
+        echo $stack . ($wt >= 1000 ? '' : ' fail') . "\n";
+    }
+}
+
+$callgrind = tideways_cct_export('callgrind');
+echo substr($callgrind, 0, strpos($callgrind, "\n\n")) . "\n";
+preg_match_all('(^calls=(\d+) 0$)m', $callgrind, $matches);
+echo "calls: " . implode(",", $matches[1]) . "\n";
+
+$pprof = tideways_cct_export('pprof');
+echo "pprof: " . (substr($pprof, 0, 2) === "\x1f\x8b" && strpos($pprof, "microseconds") !== false && strpos($pprof, "leaf") !== false ? 'ok' : 'fail') . "\n";
+
+$file = tempnam(sys_get_temp_dir(), 'cct');
+var_dump(tideways_cct_export('pprof', $file));
+echo "file: " . (file_get_contents($file) === $pprof ? 'ok' : 'fail') . "\n";
+unlink($file);
+
+var_dump(@tideways_cct_export('unknown'));
+--EXPECT--
+edges: 0
+main();a;leaf
+main();b;leaf
+# callgrind format
+version: 1
+creator: tideways
+positions: line
+events: Wt
+calls: 1,2,1,4
+pprof: ok
+bool(true)
+file: ok
+bool(false)
@@ -0,0 +1,78 @@
+--TEST--
+Tideways: Trace mode records calls into a ring buffer
+--FILE--
+<?php
+
+function tideways_trace_decode($dump) {
+    $header = unpack('a8magic/Vstart_lo/Vstart_hi/Vfunctions/Vrecords/Vtotal_lo/Vtotal_hi', substr($dump, 0, 32));
+    $offset = 32;
+    $functions = array();
+
+    for ($i = 0; $i < $header['functions']; $i++) {
+        $length = unpack('V', substr($dump, $offset, 4));
+        $functions[] = substr($dump, $offset + 4, $length[1]);
+        $offset += 4 + $length[1];
+    }
+
+    $records = array();
+    for ($i = 0; $i < $header['records']; $i++) {
+        $record = unpack('Vts_lo/Vts_hi/Vfunction/Vmemory', substr($dump, $offset, 16));
+        $exit = ($record['function'] & 0x80000000) != 0;
+        $records[] = array(
+            'ts' => $record['ts_lo'] + $record['ts_hi'] * 4294967296,
+            'exit' => $exit,
+            'function' => $functions[$record['function'] & 0x7FFFFFFF],
+        );
+        $offset += 16;
+    }
+
+    return array($header, $functions, $records);
+}
+
+function bar() {
+}
+
+function foo() {
+    bar();
+}
+
+tideways_enable(XHPROF_FLAGS_TRACE | XHPROF_FLAGS_NO_BUILTINS, array('trace_buffer_size' => 6));
+
+foo();
+foo();
+
+tideways_disable();
+
+$dump = tideways_trace_dump();
+list($header, $functions, $records) = tideways_trace_decode($dump);
+
+echo $header['magic'] . "\n";
+echo "written: " . $header['total_lo'] . "\n";
+echo "functions: " . implode(", ", $functions) . "\n";
+
+$last = 0;
+foreach ($records as $record) {
+    echo ($record['exit'] ? '- ' : '+ ') . $record['function'] . ($record['ts'] >= $last ? '' : ' out of order') . "\n";
+    $last = $record['ts'];
+}
+
+ini_set('xhprof.output_dir', sys_get_temp_dir());
+$file = tideways_trace_dump();
+echo "file: " . (file_get_contents($file) === $dump ? 'ok' : 'fail') . "\n";
+unlink($file);
+
+tideways_enable();
+tideways_disable();
+var_dump(@tideways_trace_dump());
+--EXPECT--
+TWTRACE1
+written: 10
+functions: main(), foo, bar
+- foo
++ foo
++ bar
+- bar
+- foo
+- main()
+file: ok
+bool(false)
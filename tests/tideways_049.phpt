@@ -0,0 +1,44 @@
+--TEST--
+Tideways: Tail based retention keeps full profiles of slow requests only
+--FILE--
+<?php
+
+function work($us) {
+    usleep($us);
+}
+
+function profile($us, $spans = 0) {
+    tideways_enable();
+    work($us);
+    for ($i = 0; $i < $spans; $i++) {
+        tideways_span_create('sql');
+    }
+    $edges = tideways_disable();
+
+    printf(
+        "%s edges=%s spans=%d\n",
+        var_export(tideways_retention_reason(), true),
+        isset($edges['main()==>work']) ? 'full' : implode(',', array_keys($edges)),
+        count(tideways_get_spans())
+    );
+}
+
+profile(1000);
+
+ini_set('tideways.retention_threshold', 50);
+profile(1000, 2);
+profile(60000);
+
+$spans = tideways_get_spans();
+echo "retain: " . $spans[0]['a']['retain'] . "\n";
+
+ini_set('tideways.retention_spans', 3);
+profile(1000, 2);
+profile(1000, 3);
+--EXPECT--
+NULL edges=full spans=1
+false edges=main() spans=1
+'latency' edges=full spans=1
+retain: latency
+false edges=main() spans=1
+'spans' edges=full spans=4
@@ -0,0 +1,47 @@
+--TEST--
+Tideways: Profiler overhead is measured and kept within tideways.overhead_budget
+--FILE--
+<?php
+
+function f() {
+    return str_repeat('a', 2);
+}
+
+function profile() {
+    tideways_enable();
+    for ($i = 0; $i < 100; $i++) {
+        f();
+    }
+    $edges = tideways_disable();
+    $spans = tideways_get_spans();
+    $overhead = tideways_overhead();
+
+    printf(
+        "level=%d edges=%d builtins=%s overhead=%s\n",
+        $overhead['level'],
+        count($edges),
+        isset($edges['f==>str_repeat']) ? 'yes' : 'no',
+        isset($spans[0]['a']['overhead']) && $overhead['overhead'] >= 0 ? 'ok' : 'fail'
+    );
+}
+
+ini_set('tideways.overhead_budget', '0.000001');
+profile();
+profile();
+profile();
+
+ini_set('tideways.overhead_budget', '1000');
+profile();
+
+$overhead = tideways_overhead();
+echo "keys: " . implode(",", array_keys($overhead)) . "\n";
+echo "ewma: " . ($overhead['ewma'] > 0 && $overhead['ewma'] <= 100 ? 'ok' : $overhead['ewma']) . "\n";
+echo "sample_rate: " . $overhead['sample_rate'] . "\n";
+--EXPECT--
+level=0 edges=4 builtins=yes overhead=ok
+level=1 edges=2 builtins=no overhead=ok
+level=2 edges=0 builtins=no overhead=ok
+level=1 edges=2 builtins=no overhead=ok
+keys: overhead,ewma,budget,level,sample_rate
+ewma: ok
+sample_rate: 30
@@ -0,0 +1,53 @@
+--TEST--
+Tideways: Calibrated overhead compensation adds corr_wt and corr_cpu
+--FILE--
+<?php
+
+function leaf() {
+}
+
+function f() {
+    for ($i = 0; $i < 100; $i++) {
+        leaf();
+    }
+}
+
+tideways_enable(TIDEWAYS_FLAGS_CPU);
+f();
+$edges = tideways_disable();
+echo "default: " . (isset($edges['main()==>f']['corr_wt']) ? 'corrected' : 'raw') . "\n";
+
+tideways_enable(TIDEWAYS_FLAGS_CPU, array('calibrate' => true));
+f();
+$data = tideways_disable(array('functions' => true, 'profiler' => true));
+
+foreach (array('main()==>f', 'f==>leaf') as $edge) {
+    $metrics = $data['edges'][$edge];
+    printf(
+        "%s: corr_wt=%s corr_cpu=%s\n",
+        $edge,
+        $metrics['corr_wt'] >= 0 && $metrics['corr_wt'] <= $metrics['wt'] ? 'ok' : 'fail',
+        $metrics['corr_cpu'] >= 0 && $metrics['corr_cpu'] <= $metrics['cpu'] ? 'ok' : 'fail'
+    );
+}
+
+$calibration = array_filter(array_keys($data['edges']), function ($edge) {
+    return strpos($edge, 'tideways_calibrate') !== false;
+});
+echo "calibration edges: " . count($calibration) . "\n";
+echo "excl_corr_wt: " . (isset($data['functions']['f']['excl_corr_wt']) ? 'yes' : 'no') . "\n";
+echo "call_wt: " . ($data['profiler']['call_wt'] > 0 ? 'ok' : 'fail') . "\n";
+
+ini_set('tideways.calibrate', '1');
+tideways_enable();
+f();
+$edges = tideways_disable();
+echo "ini: " . (isset($edges['main()==>f']['corr_wt']) && !isset($edges['main()==>f']['corr_cpu']) ? 'corrected' : 'raw') . "\n";
+--EXPECT--
+default: raw
+main()==>f: corr_wt=ok corr_cpu=ok
+f==>leaf: corr_wt=ok corr_cpu=ok
+calibration edges: 0
+excl_corr_wt: yes
+call_wt: ok
+ini: corrected
@@ -0,0 +1,58 @@
+--TEST--
+Tideways: Shared memory function table sums the profiles of all workers
+--SKIPIF--
+<?php
+if (substr(PHP_OS, 0, 3) == 'WIN') echo "skip: shared memory table not available on Windows\n";
+--INI--
+tideways.shm_functions=1024
+--FILE--
+<?php
+
+function g() {
+}
+
+function f() {
+    g();
+    g();
+}
+
+function profile($calls) {
+    tideways_enable(TIDEWAYS_FLAGS_CPU);
+    for ($i = 0; $i < $calls; $i++) {
+        f();
+    }
+    tideways_disable();
+}
+
+$stats = tideways_shm_stats();
+echo "size: " . $stats['size'] . "\n";
+echo "profiles: " . $stats['profiles'] . "\n";
+echo "functions: " . count($stats['functions']) . "\n";
+
+profile(3);
+profile(2);
+
+$stats = tideways_shm_stats();
+echo "profiles: " . $stats['profiles'] . "\n";
+echo "dropped: " . $stats['dropped'] . "\n";
+
+foreach (array('main()', 'f', 'g') as $name) {
+    $function = $stats['functions'][$name];
+    printf(
+        "%s: ct=%d excl_wt=%s\n",
+        $name,
+        $function['ct'],
+        $function['excl_wt'] >= 0 && $function['excl_wt'] <= $function['wt'] ? 'ok' : 'fail'
+    );
+}
+echo "keys: " . implode(",", array_keys($stats['functions']['f'])) . "\n";
+--EXPECT--
+size: 1024
+profiles: 0
+functions: 0
+profiles: 2
+dropped: 0
+main(): ct=2 excl_wt=ok
+f: ct=5 excl_wt=ok
+g: ct=10 excl_wt=ok
+keys: ct,wt,cpu,excl_wt,excl_cpu
@@ -37,9 +37,11 @@ array(3) {
       int(%d)
     }
     ["a"]=>
-    array(1) {
+    array(2) {
       ["cpu"]=>
       string(%d) "%d"
+      ["php.wt"]=>
+      string(%d) "%d"
     }
   }
   [1]=>
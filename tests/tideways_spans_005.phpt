@@ -40,11 +40,10 @@ print_spans(tideways_get_spans());
 tideways_disable();
 --EXPECTF--
 app: 1 timers - 
-sql: 1 timers - sql=CREATE TABLE baz (id INTEGER)
-sql: 1 timers - sql=SELECT 'foo' FROM 'baz'
-sql: 1 timers - sql=INSERT INTO baz (id) VALUES (1)
-sql: 1 timers - sql=UPDATE baz SET id = 2 WHERE id = 1
-sql: 1 timers - sql=DELETE FROM baz
-sql: 1 timers - sql=SELECT count(*) FROM baz
-sql: 1 timers - sql=SELECT count(*) FROM baz
+sql: 1 timers - fp=c2031e5d6e45a376 sql=CREATE TABLE baz (id INTEGER) title=other
+sql: 1 timers - fp=743d9f8f87586895 sql=SELECT ? FROM ? title=select baz
+sql: 1 timers - fp=a817de3bba94c079 sql=INSERT INTO baz (id) VALUES (?) title=insert baz
+sql: 1 timers - fp=ea4b1faa63f092d2 sql=UPDATE baz SET id = ? WHERE id = ? title=update baz
+sql: 1 timers - fp=f9cc319305b7abff sql=DELETE FROM baz title=delete baz
+sql: 2 timers - fp=0899b5501aba6834 sql=SELECT count(*) FROM baz title=select baz
 sql: 1 timers - title=commit
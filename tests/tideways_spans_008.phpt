@@ -29,7 +29,4 @@ print_spans(tideways_get_spans());
 tideways_disable();
 --EXPECTF--
 app: 1 timers - 
-sql: 1 timers - sql=select * from information_schema.tables
-sql: 1 timers - sql=select * from information_schema.tables
-sql: 1 timers - title=select foo
-sql: 1 timers - title=select bar
+sql: 4 timers - fp=460219006aae99d2 sql=select * from information_schema.tables title=select information_schema.tables
@@ -38,5 +38,5 @@ $data = tideways_disable();
 
 print_Spans(tideways_get_spans());
 --EXPECTF--
-app: 1 timers - cpu=%d
+app: 1 timers - cpu=%d http.wt=%d
 http: 1 timers - method=POST service=soap url=http://ec.europa.eu/taxation_customs/vies/services/checkVatService
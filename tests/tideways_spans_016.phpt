@@ -18,9 +18,22 @@ $mysql = new mysqli('127.0.0.1', 'root', '', 'information_schema');
 $stmt = $mysql->prepare('SELECT * FROM TABLES LIMIT 1');
 $stmt->execute();
 
+$stmt = $mysql->stmt_init();
+$stmt->prepare('SELECT * FROM COLUMNS LIMIT 1');
+$stmt->execute();
+$stmt->execute();
+$stmt->close();
+
+// A new statement must not pick up the SQL of the closed one
+$stmt = $mysql->stmt_init();
+@$stmt->execute();
+
 print_spans(tideways_get_spans());
 tideways_disable();
 --EXPECTF--
 app: 1 timers - 
-sql: 1 timers - sql=SELECT * FROM TABLES LIMIT 1
+sql: 1 timers - fp=192a15f17167aee4 prepare=1 sql=SELECT * FROM TABLES LIMIT ? title=select TABLES
+sql: 1 timers - fp=192a15f17167aee4 sql=SELECT * FROM TABLES LIMIT ? title=select TABLES
+sql: 1 timers - fp=41e6e374aa9c0798 prepare=1 sql=SELECT * FROM COLUMNS LIMIT ? title=select COLUMNS
+sql: 2 timers - fp=41e6e374aa9c0798 sql=SELECT * FROM COLUMNS LIMIT ? title=select COLUMNS
 sql: 1 timers - title=execute
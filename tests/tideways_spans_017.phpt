@@ -136,9 +136,11 @@ array(2) {
       int(%d)
     }
     ["a"]=>
-    array(1) {
+    array(2) {
       ["cpu"]=>
       string(%d) "%d"
+      ["doctrine.wt"]=>
+      string(%d) "%d"
     }
   }
   [1]=>
@@ -20,7 +20,7 @@ $queue->basic_publish(array(), 'amqp.bar');
 tideways_disable();
 print_spans(tideways_get_spans());
 --EXPECTF--
-app: 1 timers - cpu=%d
+app: 1 timers - cpu=%d queue.wt=%d
 queue: 1 timers - title=default
 queue: 1 timers - title=foo
 queue: 1 timers - title=bar
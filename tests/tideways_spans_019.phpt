@@ -46,7 +46,7 @@ tideways_disable();
 print_spans(tideways_get_spans());
 
 --EXPECTF--
-app: 1 timers - cpu=%d
+app: 1 timers - cpu=%d mongo.wt=%d
 mongo: 1 timers - collection=items title=MongoCollection::find
 mongo: 1 timers - collection=items title=MongoCollection::findOne
 mongo: 1 timers - collection=items title=MongoCollection::save
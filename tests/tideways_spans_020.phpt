@@ -15,6 +15,6 @@ tideways_disable();
 
 print_spans(tideways_get_spans());
 --EXPECTF--
-app: 1 timers - cpu=%d
+app: 1 timers - cpu=%d predis.wt=%d
 predis: 1 timers - title=hexists
 predis: 1 timers - title=hget
@@ -0,0 +1,40 @@
+--TEST--
+Tideways: Span Parent/Child Hierarchy
+--FILE--
+<?php
+
+function get_sidebar() {
+    $sql = tideways_span_create('sql');
+    tideways_span_timer_start($sql);
+    tideways_span_timer_stop($sql);
+}
+
+tideways_enable();
+
+$outer = tideways_span_create('php');
+tideways_span_timer_start($outer);
+
+$inner = tideways_span_create('sql');
+tideways_span_timer_start($inner);
+$innermost = tideways_span_create('http');
+tideways_span_timer_stop($inner);
+
+tideways_span_timer_stop($outer);
+
+$sibling = tideways_span_create('php');
+
+get_sidebar();
+
+tideways_disable();
+
+foreach (tideways_get_spans() as $id => $span) {
+    printf("%d %s parent=%s\n", $id, $span['n'], isset($span['p']) ? $span['p'] : '-');
+}
+--EXPECT--
+0 app parent=-
+1 php parent=-
+2 sql parent=1
+3 http parent=2
+4 php parent=-
+5 php parent=-
+6 sql parent=5
@@ -0,0 +1,46 @@
+--TEST--
+Tideways: Span Category Breakdown
+--FILE--
+<?php
+
+tideways_enable();
+
+$outer = tideways_span_create('sql');
+tideways_span_timer_start($outer);
+usleep(1000);
+
+$nested = tideways_span_create('sql');
+tideways_span_timer_start($nested);
+usleep(1000);
+tideways_span_timer_stop($nested);
+
+usleep(1000);
+tideways_span_timer_stop($outer);
+
+$http = tideways_span_create('http');
+tideways_span_timer_start($http);
+usleep(1000);
+tideways_span_timer_stop($http);
+
+tideways_disable();
+
+$spans = tideways_get_spans();
+$breakdown = tideways_span_breakdown();
+ksort($breakdown);
+
+var_dump(array_keys($breakdown));
+var_dump($breakdown['sql'] === $spans[1]['e'][0] - $spans[1]['b'][0]);
+var_dump($breakdown['http'] === $spans[3]['e'][0] - $spans[3]['b'][0]);
+var_dump($spans[0]['a']['sql.wt'] == $breakdown['sql']);
+var_dump($spans[0]['a']['http.wt'] == $breakdown['http']);
+--EXPECT--
+array(2) {
+  [0]=>
+  string(4) "http"
+  [1]=>
+  string(3) "sql"
+}
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,45 @@
+--TEST--
+Tideways: SQL Fingerprints and N+1 Detection
+--SKIPIF--
+<?php
+if (!extension_loaded('pdo_sqlite')) {
+    print "skip: pdo_sqlite not installed\n";
+    exit(1);
+}
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function load_users($pdo) {
+    foreach (array(1, 2, 3, 4, 5) as $id) {
+        $pdo->query("SELECT * FROM users WHERE id = " . $id);
+    }
+}
+
+function load_name($pdo, $id) {
+    return $pdo->query("SELECT name FROM users WHERE id = '" . $id . "'");
+}
+
+tideways_enable(0, array('n_plus_one_threshold' => 3));
+
+$pdo = new PDO('sqlite::memory:');
+$pdo->exec("CREATE TABLE users (id INTEGER, name TEXT)");
+
+load_users($pdo);
+
+for ($id = 1; $id <= 5; $id++) {
+    load_name($pdo, $id);
+}
+
+$pdo->query("SELECT * FROM users WHERE id IN (1, 2, 3)");
+$pdo->query("SELECT * FROM users WHERE id IN (4)");
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECT--
+app: 1 timers - 
+sql: 1 timers - fp=c5f9a82709a50e07 sql=CREATE TABLE users (id INTEGER, name TEXT) title=other
+sql: 5 timers - fp=8aecd125cab18145 n+1=5 sql=SELECT * FROM users WHERE id = ? title=select users
+sql: 5 timers - fp=6dc8ce966759aa8e sql=SELECT name FROM users WHERE id = ? title=select users
+sql: 2 timers - fp=93ff7b01ef6e4d86 sql=SELECT * FROM users WHERE id IN (?) title=select users
@@ -0,0 +1,48 @@
+--TEST--
+Tideways: PDO Fetch Time and Rows
+--SKIPIF--
+<?php
+if (!extension_loaded('pdo_sqlite')) {
+    print "skip: pdo_sqlite not installed\n";
+    exit(1);
+}
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+tideways_enable();
+
+$pdo = new PDO('sqlite::memory:');
+$pdo->exec("CREATE TABLE users (id INTEGER)");
+$pdo->exec("INSERT INTO users (id) VALUES (1)");
+$pdo->exec("INSERT INTO users (id) VALUES (2)");
+$pdo->exec("INSERT INTO users (id) VALUES (3)");
+
+$stmt = $pdo->query("SELECT * FROM users");
+while ($row = $stmt->fetch()) {
+}
+
+$stmt = $pdo->prepare("SELECT id FROM users WHERE id > ?");
+$stmt->execute(array(1));
+$rows = $stmt->fetchAll();
+
+$stmt = $pdo->query("SELECT * FROM users");
+$id = $stmt->fetchColumn();
+
+// A prepared statement reusing the handle of a freed one has no span yet
+unset($stmt);
+$stmt = $pdo->query("DELETE FROM users WHERE id = 0");
+unset($stmt);
+$stmt = $pdo->prepare("SELECT * FROM users");
+$stmt->fetch();
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECTF--
+app: 1 timers - 
+sql: 1 timers - fp=b86065eea2b2c67d sql=CREATE TABLE users (id INTEGER) title=other
+sql: 3 timers - fp=7b1b42b05259c4cc sql=INSERT INTO users (id) VALUES (?) title=insert users
+sql: 2 timers - fetch_wt=%d fp=60e147df8e323f3d rows=4 sql=SELECT * FROM users title=select users
+sql: 1 timers - fetch_wt=%d fp=94d8a7bcbdb73b39 rows=2 sql=SELECT id FROM users WHERE id > ? title=select users
+sql: 1 timers - fp=%s sql=DELETE FROM users WHERE id = ? title=delete users
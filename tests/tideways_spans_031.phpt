@@ -0,0 +1,50 @@
+--TEST--
+Tideways: curl_multi spans
+--SKIPIF--
+<?php
+if (!extension_loaded('curl')) {
+    echo "skip: curl required\n";
+    die;
+}
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+tideways_enable(0, array('http_timings' => true));
+
+$mh = curl_multi_init();
+$handles = array();
+
+foreach (array("http://localhost/phpinfo.php", "http://localhost/index.php") as $url) {
+    $ch = curl_init($url);
+    curl_setopt($ch, CURLOPT_RETURNTRANSFER, true);
+    curl_multi_add_handle($mh, $ch);
+    $handles[] = $ch;
+}
+
+do {
+    $status = curl_multi_exec($mh, $active);
+
+    if ($active) {
+        curl_multi_select($mh, 0.1);
+    }
+
+    while (curl_multi_info_read($mh)) {
+    }
+} while ($active && $status == CURLM_OK);
+
+foreach ($handles as $ch) {
+    curl_multi_remove_handle($mh, $ch);
+}
+
+$ch = curl_init("http://localhost/unfinished.php");
+curl_multi_add_handle($mh, $ch);
+
+tideways_disable();
+print_spans(tideways_get_spans());
+--EXPECTF--
+app: 1 timers - 
+http: 1 timers - connect=%d dns=%d down=%d reused=%d status=%d tls=%d transfer=%d ttfb=%d up=%d url=http://localhost/phpinfo.php
+http: 1 timers - connect=%d dns=%d down=%d reused=%d status=%d tls=%d transfer=%d ttfb=%d up=%d url=http://localhost/index.php
+http: 1 timers - url=http://localhost/unfinished.php
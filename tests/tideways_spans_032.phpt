@@ -0,0 +1,57 @@
+--TEST--
+Tideways: Twig template names are resolved once per template class
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+class Twig_Template
+{
+    static public $calls = 0;
+
+    public function getTemplateName()
+    {
+        self::$calls++;
+
+        return static::NAME;
+    }
+
+    public function display($variables)
+    {
+    }
+
+    public function render($variables)
+    {
+    }
+}
+
+class __TwigTemplate_layout extends Twig_Template
+{
+    const NAME = 'layout.twig';
+}
+
+class __TwigTemplate_sidebar extends Twig_Template
+{
+    const NAME = 'sidebar.twig';
+}
+
+tideways_enable();
+
+for ($i = 0; $i < 3; $i++) {
+    $layout = new __TwigTemplate_layout();
+    $layout->display(array());
+
+    $sidebar = new __TwigTemplate_sidebar();
+    $sidebar->render(array());
+}
+
+print_spans(tideways_get_spans());
+tideways_disable();
+
+echo "getTemplateName() calls: " . Twig_Template::$calls . "\n";
+?>
+--EXPECT--
+app: 1 timers - 
+view: 3 timers - title=layout.twig
+view: 3 timers - title=sidebar.twig
+getTemplateName() calls: 2
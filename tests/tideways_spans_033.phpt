@@ -0,0 +1,52 @@
+--TEST--
+Tideways: Redis command spans aggregated per command
+--SKIPIF--
+<?php
+if (extension_loaded('redis')) {
+    echo "skip: test uses a userland Redis class\n";
+}
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+class Redis
+{
+    const PIPELINE = 2;
+
+    public function get($key) { return $this; }
+    public function set($key, $value) { return $this; }
+    public function incr($key) { return $this; }
+    public function multi($mode = 1) { return $this; }
+    public function pipeline() { return $this; }
+    public function exec() { return array(); }
+    public function discard() { return true; }
+}
+
+tideways_enable();
+
+$redis = new Redis();
+$redis->get('foo');
+$redis->get('bar');
+$redis->set('foo', 1);
+
+$redis->multi()->set('foo', 2)->incr('counter')->exec();
+
+$redis->pipeline();
+$redis->get('foo');
+$redis->get('bar');
+$redis->get('baz');
+$redis->exec();
+
+$redis->multi(Redis::PIPELINE)->incr('counter')->exec();
+
+$redis->multi()->set('foo', 3)->discard();
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECT--
+app: 1 timers - 
+redis: 2 timers - title=get
+redis: 1 timers - title=set
+redis: 1 timers - commands=2 title=multi
+redis: 2 timers - commands=4 title=pipeline
@@ -0,0 +1,40 @@
+--TEST--
+Tideways: Memcached spans with key counts, hits and misses
+--SKIPIF--
+<?php
+if (!extension_loaded('memcached')) {
+    die('skip: memcached extension required');
+}
+$memcached = new Memcached();
+$memcached->addServer('localhost', 11211);
+if (!$memcached->set('tideways_test', 1)) {
+    die('skip: could not connect to memcached');
+}
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+$memcached = new Memcached();
+$memcached->addServer('localhost', 11211);
+$memcached->deleteMulti(array('tw_foo', 'tw_bar', 'tw_baz', 'tw_qux', 'tw_false'));
+
+tideways_enable();
+
+$memcached->setMulti(array('tw_foo' => 1, 'tw_bar' => 2, 'tw_false' => false));
+
+foreach (array('tw_foo', 'tw_bar', 'tw_baz', 'tw_false') as $key) {
+    $memcached->get($key);
+}
+
+$memcached->getMulti(array('tw_foo', 'tw_bar', 'tw_baz', 'tw_qux'));
+$memcached->delete('tw_foo');
+
+print_spans(tideways_get_spans());
+tideways_disable();
+--EXPECT--
+app: 1 timers - 
+memcache: 1 timers - keys=3 title=Memcached::setMulti
+memcache: 4 timers - hits=3 keys=4 misses=1 title=Memcached::get
+memcache: 1 timers - hits=2 keys=4 misses=2 title=Memcached::getMulti
+memcache: 1 timers - keys=1 title=Memcached::delete
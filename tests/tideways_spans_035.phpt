@@ -0,0 +1,61 @@
+--TEST--
+Tideways: Span export as Chrome trace events and OTLP protobuf
+--SKIPIF--
+<?php
+if (!function_exists('json_decode')) {
+    die('skip: json extension required');
+}
+--FILE--
+<?php
+
+tideways_enable();
+
+$sql = tideways_span_create('sql');
+tideways_span_annotate($sql, array('title' => 'select "users"', 'rows' => 3));
+tideways_span_timer_start($sql);
+usleep(1000);
+tideways_span_timer_stop($sql);
+tideways_span_timer_start($sql);
+tideways_span_timer_stop($sql);
+
+tideways_disable();
+
+$chrome = json_decode(tideways_span_export('chrome'), true);
+
+foreach ($chrome['traceEvents'] as $event) {
+    printf("%s %s %s span=%d dur=%s\n", $event['ph'], $event['cat'], $event['name'], $event['args']['span'], $event['dur'] >= 0 ? 'ok' : 'fail');
+}
+echo "rows: " . $chrome['traceEvents'][1]['args']['rows'] . "\n";
+
+$otlp = tideways_span_export('otlp', null, array(
+    'trace_id' => '0102030405060708090a0b0c0d0e0f10',
+    'parent_span_id' => 'a1a2a3a4a5a6a7a8',
+    'service_name' => 'shop',
+));
+$hex = bin2hex($otlp);
+
+echo "trace_id: " . substr_count($hex, '0a100102030405060708090a0b0c0d0e0f10') . "\n";
+echo "root parent: " . substr_count($hex, '2208a1a2a3a4a5a6a7a8') . "\n";
+echo "child parent: " . substr_count($hex, '22080d0e0f1000000001') . "\n";
+echo "service: " . (strpos($otlp, 'service.name') !== false && strpos($otlp, 'shop') !== false ? 'ok' : 'fail') . "\n";
+
+$file = tempnam(sys_get_temp_dir(), 'spans');
+var_dump(tideways_span_export('otlp', $file, array('trace_id' => '0102030405060708090a0b0c0d0e0f10')));
+echo "file: " . (strlen(file_get_contents($file)) > 0 ? 'ok' : 'fail') . "\n";
+unlink($file);
+
+var_dump(@tideways_span_export('otlp', null, array('trace_id' => 'abc')));
+var_dump(@tideways_span_export('unknown'));
+--EXPECT--
+X app app span=0 dur=ok
+X sql select "users" span=1 dur=ok
+X sql select "users" span=1 dur=ok
+rows: 3
+trace_id: 3
+root parent: 1
+child parent: 2
+service: ok
+bool(true)
+file: ok
+bool(false)
+bool(false)
@@ -0,0 +1,49 @@
+--TEST--
+Tideways: Redis command spans with the phpredis extension
+--SKIPIF--
+<?php
+if (!extension_loaded('redis')) {
+    die('skip: redis extension required');
+}
+try {
+    $redis = new Redis();
+    if (!@$redis->connect('127.0.0.1', 6379, 1)) {
+        die('skip: could not connect to redis on 127.0.0.1:6379');
+    }
+} catch (\Exception $e) {
+    die('skip: could not connect to redis on 127.0.0.1:6379');
+}
+--FILE--
+<?php
+
+require_once __DIR__ . '/common.php';
+
+$redis = new Redis();
+$redis->connect('127.0.0.1', 6379);
+
+tideways_enable();
+
+$redis->get('tidewaystest:foo');
+$redis->get('tidewaystest:bar');
+$redis->set('tidewaystest:foo', 1);
+
+$redis->multi()->set('tidewaystest:foo', 2)->incr('tidewaystest:counter')->exec();
+
+$redis->pipeline();
+$redis->get('tidewaystest:foo');
+$redis->get('tidewaystest:bar');
+$redis->get('tidewaystest:baz');
+$redis->exec();
+
+$redis->multi()->set('tidewaystest:foo', 3)->discard();
+
+print_spans(tideways_get_spans());
+tideways_disable();
+
+$redis->del('tidewaystest:foo', 'tidewaystest:counter');
+--EXPECT--
+app: 1 timers - 
+redis: 2 timers - title=get
+redis: 1 timers - title=set
+redis: 1 timers - commands=2 title=multi
+redis: 1 timers - commands=3 title=pipeline
@@ -10,16 +10,20 @@ $queries = array(
     'DELETE FROM baz WHERE bar = 1' => 'delete baz',
     'COMMIT' => 'commit',
     'DROP TABLE' => 'other',
+    '/* from comment */ SELECT a, \'FROM x\' FROM `db`.`foo` WHERE id IN (SELECT id FROM bar)' => 'select db.foo',
+    "-- comment\nselect count(*) from \"users\" u" => 'select users',
+    'INSERT OR IGNORE INTO bar VALUES (1)' => 'insert bar',
+    'SELECT 1' => 'select',
 );
 
 $i = 0;
 foreach ($queries as $sql => $expectedSummary) {
     $actualSummary = tideways_sql_minify($sql);
 
-    if ($actualSummary === '') {
+    if ($actualSummary === $expectedSummary) {
         echo ++$i . ") OK\n";
     } else {
-        echo ++$i . ") FAIL got '" . $actualSummary . "' but expected empty string.\n";
+        echo ++$i . ") FAIL got '" . $actualSummary . "' but expected '" . $expectedSummary . "'.\n";
     }
 }
 --EXPECTF--
@@ -29,3 +33,7 @@ foreach ($queries as $sql => $expectedSummary) {
 4) OK
 5) OK
 6) OK
+7) OK
+8) OK
+9) OK
+10) OK
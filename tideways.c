@@ -32,6 +32,15 @@
 #include <sys/resource.h>
 #endif
 
+#if !defined(PHP_WIN32) && defined(__GNUC__)
+#include <sys/mman.h>
+#define TIDEWAYS_SHM 1
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 #if __APPLE__
 #include <mach/mach_init.h>
 #include <mach/mach_time.h>
@@ -49,9 +58,24 @@
 #include "zend_gc.h"
 
 #include "ext/standard/url.h"
+#include "ext/standard/crc32.h"
 #include "ext/pdo/php_pdo_driver.h"
 #include "zend_stream.h"
 
+#if PHP_VERSION_ID >= 70100
+#include "ext/standard/php_random.h"
+#endif
+
+#if PHP_VERSION_ID >= 70000
+#include "zend_smart_str.h"
+#define TW_SMART_STR_VAL(str) ((str).s ? ZSTR_VAL((str).s) : "")
+#define TW_SMART_STR_LEN(str) ((str).s ? ZSTR_LEN((str).s) : 0)
+#else
+#include "ext/standard/php_smart_str.h"
+#define TW_SMART_STR_VAL(str) ((str).c ? (str).c : "")
+#define TW_SMART_STR_LEN(str) ((str).len)
+#endif
+
 #if PHP_VERSION_ID < 70000
 
 static inline void **hp_get_execute_arguments(zend_execute_data *data)
@@ -141,6 +165,7 @@ static zend_always_inline void zend_string_release(zend_string *s)
 #define Z_TRY_ADDREF_P(zv) Z_ADDREF_P(zv);
 #define _ZCE_NAME(ce) ce->name
 #define _ZCE_NAME_LENGTH(ce) ce->name_length
+#define _Z_RES_HANDLE_P(zv) Z_RESVAL_P(zv)
 #define _ZVAL_STRING(str, len) ZVAL_STRING(str, len, 0)
 #define _RETURN_STRING(str) RETURN_STRING(str, 0)
 #define _add_assoc_string_ex(arg, key, key_len, str, copy) add_assoc_string_ex(arg, key, key_len, str, copy)
@@ -161,6 +186,7 @@ static zend_always_inline void zend_string_release(zend_string *s)
 #define EX_OBJ(call) ((call->This.value.obj) ? &(call->This) : NULL)
 #define _ZCE_NAME(ce) ce->name->val
 #define _ZCE_NAME_LENGTH(ce) ce->name->len
+#define _Z_RES_HANDLE_P(zv) Z_RES_HANDLE_P(zv)
 #define _ZVAL_STRING(str, len) ZVAL_STRING(str, len)
 #define _RETURN_STRING(str) RETURN_STRING(str)
 #define _add_assoc_string_ex(arg, key, key_len, str, copy) add_assoc_string_ex(arg, key, key_len-1, str)
@@ -274,6 +300,10 @@ int (*tw_original_gc_collect_cycles)(void);
 int tw_gc_collect_cycles(void);
 #endif
 
+/* Shared memory function table, mapped in MINIT before the workers fork */
+static tw_shm_table *tw_shm = NULL;
+static size_t tw_shm_bytes = 0;
+
 /* Bloom filter for function names to be ignored */
 #define INDEX_2_BYTE(index)  (index >> 3)
 #define INDEX_2_BIT(index)   (1 << (index & 0x7));
@@ -290,6 +320,9 @@ static void hp_begin(long tideways_flags TSRMLS_DC);
 static void hp_stop(TSRMLS_D);
 static void hp_end(TSRMLS_D);
 
+static void tw_shm_init(long size);
+static void tw_shm_shutdown();
+
 static uint64 cycle_timer(TSRMLS_C);
 
 static void hp_free_the_free_list(TSRMLS_D);
@@ -324,7 +357,8 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_enable, 0, 0, 0)
   ZEND_ARG_INFO(0, options)
 ZEND_END_ARG_INFO()
 
-ZEND_BEGIN_ARG_INFO(arginfo_tideways_disable, 0)
+ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_disable, 0, 0, 0)
+  ZEND_ARG_INFO(0, options)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO(arginfo_tideways_transaction_name, 0)
@@ -353,6 +387,36 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO(arginfo_tideways_get_spans, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_tideways_span_breakdown, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_tideways_get_histograms, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_cct_export, 0, 0, 1)
+	ZEND_ARG_INFO(0, format)
+	ZEND_ARG_INFO(0, path)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_tideways_retention_reason, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_tideways_overhead, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_tideways_shm_stats, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_trace_dump, 0, 0, 0)
+	ZEND_ARG_INFO(0, path)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_span_export, 0, 0, 1)
+	ZEND_ARG_INFO(0, format)
+	ZEND_ARG_INFO(0, path)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_span_timer_start, 0, 0, 0)
 	ZEND_ARG_INFO(0, span)
 ZEND_END_ARG_INFO()
@@ -376,6 +440,10 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_span_callback, 0, 0, 0)
 	ZEND_ARG_INFO(0, callback)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_tideways_object_census, 0, 0, 0)
+	ZEND_ARG_INFO(0, limit)
+ZEND_END_ARG_INFO()
+
 /* }}} */
 
 /**
@@ -395,11 +463,20 @@ zend_function_entry tideways_functions[] = {
 	PHP_FE(tideways_sql_minify, arginfo_tideways_sql_minify)
 	PHP_FE(tideways_span_create, arginfo_tideways_span_create)
 	PHP_FE(tideways_get_spans, arginfo_tideways_get_spans)
+	PHP_FE(tideways_span_breakdown, arginfo_tideways_span_breakdown)
+	PHP_FE(tideways_get_histograms, arginfo_tideways_get_histograms)
+	PHP_FE(tideways_cct_export, arginfo_tideways_cct_export)
+	PHP_FE(tideways_span_export, arginfo_tideways_span_export)
+	PHP_FE(tideways_trace_dump, arginfo_tideways_trace_dump)
+	PHP_FE(tideways_retention_reason, arginfo_tideways_retention_reason)
+	PHP_FE(tideways_overhead, arginfo_tideways_overhead)
+	PHP_FE(tideways_shm_stats, arginfo_tideways_shm_stats)
 	PHP_FE(tideways_span_timer_start, arginfo_tideways_span_timer_start)
 	PHP_FE(tideways_span_timer_stop, arginfo_tideways_span_timer_stop)
 	PHP_FE(tideways_span_annotate, arginfo_tideways_span_annotate)
 	PHP_FE(tideways_span_watch, arginfo_tideways_span_watch)
 	PHP_FE(tideways_span_callback, arginfo_tideways_span_callback)
+	PHP_FE(tideways_object_census, arginfo_tideways_object_census)
 	{NULL, NULL, NULL}
 };
 
@@ -439,6 +516,16 @@ PHP_INI_ENTRY("tideways.collect", "tracing", PHP_INI_ALL, NULL)
 PHP_INI_ENTRY("tideways.monitor", "basic", PHP_INI_ALL, NULL)
 PHP_INI_ENTRY("tideways.distributed_tracing_hosts", "127.0.0.1", PHP_INI_ALL, NULL)
 PHP_INI_ENTRY("tideways.log_level", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.max_edges", "100000", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.max_bytes", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.n_plus_one_threshold", "5", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.trace_buffer_size", "65536", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.retention_threshold", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.retention_spans", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.overhead_budget", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.calibrate", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.http_timings", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("tideways.shm_functions", "0", PHP_INI_SYSTEM, NULL)
 PHP_INI_ENTRY("xhprof.output_dir", "", PHP_INI_ALL, NULL)
 
 PHP_INI_END()
@@ -467,10 +554,72 @@ PHP_GINIT_FUNCTION(hp)
 	hp_globals->trace_watch_callbacks = NULL;
 	hp_globals->trace_callbacks = NULL;
 	hp_globals->span_cache = NULL;
+	hp_globals->sql_repeats = NULL;
+	hp_globals->sql_statements = NULL;
+	hp_globals->pdo_statements = NULL;
+	hp_globals->pdo_fetches = NULL;
+	hp_globals->span_counts = NULL;
+	hp_globals->curl_handles = NULL;
+	hp_globals->curl_multi_spans = NULL;
+	hp_globals->mongo_objects = NULL;
+	hp_globals->redis_batches = NULL;
+	hp_globals->template_names = NULL;
+	hp_globals->pending_return_cb = NULL;
+	hp_globals->n_plus_one_threshold = 0;
+	hp_globals->retention_threshold = 0;
+	hp_globals->retention_spans = 0;
+	hp_globals->retention_reason = TIDEWAYS_RETENTION_OFF;
+	hp_globals->error_message_start = NULL;
+	hp_globals->error_type_start = 0;
+	hp_globals->error_lineno_start = 0;
+	hp_globals->overhead_tsc = 0;
+	hp_globals->overhead_ewma = 0;
+	hp_globals->overhead_budget = 0;
+	hp_globals->overhead_level = TIDEWAYS_OVERHEAD_FULL;
+	hp_globals->calls = 0;
+	hp_globals->calibrate = 0;
+	hp_globals->calibration = NULL;
+	hp_globals->calibrations_count = 0;
+	hp_globals->http_timings = 0;
+	hp_globals->trace_id_state = 0;
+	hp_globals->span_stack = NULL;
+	hp_globals->span_stack_depth = 0;
+	hp_globals->span_stack_size = 0;
+	hp_globals->span_categories = NULL;
+	hp_globals->span_categories_count = 0;
+	hp_globals->max_edges = 0;
+	hp_globals->max_bytes = 0;
+	hp_globals->stats_edges = 0;
+	hp_globals->stats_bytes = 0;
+	hp_globals->stats_overflow = 0;
+	hp_globals->histograms = NULL;
+	hp_globals->cct_nodes = NULL;
+	hp_globals->cct_count = 0;
+	hp_globals->cct_size = 0;
+	hp_globals->cct_names = NULL;
+	hp_globals->trace_records = NULL;
+	hp_globals->trace_size = 0;
+	hp_globals->trace_count = 0;
+	hp_globals->trace_buffer_size = 0;
+	hp_globals->trace_functions = NULL;
+	memset(hp_globals->trace_function_names, 0, sizeof(hp_globals->trace_function_names));
+	hp_globals->alloc_bytes = 0;
+	hp_globals->alloc_count = 0;
+#if PHP_VERSION_ID >= 70000
+	hp_globals->mm_heap = NULL;
+	hp_globals->mm_malloc = NULL;
+	hp_globals->mm_free = NULL;
+	hp_globals->mm_realloc = NULL;
+#endif
 }
 
 PHP_GSHUTDOWN_FUNCTION(hp)
 {
+	if (hp_globals->template_names) {
+		zend_hash_destroy(hp_globals->template_names);
+		pefree(hp_globals->template_names, 1);
+		hp_globals->template_names = NULL;
+	}
 }
 
 /**
@@ -501,6 +650,16 @@ PHP_MINIT_FUNCTION(tideways)
 	TWG(trace_callbacks) = NULL;
 	TWG(trace_watch_callbacks) = NULL;
 	TWG(span_cache) = NULL;
+	TWG(sql_repeats) = NULL;
+	TWG(sql_statements) = NULL;
+	TWG(pdo_statements) = NULL;
+	TWG(pdo_fetches) = NULL;
+	TWG(span_counts) = NULL;
+	TWG(curl_handles) = NULL;
+	TWG(curl_multi_spans) = NULL;
+	TWG(mongo_objects) = NULL;
+	TWG(redis_batches) = NULL;
+	TWG(pending_return_cb) = NULL;
 
 	/* no free hp_entry_t structures to start with */
 	TWG(entry_free_list) = NULL;
@@ -512,6 +671,8 @@ PHP_MINIT_FUNCTION(tideways)
 	hp_transaction_function_clear(TSRMLS_C);
 	hp_exception_function_clear(TSRMLS_C);
 
+	tw_shm_init(INI_INT("tideways.shm_functions"));
+
 	_zend_compile_file = zend_compile_file;
 	zend_compile_file  = hp_compile_file;
 	_zend_compile_string = zend_compile_string;
@@ -555,6 +716,8 @@ PHP_MSHUTDOWN_FUNCTION(tideways)
 	/* free any remaining items in the free list */
 	hp_free_the_free_list(TSRMLS_C);
 
+	tw_shm_shutdown();
+
 	/* Remove proxies, restore the originals */
 #if PHP_VERSION_ID < 50500
 	zend_execute = _zend_execute;
@@ -614,6 +777,45 @@ long tw_trace_callback_record_with_cache(char *category, int category_len, char
 	return idx;
 }
 
+/**
+ * Mark a span as open, spans created while it is on the stack get it as
+ * their parent.
+ */
+void tw_span_push(long spanId TSRMLS_DC)
+{
+	if (spanId < 0) {
+		return;
+	}
+
+	if (TWG(span_stack_depth) == TWG(span_stack_size)) {
+		TWG(span_stack_size) = TWG(span_stack_size) > 0 ? TWG(span_stack_size) * 2 : 32;
+		TWG(span_stack) = erealloc(TWG(span_stack), TWG(span_stack_size) * sizeof(long));
+	}
+
+	TWG(span_stack)[TWG(span_stack_depth)++] = spanId;
+}
+
+/**
+ * Close the innermost occurrence of a span on the stack. Userland timers are
+ * not guaranteed to be stopped in order, so this searches from the top.
+ */
+void tw_span_pop(long spanId TSRMLS_DC)
+{
+	int i;
+
+	if (spanId < 0) {
+		return;
+	}
+
+	for (i = TWG(span_stack_depth) - 1; i >= 0; i--) {
+		if (TWG(span_stack)[i] == spanId) {
+			memmove(&TWG(span_stack)[i], &TWG(span_stack)[i + 1], (TWG(span_stack_depth) - i - 1) * sizeof(long));
+			TWG(span_stack_depth)--;
+			return;
+		}
+	}
+}
+
 void tw_span_timer_start(long spanId TSRMLS_DC)
 {
 	zval *span, *starts;
@@ -695,2533 +897,6816 @@ void tw_span_record_duration(long spanId, double start, double end TSRMLS_DC)
 	add_next_index_long(timer, end);
 }
 
-long tw_trace_callback_php_call(char *symbol, zend_execute_data *data TSRMLS_DC)
+static int tw_span_interval_compare(const void *a, const void *b)
 {
-	return tw_trace_callback_record_with_cache("php", 3, symbol, strlen(symbol), 1 TSRMLS_CC);
+	const tw_span_interval *left = (const tw_span_interval *)a;
+	const tw_span_interval *right = (const tw_span_interval *)b;
+	int cmp = strcmp(left->category, right->category);
+
+	if (cmp != 0) {
+		return cmp;
+	}
+
+	return (left->start > right->start) - (left->start < right->start);
 }
 
-long tw_trace_callback_watch(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_span_breakdown_clear(TSRMLS_D)
 {
-	tw_watch_callback **temp;
-	tw_watch_callback *twcb = NULL;
-	zend_fcall_info fci = empty_fcall_info;
-	zend_fcall_info_cache fcic = empty_fcall_info_cache;
-	int args_len = ZEND_CALL_NUM_ARGS(data);
-	zval *object = EX_OBJ(data);
-	_DECLARE_ZVAL(retval);
-	_DECLARE_ZVAL(context);
-	_DECLARE_ZVAL(zargs);
-#if PHP_VERSION_ID < 70000
-	zval *params[1];
-#else
-	zval params[1];
-#endif
-	zend_error_handling zeh;
 	int i;
-	long idx;
 
-	if (TWG(trace_watch_callbacks) == NULL) {
-		return -1;
+	for (i = 0; i < TWG(span_categories_count); i++) {
+		efree(TWG(span_categories)[i].name);
 	}
 
-#if PHP_VERSION_ID < 70000
-	if (zend_hash_find(TWG(trace_watch_callbacks), symbol, strlen(symbol)+1, (void **)&temp) == SUCCESS) {
-		twcb = *temp;
-#else
-	twcb = zend_hash_str_find_ptr(TWG(trace_watch_callbacks), symbol, strlen(symbol));
-
-	if (twcb) {
-#endif
-		_ALLOC_INIT_ZVAL(context);
-		array_init(context);
-
-		_ALLOC_INIT_ZVAL(zargs);
-		array_init(zargs);
-		Z_ADDREF_P(zargs);
+	if (TWG(span_categories)) {
+		efree(TWG(span_categories));
+	}
 
-		_add_assoc_string_ex(context, "fn", sizeof("fn"), symbol, 1);
+	TWG(span_categories) = NULL;
+	TWG(span_categories_count) = 0;
+}
 
-		if (args_len > 0) {
-			for (i = 0; i < args_len; i++) {
-				Z_TRY_ADDREF_P(ZEND_CALL_ARG(data, i+1));
-				add_next_index_zval(zargs, ZEND_CALL_ARG(data, i+1));
-			}
-		}
+/**
+ * Compute the wall time spent per span category. Timers are sorted by
+ * category and start and then merged, so that overlapping or nested spans of
+ * the same category are only counted once.
+ */
+static void tw_span_breakdown_compute(TSRMLS_D)
+{
+	tw_span_interval *intervals;
+	tw_span_category *current = NULL;
+	int count, size = 0, i;
+	long start = 0, end = 0;
 
-		add_assoc_zval(context, "args", zargs);
+	tw_span_breakdown_clear(TSRMLS_C);
 
-		if (object != NULL) {
-			Z_TRY_ADDREF_P(object);
-			add_assoc_zval(context, "object", object);
-		}
+	count = tw_span_intervals(&intervals, 0 TSRMLS_CC);
 
-#if PHP_VERSION_ID < 70000
-		params[0] = (zval *)&(context);
-#else
-		ZVAL_COPY(&params[0], context);
-#endif
+	if (count == 0) {
+		return;
+	}
 
-		twcb->fci.param_count = 1;
-		twcb->fci.size = sizeof(twcb->fci);
-#if PHP_VERSION_ID < 70000
-		twcb->fci.retval_ptr_ptr = &retval;
-		twcb->fci.params = (zval ***)params;
-#else
-		twcb->fci.retval = retval;
-		twcb->fci.params = params;
-#endif
+	qsort(intervals, count, sizeof(tw_span_interval), tw_span_interval_compare);
 
-		fci = twcb->fci;
-		fcic = twcb->fcic;
+	for (i = 0; i < count; i++) {
+		if (current != NULL && strcmp(current->name, intervals[i].category) == 0) {
+			if (intervals[i].start > end) {
+				current->wt += end - start;
+				start = intervals[i].start;
+				end = intervals[i].end;
+			} else if (intervals[i].end > end) {
+				end = intervals[i].end;
+			}
 
-		if (zend_call_function(&fci, &fcic TSRMLS_CC) == FAILURE) {
-			zend_error(E_ERROR, "Cannot call Trace Watch Callback");
+			continue;
 		}
 
-		hp_ptr_dtor(context);
-		hp_ptr_dtor(zargs);
-#if PHP_VERSION_ID >= 70000
-		hp_ptr_dtor(&params[0]);
-#endif
-
-		idx = -1;
-
-		if (retval) {
-			if (Z_TYPE_P(retval) == IS_LONG) {
-				idx = Z_LVAL_P(retval);
-			}
+		if (current != NULL) {
+			current->wt += end - start;
+		}
 
-			hp_ptr_dtor(retval);
+		if (TWG(span_categories_count) == size) {
+			size = size > 0 ? size * 2 : 8;
+			TWG(span_categories) = erealloc(TWG(span_categories), size * sizeof(tw_span_category));
 		}
 
-		return idx;
+		current = &TWG(span_categories)[TWG(span_categories_count)++];
+		current->name = estrdup(intervals[i].category);
+		current->wt = 0;
+
+		start = intervals[i].start;
+		end = intervals[i].end;
 	}
 
-	return -1;
+	current->wt += end - start;
+
+	efree(intervals);
 }
 
-long tw_trace_callback_mongo_cursor_io(char *symbol, zend_execute_data *data TSRMLS_DC)
+static int tw_histogram_bucket(long value)
 {
-	long idx = -1;
-	zval *object = EX_OBJ(data);
-	zval fname, *element;
-	_DECLARE_ZVAL(retval_ptr);
-
-	idx = tw_span_create("mongo", 5 TSRMLS_CC);
-	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+	int exp = 0;
+	unsigned long v;
 
-	_ZVAL_STRING(&fname, "info");
-
-	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
-		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
-			element = zend_compat_hash_find_const(Z_ARRVAL_P(retval_ptr), "ns", sizeof("ns"));
-			if (element != NULL) {
-				tw_span_annotate_string(idx, "collection", Z_STRVAL_P(element), 1 TSRMLS_CC);
-			}
-		}
+	if (value < TIDEWAYS_HISTOGRAM_LINEAR) {
+		return value < 0 ? 0 : (int)value;
+	}
 
-		hp_ptr_dtor(retval_ptr);
+	for (v = (unsigned long)value; v > 1; v >>= 1) {
+		exp++;
 	}
 
-#if PHP_VERSION_ID >= 70000
-	zend_string_release(Z_STR(fname));
-#endif
+	if (exp > TIDEWAYS_HISTOGRAM_MAX_EXP) {
+		return TIDEWAYS_HISTOGRAM_BUCKETS - 1;
+	}
 
-	return idx;
+	return TIDEWAYS_HISTOGRAM_LINEAR + (exp - 4) * (1 << TIDEWAYS_HISTOGRAM_SUB_BITS)
+		+ (int)((value >> (exp - TIDEWAYS_HISTOGRAM_SUB_BITS)) & ((1 << TIDEWAYS_HISTOGRAM_SUB_BITS) - 1));
 }
 
-long tw_trace_callback_mongo_cursor_next(char *symbol, zend_execute_data *data TSRMLS_DC)
+/* Middle of a bucket */
+static long tw_histogram_value(int bucket)
 {
-	long idx = -1;
-	zend_class_entry *cursor_ce;
-	zval *object = EX_OBJ(data);
-	zval *queryRunProperty;
-	zval fname, *element;
-	_DECLARE_ZVAL(retval_ptr);
-	zval *__rv;
+	int exp, sub;
+	long width;
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
+	if (bucket < TIDEWAYS_HISTOGRAM_LINEAR) {
+		return bucket;
 	}
 
-	cursor_ce = Z_OBJCE_P(object);
-	queryRunProperty = _zend_read_property(cursor_ce, object, "_tidewaysQueryRun", sizeof("_tidewaysQueryRun")-1, 1, __rv);
+	exp = 4 + (bucket - TIDEWAYS_HISTOGRAM_LINEAR) / (1 << TIDEWAYS_HISTOGRAM_SUB_BITS);
+	sub = (bucket - TIDEWAYS_HISTOGRAM_LINEAR) % (1 << TIDEWAYS_HISTOGRAM_SUB_BITS);
+	width = 1L << (exp - TIDEWAYS_HISTOGRAM_SUB_BITS);
 
-	if (queryRunProperty != NULL && Z_TYPE_P(queryRunProperty) != IS_NULL) {
-		return idx;
-	}
+	return (1L << exp) + sub * width + width / 2;
+}
 
-	zend_update_property_bool(cursor_ce, object, "_tidewaysQueryRun", sizeof("_tidewaysQueryRun") - 1, 1 TSRMLS_CC);
+static void tw_histogram_record(tw_histogram *histogram, long value)
+{
+	histogram->counts[tw_histogram_bucket(value)]++;
+	histogram->count++;
 
-	idx = tw_span_create("mongo", 5 TSRMLS_CC);
-	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
 
-	_ZVAL_STRING(&fname, "info");
+static long tw_histogram_percentile(tw_histogram *histogram, int percent)
+{
+	long rank = (histogram->count * percent + 99) / 100, seen = 0, value;
+	int i;
 
-	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
-		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
-			element = zend_compat_hash_find_const(Z_ARRVAL_P(retval_ptr), "ns", sizeof("ns"));
-			if (element != NULL) {
-				tw_span_annotate_string(idx, "collection", Z_STRVAL_P(element), 1 TSRMLS_CC);
-			}
-		}
+	for (i = 0; i < TIDEWAYS_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
 
-		hp_ptr_dtor(retval_ptr);
+		if (seen >= rank && seen > 0) {
+			value = tw_histogram_value(i);
+			return value > histogram->max ? histogram->max : value;
+		}
 	}
 
-#if PHP_VERSION_ID >= 70000
-	zend_string_release(Z_STR(fname));
-#endif
-
-	return idx;
+	return histogram->max;
 }
 
-long tw_trace_callback_mongo_collection(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_histogram_add_summary(zval *result, char *name, size_t name_len, tw_histogram *histogram TSRMLS_DC)
 {
-	long idx = -1;
-	zval *object = EX_OBJ(data);
-	zval fname;
-	_DECLARE_ZVAL(retval_ptr);
+	_DECLARE_ZVAL(summary);
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
-	}
+#if PHP_VERSION_ID < 70000
+	MAKE_STD_ZVAL(summary);
+#endif
+	array_init(summary);
+	add_assoc_long(summary, "count", histogram->count);
+	add_assoc_long(summary, "p50", tw_histogram_percentile(histogram, 50));
+	add_assoc_long(summary, "p95", tw_histogram_percentile(histogram, 95));
+	add_assoc_long(summary, "p99", tw_histogram_percentile(histogram, 99));
+	add_assoc_long(summary, "max", histogram->max);
 
-	_ZVAL_STRING(&fname, "getName");
+#if PHP_VERSION_ID >= 70000
+	zend_hash_str_update(Z_ARRVAL_P(result), name, name_len, summary);
+#else
+	zend_hash_update(Z_ARRVAL_P(result), name, name_len+1, &summary, sizeof(zval*), NULL);
+#endif
+}
 
-	idx = tw_span_create("mongo", 5 TSRMLS_CC);
-	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+/**
+ * Histograms are kept per function instead of per edge to bound memory,
+ * about 1KB each.
+ */
+static void tw_histogram_record_function(char *name, long wt TSRMLS_DC)
+{
+	tw_histogram *histogram = NULL;
+	size_t len = strlen(name);
 
-	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
-		if (Z_TYPE_P(retval_ptr) == IS_STRING) {
-			tw_span_annotate_string(idx, "collection", Z_STRVAL_P(retval_ptr), 1 TSRMLS_CC);
-		}
+#if PHP_VERSION_ID >= 70000
+	histogram = zend_hash_str_find_ptr(TWG(histograms), name, len);
 
-		hp_ptr_dtor(retval_ptr);
+	if (histogram == NULL) {
+		histogram = ecalloc(1, sizeof(tw_histogram));
+		zend_hash_str_update_ptr(TWG(histograms), name, len, histogram);
 	}
+#else
+	if (zend_hash_find(TWG(histograms), name, len+1, (void **)&histogram) == FAILURE) {
+		tw_histogram empty;
 
-#if PHP_VERSION_ID >= 70000
-	zend_string_release(Z_STR(fname));
+		memset(&empty, 0, sizeof(tw_histogram));
+		zend_hash_update(TWG(histograms), name, len+1, &empty, sizeof(tw_histogram), (void **)&histogram);
+	}
 #endif
 
-	return idx;
+	tw_histogram_record(histogram, wt);
 }
 
-long tw_trace_callback_predis_call(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_histograms_clear(TSRMLS_D)
 {
-	zval *commandId = ZEND_CALL_ARG(data, 1);
-
-	if (commandId == NULL || Z_TYPE_P(commandId) != IS_STRING) {
-		return -1;
+	if (TWG(histograms)) {
+		zend_hash_destroy(TWG(histograms));
+		FREE_HASHTABLE(TWG(histograms));
+		TWG(histograms) = NULL;
 	}
-
-	return tw_trace_callback_record_with_cache("predis", 6, Z_STRVAL_P(commandId), Z_STRLEN_P(commandId), 1 TSRMLS_CC);
 }
 
-long tw_trace_callback_phpampqlib(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * Span histograms are built from the recorded timers on demand, one per
+ * category, so they cost nothing while profiling.
+ */
+static void tw_histograms_spans(zval *result TSRMLS_DC)
 {
-	zval *exchange;
-	long idx = -1;
+	tw_span_interval *intervals;
+	tw_histogram *histogram;
+	int count, i;
 
-	if (ZEND_CALL_NUM_ARGS(data) < 2) {
-		return idx;
+	count = tw_span_intervals(&intervals, 0 TSRMLS_CC);
+
+	if (count == 0) {
+		return;
 	}
 
-	exchange = ZEND_CALL_ARG(data, 2);
+	qsort(intervals, count, sizeof(tw_span_interval), tw_span_interval_compare);
+	histogram = ecalloc(1, sizeof(tw_histogram));
 
-	if (exchange == NULL || Z_TYPE_P(exchange) != IS_STRING) {
-		return idx;
+	for (i = 0; i < count; i++) {
+		tw_histogram_record(histogram, intervals[i].end - intervals[i].start);
+
+		if (i + 1 == count || strcmp(intervals[i].category, intervals[i+1].category) != 0) {
+			tw_histogram_add_summary(result, intervals[i].category, strlen(intervals[i].category), histogram TSRMLS_CC);
+			memset(histogram, 0, sizeof(tw_histogram));
+		}
 	}
 
-	return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(exchange), Z_STRLEN_P(exchange), 1 TSRMLS_CC);
+	efree(histogram);
+	efree(intervals);
 }
 
-long tw_trace_callback_pheanstalk(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * Returns the calling context node of name below parent, created on first
+ * use. Contexts below a dropped node and new contexts once the node budget
+ * (max_edges) is used up are dropped and return -1, their time stays in the
+ * exclusive time of the closest recorded caller.
+ */
+static int tw_cct_enter(int parent, int is_root, char *name TSRMLS_DC)
 {
-	zend_class_entry *pheanstalk_ce;
-	zval *object = EX_OBJ(data);
-	zval *property;
-	long idx = -1;
-	zval *__rv;
+	tw_cct_node *node;
+	tw_cct_name *interned;
+	size_t len;
+	zend_ulong hash;
+	int idx;
+#if PHP_VERSION_ID < 70000
+	tw_cct_name **found;
+#endif
 
-	if (Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
+	if (parent < 0 && !is_root) {
+		return -1;
 	}
 
-	pheanstalk_ce = Z_OBJCE_P(object);
+	len = strlen(name);
+	hash = zend_inline_hash_func(name, len);
 
-	property = _zend_read_property(pheanstalk_ce, object, "_using", sizeof("_using") - 1, 1, __rv);
+	if (parent >= 0) {
+		for (idx = TWG(cct_nodes)[parent].first_child; idx >= 0; idx = TWG(cct_nodes)[idx].next_sibling) {
+			if (TWG(cct_nodes)[idx].hash == hash && strcmp(TWG(cct_nodes)[idx].name, name) == 0) {
+				return idx;
+			}
+		}
+	}
 
-	if (property != NULL && Z_TYPE_P(property) == IS_STRING) {
-		return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(property), Z_STRLEN_P(property), 1 TSRMLS_CC);
-	} else {
-		return tw_trace_callback_record_with_cache("queue", 5, "default", 7, 1 TSRMLS_CC);
+	if (TWG(max_edges) > 0 && TWG(cct_count) >= TWG(max_edges)) {
+		TWG(stats_overflow)++;
+		return -1;
 	}
-}
 
-long tw_trace_callback_memcache(char *symbol, zend_execute_data *data TSRMLS_DC)
-{
-	return tw_trace_callback_record_with_cache("memcache", 8, symbol, strlen(symbol), 1 TSRMLS_CC);
-}
+#if PHP_VERSION_ID >= 70000
+	interned = zend_hash_str_find_ptr(TWG(cct_names), name, len);
 
-long tw_trace_callback_php_controller(char *symbol, zend_execute_data *data TSRMLS_DC)
-{
-	long idx;
+	if (interned == NULL) {
+		interned = emalloc(sizeof(tw_cct_name));
+		interned->name = estrndup(name, len);
+		interned->id = zend_hash_num_elements(TWG(cct_names)) + 1;
+		zend_hash_str_update_ptr(TWG(cct_names), name, len, interned);
+	}
+#else
+	if (zend_hash_find(TWG(cct_names), name, len+1, (void **)&found) == SUCCESS) {
+		interned = *found;
+	} else {
+		interned = emalloc(sizeof(tw_cct_name));
+		interned->name = estrndup(name, len);
+		interned->id = zend_hash_num_elements(TWG(cct_names)) + 1;
+		zend_hash_update(TWG(cct_names), name, len+1, &interned, sizeof(tw_cct_name*), NULL);
+	}
+#endif
 
-	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
-	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+	if (TWG(cct_count) == TWG(cct_size)) {
+		TWG(cct_size) *= 2;
+		TWG(cct_nodes) = erealloc(TWG(cct_nodes), sizeof(tw_cct_node) * TWG(cct_size));
+	}
+
+	idx = TWG(cct_count)++;
+	node = &TWG(cct_nodes)[idx];
+	memset(node, 0, sizeof(tw_cct_node));
+	node->name = interned->name;
+	node->function_id = interned->id;
+	node->hash = hash;
+	node->parent = parent;
+	node->first_child = -1;
+	node->last_child = -1;
+	node->next_sibling = -1;
+
+	if (parent >= 0) {
+		/* Keep children in call order, exports are easier to read */
+		if (TWG(cct_nodes)[parent].last_child >= 0) {
+			TWG(cct_nodes)[TWG(cct_nodes)[parent].last_child].next_sibling = idx;
+		} else {
+			TWG(cct_nodes)[parent].first_child = idx;
+		}
+		TWG(cct_nodes)[parent].last_child = idx;
+	}
 
 	return idx;
 }
 
-long tw_trace_callback_presta_controller(char *symbol, zend_execute_data *data TSRMLS_DC)
+#if PHP_VERSION_ID >= 70000
+static void tw_cct_free_name(zval *zv)
 {
-	zend_class_entry *controller_ce;
-	zval *object = EX_OBJ(data);
-	zval *property;
-	long idx = -1;
-
-	if (Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
-	}
-
-	controller_ce = Z_OBJCE_P(object);
-
-	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
-	tw_span_annotate_string(idx, "title", _ZCE_NAME(controller_ce), 1 TSRMLS_CC);
+	tw_cct_name *interned = Z_PTR_P(zv);
 
-	return idx;
+	efree(interned->name);
+	efree(interned);
 }
-
-long tw_trace_callback_doctrine_couchdb_request(char *symbol, zend_execute_data *data TSRMLS_DC)
+#else
+static void tw_cct_free_name(void *name)
 {
-	zval *method = ZEND_CALL_ARG(data, 1);
-	zval *path = ZEND_CALL_ARG(data, 2);
-	long idx;
+	tw_cct_name *interned = *((tw_cct_name **)name);
 
-	if (Z_TYPE_P(method) != IS_STRING || Z_TYPE_P(path) != IS_STRING) {
-		return -1;
-	}
+	efree(interned->name);
+	efree(interned);
+}
+#endif
 
-	idx = tw_span_create("http", 4 TSRMLS_CC);
-	tw_span_annotate_string(idx, "method", Z_STRVAL_P(method), 1 TSRMLS_CC);
-	tw_span_annotate_string(idx, "url", Z_STRVAL_P(path), 1 TSRMLS_CC);
-	tw_span_annotate_string(idx, "service", "couchdb", 1 TSRMLS_CC);
+static void tw_cct_init(TSRMLS_D)
+{
+	TWG(cct_size) = 1024;
+	TWG(cct_count) = 0;
+	TWG(cct_nodes) = emalloc(sizeof(tw_cct_node) * TWG(cct_size));
 
-	return idx;
+	ALLOC_HASHTABLE(TWG(cct_names));
+	zend_hash_init(TWG(cct_names), 64, NULL, tw_cct_free_name, 0);
 }
 
-long tw_trace_callback_view_class(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_cct_clear(TSRMLS_D)
 {
-	zend_class_entry *ce;
-	zval *object = EX_OBJ(data);
-
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return -1;
+	if (TWG(cct_nodes)) {
+		efree(TWG(cct_nodes));
+		TWG(cct_nodes) = NULL;
 	}
+	TWG(cct_count) = 0;
+	TWG(cct_size) = 0;
 
-	ce = Z_OBJCE_P(object);
-
-	return tw_trace_callback_record_with_cache("view", 4, _ZCE_NAME(ce), _ZCE_NAME_LENGTH(ce), 1 TSRMLS_CC);
+	if (TWG(cct_names)) {
+		zend_hash_destroy(TWG(cct_names));
+		FREE_HASHTABLE(TWG(cct_names));
+		TWG(cct_names) = NULL;
+	}
 }
 
-/* Zend_View_Abstract::render($name); */
-long tw_trace_callback_view_engine(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_trace_buffer_init(TSRMLS_D)
 {
-	zval *name = ZEND_CALL_ARG(data, 1);
-	char *view;
+	TWG(trace_size) = TWG(trace_buffer_size) > 0 ? TWG(trace_buffer_size) : 1;
 
-	if (Z_TYPE_P(name) != IS_STRING) {
-		return -1;
+	if (TWG(trace_size) > TIDEWAYS_TRACE_BUFFER_MAX) {
+		TWG(trace_size) = TIDEWAYS_TRACE_BUFFER_MAX;
 	}
 
-	view = hp_get_base_filename(Z_STRVAL_P(name));
+	TWG(trace_count) = 0;
+	TWG(trace_records) = safe_emalloc(TWG(trace_size), sizeof(tw_trace_record), 0);
+	memset(TWG(trace_function_names), 0, sizeof(TWG(trace_function_names)));
 
-	return tw_trace_callback_record_with_cache("view", 4, view, strlen(view)+1, 1 TSRMLS_CC);
+	ALLOC_HASHTABLE(TWG(trace_functions));
+	zend_hash_init(TWG(trace_functions), 64, NULL, NULL, 0);
 }
 
-/* Applies to Enlight, Mage and Zend1 */
-long tw_trace_callback_zend1_dispatcher_families_tx(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_trace_buffer_clear(TSRMLS_D)
 {
-	zval *argument_element = ZEND_CALL_ARG(data, 1);
-	int len;
-	char *ret = NULL;
-	zend_class_entry *ce;
-	long idx;
-	zval *object = EX_OBJ(data);
+	int i;
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return -1;
-	}
+	if (TWG(trace_records)) {
+		efree(TWG(trace_records));
+		TWG(trace_records) = NULL;
 
-	if (Z_TYPE_P(argument_element) != IS_STRING) {
-		return -1;
+		for (i = 0; i < 256; i++) {
+			if (TWG(trace_function_names)[i]) {
+				efree(TWG(trace_function_names)[i]);
+				TWG(trace_function_names)[i] = NULL;
+			}
+		}
 	}
+	TWG(trace_size) = 0;
+	TWG(trace_count) = 0;
 
-	ce = Z_OBJCE_P(object);
-
-	len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(argument_element) + 3;
-	ret = (char*)emalloc(len);
-	snprintf(ret, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(argument_element));
-
-	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
-	tw_span_annotate_string(idx, "title", ret, 0 TSRMLS_CC);
+	if (TWG(trace_functions)) {
+		zend_hash_destroy(TWG(trace_functions));
+		FREE_HASHTABLE(TWG(trace_functions));
+		TWG(trace_functions) = NULL;
+	}
+}
 
+/**
+ * Function ids are assigned in order of the first call, the insertion order
+ * of trace_functions is the function table of the dump. Repeated calls of
+ * the same function are answered from the cache slot of its hash code.
+ */
+static uint32 tw_trace_function_id(char *name, uint8 hash_code TSRMLS_DC)
+{
+	char **cached = &TWG(trace_function_names)[hash_code];
+	size_t len;
+	long id;
 #if PHP_VERSION_ID >= 70000
-	efree(ret);
+	zval *found, value;
+#else
+	long *found;
 #endif
 
-	return idx;
-}
+	if (*cached != NULL && strcmp(*cached, name) == 0) {
+		return TWG(trace_function_ids)[hash_code];
+	}
 
-/* oxShopControl::_process($sClass, $sFnc = null); */
-long tw_trace_callback_oxid_tx(char *symbol, zend_execute_data *data TSRMLS_DC)
-{
-	zval *sClass = ZEND_CALL_ARG(data, 1);
-	zval *sFnc = ZEND_CALL_ARG(data, 2);
-	char *ret = NULL;
-	long idx;
-	int len, copy;
-	int args_len = ZEND_CALL_NUM_ARGS(data);
+	len = strlen(name);
 
-	if (Z_TYPE_P(sClass) != IS_STRING) {
-		return -1;
-	}
+#if PHP_VERSION_ID >= 70000
+	found = zend_hash_str_find(TWG(trace_functions), name, len);
 
-	if (args_len > 1 && sFnc != NULL && Z_TYPE_P(sFnc) == IS_STRING) {
-		len = Z_STRLEN_P(sClass) + Z_STRLEN_P(sFnc) + 3;
-		ret = (char*)emalloc(len);
-		snprintf(ret, len, "%s::%s", Z_STRVAL_P(sClass), Z_STRVAL_P(sFnc));
-		copy = 0;
+	if (found != NULL) {
+		id = Z_LVAL_P(found);
 	} else {
-		ret = Z_STRVAL_P(sClass);
-		len = Z_STRLEN_P(sClass);
-		copy = 1;
+		id = zend_hash_num_elements(TWG(trace_functions));
+		ZVAL_LONG(&value, id);
+		zend_hash_str_add(TWG(trace_functions), name, len, &value);
+	}
+#else
+	if (zend_hash_find(TWG(trace_functions), name, len+1, (void **)&found) == SUCCESS) {
+		id = *found;
+	} else {
+		id = zend_hash_num_elements(TWG(trace_functions));
+		zend_hash_add(TWG(trace_functions), name, len+1, &id, sizeof(long), NULL);
 	}
+#endif
 
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
-		return -1;
+	if (*cached != NULL) {
+		efree(*cached);
 	}
 
-	return tw_trace_callback_record_with_cache("php.ctrl", 8, ret, len, copy TSRMLS_CC);
+	*cached = estrndup(name, len);
+	TWG(trace_function_ids)[hash_code] = (uint32)id;
+
+	return (uint32)id;
 }
 
-/* $resolver->getArguments($request, $controller); */
-long tw_trace_callback_symfony_resolve_arguments_tx(char *symbol, zend_execute_data *data TSRMLS_DC)
+static zend_always_inline void tw_trace_record_call(uint32 function, uint64 tsc TSRMLS_DC)
 {
-	zval *callback, *controller, *action;
-	char *ret = NULL;
-	int len;
-	tw_trace_callback cb;
-	zend_class_entry *ce;
+	tw_trace_record *record = &TWG(trace_records)[TWG(trace_count) % TWG(trace_size)];
+	long memory;
 
-	callback = ZEND_CALL_ARG(data, 2);
-
-	// Only Symfony2 framework for now
-	if (Z_TYPE_P(callback) == IS_ARRAY) {
-		controller = zend_compat_hash_index_find(Z_ARRVAL_P(callback), 0);
-
-		if (controller == NULL && Z_TYPE_P(controller) != IS_OBJECT) {
-			return -1;
-		}
-
-		action = zend_compat_hash_index_find(Z_ARRVAL_P(callback), 1);
+	record->timestamp = (uint64)get_us_from_tsc(tsc - TWG(start_time) TSRMLS_CC);
+	record->function = function;
+	record->memory = 0;
 
-		if (action == NULL && Z_TYPE_P(action) != IS_STRING) {
-			return -1;
-		}
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_MEMORY) {
+		memory = zend_memory_usage(0 TSRMLS_CC);
+		record->memory = (uint64)memory > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32)memory;
+	}
 
-		ce = Z_OBJCE_P(controller);
+	TWG(trace_count)++;
+}
 
-		len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(action) + 3;
-		ret = (char*)emalloc(len);
-		snprintf(ret, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(action));
+static void tw_le32(smart_str *out, uint32 value)
+{
+	char buf[4];
 
-		cb = tw_trace_callback_php_controller;
-		register_trace_callback_len(ret, len-1, cb);
+	buf[0] = (char)(value & 0xFF);
+	buf[1] = (char)((value >> 8) & 0xFF);
+	buf[2] = (char)((value >> 16) & 0xFF);
+	buf[3] = (char)((value >> 24) & 0xFF);
 
-		efree(ret);
-	}
+	smart_str_appendl(out, buf, sizeof(buf));
+}
 
-	return -1;
+static void tw_le64(smart_str *out, uint64 value)
+{
+	tw_le32(out, (uint32)(value & 0xFFFFFFFF));
+	tw_le32(out, (uint32)(value >> 32));
 }
 
-long tw_trace_callback_pgsql_execute(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * Binary dump of the trace buffer, all integers little endian:
+ *
+ *   "TWTRACE1", uint64 start (microseconds since the epoch),
+ *   uint32 functions, uint32 records, uint64 records written in total,
+ *   per function: uint32 length, name,
+ *   per record, oldest first: uint64 timestamp, uint32 function, uint32 memory
+ */
+static void tw_trace_dump(smart_str *out TSRMLS_DC)
 {
-	zval *argument_element;
-	char *summary;
-	int i;
-	int args_len = ZEND_CALL_NUM_ARGS(data);
+	long records = MIN(TWG(trace_count), TWG(trace_size));
+	long first = TWG(trace_count) - records, i;
+	tw_trace_record *record;
 
-	for (i = 0; i < args_len; i++) {
-		argument_element = ZEND_CALL_ARG(data, i+1);
+	smart_str_appendl(out, "TWTRACE1", 8);
+	tw_le64(out, TWG(start_timestamp));
+	tw_le32(out, zend_hash_num_elements(TWG(trace_functions)));
+	tw_le32(out, (uint32)records);
+	tw_le64(out, (uint64)TWG(trace_count));
 
-		if (argument_element && Z_TYPE_P(argument_element) == IS_STRING && Z_STRLEN_P(argument_element) > 0) {
-			// TODO: Introduce SQL statement cache to find the names here again.
-			summary = Z_STRVAL_P(argument_element);
+	{
+#if PHP_VERSION_ID >= 70000
+		zend_string *name;
 
-			return tw_trace_callback_record_with_cache("sql", 3, summary, strlen(summary), 1 TSRMLS_CC);
+		ZEND_HASH_FOREACH_STR_KEY(TWG(trace_functions), name) {
+			tw_le32(out, (uint32)ZSTR_LEN(name));
+			smart_str_appendl(out, ZSTR_VAL(name), ZSTR_LEN(name));
+		} ZEND_HASH_FOREACH_END();
+#else
+		HashPosition pos;
+		char *name;
+		uint name_len;
+		ulong num_key;
+
+		for (zend_hash_internal_pointer_reset_ex(TWG(trace_functions), &pos);
+			zend_hash_get_current_key_ex(TWG(trace_functions), &name, &name_len, &num_key, 0, &pos) == HASH_KEY_IS_STRING;
+			zend_hash_move_forward_ex(TWG(trace_functions), &pos)) {
+			tw_le32(out, name_len - 1);
+			smart_str_appendl(out, name, name_len - 1);
 		}
+#endif
 	}
 
-	return -1;
+	for (i = first; i < TWG(trace_count); i++) {
+		record = &TWG(trace_records)[i % TWG(trace_size)];
+		tw_le64(out, record->timestamp);
+		tw_le32(out, record->function);
+		tw_le32(out, record->memory);
+	}
 }
 
-long tw_trace_callback_pgsql_query(char *symbol, zend_execute_data *data TSRMLS_DC)
+/* Exclusive wall and cpu time of every node, children always come after
+ * their parent in the arena */
+static void tw_cct_self(tw_cct_node *nodes, int count, long *self_wt, long *self_cpu)
 {
-	zval *argument_element;
-	long idx;
 	int i;
-	int args_len = ZEND_CALL_NUM_ARGS(data);
 
-	for (i = 0; i < args_len; i++) {
-		argument_element = ZEND_CALL_ARG(data, i+1);
-
-		if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
-			idx = tw_span_create("sql", 3 TSRMLS_CC);
-			tw_span_annotate_string(idx, "sql", Z_STRVAL_P(argument_element), 1 TSRMLS_CC);
+	for (i = 0; i < count; i++) {
+		self_wt[i] = nodes[i].wt;
+		self_cpu[i] = nodes[i].cpu;
+	}
 
-			return idx;
+	for (i = count - 1; i > 0; i--) {
+		if (nodes[i].parent >= 0) {
+			self_wt[nodes[i].parent] -= nodes[i].wt;
+			self_cpu[nodes[i].parent] -= nodes[i].cpu;
 		}
 	}
 
-	return -1;
+	for (i = 0; i < count; i++) {
+		self_wt[i] = self_wt[i] > 0 ? self_wt[i] : 0;
+		self_cpu[i] = self_cpu[i] > 0 ? self_cpu[i] : 0;
+	}
 }
 
-long tw_trace_callback_smarty3_template(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_cct_collapsed(tw_cct_node *nodes, int count, long *self_wt, smart_str *out)
 {
-	zval *argument_element = ZEND_CALL_ARG(data, 1);
-	zval *obj;
-	zend_class_entry *smarty_ce;
-	char *template;
-	size_t template_len;
-	zval *__rv;
-
-	if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
-		template = Z_STRVAL_P(argument_element);
-	} else {
-		zval *object = EX_OBJ(data);
+	int i, depth, *path = emalloc(sizeof(int) * (count + 1));
+	int node;
 
-		if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-			return -1;
+	for (i = 0; i < count; i++) {
+		if (self_wt[i] <= 0) {
+			continue;
 		}
 
-		smarty_ce = Z_OBJCE_P(object);
-
-		argument_element = _zend_read_property(smarty_ce, object, "template_resource", sizeof("template_resource") - 1, 1, __rv);
+		depth = 0;
+		for (node = i; node >= 0; node = nodes[node].parent) {
+			path[depth++] = node;
+		}
 
-		if (Z_TYPE_P(argument_element) != IS_STRING) {
-			return -1;
+		while (depth-- > 0) {
+			smart_str_appends(out, nodes[path[depth]].name);
+			smart_str_appendc(out, depth > 0 ? ';' : ' ');
 		}
 
-		template = Z_STRVAL_P(argument_element);
+		smart_str_append_long(out, self_wt[i]);
+		smart_str_appendc(out, '\n');
 	}
 
-	template_len = Z_STRLEN_P(argument_element);
-
-	return tw_trace_callback_record_with_cache("view", 4, template, template_len, 1 TSRMLS_CC);
+	efree(path);
 }
 
-long tw_trace_callback_doctrine_persister(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_cct_callgrind(tw_cct_node *nodes, int count, long *self_wt, long *self_cpu, int with_cpu, smart_str *out)
 {
-	zval *property;
-	zend_class_entry *persister_ce, *metadata_ce;
-	zval *object = EX_OBJ(data);
-	zval *__rv;
-
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return -1;
+	int i, child;
+
+	smart_str_appends(out, "# callgrind format\nversion: 1\ncreator: tideways\npositions: line\n");
+	smart_str_appends(out, with_cpu ? "events: Wt Cpu\n" : "events: Wt\n");
+
+	for (i = 0; i < count; i++) {
+		smart_str_appends(out, "\nfn=");
+		smart_str_appends(out, nodes[i].name);
+		smart_str_appends(out, "\n0 ");
+		smart_str_append_long(out, self_wt[i]);
+		if (with_cpu) {
+			smart_str_appendc(out, ' ');
+			smart_str_append_long(out, self_cpu[i]);
+		}
+		smart_str_appendc(out, '\n');
+
+		for (child = nodes[i].first_child; child >= 0; child = nodes[child].next_sibling) {
+			smart_str_appends(out, "cfn=");
+			smart_str_appends(out, nodes[child].name);
+			smart_str_appends(out, "\ncalls=");
+			smart_str_append_long(out, nodes[child].ct);
+			smart_str_appends(out, " 0\n0 ");
+			smart_str_append_long(out, nodes[child].wt);
+			if (with_cpu) {
+				smart_str_appendc(out, ' ');
+				smart_str_append_long(out, nodes[child].cpu);
+			}
+			smart_str_appendc(out, '\n');
+		}
 	}
+}
 
-	persister_ce = Z_OBJCE_P(object);
+/* Minimal protocol buffers encoding */
+static void tw_pb_varint(smart_str *out, uint64 value)
+{
+	char buf[10];
+	int len = 0;
+
+	do {
+		buf[len] = (char)(value & 0x7f);
+		value >>= 7;
+		if (value) {
+			buf[len] |= 0x80;
+		}
+		len++;
+	} while (value);
 
-	property = _zend_read_property(persister_ce, object, "class", sizeof("class") - 1, 1, __rv);
-	if (property == NULL) {
-		property = _zend_read_property(persister_ce, object, "_class", sizeof("_class") - 1, 1, __rv);
-	}
+	smart_str_appendl(out, buf, len);
+}
 
-	if (property != NULL && Z_TYPE_P(property) == IS_OBJECT) {
-		metadata_ce = Z_OBJCE_P(property);
+static void tw_pb_uint(smart_str *out, int field, uint64 value)
+{
+	tw_pb_varint(out, (uint64)field << 3);
+	tw_pb_varint(out, value);
+}
 
-		property = _zend_read_property(metadata_ce, property, "name", sizeof("name") - 1, 1, __rv);
+static void tw_pb_bytes(smart_str *out, int field, const char *data, size_t len)
+{
+	tw_pb_varint(out, ((uint64)field << 3) | 2);
+	tw_pb_varint(out, len);
+	smart_str_appendl(out, data, len);
+}
 
-		if (property == NULL) {
-			return -1;
-		}
+static void tw_pb_message(smart_str *out, int field, smart_str *message)
+{
+	tw_pb_bytes(out, field, TW_SMART_STR_VAL(*message), TW_SMART_STR_LEN(*message));
+	smart_str_free(message);
+}
 
-		return tw_trace_callback_record_with_cache("doctrine.load", 13, Z_STRVAL_P(property), Z_STRLEN_P(property), 1 TSRMLS_CC);
-	}
+static void tw_pb_value_type(smart_str *out, int field, int type, int unit)
+{
+	smart_str message = {0};
 
-	return -1;
+	tw_pb_uint(&message, 1, type);
+	tw_pb_uint(&message, 2, unit);
+	tw_pb_message(out, field, &message);
 }
 
-long tw_trace_callback_doctrine_query(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * pprof profile.proto: one function and location per distinct name, one
+ * sample per context with its call count and exclusive times. Function ids
+ * are assigned when names are interned, a name first seen in a node always
+ * has a higher id than the names of all nodes before it.
+ */
+static void tw_cct_pprof(tw_cct_node *nodes, int count, long *self_wt, long *self_cpu, int with_cpu, long duration, smart_str *out)
 {
-	zval *property;
-	zend_class_entry *query_ce;
-	zval fname;
-	_DECLARE_ZVAL(retval_ptr);
-	zval *object = EX_OBJ(data);
-	char *summary, *className;
-	long idx = -1;
-	int keepQuery = 0;
+	smart_str message = {0}, packed = {0}, line = {0};
+	int i, node, strings, emitted;
+	static const char *fixed_strings[] = {"", "calls", "count", "wall", "microseconds", "cpu"};
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
+	tw_pb_value_type(out, 1, 1, 2);
+	tw_pb_value_type(out, 1, 3, 4);
+	if (with_cpu) {
+		tw_pb_value_type(out, 1, 5, 4);
 	}
 
-	query_ce = Z_OBJCE_P(object);
-	className = _ZCE_NAME(query_ce);
+	for (i = 0; i < count; i++) {
+		for (node = i; node >= 0; node = nodes[node].parent) {
+			tw_pb_varint(&packed, nodes[node].function_id);
+		}
+		tw_pb_message(&message, 1, &packed);
 
-	if (strcmp(className, "Doctrine\\ORM\\Query") == 0) {
-		_ZVAL_STRING(&fname, "getDQL");
-		keepQuery = 1;
-	} else if (strcmp(className, "Doctrine\\ORM\\NativeQuery") == 0) {
-		_ZVAL_STRING(&fname, "getSQL");
-	} else {
-		return idx;
+		tw_pb_varint(&packed, nodes[i].ct);
+		tw_pb_varint(&packed, self_wt[i]);
+		if (with_cpu) {
+			tw_pb_varint(&packed, self_cpu[i]);
+		}
+		tw_pb_message(&message, 2, &packed);
+
+		tw_pb_message(out, 2, &message);
 	}
 
-	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
-		if (Z_TYPE_P(retval_ptr) != IS_STRING) {
-			return idx;
-		}
+	strings = sizeof(fixed_strings) / sizeof(fixed_strings[0]);
 
-		idx = tw_span_create("doctrine.query", 14 TSRMLS_CC);
-		if (keepQuery) {
-			tw_span_annotate_string(idx, "title", "DQL", 1 TSRMLS_CC);
-			tw_span_annotate_string(idx, "sql", Z_STRVAL_P(retval_ptr), 1 TSRMLS_CC);
-		} else {
-			tw_span_annotate_string(idx, "title", "Native", 1 TSRMLS_CC);
+	/* Location and function ids are the same, first context with a name */
+	for (i = 0, emitted = 0; i < count; i++) {
+		if (nodes[i].function_id <= emitted) {
+			continue;
 		}
+		emitted = nodes[i].function_id;
 
-		hp_ptr_dtor(retval_ptr);
+		tw_pb_uint(&message, 1, nodes[i].function_id);
+		tw_pb_uint(&line, 1, nodes[i].function_id);
+		tw_pb_message(&message, 4, &line);
+		tw_pb_message(out, 4, &message);
+
+		tw_pb_uint(&message, 1, nodes[i].function_id);
+		tw_pb_uint(&message, 2, strings + nodes[i].function_id - 1);
+		tw_pb_uint(&message, 3, strings + nodes[i].function_id - 1);
+		tw_pb_message(out, 5, &message);
 	}
-#if PHP_VERSION_ID >= 70000
-	zend_string_release(Z_STR(fname));
-#endif
 
-	return idx;
+	for (i = 0; i < strings; i++) {
+		tw_pb_bytes(out, 6, fixed_strings[i], strlen(fixed_strings[i]));
+	}
+
+	for (i = 0, emitted = 0; i < count; i++) {
+		if (nodes[i].function_id > emitted) {
+			emitted = nodes[i].function_id;
+			tw_pb_bytes(out, 6, nodes[i].name, strlen(nodes[i].name));
+		}
+	}
+
+	tw_pb_uint(out, 10, (uint64)duration * 1000);
+	tw_pb_value_type(out, 11, 3, 4);
 }
 
-long tw_trace_callback_twig_template(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * Wraps data in gzip framing with uncompressed deflate blocks, pprof expects
+ * gzip'd profiles and this avoids a zlib dependency.
+ */
+static void tw_gzip_stored(const char *data, size_t len, smart_str *out)
 {
-	long idx = -1, *idx_ptr;
-	zval fname;
-	_DECLARE_ZVAL(retval_ptr);
-	zval *object = EX_OBJ(data);
+	static const char header[] = {0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, (char)0xff};
+	uint32 crc = 0xFFFFFFFF;
+	size_t offset = 0, block;
+	char trailer[8];
+	int i;
 
-	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
-		return idx;
-	}
+	smart_str_appendl(out, header, sizeof(header));
 
-	_ZVAL_STRING(&fname, "getTemplateName");
+	do {
+		block = len - offset > 0xFFFF ? 0xFFFF : len - offset;
 
-	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
-		if (Z_TYPE_P(retval_ptr) == IS_STRING) {
-			idx = tw_trace_callback_record_with_cache("view", 4, Z_STRVAL_P(retval_ptr), Z_STRLEN_P(retval_ptr), 1 TSRMLS_CC);
+		smart_str_appendc(out, offset + block == len ? 1 : 0);
+		smart_str_appendc(out, (char)(block & 0xFF));
+		smart_str_appendc(out, (char)(block >> 8));
+		smart_str_appendc(out, (char)(~block & 0xFF));
+		smart_str_appendc(out, (char)((~block >> 8) & 0xFF));
+		smart_str_appendl(out, data + offset, block);
 
-		}
+		offset += block;
+	} while (offset < len);
 
-		hp_ptr_dtor(retval_ptr);
+	for (offset = 0; offset < len; offset++) {
+		CRC32(crc, (unsigned char)data[offset]);
 	}
-#if PHP_VERSION_ID >= 70000
-	zend_string_release(Z_STR(fname));
-#endif
+	crc = ~crc;
 
-	return idx;
+	for (i = 0; i < 4; i++) {
+		trailer[i] = (char)((crc >> (8 * i)) & 0xFF);
+		trailer[i + 4] = (char)(((uint32)len >> (8 * i)) & 0xFF);
+	}
+
+	smart_str_appendl(out, trailer, sizeof(trailer));
 }
 
-long tw_trace_callback_event_dispatchers2(char *symbol, zend_execute_data *data TSRMLS_DC)
+/* Span exports, name and annotations of a span are collected through
+ * tw_span_annotations() */
+typedef struct tw_span_export_context {
+	smart_str *out;
+	int count;
+	char *title;
+	size_t title_len;
+} tw_span_export_context;
+
+static void tw_json_string(smart_str *out, const char *str, size_t len)
 {
-	long idx = -1, *idx_ptr;
-	zval *arg1 = ZEND_CALL_ARG(data, 1);
-	zval *arg2 = ZEND_CALL_ARG(data, 2);
-	char *event;
-	int len;
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t i;
+
+	smart_str_appendc(out, '"');
+
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)str[i];
+
+		if (c == '"' || c == '\\') {
+			smart_str_appendc(out, '\\');
+			smart_str_appendc(out, c);
+		} else if (c < 0x20) {
+			smart_str_appendl(out, "\\u00", 4);
+			smart_str_appendc(out, hex[c >> 4]);
+			smart_str_appendc(out, hex[c & 0xF]);
+		} else {
+			smart_str_appendc(out, c);
+		}
+	}
 
-	if (arg1 && arg2 && Z_TYPE_P(arg1) == IS_STRING && Z_TYPE_P(arg2) == IS_STRING) {
-		len = Z_STRLEN_P(arg1) + Z_STRLEN_P(arg2) + 3;
-		event = (char*)emalloc(len);
-		snprintf(event, len, "%s::%s", Z_STRVAL_P(arg1), Z_STRVAL_P(arg2));
-		event[len-1] = '\0';
+	smart_str_appendc(out, '"');
+}
 
-		idx = tw_trace_callback_record_with_cache("event", 5, event, len, 1 TSRMLS_CC);
+static void tw_span_export_title(char *key, size_t key_len, char *value, size_t value_len, void *context)
+{
+	tw_span_export_context *export = context;
 
-		efree(event);
+	if (key_len == sizeof("title") - 1 && memcmp(key, "title", key_len) == 0) {
+		export->title = value;
+		export->title_len = value_len;
 	}
+}
 
-	return idx;
+static void tw_span_export_json_annotation(char *key, size_t key_len, char *value, size_t value_len, void *context)
+{
+	tw_span_export_context *export = context;
+
+	smart_str_appendc(export->out, ',');
+	tw_json_string(export->out, key, key_len);
+	smart_str_appendc(export->out, ':');
+	tw_json_string(export->out, value, value_len);
 }
 
-long tw_trace_callback_event_dispatchers(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * Chrome trace event format, complete ("X") events in microseconds since the
+ * start of the request, loads in Perfetto and chrome://tracing.
+ */
+static void tw_span_export_chrome(tw_span_interval *intervals, int count, smart_str *out TSRMLS_DC)
 {
-	long idx = -1, *idx_ptr;
-	zval *argument_element = ZEND_CALL_ARG(data, 1);
+	tw_span_export_context export;
+	long pid = (long)getpid();
+	int i;
 
-	if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
-		idx = tw_trace_callback_record_with_cache("event", 5, Z_STRVAL_P(argument_element), Z_STRLEN_P(argument_element), 1 TSRMLS_CC);
-	}
+	smart_str_appends(out, "{\"traceEvents\":[");
 
-	return idx;
+	for (i = 0; i < count; i++) {
+		memset(&export, 0, sizeof(export));
+		export.out = out;
+		tw_span_annotations(intervals[i].span, tw_span_export_title, &export TSRMLS_CC);
+
+		if (i > 0) {
+			smart_str_appendc(out, ',');
+		}
+
+		smart_str_appends(out, "\n{\"name\":");
+		if (export.title != NULL) {
+			tw_json_string(out, export.title, export.title_len);
+		} else {
+			tw_json_string(out, intervals[i].category, strlen(intervals[i].category));
+		}
+		smart_str_appends(out, ",\"cat\":");
+		tw_json_string(out, intervals[i].category, strlen(intervals[i].category));
+		smart_str_appends(out, ",\"ph\":\"X\",\"ts\":");
+		smart_str_append_long(out, intervals[i].start);
+		smart_str_appends(out, ",\"dur\":");
+		smart_str_append_long(out, intervals[i].end - intervals[i].start);
+		smart_str_appends(out, ",\"pid\":");
+		smart_str_append_long(out, pid);
+		smart_str_appends(out, ",\"tid\":");
+		smart_str_append_long(out, pid);
+		smart_str_appends(out, ",\"args\":{\"span\":");
+		smart_str_append_long(out, intervals[i].span);
+		tw_span_annotations(intervals[i].span, tw_span_export_json_annotation, &export TSRMLS_CC);
+		smart_str_appends(out, "}}");
+	}
+
+	smart_str_appends(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
 }
 
-long tw_trace_callback_pdo_stmt_execute(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_pb_fixed64(smart_str *out, int field, uint64 value)
 {
-	long idx;
+	char buf[8];
+	int i;
 
-#if PHP_VERSION_ID >= 70000
-	pdo_stmt_t *stmt = (pdo_stmt_t*) ((char*) Z_OBJ_P(EX_OBJ(data)) - Z_OBJ_HT_P(EX_OBJ(data))->offset);
-#else
-	pdo_stmt_t *stmt = (pdo_stmt_t*)zend_object_store_get_object_by_handle(Z_OBJ_HANDLE_P(EX_OBJ(data)) TSRMLS_CC);
-#endif
-	idx = tw_span_create("sql", 3 TSRMLS_CC);
-	tw_span_annotate_string(idx, "sql", stmt->query_string, 1 TSRMLS_CC);
+	for (i = 0; i < 8; i++) {
+		buf[i] = (char)((value >> (8 * i)) & 0xFF);
+	}
 
-	return idx;
+	tw_pb_varint(out, ((uint64)field << 3) | 1);
+	smart_str_appendl(out, buf, sizeof(buf));
 }
 
-long tw_trace_callback_mysqli_stmt_execute(char *symbol, zend_execute_data *data TSRMLS_DC)
+/* OTLP KeyValue with a string AnyValue */
+static void tw_pb_attribute(smart_str *out, int field, const char *key, size_t key_len, const char *value, size_t value_len)
 {
-	return tw_trace_callback_record_with_cache("sql", 3, "execute", 7, 1 TSRMLS_CC);
+	smart_str attribute = {0}, any = {0};
+
+	tw_pb_bytes(&any, 1, value, value_len);
+	tw_pb_bytes(&attribute, 1, key, key_len);
+	tw_pb_message(&attribute, 2, &any);
+	tw_pb_message(out, field, &attribute);
 }
 
-long tw_trace_callback_sql_commit(char *symbol, zend_execute_data *data TSRMLS_DC)
+static void tw_span_export_otlp_annotation(char *key, size_t key_len, char *value, size_t value_len, void *context)
 {
-	return tw_trace_callback_record_with_cache("sql", 3, "commit", 3, 1 TSRMLS_CC);
+	tw_span_export_context *export = context;
+
+	tw_pb_attribute(export->out, 9, key, key_len, value, value_len);
 }
 
-long tw_trace_callback_sql_functions(char *symbol, zend_execute_data *data TSRMLS_DC)
+/* Span ids share the random tail of the trace id, followed by the interval */
+static void tw_otlp_span_id(unsigned char *trace_id, int interval, char *span_id)
 {
-	zval *argument_element;
-	long idx;
+	memcpy(span_id, trace_id + 12, 4);
+	span_id[4] = (char)(((interval + 1) >> 24) & 0xFF);
+	span_id[5] = (char)(((interval + 1) >> 16) & 0xFF);
+	span_id[6] = (char)(((interval + 1) >> 8) & 0xFF);
+	span_id[7] = (char)((interval + 1) & 0xFF);
+}
 
-	if (strcmp(symbol, "mysqli_query") == 0 || strcmp(symbol, "mysqli_prepare") == 0) {
-		argument_element = ZEND_CALL_ARG(data, 2);
-	} else {
-		argument_element = ZEND_CALL_ARG(data, 1);
-	}
+/**
+ * The interval of the parent span enclosing interval i, spans can have more
+ * than one timer. first holds the first interval of spans 0 to spans - 1 or
+ * -1 for spans without one. Returns -1 without parent.
+ */
+static int tw_otlp_parent_interval(tw_span_interval *intervals, int count, int *first, long spans, int i)
+{
+	long parent = intervals[i].parent;
+	int j;
 
-	if (Z_TYPE_P(argument_element) != IS_STRING) {
+	if (parent < 0 || parent >= spans || first[parent] < 0) {
 		return -1;
 	}
 
-	idx = tw_span_create("sql", 3 TSRMLS_CC);
-	tw_span_annotate_string(idx, "sql", Z_STRVAL_P(argument_element), 1 TSRMLS_CC);
+	for (j = first[parent]; j < count && intervals[j].span == parent; j++) {
+		if (intervals[j].start <= intervals[i].start && intervals[j].end >= intervals[i].end) {
+			return j;
+		}
+	}
 
-	return idx;
+	return first[parent];
 }
 
-long tw_trace_callback_fastcgi_finish_request(char *symbol, zend_execute_data *data TSRMLS_DC)
+/**
+ * OTLP ExportTraceServiceRequest protobuf with one resource and one span per
+ * timer, as accepted by an OpenTelemetry collector on /v1/traces.
+ */
+static void tw_span_export_otlp(tw_span_interval *intervals, int count, unsigned char *trace_id, char *parent_span_id, char *service, smart_str *out TSRMLS_DC)
 {
-	// stop the main span, the request ended here
-	tw_span_timer_stop(0 TSRMLS_CC);
-	return -1;
-}
+	smart_str resource = {0}, scope = {0}, scope_spans = {0}, span = {0}, resource_spans = {0};
+	tw_span_export_context export;
+	char span_id[8];
+	int i, parent, *first;
+	long kind, spans = 1;
+
+	tw_pb_attribute(&resource, 1, "service.name", sizeof("service.name") - 1, service, strlen(service));
+	tw_pb_message(&resource_spans, 1, &resource);
+
+	tw_pb_bytes(&scope, 1, "tideways", sizeof("tideways") - 1);
+	tw_pb_bytes(&scope, 2, TIDEWAYS_VERSION, sizeof(TIDEWAYS_VERSION) - 1);
+	tw_pb_message(&scope_spans, 1, &scope);
+
+	for (i = 0; i < count; i++) {
+		if (intervals[i].span >= spans) {
+			spans = intervals[i].span + 1;
+		}
+	}
 
-long tw_trace_callback_curl_exec(char *symbol, zend_execute_data *data TSRMLS_DC)
-{
-	zval *argument = ZEND_CALL_ARG(data, 1);
-	zval *option;
-	char *summary;
-	long idx, *idx_ptr;
-	zval fname, *opt;
-	zval ***params_array;
-	_DECLARE_ZVAL(retval_ptr);
-#if PHP_VERSION_ID >= 70000
-	zval params[1];
-#endif
+	first = safe_emalloc(spans, sizeof(int), 0);
 
-	if (argument == NULL || Z_TYPE_P(argument) != IS_RESOURCE) {
-		return -1;
+	for (i = 0; i < spans; i++) {
+		first[i] = -1;
+	}
+	for (i = count - 1; i >= 0; i--) {
+		first[intervals[i].span] = i;
 	}
 
-	_ZVAL_STRING(&fname, "curl_getinfo");
-
-#if PHP_VERSION_ID < 70000
-	params_array = (zval ***) emalloc(sizeof(zval **));
-	params_array[0] = &argument;
+	for (i = 0; i < count; i++) {
+		memset(&export, 0, sizeof(export));
+		export.out = &span;
+		tw_span_annotations(intervals[i].span, tw_span_export_title, &export TSRMLS_CC);
 
-	if (SUCCESS == call_user_function_ex(EG(function_table), NULL, &fname, &retval_ptr, 1, params_array, 1, NULL TSRMLS_CC)) {
-#else
-	ZVAL_RES(&params[0], Z_RES_P(argument));
+		tw_pb_bytes(&span, 1, (char *)trace_id, 16);
+		tw_otlp_span_id(trace_id, i, span_id);
+		tw_pb_bytes(&span, 2, span_id, sizeof(span_id));
 
-	if (SUCCESS == call_user_function_ex(EG(function_table), NULL, &fname, retval_ptr, 1, params, 1, NULL)) {
-#endif
-		option = zend_compat_hash_find_const(Z_ARRVAL_P(retval_ptr), "url", sizeof("url")-1);
+		parent = tw_otlp_parent_interval(intervals, count, first, spans, i);
 
-		if (option && Z_TYPE_P(option) == IS_STRING) {
-			summary = hp_get_file_summary(Z_STRVAL_P(option), Z_STRLEN_P(option) TSRMLS_CC);
+		if (parent >= 0) {
+			tw_otlp_span_id(trace_id, parent, span_id);
+			tw_pb_bytes(&span, 4, span_id, sizeof(span_id));
+		} else if (parent_span_id != NULL) {
+			tw_pb_bytes(&span, 4, parent_span_id, 8);
+		}
 
+		if (export.title != NULL) {
+			tw_pb_bytes(&span, 5, export.title, export.title_len);
+		} else {
+			tw_pb_bytes(&span, 5, intervals[i].category, strlen(intervals[i].category));
+		}
 
-			idx = tw_span_create("http", 4 TSRMLS_CC);
-			tw_span_annotate_string(idx, "url", summary, 0 TSRMLS_CC);
-#if PHP_VERSION_ID >= 70000
-			efree(summary);
-#endif
+		/* SERVER for the request, CLIENT for calls to other services */
+		if (intervals[i].span == 0) {
+			kind = 2;
+		} else if (strcmp(intervals[i].category, "php") == 0 || strcmp(intervals[i].category, "view") == 0 ||
+				strcmp(intervals[i].category, "event") == 0 || strcmp(intervals[i].category, "gc") == 0) {
+			kind = 1;
+		} else {
+			kind = 3;
 		}
+		tw_pb_uint(&span, 6, kind);
 
-		hp_ptr_dtor(retval_ptr);
+		tw_pb_fixed64(&span, 7, (TWG(start_timestamp) + intervals[i].start) * 1000);
+		tw_pb_fixed64(&span, 8, (TWG(start_timestamp) + intervals[i].end) * 1000);
+
+		tw_pb_attribute(&span, 9, "tideways.category", sizeof("tideways.category") - 1, intervals[i].category, strlen(intervals[i].category));
+		tw_span_annotations(intervals[i].span, tw_span_export_otlp_annotation, &export TSRMLS_CC);
+
+		tw_pb_message(&scope_spans, 2, &span);
 	}
 
-#if PHP_VERSION_ID < 70000
-	efree(params_array);
-#else
-	zend_string_release(Z_STR(fname));
-#endif
+	efree(first);
 
-	return idx;
+	tw_pb_message(&resource_spans, 2, &scope_spans);
+	tw_pb_message(out, 1, &resource_spans);
 }
 
-long tw_trace_callback_soap_client_dorequest(char *symbol, zend_execute_data *data TSRMLS_DC)
+static int tw_hex_decode(const char *hex, size_t hex_len, unsigned char *out, size_t out_len)
 {
-	char *summary;
-	zval *argument;
-	long idx = -1;
+	size_t i;
+	int digit;
+	char c;
 
-	if (ZEND_CALL_NUM_ARGS(data) < 2) {
-		return -1;
+	if (hex_len != out_len * 2) {
+		return 0;
 	}
 
-	argument = ZEND_CALL_ARG(data, 2);
+	memset(out, 0, out_len);
 
-	if (Z_TYPE_P(argument) != IS_STRING) {
-		return idx;
+	for (i = 0; i < hex_len; i++) {
+		c = hex[i];
+
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			return 0;
+		}
+
+		out[i / 2] |= (unsigned char)(i % 2 == 0 ? digit << 4 : digit);
 	}
 
-	idx = tw_span_create("http", 4 TSRMLS_CC);
-	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1 TSRMLS_CC);
-	tw_span_annotate_string(idx, "method", "POST", 1 TSRMLS_CC);
-	tw_span_annotate_string(idx, "service", "soap", 1 TSRMLS_CC);
+	return 1;
+}
 
-	return idx;
+long tw_trace_callback_php_call(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	return tw_trace_callback_record_with_cache("php", 3, symbol, strlen(symbol), 1 TSRMLS_CC);
 }
 
-long tw_trace_callback_file_get_contents(char *symbol, zend_execute_data *data TSRMLS_DC)
+long tw_trace_callback_watch(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	zval *argument = ZEND_CALL_ARG(data, 1);
-	char *summary;
-	long idx = -1;
+	tw_watch_callback **temp;
+	tw_watch_callback *twcb = NULL;
+	zend_fcall_info fci = empty_fcall_info;
+	zend_fcall_info_cache fcic = empty_fcall_info_cache;
+	int args_len = ZEND_CALL_NUM_ARGS(data);
+	zval *object = EX_OBJ(data);
+	_DECLARE_ZVAL(retval);
+	_DECLARE_ZVAL(context);
+	_DECLARE_ZVAL(zargs);
+#if PHP_VERSION_ID < 70000
+	zval *params[1];
+#else
+	zval params[1];
+#endif
+	zend_error_handling zeh;
+	int i;
+	long idx;
 
-	if (Z_TYPE_P(argument) != IS_STRING) {
-		return idx;
+	if (TWG(trace_watch_callbacks) == NULL) {
+		return -1;
 	}
 
-	if (strncmp(Z_STRVAL_P(argument), "http", 4) != 0) {
+#if PHP_VERSION_ID < 70000
+	if (zend_hash_find(TWG(trace_watch_callbacks), symbol, strlen(symbol)+1, (void **)&temp) == SUCCESS) {
+		twcb = *temp;
+#else
+	twcb = zend_hash_str_find_ptr(TWG(trace_watch_callbacks), symbol, strlen(symbol));
+
+	if (twcb) {
+#endif
+		_ALLOC_INIT_ZVAL(context);
+		array_init(context);
+
+		_ALLOC_INIT_ZVAL(zargs);
+		array_init(zargs);
+		Z_ADDREF_P(zargs);
+
+		_add_assoc_string_ex(context, "fn", sizeof("fn"), symbol, 1);
+
+		if (args_len > 0) {
+			for (i = 0; i < args_len; i++) {
+				Z_TRY_ADDREF_P(ZEND_CALL_ARG(data, i+1));
+				add_next_index_zval(zargs, ZEND_CALL_ARG(data, i+1));
+			}
+		}
+
+		add_assoc_zval(context, "args", zargs);
+
+		if (object != NULL) {
+			Z_TRY_ADDREF_P(object);
+			add_assoc_zval(context, "object", object);
+		}
+
+#if PHP_VERSION_ID < 70000
+		params[0] = (zval *)&(context);
+#else
+		ZVAL_COPY(&params[0], context);
+#endif
+
+		twcb->fci.param_count = 1;
+		twcb->fci.size = sizeof(twcb->fci);
+#if PHP_VERSION_ID < 70000
+		twcb->fci.retval_ptr_ptr = &retval;
+		twcb->fci.params = (zval ***)params;
+#else
+		twcb->fci.retval = retval;
+		twcb->fci.params = params;
+#endif
+
+		fci = twcb->fci;
+		fcic = twcb->fcic;
+
+		if (zend_call_function(&fci, &fcic TSRMLS_CC) == FAILURE) {
+			zend_error(E_ERROR, "Cannot call Trace Watch Callback");
+		}
+
+		hp_ptr_dtor(context);
+		hp_ptr_dtor(zargs);
+#if PHP_VERSION_ID >= 70000
+		hp_ptr_dtor(&params[0]);
+#endif
+
+		idx = -1;
+
+		if (retval) {
+			if (Z_TYPE_P(retval) == IS_LONG) {
+				idx = Z_LVAL_P(retval);
+			}
+
+			hp_ptr_dtor(retval);
+		}
+
 		return idx;
 	}
 
-	idx = tw_span_create("http", 4 TSRMLS_CC);
-	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1 TSRMLS_CC);
+	return -1;
+}
 
-	return idx;
+static void tw_mongo_object_reset(tw_mongo_object *mongo, zval *object)
+{
+	memset(mongo, 0, sizeof(tw_mongo_object));
+	mongo->ce = Z_OBJCE_P(object);
 }
 
 /**
- * Request init callback.
- *
- * Check if Tideways.php exists in extension_dir and load it
- * in request init. This makes class \Tideways\Profiler available
- * for usage.
+ * Find the side table entry of a Mongo collection or cursor object, created
+ * on first use. Entries live until the end of the request, a handle reused by
+ * a new cursor is reset by find(), aggregateCursor() or the cursor
+ * constructors, and by any object of another class.
  */
-PHP_RINIT_FUNCTION(tideways)
+static tw_mongo_object *tw_mongo_object_find(zval *object, int create TSRMLS_DC)
 {
-	char *extension_dir;
-	char *profiler_file;
-	int profiler_file_len;
+	tw_mongo_object *mongo = NULL, empty;
 
-	TWG(prepend_overwritten) = 0;
-	TWG(backtrace) = NULL;
-	TWG(transaction_name) = NULL;
-	TWG(transaction_function) = NULL;
 #if PHP_VERSION_ID >= 70000
-	ZVAL_NULL(&TWG(spans));
-	ZVAL_NULL(&TWG(stats_count));
-	ZVAL_NULL(&TWG(exception));
+	mongo = zend_hash_index_find_ptr(TWG(mongo_objects), Z_OBJ_HANDLE_P(object));
 #else
-	TWG(exception) = NULL;
+	zend_hash_index_find(TWG(mongo_objects), Z_OBJ_HANDLE_P(object), (void **)&mongo);
 #endif
 
-	if (INI_INT("tideways.auto_prepend_library") == 0) {
-		return SUCCESS;
+	if (mongo != NULL && mongo->ce != Z_OBJCE_P(object)) {
+		tw_mongo_object_reset(mongo, object);
 	}
 
-	extension_dir  = INI_STR("extension_dir");
-	profiler_file_len = strlen(extension_dir) + strlen("Tideways.php") + 2;
-	profiler_file = emalloc(profiler_file_len);
-	snprintf(profiler_file, profiler_file_len, "%s/%s", extension_dir, "Tideways.php");
-
-	if (PG(open_basedir) && php_check_open_basedir_ex(profiler_file, 0 TSRMLS_CC)) {
-		efree(profiler_file);
-		return SUCCESS;
+	if (mongo == NULL && create) {
+		tw_mongo_object_reset(&empty, object);
+#if PHP_VERSION_ID >= 70000
+		mongo = zend_hash_index_update_mem(TWG(mongo_objects), Z_OBJ_HANDLE_P(object), &empty, sizeof(tw_mongo_object));
+#else
+		zend_hash_index_update(TWG(mongo_objects), Z_OBJ_HANDLE_P(object), &empty, sizeof(tw_mongo_object), (void **)&mongo);
+#endif
 	}
 
-	if (VCWD_ACCESS(profiler_file, F_OK) == 0) {
-		PG(auto_prepend_file) = profiler_file;
-		TWG(prepend_overwritten) = 1;
-	} else {
-		efree(profiler_file);
-	}
+	return mongo;
+}
 
-	return SUCCESS;
+static void tw_mongo_object_set_ns(tw_mongo_object *mongo, zval *ns)
+{
+	if (ns != NULL && Z_TYPE_P(ns) == IS_STRING) {
+		strncpy(mongo->ns, Z_STRVAL_P(ns), sizeof(mongo->ns) - 1);
+		mongo->ns[sizeof(mongo->ns) - 1] = '\0';
+		mongo->has_ns = 1;
+	}
 }
 
 /**
- * Request shutdown callback. Stop profiling and return.
+ * Namespace of a cursor, asking $cursor->info() only for cursors that were
+ * not returned by a MongoCollection method while profiling.
  */
-PHP_RSHUTDOWN_FUNCTION(tideways)
+static tw_mongo_object *tw_mongo_cursor_find(zval *object TSRMLS_DC)
 {
-	hp_end(TSRMLS_C);
+	tw_mongo_object *mongo = tw_mongo_object_find(object, 1 TSRMLS_CC);
+	zval fname;
+	_DECLARE_ZVAL(retval_ptr);
 
-	if (TWG(prepend_overwritten) == 1) {
-		efree(PG(auto_prepend_file));
-		PG(auto_prepend_file) = NULL;
-		TWG(prepend_overwritten) = 0;
+	if (mongo->has_ns) {
+		return mongo;
 	}
 
-	return SUCCESS;
+	_ZVAL_STRING(&fname, "info");
+
+	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
+		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
+			tw_mongo_object_set_ns(mongo, zend_compat_hash_find_const(Z_ARRVAL_P(retval_ptr), "ns", sizeof("ns")-1));
+		}
+
+		hp_ptr_dtor(retval_ptr);
+	}
+
+#if PHP_VERSION_ID >= 70000
+	zend_string_release(Z_STR(fname));
+#endif
+
+	/* Do not ask again, even if info() failed */
+	mongo->has_ns = 1;
+
+	return mongo;
 }
 
-/**
- * Module info callback. Returns the Tideways version.
- */
-PHP_MINFO_FUNCTION(tideways)
+long tw_trace_callback_mongo_cursor_io(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	char *extension_dir;
-	char *profiler_file;
-	int profiler_file_len;
+	long idx = -1;
+	zval *object = EX_OBJ(data);
+	tw_mongo_object *mongo;
 
-	php_info_print_table_start();
-	php_info_print_table_header(2, "tideways", TIDEWAYS_VERSION);
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
+	}
 
-	php_info_print_table_row(2, "Connection (tideways.connection)", INI_STR("tideways.connection"));
-	php_info_print_table_row(2, "UDP Connection (tideways.udp_connection)", INI_STR("tideways.udp_connection"));
-	php_info_print_table_row(2, "Default API Key (tideways.api_key)", INI_STR("tideways.api_key"));
-	php_info_print_table_row(2, "Default Sample-Rate (tideways.sample_rate)", INI_STR("tideways.sample_rate"));
-	php_info_print_table_row(2, "Framework Detection (tideways.framework)", INI_STR("tideways.framework"));
-	php_info_print_table_row(2, "Automatically Start (tideways.auto_start)", INI_INT("tideways.auto_start") ? "Yes": "No");
-	php_info_print_table_row(2, "Tideways Collect Mode (tideways.collect)", INI_STR("tideways.collect"));
-	php_info_print_table_row(2, "Tideways Monitoring Mode (tideways.monitor)", INI_STR("tideways.monitor"));
-	php_info_print_table_row(2, "Allowed Distributed Tracing Hosts (tideways.distributed_tracing_hosts)", INI_STR("tideways.distributed_tracing_hosts"));
-	php_info_print_table_row(2, "Load PHP Library (tideways.auto_prepend_library)", INI_INT("tideways.auto_prepend_library") ? "Yes": "No");
+	mongo = tw_mongo_cursor_find(object TSRMLS_CC);
 
-	extension_dir  = INI_STR("extension_dir");
-	profiler_file_len = strlen(extension_dir) + strlen("Tideways.php") + 2;
-	profiler_file = emalloc(profiler_file_len);
-	snprintf(profiler_file, profiler_file_len, "%s/%s", extension_dir, "Tideways.php");
+	idx = tw_span_create("mongo", 5 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
 
-	if (VCWD_ACCESS(profiler_file, F_OK) == 0) {
-		php_info_print_table_row(2, "Tideways.php found", "Yes");
-	} else {
-		php_info_print_table_row(2, "Tideways.php found", "No");
+	if (mongo->ns[0] != '\0') {
+		tw_span_annotate_string(idx, "collection", mongo->ns, 1 TSRMLS_CC);
 	}
 
-	efree(profiler_file);
-
-	php_info_print_table_end();
+	return idx;
 }
 
+long tw_trace_callback_mongo_cursor_next(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	long idx = -1;
+	zval *object = EX_OBJ(data);
+	tw_mongo_object *mongo;
 
-/**
- * ***************************************************
- * COMMON HELPER FUNCTION DEFINITIONS AND LOCAL MACROS
- * ***************************************************
- */
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
+	}
 
-static void hp_register_constants(INIT_FUNC_ARGS)
-{
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_CPU", TIDEWAYS_FLAGS_CPU, CONST_CS | CONST_PERSISTENT);
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_MEMORY", TIDEWAYS_FLAGS_MEMORY, CONST_CS | CONST_PERSISTENT);
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_BUILTINS", TIDEWAYS_FLAGS_NO_BUILTINS, CONST_CS | CONST_PERSISTENT);
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_USERLAND", TIDEWAYS_FLAGS_NO_USERLAND, CONST_CS | CONST_PERSISTENT);
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_COMPILE", TIDEWAYS_FLAGS_NO_COMPILE, CONST_CS | CONST_PERSISTENT);
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_SPANS", TIDEWAYS_FLAGS_NO_SPANS, CONST_CS | CONST_PERSISTENT);
-	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_HIERACHICAL", TIDEWAYS_FLAGS_NO_HIERACHICAL, CONST_CS | CONST_PERSISTENT);
+	mongo = tw_mongo_cursor_find(object TSRMLS_CC);
+
+	/* Only the call running the query gets a span */
+	if (mongo->queried) {
+		return idx;
+	}
+
+	mongo->queried = 1;
+
+	idx = tw_span_create("mongo", 5 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+
+	if (mongo->ns[0] != '\0') {
+		tw_span_annotate_string(idx, "collection", mongo->ns, 1 TSRMLS_CC);
+	}
+
+	return idx;
 }
 
 /**
- * A hash function to calculate a 8-bit hash code for a function name.
- * This is based on a small modification to 'zend_inline_hash_func' by summing
- * up all bytes of the ulong returned by 'zend_inline_hash_func'.
- *
- * @param str, char *, string to be calculated hash code for.
- *
- * @author cjiang
+ * Collection spans are annotated with the collection name only, the part of
+ * the "db.collection" namespace after the database name.
  */
-static inline uint8 hp_inline_hash(char * arKey)
+static char *tw_mongo_collection_name(tw_mongo_object *mongo)
 {
-	size_t nKeyLength = strlen(arKey);
-	register uint8 hash = 0;
+	char *name = strchr(mongo->ns, '.');
 
-	/* variant with the hash unrolled eight times */
-	for (; nKeyLength >= 8; nKeyLength -= 8) {
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-		hash = ((hash << 5) + hash) + *arKey++;
-	}
-	switch (nKeyLength) {
-		case 7: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
-		case 6: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
-		case 5: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
-		case 4: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
-		case 3: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
-		case 2: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
-		case 1: hash = ((hash << 5) + hash) + *arKey++; break;
-		case 0: break;
-EMPTY_SWITCH_DEFAULT_CASE()
-	}
-	return hash;
+	return name != NULL ? name + 1 : mongo->ns;
 }
 
 /**
- * Parse the list of ignored functions from the zval argument.
- *
- * @author mpal
+ * Cursors returned from find() and aggregateCursor() inherit the namespace
+ * of the collection, so iterating them never calls back into userland.
  */
-static void hp_parse_options_from_arg(zval *args TSRMLS_DC)
+void tw_trace_return_mongo_collection(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
 {
-	zval *zresult = NULL;
-
-	hp_clean_profiler_options_state(TSRMLS_C);
+	zval *object = EX_OBJ(data);
+	tw_mongo_object *collection, *cursor;
 
-	if (args == NULL) {
+	if (object == NULL || return_value == NULL || Z_TYPE_P(return_value) != IS_OBJECT) {
 		return;
 	}
 
-	zresult = hp_zval_at_key("ignored_functions", sizeof("ignored_functions"), args);
+	collection = tw_mongo_object_find(object, 0 TSRMLS_CC);
 
-	if (zresult == NULL) {
-		zresult = hp_zval_at_key("functions", sizeof("functions"), args);
-		if (zresult != NULL) {
-			TWG(filtered_type) = 2;
-		}
-	} else {
-		TWG(filtered_type) = 1;
+	if (collection == NULL) {
+		return;
 	}
 
-	TWG(filtered_functions) = hp_function_map_create(hp_strings_in_zval(zresult));
+	cursor = tw_mongo_object_find(return_value, 1 TSRMLS_CC);
+	tw_mongo_object_reset(cursor, return_value);
+	memcpy(cursor->ns, collection->ns, sizeof(cursor->ns));
+	cursor->has_ns = collection->has_ns;
+}
 
-	zresult = hp_zval_at_key("transaction_function", sizeof("transaction_function"), args);
+long tw_trace_callback_mongo_collection(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	long idx = -1;
+	zval *object = EX_OBJ(data);
+	tw_mongo_object *mongo;
+	zval fname;
+	_DECLARE_ZVAL(retval_ptr);
 
-	if (zresult != NULL && Z_TYPE_P(zresult) == IS_STRING) {
-		TWG(transaction_function) = zend_string_copy(Z_STR_P(zresult));
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
 	}
 
-	zresult = hp_zval_at_key("exception_function", sizeof("exception_function"), args);
+	/* Collection objects are short lived and their handles reused, refresh
+	 * the namespace on every call */
+	mongo = tw_mongo_object_find(object, 1 TSRMLS_CC);
+	tw_mongo_object_reset(mongo, object);
+	mongo->has_ns = 1;
 
-	if (zresult != NULL && Z_TYPE_P(zresult) == IS_STRING) {
-		TWG(exception_function) = zend_string_copy(Z_STR_P(zresult));
-	}
-}
+	_ZVAL_STRING(&fname, "__toString");
 
-static void hp_exception_function_clear(TSRMLS_D) {
-	if (TWG(exception_function) != NULL) {
-		zend_string_release(TWG(exception_function));
-		TWG(exception_function) = NULL;
+	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
+		tw_mongo_object_set_ns(mongo, retval_ptr);
+		hp_ptr_dtor(retval_ptr);
 	}
 
 #if PHP_VERSION_ID >= 70000
-	hp_ptr_dtor(&TWG(exception));
-	ZVAL_NULL(&TWG(exception));
-#else 
-	if (TWG(exception) != NULL) {
-		hp_ptr_dtor(TWG(exception));
-		TWG(exception) = NULL;
-	}
+	zend_string_release(Z_STR(fname));
 #endif
+
+	idx = tw_span_create("mongo", 5 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+
+	if (mongo->ns[0] != '\0') {
+		tw_span_annotate_string(idx, "collection", tw_mongo_collection_name(mongo), 1 TSRMLS_CC);
+	}
+
+	if (strcmp(symbol, "MongoCollection::find") == 0 || strcmp(symbol, "MongoCollection::aggregateCursor") == 0) {
+		TWG(pending_return_cb) = tw_trace_return_mongo_collection;
+	}
+
+	return idx;
 }
 
-static void hp_transaction_function_clear(TSRMLS_D) {
-	if (TWG(transaction_function)) {
-		zend_string_release(TWG(transaction_function));
-		TWG(transaction_function) = NULL;
+/* MongoCursor::__construct($connection, $ns, ...) and
+ * MongoCommandCursor::__construct($connection, $ns, $command) */
+long tw_trace_callback_mongo_cursor_construct(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *object = EX_OBJ(data);
+	tw_mongo_object *mongo;
+
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return -1;
 	}
+
+	mongo = tw_mongo_object_find(object, 1 TSRMLS_CC);
+	tw_mongo_object_reset(mongo, object);
+
+	if (ZEND_CALL_NUM_ARGS(data) >= 2) {
+		tw_mongo_object_set_ns(mongo, ZEND_CALL_ARG(data, 2));
+	}
+
+	return -1;
 }
 
-static inline hp_function_map *hp_function_map_create(char **names)
+/**
+ * Counters of a cache span, created on first use. Callbacks add to them
+ * natively and tw_span_counts_flush() writes the annotations.
+ */
+static tw_span_counts *tw_span_counts_find(long idx TSRMLS_DC)
 {
-	hp_function_map *map;
-	int i = 0;
+	tw_span_counts counts, *counts_ptr = NULL;
 
-	if (names == NULL) {
+	if (idx < 0 || TWG(span_counts) == NULL) {
 		return NULL;
 	}
 
-	map = emalloc(sizeof(hp_function_map));
-	map->names = names;
-
-	memset(map->filter, 0, TIDEWAYS_FILTERED_FUNCTION_SIZE);
+#if PHP_VERSION_ID >= 70000
+	counts_ptr = zend_hash_index_find_ptr(TWG(span_counts), idx);
+#else
+	zend_hash_index_find(TWG(span_counts), idx, (void **)&counts_ptr);
+#endif
 
-	for(; names[i] != NULL; i++) {
-		char *str  = names[i];
-		uint8 hash = hp_inline_hash(str);
-		int   idx  = INDEX_2_BYTE(hash);
-		map->filter[idx] |= INDEX_2_BIT(hash);
+	if (counts_ptr == NULL) {
+		memset(&counts, 0, sizeof(tw_span_counts));
+#if PHP_VERSION_ID >= 70000
+		counts_ptr = zend_hash_index_update_mem(TWG(span_counts), idx, &counts, sizeof(tw_span_counts));
+#else
+		zend_hash_index_update(TWG(span_counts), idx, &counts, sizeof(tw_span_counts), (void **)&counts_ptr);
+#endif
 	}
 
-	return map;
+	return counts_ptr;
 }
 
-static inline void hp_function_map_clear(hp_function_map *map) {
-	if (map == NULL) {
-		return;
+static void tw_span_counts_write(long idx, tw_span_counts *counts TSRMLS_DC)
+{
+	if (counts->set & TIDEWAYS_COUNT_KEYS) {
+		tw_span_annotate_long(idx, "keys", counts->keys TSRMLS_CC);
 	}
 
-	hp_array_del(map->names);
-	map->names = NULL;
+	if (counts->set & TIDEWAYS_COUNT_HITS) {
+		tw_span_annotate_long(idx, "hits", counts->hits TSRMLS_CC);
+		tw_span_annotate_long(idx, "misses", counts->misses TSRMLS_CC);
+	}
 
-	memset(map->filter, 0, TIDEWAYS_FILTERED_FUNCTION_SIZE);
-	efree(map);
+	if (counts->set & TIDEWAYS_COUNT_COMMANDS) {
+		tw_span_annotate_long(idx, "commands", counts->commands TSRMLS_CC);
+	}
 }
 
-static inline int hp_function_map_exists(hp_function_map *map, uint8 hash_code, char *curr_func)
+/**
+ * Write the counters of all cache spans, before the spans are read.
+ */
+static void tw_span_counts_flush(TSRMLS_D)
 {
-	if (hp_function_map_filter_collision(map, hash_code)) {
-		int i = 0;
-		for (; map->names[i] != NULL; i++) {
-			char *name = map->names[i];
-			if (strcmp(curr_func, name) == 0) {
-				return 1;
-			}
-		}
+	tw_span_counts *counts;
+#if PHP_VERSION_ID >= 70000
+	zend_ulong idx;
+#else
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong idx;
+#endif
+
+	if (TWG(span_counts) == NULL) {
+		return;
 	}
 
-	return 0;
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_NUM_KEY_PTR(TWG(span_counts), idx, counts) {
+		tw_span_counts_write(idx, counts TSRMLS_CC);
+	} ZEND_HASH_FOREACH_END();
+#else
+	for (zend_hash_internal_pointer_reset_ex(TWG(span_counts), &pos);
+			zend_hash_get_current_data_ex(TWG(span_counts), (void **) &counts, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(TWG(span_counts), &pos)) {
+		if (zend_hash_get_current_key_ex(TWG(span_counts), &key, &key_len, &idx, 0, &pos) != HASH_KEY_IS_LONG) {
+			continue;
+		}
+
+		tw_span_counts_write(idx, counts TSRMLS_CC);
+	}
+#endif
 }
 
+/* Redis and RedisCluster methods sending a command, named as phpredis
+ * declares them */
+static const char *tw_redis_commands[] = {
+	"get", "set", "setex", "psetex", "setnx", "getSet", "del", "delete", "unlink",
+	"exists", "incr", "incrBy", "incrByFloat", "decr", "decrBy", "mget",
+	"getMultiple", "mset", "msetnx", "expire", "pexpire", "expireAt", "ttl",
+	"pttl", "persist", "keys", "scan", "type", "append", "getRange", "setRange",
+	"strlen", "lPush", "rPush", "lPop", "rPop", "blPop", "brPop", "lLen",
+	"lRange", "lRem", "lTrim", "lIndex", "lSet", "sAdd", "sRem", "sMembers",
+	"sIsMember", "sCard", "sPop", "sRandMember", "sInter", "sUnion", "sDiff",
+	"sScan", "zAdd", "zRem", "zRange", "zRevRange", "zRangeByScore",
+	"zRevRangeByScore", "zCard", "zScore", "zRank", "zRevRank", "zIncrBy",
+	"zCount", "zScan", "hGet", "hSet", "hSetNx", "hMGet", "hMSet", "hGetAll",
+	"hDel", "hExists", "hIncrBy", "hIncrByFloat", "hKeys", "hVals", "hLen",
+	"hScan", "publish", "eval", "evalSha", "rawCommand", "rename", "ping",
+	"flushDB", "flushAll", "watch", "unwatch",
+	NULL
+};
 
-static inline int hp_function_map_filter_collision(hp_function_map *map, uint8 hash)
+/**
+ * Spans of Redis commands are aggregated per command, keyed apart from other
+ * cached spans so that e.g. a "get" view does not share them.
+ */
+static long tw_trace_callback_record_redis(char *command TSRMLS_DC)
 {
-	uint8 mask = INDEX_2_BIT(hash);
-	return map->filter[INDEX_2_BYTE(hash)] & mask;
+	char key[SCRATCH_BUF_LEN];
+	long idx;
+#if PHP_VERSION_ID < 70000
+	long *idx_ptr = NULL;
+#else
+	zval zidx, *zidx_ptr;
+#endif
+
+	snprintf(key, sizeof(key), "redis:%s", command);
+
+#if PHP_VERSION_ID < 70000
+	if (zend_hash_find(TWG(span_cache), key, strlen(key)+1, (void **)&idx_ptr) == SUCCESS) {
+		return *idx_ptr;
+	}
+
+	idx = tw_span_create("redis", 5 TSRMLS_CC);
+	zend_hash_update(TWG(span_cache), key, strlen(key)+1, &idx, sizeof(long), NULL);
+#else
+	if (zidx_ptr = zend_hash_str_find(TWG(span_cache), key, strlen(key))) {
+		return Z_LVAL_P(zidx_ptr);
+	}
+
+	idx = tw_span_create("redis", 5 TSRMLS_CC);
+	ZVAL_LONG(&zidx, idx);
+	zend_hash_str_update(TWG(span_cache), key, strlen(key), &zidx);
+#endif
+
+	tw_span_annotate_string(idx, "title", command, 1 TSRMLS_CC);
+
+	return idx;
 }
 
+static tw_redis_batch *tw_redis_batch_find(zval *object TSRMLS_DC)
+{
+	tw_redis_batch *batch = NULL;
+
 #if PHP_VERSION_ID >= 70000
-static inline void hp_free_trace_cb(zval *zv) {
-	efree(Z_PTR_P(zv));
-}
+	batch = zend_hash_index_find_ptr(TWG(redis_batches), Z_OBJ_HANDLE_P(object));
 #else
-static inline void hp_free_trace_cb(void *p) {}
+	zend_hash_index_find(TWG(redis_batches), Z_OBJ_HANDLE_P(object), (void **)&batch);
 #endif
 
-void hp_init_trace_callbacks(TSRMLS_D)
+	return batch;
+}
+
+long tw_trace_callback_redis_call(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	tw_trace_callback cb;
+	zval *object = EX_OBJ(data);
+	char *command = strstr(symbol, "::");
+	tw_redis_batch *batch;
 
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
-		return;
+	if (object == NULL || command == NULL) {
+		return -1;
 	}
 
-	TWG(trace_callbacks) = NULL;
-	TWG(trace_watch_callbacks) = NULL;
-	TWG(span_cache) = NULL;
+	batch = tw_redis_batch_find(object TSRMLS_CC);
 
-	ALLOC_HASHTABLE(TWG(trace_callbacks));
-	zend_hash_init(TWG(trace_callbacks), 255, NULL, hp_free_trace_cb, 0);
+	/* Queued until exec(), no round trip */
+	if (batch != NULL) {
+		batch->commands++;
+		return -1;
+	}
 
-	ALLOC_HASHTABLE(TWG(span_cache));
-	zend_hash_init(TWG(span_cache), 255, NULL, NULL, 0);
+	return tw_trace_callback_record_redis(command + 2 TSRMLS_CC);
+}
 
-	cb = tw_trace_callback_file_get_contents;
-	register_trace_callback("file_get_contents", cb);
+/* Redis::multi([$mode]), Redis::pipeline() */
+long tw_trace_callback_redis_multi(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *object = EX_OBJ(data);
+	zval *mode;
+	tw_redis_batch batch;
 
-	cb = tw_trace_callback_php_call;
-	register_trace_callback("session_start", cb);
-	// Symfony
-	register_trace_callback("Symfony\\Component\\HttpKernel\\Kernel::boot", cb);
-	register_trace_callback("Symfony\\Component\\EventDispatcher\\ContainerAwareEventDispatcher::lazyLoad", cb);
-	register_trace_callback("Symfony\\Component\\HttpKernel\\HttpCache\\HttpCache::lock", cb);
-	register_trace_callback("Symfony\\Component\\HttpKernel\\HttpCache\\HttpCache::forward", cb);
-	// Wordpress
-	register_trace_callback("get_sidebar", cb);
-	register_trace_callback("get_header", cb);
-	register_trace_callback("get_footer", cb);
-	register_trace_callback("load_textdomain", cb);
-	register_trace_callback("setup_theme", cb);
-	// Doctrine
-	register_trace_callback("Doctrine\\ORM\\EntityManager::flush", cb);
-	register_trace_callback("Doctrine\\ODM\\CouchDB\\DocumentManager::flush", cb);
-	// Magento
-	register_trace_callback("Mage_Core_Model_App::_initModules", cb);
-	register_trace_callback("Mage_Core_Model_Config::loadModules", cb);
-	register_trace_callback("Mage_Core_Model_Config::loadDb", cb);
-	// Smarty&Twig Compiler
-	register_trace_callback("Smarty_Internal_TemplateCompilerBase::compileTemplate", cb);
-	register_trace_callback("Twig_Environment::compileSource", cb);
-	// Shopware Assets (very special, do we really need it?)
-	register_trace_callback("JSMin::minify", cb);
-	register_trace_callback("Less_Parser::getCss", cb);
-	// Laravel (4+5)
-	register_trace_callback("Illuminate\\Foundation\\Application::boot", cb);
-	register_trace_callback("Illuminate\\Foundation\\Application::dispatch", cb);
-	// Silex
-	register_trace_callback("Silex\\Application::mount", cb);
+	if (object == NULL || tw_redis_batch_find(object TSRMLS_CC) != NULL) {
+		return -1;
+	}
 
-	cb = tw_trace_callback_presta_controller;
-	register_trace_callback("ControllerCore::run", cb); // PrestaShop 1.6
+	memset(&batch, 0, sizeof(tw_redis_batch));
+	batch.pipeline = strstr(symbol, "::pipeline") != NULL;
 
-	cb = tw_trace_callback_doctrine_persister;
-	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::load", cb);
-	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::loadAll", cb);
-	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::load", cb);
-	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::loadAll", cb);
+	if (ZEND_CALL_NUM_ARGS(data) > 0) {
+		mode = ZEND_CALL_ARG(data, 1);
+		batch.pipeline = mode != NULL && Z_TYPE_P(mode) == IS_LONG && Z_LVAL_P(mode) == TIDEWAYS_REDIS_PIPELINE;
+	}
 
-	cb = tw_trace_callback_doctrine_query;
-	register_trace_callback("Doctrine\\ORM\\AbstractQuery::execute", cb);
+#if PHP_VERSION_ID >= 70000
+	zend_hash_index_update_mem(TWG(redis_batches), Z_OBJ_HANDLE_P(object), &batch, sizeof(tw_redis_batch));
+#else
+	zend_hash_index_update(TWG(redis_batches), Z_OBJ_HANDLE_P(object), &batch, sizeof(tw_redis_batch), NULL);
+#endif
 
-	cb = tw_trace_callback_doctrine_couchdb_request;
-	register_trace_callback("Doctrine\\CouchDB\\HTTP\\SocketClient::request", cb);
-	register_trace_callback("Doctrine\\CouchDB\\HTTP\\StreamClient::request", cb);
+	return -1;
+}
 
-	cb = tw_trace_callback_curl_exec;
-	register_trace_callback("curl_exec", cb);
+/**
+ * The whole multi() or pipeline() block is sent by exec() and becomes one
+ * span, annotated with the number of commands it contained.
+ */
+long tw_trace_callback_redis_exec(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *object = EX_OBJ(data);
+	tw_redis_batch *batch;
+	tw_span_counts *counts;
+	long idx = -1;
 
-	cb = tw_trace_callback_sql_functions;
-	register_trace_callback("PDO::exec", cb);
-	register_trace_callback("PDO::query", cb);
-	register_trace_callback("mysql_query", cb);
-	register_trace_callback("mysqli_query", cb);
-	register_trace_callback("mysqli::query", cb);
-	register_trace_callback("mysqli::prepare", cb);
-	register_trace_callback("mysqli_prepare", cb);
+	if (object == NULL || (batch = tw_redis_batch_find(object TSRMLS_CC)) == NULL) {
+		return -1;
+	}
 
-	cb = tw_trace_callback_sql_commit;
-	register_trace_callback("PDO::commit", cb);
-	register_trace_callback("mysqli::commit", cb);
-	register_trace_callback("mysqli_commit", cb);
+	if (strstr(symbol, "::exec") != NULL) {
+		idx = tw_trace_callback_record_redis(batch->pipeline ? "pipeline" : "multi" TSRMLS_CC);
+		counts = tw_span_counts_find(idx TSRMLS_CC);
 
-	cb = tw_trace_callback_pdo_stmt_execute;
-	register_trace_callback("PDOStatement::execute", cb);
+		if (counts != NULL) {
+			counts->commands += batch->commands;
+			counts->set |= TIDEWAYS_COUNT_COMMANDS;
+		}
+	}
 
-	cb = tw_trace_callback_mysqli_stmt_execute;
-	register_trace_callback("mysqli_stmt_execute", cb);
-	register_trace_callback("mysqli_stmt::execute", cb);
+	zend_hash_index_del(TWG(redis_batches), Z_OBJ_HANDLE_P(object));
 
-	cb = tw_trace_callback_pgsql_query;
-	register_trace_callback("pg_query", cb);
-	register_trace_callback("pg_query_params", cb);
+	return idx;
+}
 
-	cb = tw_trace_callback_pgsql_execute;
-	register_trace_callback("pg_execute", cb);
+long tw_trace_callback_predis_call(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *commandId = ZEND_CALL_ARG(data, 1);
 
-	cb = tw_trace_callback_event_dispatchers;
-	register_trace_callback("Doctrine\\Common\\EventManager::dispatchEvent", cb);
-	register_trace_callback("Enlight_Event_EventManager::filter", cb);
-	register_trace_callback("Enlight_Event_EventManager::notify", cb);
-	register_trace_callback("Enlight_Event_EventManager::notifyUntil", cb);
-	register_trace_callback("Zend\\EventManager\\EventManager::trigger", cb);
-	register_trace_callback("do_action", cb);
-	register_trace_callback("drupal_alter", cb);
-	register_trace_callback("Mage::dispatchEvent", cb);
-	register_trace_callback("Magento\\Framework\\Event\\Manager::dispatch", cb);
-	register_trace_callback("Symfony\\Component\\EventDispatcher\\EventDispatcher::dispatch", cb);
-	register_trace_callback("Illuminate\\Events\\Dispatcher::fire", cb);
-	register_trace_callback("HookCore::exec", cb); // PrestaShop 1.6
-
-	cb = tw_trace_callback_event_dispatchers2;
-	register_trace_callback("HookCore::coreCallHook", cb); // PrestaShop 1.6
-	register_trace_callback("TYPO3\\Flow\\SignalSlot\\Dispatcher::dispatch", cb);
-	register_trace_callback("TYPO3\\CMS\\Extbase\\SignalSlot\\Dispatcher::dispatch", cb);
-
-	cb = tw_trace_callback_twig_template;
-	register_trace_callback("Twig_Template::render", cb);
-	register_trace_callback("Twig_Template::display", cb);
-
-	cb = tw_trace_callback_smarty3_template;
-	register_trace_callback("Smarty_Internal_TemplateBase::fetch", cb);
-
-	cb = tw_trace_callback_fastcgi_finish_request;
-	register_trace_callback("fastcgi_finish_request", cb);
-
-	cb = tw_trace_callback_soap_client_dorequest;
-	register_trace_callback("SoapClient::__doRequest", cb);
-
-	cb = tw_trace_callback_view_class;
-	register_trace_callback("Mage_Core_Block_Abstract::toHtml", cb);
-	register_trace_callback("Magento\\Framework\\View\\Element\\AbstractBlock::toHtml", cb);
-	register_trace_callback("TYPO3\\Flow\\Mvc\\View\\JsonView::render", cb);
-	register_trace_callback("TYPO3\\Fluid\\View\\AbstractTemplateView::render", cb);
-	register_trace_callback("TYPO3\\CMS\\Extbase\\Mvc\\View\\JsonView::render", cb);
-	register_trace_callback("TYPO3\\CMS\\Extbase\\Mvc\\View\\NotFoundView::render", cb);
-	register_trace_callback("TYPO3\\CMS\\Fluid\\View\\AbstractTemplateView::render", cb);
-
-	cb = tw_trace_callback_view_engine;
-	register_trace_callback("Zend_View_Abstract::render", cb);
-	register_trace_callback("Illuminate\\View\\Engines\\CompilerEngine::get", cb);
-	register_trace_callback("Smarty::fetch", cb);
-	register_trace_callback("load_template", cb);
+	if (commandId == NULL || Z_TYPE_P(commandId) != IS_STRING) {
+		return -1;
+	}
 
-	cb = tw_trace_callback_zend1_dispatcher_families_tx;
-	register_trace_callback("Enlight_Controller_Action::dispatch", cb);
-	register_trace_callback("Mage_Core_Controller_Varien_Action::dispatch", cb);
-	register_trace_callback("Magento\\Framework\\App\\Action\\Action::dispatch", cb);
-	register_trace_callback("Zend_Controller_Action::dispatch", cb);
-	register_trace_callback("Illuminate\\Routing\\Controller::callAction", cb);
+	return tw_trace_callback_record_with_cache("predis", 6, Z_STRVAL_P(commandId), Z_STRLEN_P(commandId), 1 TSRMLS_CC);
+}
 
-	cb = tw_trace_callback_symfony_resolve_arguments_tx;
-	register_trace_callback("Symfony\\Component\\HttpKernel\\Controller\\ControllerResolver::getArguments", cb);
+long tw_trace_callback_phpampqlib(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *exchange;
+	long idx = -1;
 
-	cb = tw_trace_callback_oxid_tx;
-	register_trace_callback("oxShopControl::_process", cb);
+	if (ZEND_CALL_NUM_ARGS(data) < 2) {
+		return idx;
+	}
 
-	// Different versions of Memcache Extension have either MemcachePool or Memcache class, @todo investigate
-	cb = tw_trace_callback_memcache;
-	register_trace_callback("MemcachePool::get", cb);
-	register_trace_callback("MemcachePool::set", cb);
-	register_trace_callback("MemcachePool::delete", cb);
-	register_trace_callback("MemcachePool::flush", cb);
-	register_trace_callback("MemcachePool::replace", cb);
-	register_trace_callback("MemcachePool::increment", cb);
-	register_trace_callback("MemcachePool::decrement", cb);
-	register_trace_callback("Memcache::get", cb);
-	register_trace_callback("Memcache::set", cb);
-	register_trace_callback("Memcache::delete", cb);
-	register_trace_callback("Memcache::flush", cb);
-	register_trace_callback("Memcache::replace", cb);
-	register_trace_callback("Memcache::increment", cb);
-	register_trace_callback("Memcache::decrement", cb);
+	exchange = ZEND_CALL_ARG(data, 2);
 
-	cb = tw_trace_callback_pheanstalk;
-	register_trace_callback("Pheanstalk_Pheanstalk::put", cb);
-	register_trace_callback("Pheanstalk\\Pheanstalk::put", cb);
+	if (exchange == NULL || Z_TYPE_P(exchange) != IS_STRING) {
+		return idx;
+	}
 
-	cb = tw_trace_callback_phpampqlib;
-	register_trace_callback("PhpAmqpLib\\Channel\\AMQPChannel::basic_publish", cb);
+	return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(exchange), Z_STRLEN_P(exchange), 1 TSRMLS_CC);
+}
 
-	cb = tw_trace_callback_mongo_collection;
-	register_trace_callback("MongoCollection::find", cb);
-	register_trace_callback("MongoCollection::findOne", cb);
-	register_trace_callback("MongoCollection::findAndModify", cb);
-	register_trace_callback("MongoCollection::insert", cb);
-	register_trace_callback("MongoCollection::remove", cb);
-	register_trace_callback("MongoCollection::save", cb);
-	register_trace_callback("MongoCollection::update", cb);
-	register_trace_callback("MongoCollection::group", cb);
-	register_trace_callback("MongoCollection::distinct", cb);
-	register_trace_callback("MongoCollection::batchInsert", cb);
-	register_trace_callback("MongoCollection::aggregate", cb);
-	register_trace_callback("MongoCollection::aggregateCursor", cb);
+long tw_trace_callback_pheanstalk(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zend_class_entry *pheanstalk_ce;
+	zval *object = EX_OBJ(data);
+	zval *property;
+	long idx = -1;
+	zval *__rv;
 
-	cb = tw_trace_callback_mongo_cursor_next;
-	register_trace_callback("MongoCursor::next", cb);
-	register_trace_callback("MongoCursor::hasNext", cb);
-	register_trace_callback("MongoCursor::getNext", cb);
-	register_trace_callback("MongoCommandCursor::next", cb);
-	register_trace_callback("MongoCommandCursor::hasNext", cb);
-	register_trace_callback("MongoCommandCursor::getNext", cb);
+	if (Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
+	}
 
-	cb = tw_trace_callback_mongo_cursor_io;
-	register_trace_callback("MongoCursor::rewind", cb);
-	register_trace_callback("MongoCursor::doQuery", cb);
-	register_trace_callback("MongoCursor::count", cb);
+	pheanstalk_ce = Z_OBJCE_P(object);
 
-	cb = tw_trace_callback_predis_call;
-	register_trace_callback("Predis\\Client::__call", cb);
+	property = _zend_read_property(pheanstalk_ce, object, "_using", sizeof("_using") - 1, 1, __rv);
 
-	TWG(gc_runs) = GC_G(gc_runs);
-	TWG(gc_collected) = GC_G(collected);
-	TWG(compile_count) = 0;
-	TWG(compile_wt) = 0;
+	if (property != NULL && Z_TYPE_P(property) == IS_STRING) {
+		return tw_trace_callback_record_with_cache("queue", 5, Z_STRVAL_P(property), Z_STRLEN_P(property), 1 TSRMLS_CC);
+	} else {
+		return tw_trace_callback_record_with_cache("queue", 5, "default", 7, 1 TSRMLS_CC);
+	}
 }
 
+long tw_trace_callback_memcache(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	return tw_trace_callback_record_with_cache("memcache", 8, symbol, strlen(symbol), 1 TSRMLS_CC);
+}
 
 /**
- * Initialize profiler state
- *
- * @author kannan, veeve
+ * Hits and misses of Memcached reads: getMulti() returns only the keys that
+ * were found, get() returns false on a miss but also for a stored false, so
+ * only then getResultCode() is asked whether the key was found.
  */
-void hp_init_profiler_state(TSRMLS_D)
+void tw_trace_return_memcached_get(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
 {
-	if (!TWG(ever_enabled)) {
-		TWG(ever_enabled) = 1;
-		TWG(entries) = NULL;
+	zval *keys, *object = EX_OBJ(data);
+	long requested = 1, hits;
+	tw_span_counts *counts;
+	zval fname;
+	_DECLARE_ZVAL(retval_ptr);
+
+	if (entry->span_id < 0 || return_value == NULL) {
+		return;
 	}
 
-#if PHP_VERSION_ID >= 70000
-	hp_ptr_dtor(&TWG(stats_count));
-	array_init(&TWG(stats_count));
+	if (strstr(entry->name_hprof, "::getMulti") != NULL) {
+		keys = ZEND_CALL_ARG(data, strstr(entry->name_hprof, "ByKey") != NULL ? 2 : 1);
 
-	hp_ptr_dtor(&TWG(spans));
-	array_init(&TWG(spans));
+		if (keys == NULL || Z_TYPE_P(keys) != IS_ARRAY) {
+			return;
+		}
+
+		requested = zend_hash_num_elements(Z_ARRVAL_P(keys));
+		hits = Z_TYPE_P(return_value) == IS_ARRAY ? zend_hash_num_elements(Z_ARRVAL_P(return_value)) : 0;
+	} else {
+#if PHP_VERSION_ID >= 70000
+		hits = Z_TYPE_P(return_value) != IS_FALSE;
 #else
+		hits = Z_TYPE_P(return_value) != IS_BOOL || Z_BVAL_P(return_value);
+#endif
 
-	if (TWG(stats_count)) {
-		hp_ptr_dtor(TWG(stats_count));
-	}
+		if (!hits && object != NULL && Z_TYPE_P(object) == IS_OBJECT) {
+			_ZVAL_STRING(&fname, "getResultCode");
 
-	_ALLOC_INIT_ZVAL(TWG(stats_count));
-	array_init(TWG(stats_count));
+			if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
+				hits = Z_TYPE_P(retval_ptr) == IS_LONG && Z_LVAL_P(retval_ptr) == TIDEWAYS_MEMCACHED_RES_SUCCESS;
+				hp_ptr_dtor(retval_ptr);
+			}
 
-	if (TWG(spans)) {
-		hp_ptr_dtor(TWG(spans));
+#if PHP_VERSION_ID >= 70000
+			zend_string_release(Z_STR(fname));
+#endif
+		}
 	}
 
-	_ALLOC_INIT_ZVAL(TWG(spans));
-	array_init(TWG(spans));
-#endif
+	counts = tw_span_counts_find(entry->span_id TSRMLS_CC);
 
-	hp_init_trace_callbacks(TSRMLS_C);
+	if (counts != NULL) {
+		counts->hits += hits;
+		counts->misses += requested > hits ? requested - hits : 0;
+		counts->set |= TIDEWAYS_COUNT_HITS;
+	}
 }
 
 /**
- * Cleanup profiler state
- *
- * @author kannan, veeve
+ * Memcached spans are aggregated per method, multi operations count the keys
+ * they were passed.
  */
-void hp_clean_profiler_state(TSRMLS_D)
+long tw_trace_callback_memcached(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-#if PHP_VERSION_ID >= 70000
-	hp_ptr_dtor(&TWG(stats_count));
-	ZVAL_NULL(&TWG(stats_count));
-	hp_ptr_dtor(&TWG(spans));
-	ZVAL_NULL(&TWG(spans));
-#else
-	if (TWG(stats_count)) {
-		hp_ptr_dtor(TWG(stats_count));
-		TWG(stats_count) = NULL;
+	zval *keys;
+	int by_key = strstr(symbol, "ByKey") != NULL;
+	long idx = tw_trace_callback_record_with_cache("memcache", 8, symbol, strlen(symbol), 1 TSRMLS_CC);
+	tw_span_counts *counts = tw_span_counts_find(idx TSRMLS_CC);
+
+	if (counts == NULL) {
+		return idx;
 	}
-	if (TWG(spans)) {
-		hp_ptr_dtor(TWG(spans));
-		TWG(spans) = NULL;
+
+	if (strstr(symbol, "Multi") != NULL && ZEND_CALL_NUM_ARGS(data) > by_key) {
+		keys = ZEND_CALL_ARG(data, by_key + 1);
+
+		if (keys != NULL && Z_TYPE_P(keys) == IS_ARRAY) {
+			counts->keys += zend_hash_num_elements(Z_ARRVAL_P(keys));
+			counts->set |= TIDEWAYS_COUNT_KEYS;
+		}
+	} else if (strstr(symbol, "::flush") == NULL) {
+		counts->keys++;
+		counts->set |= TIDEWAYS_COUNT_KEYS;
 	}
-#endif
 
-	TWG(entries) = NULL;
-	TWG(ever_enabled) = 0;
+	if (strstr(symbol, "::get") != NULL) {
+		TWG(pending_return_cb) = tw_trace_return_memcached_get;
+	}
 
-	hp_clean_profiler_options_state(TSRMLS_C);
+	return idx;
 }
 
-static void hp_transaction_name_clear(TSRMLS_D)
+long tw_trace_callback_php_controller(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	if (TWG(transaction_name)) {
-		zend_string_release(TWG(transaction_name));
-		TWG(transaction_name) = NULL;
-	}
+	long idx;
+
+	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", symbol, 1 TSRMLS_CC);
+
+	return idx;
 }
 
-static void hp_clean_profiler_options_state(TSRMLS_D)
+long tw_trace_callback_presta_controller(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	hp_function_map_clear(TWG(filtered_functions));
-	TWG(filtered_functions) = NULL;
-
-	hp_exception_function_clear(TSRMLS_C);
-	hp_transaction_function_clear(TSRMLS_C);
-	hp_transaction_name_clear(TSRMLS_C);
+	zend_class_entry *controller_ce;
+	zval *object = EX_OBJ(data);
+	zval *property;
+	long idx = -1;
 
-	if (TWG(trace_callbacks)) {
-		zend_hash_destroy(TWG(trace_callbacks));
-		FREE_HASHTABLE(TWG(trace_callbacks));
-		TWG(trace_callbacks) = NULL;
+	if (Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
 	}
 
-	if (TWG(trace_watch_callbacks)) {
-		zend_hash_destroy(TWG(trace_watch_callbacks));
-		FREE_HASHTABLE(TWG(trace_watch_callbacks));
-		TWG(trace_watch_callbacks) = NULL;
-	}
+	controller_ce = Z_OBJCE_P(object);
 
-	if (TWG(span_cache)) {
-		zend_hash_destroy(TWG(span_cache));
-		FREE_HASHTABLE(TWG(span_cache));
-		TWG(span_cache) = NULL;
-	}
-}
+	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", _ZCE_NAME(controller_ce), 1 TSRMLS_CC);
 
-/*
- * Start profiling - called just before calling the actual function
- * NOTE:  PLEASE MAKE SURE TSRMLS_CC IS AVAILABLE IN THE CONTEXT
- *        OF THE FUNCTION WHERE THIS MACRO IS CALLED.
- *        TSRMLS_CC CAN BE MADE AVAILABLE VIA TSRMLS_DC IN THE
- *        CALLING FUNCTION OR BY CALLING TSRMLS_FETCH()
- *        TSRMLS_FETCH() IS RELATIVELY EXPENSIVE.
- */
-#define BEGIN_PROFILING(entries, symbol, profile_curr, execute_data)			\
-	do {																		\
-		/* Use a hash code to filter most of the string comparisons. */			\
-		uint8 hash_code  = hp_inline_hash(symbol);								\
-		profile_curr = !hp_filter_entry(hash_code, symbol TSRMLS_CC);			\
-		if (profile_curr) {														\
-			hp_entry_t *cur_entry = hp_fast_alloc_hprof_entry(TSRMLS_C);		\
-			(cur_entry)->hash_code = hash_code;									\
-			(cur_entry)->name_hprof = symbol;									\
-			(cur_entry)->prev_hprof = (*(entries));								\
-			(cur_entry)->span_id = -1;											\
-			hp_mode_hier_beginfn_cb((entries), (cur_entry), execute_data TSRMLS_CC);			\
-			/* Update entries linked list */									\
-			(*(entries)) = (cur_entry);											\
-		}																		\
-	} while (0)
-
-/*
- * Stop profiling - called just after calling the actual function
- * NOTE:  PLEASE MAKE SURE TSRMLS_CC IS AVAILABLE IN THE CONTEXT
- *        OF THE FUNCTION WHERE THIS MACRO IS CALLED.
- *        TSRMLS_CC CAN BE MADE AVAILABLE VIA TSRMLS_DC IN THE
- *        CALLING FUNCTION OR BY CALLING TSRMLS_FETCH()
- *        TSRMLS_FETCH() IS RELATIVELY EXPENSIVE.
- */
-#define END_PROFILING(entries, profile_curr, data)							\
-	do {																	\
-		if (profile_curr) {													\
-			hp_entry_t *cur_entry;											\
-			hp_mode_hier_endfn_cb((entries), data TSRMLS_CC);				\
-			cur_entry = (*(entries));										\
-			/* Free top entry and update entries linked list */				\
-			(*(entries)) = (*(entries))->prev_hprof;						\
-			hp_fast_free_hprof_entry(cur_entry TSRMLS_CC);					\
-		}																	\
-	} while (0)
+	return idx;
+}
 
-/**
- * Returns formatted function name
- *
- * @param  entry        hp_entry
- * @param  result_buf   ptr to result buf
- * @param  result_len   max size of result buf
- * @return total size of the function name returned in result_buf
- * @author veeve
- */
-size_t hp_get_entry_name(hp_entry_t  *entry, char *result_buf, size_t result_len)
+long tw_trace_callback_doctrine_couchdb_request(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	/* Validate result_len */
-	if (result_len <= 1) {
-		/* Insufficient result_bug. Bail! */
-		return 0;
-	}
+	zval *method = ZEND_CALL_ARG(data, 1);
+	zval *path = ZEND_CALL_ARG(data, 2);
+	long idx;
 
-	/* Add '@recurse_level' if required */
-	/* NOTE:  Dont use snprintf's return val as it is compiler dependent */
-	if (entry->rlvl_hprof) {
-		snprintf(
-			result_buf,
-			result_len,
-			"%s@%d",
-			entry->name_hprof,
-			entry->rlvl_hprof
-		);
-	} else {
-		strncat(
-			result_buf,
-			entry->name_hprof,
-			result_len
-		);
+	if (Z_TYPE_P(method) != IS_STRING || Z_TYPE_P(path) != IS_STRING) {
+		return -1;
 	}
 
-	/* Force null-termination at MAX */
-	result_buf[result_len - 1] = '\0';
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "method", Z_STRVAL_P(method), 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(path), 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "service", "couchdb", 1 TSRMLS_CC);
 
-	return strlen(result_buf);
+	return idx;
 }
 
-/**
- * Check if this entry should be filtered (positive or negative), first with a
- * conservative Bloomish filter then with an exact check against the function
- * names.
- *
- * @author mpal
- */
-static inline int hp_filter_entry(uint8 hash_code, char *curr_func TSRMLS_DC)
+long tw_trace_callback_view_class(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	int exists;
+	zend_class_entry *ce;
+	zval *object = EX_OBJ(data);
 
-	/* First check if ignoring functions is enabled */
-	if (TWG(filtered_functions) == NULL || TWG(filtered_type) == 0) {
-		return 0;
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return -1;
 	}
 
-	exists = hp_function_map_exists(TWG(filtered_functions), hash_code, curr_func);
-
-	if (TWG(filtered_type) == 2) {
-		// always include main() in profiling result.
-		return (strcmp(curr_func, ROOT_SYMBOL) == 0)
-			? 0
-			: abs(1 - exists);
-	}
+	ce = Z_OBJCE_P(object);
 
-	return exists;
+	return tw_trace_callback_record_with_cache("view", 4, _ZCE_NAME(ce), _ZCE_NAME_LENGTH(ce), 1 TSRMLS_CC);
 }
 
-/**
- * Build a caller qualified name for a callee.
- *
- * For example, if A() is caller for B(), then it returns "A==>B".
- * Recursive invokations are denoted with @<n> where n is the recursion
- * depth.
- *
- * For example, "foo==>foo@1", and "foo@2==>foo@3" are examples of direct
- * recursion. And  "bar==>foo@1" is an example of an indirect recursive
- * call to foo (implying the foo() is on the call stack some levels
- * above).
- *
- * @author kannan, veeve
- */
-size_t hp_get_function_stack(hp_entry_t *entry, int level, char *result_buf, size_t result_len)
+/* Zend_View_Abstract::render($name); */
+long tw_trace_callback_view_engine(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	size_t         len = 0;
+	zval *name = ZEND_CALL_ARG(data, 1);
+	char *view;
 
-	if (!entry->prev_hprof || (level <= 1)) {
-		return hp_get_entry_name(entry, result_buf, result_len);
+	if (Z_TYPE_P(name) != IS_STRING) {
+		return -1;
 	}
 
-	len = hp_get_function_stack(entry->prev_hprof, level - 1, result_buf, result_len);
+	view = hp_get_base_filename(Z_STRVAL_P(name));
 
-	/* Append the delimiter */
-# define    HP_STACK_DELIM        "==>"
-# define    HP_STACK_DELIM_LEN    (sizeof(HP_STACK_DELIM) - 1)
+	return tw_trace_callback_record_with_cache("view", 4, view, strlen(view)+1, 1 TSRMLS_CC);
+}
 
-	if (result_len < (len + HP_STACK_DELIM_LEN)) {
-		return len;
-	}
+/* Applies to Enlight, Mage and Zend1 */
+long tw_trace_callback_zend1_dispatcher_families_tx(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument_element = ZEND_CALL_ARG(data, 1);
+	int len;
+	char *ret = NULL;
+	zend_class_entry *ce;
+	long idx;
+	zval *object = EX_OBJ(data);
 
-	if (len) {
-		strncat(result_buf + len, HP_STACK_DELIM, result_len - len);
-		len += HP_STACK_DELIM_LEN;
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return -1;
 	}
 
-# undef     HP_STACK_DELIM_LEN
-# undef     HP_STACK_DELIM
+	if (Z_TYPE_P(argument_element) != IS_STRING) {
+		return -1;
+	}
 
-	return len + hp_get_entry_name(entry, result_buf + len, result_len - len);
-}
+	ce = Z_OBJCE_P(object);
 
-/**
- * Takes an input of the form /a/b/c/d/foo.php and returns
- * a pointer to one-level directory and basefile name
- * (d/foo.php) in the same string.
- */
-static char *hp_get_base_filename(char *filename)
-{
-	char *ptr;
-	int   found = 0;
+	len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(argument_element) + 3;
+	ret = (char*)emalloc(len);
+	snprintf(ret, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(argument_element));
 
-	if (!filename)
-		return "";
+	idx = tw_span_create("php.ctrl", 8 TSRMLS_CC);
+	tw_span_annotate_string(idx, "title", ret, 0 TSRMLS_CC);
 
-	/* reverse search for "/" and return a ptr to the next char */
-	for (ptr = filename + strlen(filename) - 1; ptr >= filename; ptr--) {
-		if (*ptr == '/') {
-			found++;
-		}
-		if (found == 2) {
-			return ptr + 1;
-		}
-	}
+#if PHP_VERSION_ID >= 70000
+	efree(ret);
+#endif
 
-	/* no "/" char found, so return the whole string */
-	return filename;
+	return idx;
 }
 
-static char *hp_get_file_summary(char *filename, int filename_len TSRMLS_DC)
+/* oxShopControl::_process($sClass, $sFnc = null); */
+long tw_trace_callback_oxid_tx(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	php_url *url;
-	char *ret;
-	int len;
-
-	len = TIDEWAYS_MAX_ARGUMENT_LEN;
-	ret = emalloc(len);
-	snprintf(ret, len, "");
-
-	url = php_url_parse_ex(filename, filename_len);
-
-	if (url->scheme) {
-		snprintf(ret, len, "%s%s://", ret, url->scheme);
-	} else {
-		php_url_free(url);
-		return ret;
-	}
+	zval *sClass = ZEND_CALL_ARG(data, 1);
+	zval *sFnc = ZEND_CALL_ARG(data, 2);
+	char *ret = NULL;
+	long idx;
+	int len, copy;
+	int args_len = ZEND_CALL_NUM_ARGS(data);
 
-	if (url->host) {
-		snprintf(ret, len, "%s%s", ret, url->host);
+	if (Z_TYPE_P(sClass) != IS_STRING) {
+		return -1;
 	}
 
-	if (url->port) {
-		snprintf(ret, len, "%s:%d", ret, url->port);
+	if (args_len > 1 && sFnc != NULL && Z_TYPE_P(sFnc) == IS_STRING) {
+		len = Z_STRLEN_P(sClass) + Z_STRLEN_P(sFnc) + 3;
+		ret = (char*)emalloc(len);
+		snprintf(ret, len, "%s::%s", Z_STRVAL_P(sClass), Z_STRVAL_P(sFnc));
+		copy = 0;
+	} else {
+		ret = Z_STRVAL_P(sClass);
+		len = Z_STRLEN_P(sClass);
+		copy = 1;
 	}
 
-	if (url->path) {
-		snprintf(ret, len, "%s%s", ret, url->path);
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
+		return -1;
 	}
 
-	php_url_free(url);
-
-	return ret;
+	return tw_trace_callback_record_with_cache("php.ctrl", 8, ret, len, copy TSRMLS_CC);
 }
 
-static char *hp_concat_char(const char *s1, size_t len1, const char *s2, size_t len2, const char *seperator, size_t sep_len)
+/* $resolver->getArguments($request, $controller); */
+long tw_trace_callback_symfony_resolve_arguments_tx(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-    char *result = emalloc(len1+len2+sep_len+1);
+	zval *callback, *controller, *action;
+	char *ret = NULL;
+	int len;
+	tw_trace_callback cb;
+	zend_class_entry *ce;
 
-    strcpy(result, s1);
-	strcat(result, seperator);
-    strcat(result, s2);
-	result[len1+len2+sep_len] = '\0';
+	callback = ZEND_CALL_ARG(data, 2);
 
-    return result;
-}
+	// Only Symfony2 framework for now
+	if (Z_TYPE_P(callback) == IS_ARRAY) {
+		controller = zend_compat_hash_index_find(Z_ARRVAL_P(callback), 0);
 
-static void hp_detect_exception(char *func_name, zend_execute_data *data TSRMLS_DC)
-{
-	int arg_count = ZEND_CALL_NUM_ARGS(data);
-	zval *argument_element;
-	int i;
-	zend_class_entry *default_ce, *exception_ce;
+		if (controller == NULL && Z_TYPE_P(controller) != IS_OBJECT) {
+			return -1;
+		}
 
-	default_ce = zend_exception_get_default(TSRMLS_C);
+		action = zend_compat_hash_index_find(Z_ARRVAL_P(callback), 1);
 
-	for (i=0; i < arg_count; i++) {
-		argument_element = ZEND_CALL_ARG(data, i+1);
+		if (action == NULL && Z_TYPE_P(action) != IS_STRING) {
+			return -1;
+		}
 
-		if (Z_TYPE_P(argument_element) == IS_OBJECT) {
-			exception_ce = Z_OBJCE_P(argument_element);
+		ce = Z_OBJCE_P(controller);
 
-			if (instanceof_function(exception_ce, default_ce TSRMLS_CC) == 1) {
-#if PHP_VERSION_ID >= 70000
-				ZVAL_COPY(&TWG(exception), argument_element);
-#else
-				Z_ADDREF_P(argument_element);
-				TWG(exception) = argument_element;
-#endif
-				return;
-			}
-		}
-	}
-}
+		len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(action) + 3;
+		ret = (char*)emalloc(len);
+		snprintf(ret, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(action));
 
-static void hp_detect_transaction_name(char *ret, zend_execute_data *data TSRMLS_DC)
-{
-	zval *argument_element;
+		cb = tw_trace_callback_php_controller;
+		register_trace_callback_len(ret, len-1, cb);
 
-	if (!TWG(transaction_function) ||
-		TWG(transaction_name) ||
-		strcmp(ret, ZSTR_VAL(TWG(transaction_function))) != 0) {
-		return;
+		efree(ret);
 	}
 
-	if (strcmp(ret, "Zend_Controller_Action::dispatch") == 0 ||
-			   strcmp(ret, "Enlight_Controller_Action::dispatch") == 0 ||
-			   strcmp(ret, "Mage_Core_Controller_Varien_Action::dispatch") == 0 ||
-			   strcmp(ret, "Illuminate\\Routing\\Controller::callAction") == 0) {
-		zval *obj = EX_OBJ(data);
-		zend_class_entry *ce;
-		int len;
-		char *ctrl;
+	return -1;
+}
 
-		argument_element = ZEND_CALL_ARG(data, 1);
+#define TW_SQL_IS_WORD(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || ((c) >= '0' && (c) <= '9') || (c) == '_' || (c) == '$')
 
-		if (Z_TYPE_P(argument_element) == IS_STRING) {
-			ce = Z_OBJCE_P(obj);
+/**
+ * Skip whitespace and comments (-- and # to the end of line, C style
+ * blocks) of an SQL statement.
+ */
+static const char *tw_sql_skip(const char *p, const char *end)
+{
+	while (p < end) {
+		if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\f' || *p == '\v') {
+			p++;
+		} else if (*p == '#' || (*p == '-' && p + 1 < end && p[1] == '-')) {
+			p = memchr(p, '\n', end - p);
+			if (p == NULL) {
+				return end;
+			}
+		} else if (*p == '/' && p + 1 < end && p[1] == '*') {
+			for (p += 2; (p = memchr(p, '*', end - p)) != NULL && p + 1 < end && p[1] != '/'; p++);
+			if (p == NULL || p + 1 >= end) {
+				return end;
+			}
+			p += 2;
+		} else {
+			break;
+		}
+	}
 
-			len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(argument_element) + 3;
-			ctrl = (char*)emalloc(len);
-			snprintf(ctrl, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(argument_element));
-			ctrl[len-1] = '\0';
+	return p;
+}
 
-			TWG(transaction_name) = zend_string_init(ctrl, len-1, 0);
-			efree(ctrl);
-		}
-	} else if(strcmp(ret, "TYPO3\\CMS\\Extbase\\Mvc\\Controller\\ActionController::callActionMethod") == 0 ||
-			  strcmp(ret, "TYPO3\\Flow\\Mvc\\Controller\\ActionController::callActionMethod") == 0) {
+/**
+ * Skip a quoted string or identifier starting at p, honoring backslash
+ * escapes. Doubled quotes are two adjacent strings and need no handling.
+ */
+static const char *tw_sql_skip_quoted(const char *p, const char *end)
+{
+	char quote = *p == '[' ? ']' : *p;
+	const char *q;
 
-		zval *property;
-		zval *object = EX_OBJ(data);
-		zend_class_entry *ce = Z_OBJCE_P(object);
-		int len;
-		char *ctrl;
+	for (p++; (q = memchr(p, quote, end - p)) != NULL; p = q + 1) {
+		const char *b = q;
 
-		zval *__rv;
-		property = _zend_read_property(ce, object, "actionMethodName", sizeof("actionMethodName") - 1, 1, __rv);
+		while (b > p && b[-1] == '\\') {
+			b--;
+		}
 
-		if (property == NULL || Z_TYPE_P(property) != IS_STRING) {
-			return;
+		if (quote == ']' || ((q - b) % 2) == 0) {
+			return q + 1;
 		}
+	}
 
-		len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(property) + 3;
-		ctrl = (char*)emalloc(len);
-		snprintf(ctrl, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(property));
-		ctrl[len-1] = '\0';
+	return end;
+}
 
-		TWG(transaction_name) = zend_string_init(ctrl, len-1, 0);
-		efree(ctrl);
-	} else {
-		argument_element = ZEND_CALL_ARG(data, 1);
+static const char *tw_sql_word(const char *p, const char *end, size_t *len)
+{
+	const char *start = p;
 
-		if (Z_TYPE_P(argument_element) == IS_STRING) {
-			TWG(transaction_name) = zend_string_copy(Z_STR_P(argument_element));
-		}
+	while (p < end && TW_SQL_IS_WORD(*p)) {
+		p++;
 	}
 
-	hp_transaction_function_clear(TSRMLS_C);
+	*len = p - start;
+
+	return p;
+}
+
+static int tw_sql_word_is(const char *word, size_t len, const char *keyword)
+{
+	return strlen(keyword) == len && strncasecmp(word, keyword, len) == 0;
 }
 
 /**
- * Get the name of the current function. The name is qualified with
- * the class name if the function is in a class.
- *
- * @author kannan, hzhao
+ * Copy a possibly quoted and schema qualified table name into buf.
  */
-static char *hp_get_function_name(zend_execute_data *data TSRMLS_DC)
+static size_t tw_sql_table(const char *p, const char *end, char *buf, size_t buf_len)
 {
-	const char        *cls = NULL;
-	char              *ret = NULL;
-	zend_function      *curr_func;
-#if PHP_VERSION_ID < 70000
-	const char        *func = NULL;
-#else
-	zend_string *func = NULL;
-#endif
+	const char *start, *next;
+	size_t len = 0, part_len;
+	char closer;
+
+	while (p < end) {
+		if (*p == '`' || *p == '"' || *p == '\'' || *p == '[') {
+			closer = *p == '[' ? ']' : *p;
+			next = tw_sql_skip_quoted(p, end);
+			start = p + 1;
+			part_len = next > start && next[-1] == closer ? next - start - 1 : next - start;
+		} else {
+			start = p;
+			next = tw_sql_word(p, end, &part_len);
+		}
 
-	if (!data) {
-		return NULL;
-	}
+		if (part_len == 0 || len + part_len >= buf_len) {
+			break;
+		}
 
-#if PHP_VERSION_ID < 70000
-	curr_func = data->function_state.function;
-	func = curr_func->common.function_name;
+		memcpy(buf + len, start, part_len);
+		len += part_len;
+		p = next;
 
-	if (!func) {
-		// This branch includes execution of eval and include/require(_once) calls
-		// We assume it is not 1999 anymore and not much PHP code runs in the
-		// body of a file and if it is, we are ok with adding it to the caller's wt.
-		return NULL;
-	}
+		if (p >= end || *p != '.' || len + 1 >= buf_len) {
+			break;
+		}
 
-	/* previously, the order of the tests in the "if" below was
-	 * flipped, leading to incorrect function names in profiler
-	 * reports. When a method in a super-type is invoked the
-	 * profiler should qualify the function name with the super-type
-	 * class name (not the class name based on the run-time type
-	 * of the object.
-	 */
-	if (curr_func->common.scope) {
-		cls = curr_func->common.scope->name;
-	} else if (data->object) {
-		cls = Z_OBJCE(*data->object)->name;
+		buf[len++] = '.';
+		p++;
 	}
 
-	if (cls) {
-		char* sep = "::";
-		ret = hp_concat_char(cls, strlen(cls), func, strlen(func), sep, 2);
-	} else {
-		ret = estrdup(func);
+	if (len > 0 && buf[len - 1] == '.') {
+		len--;
 	}
-#else
-	curr_func = data->func;
-	func = curr_func->common.function_name;
 
-	if (!func) {
-		return NULL;
-	} else if (curr_func->common.scope != NULL) {
-		char* sep = "::";
-		cls = curr_func->common.scope->name->val;
-		ret = hp_concat_char(cls, curr_func->common.scope->name->len, func->val, func->len, sep, 2);
-	} else {
-		ret = emalloc(ZSTR_LEN(func)+1);
-		strcpy(ret, ZSTR_VAL(func));
-		ret[ZSTR_LEN(func)] = '\0';
-	}
-#endif
+	buf[len] = '\0';
 
-	return ret;
+	return len;
 }
 
 /**
- * Free any items in the free list.
+ * Summarize an SQL statement into its operation and main table, for
+ * example "select foo", "insert bar" or "commit", in one pass over the
+ * query. Comments and literals are skipped with memchr(), statements that
+ * are not DML are summarized as "other".
  */
-static void hp_free_the_free_list(TSRMLS_D)
+static size_t tw_sql_summary(const char *sql, size_t sql_len, char *buf, size_t buf_len)
 {
-	hp_entry_t *p = TWG(entry_free_list);
-	hp_entry_t *cur;
+	const char *p = sql, *end = sql + sql_len, *word;
+	const char *op = NULL;
+	char table[128];
+	size_t len = 0, table_len = 0;
+	int depth = 0, find_from = 0;
+
+	p = tw_sql_skip(p, end);
+
+	while (p < end && *p == '(') {
+		p = tw_sql_skip(p + 1, end);
+	}
+
+	word = p;
+	p = tw_sql_word(p, end, &len);
+
+	if (tw_sql_word_is(word, len, "select") || tw_sql_word_is(word, len, "with")) {
+		op = "select";
+		find_from = 1;
+	} else if (tw_sql_word_is(word, len, "delete")) {
+		op = "delete";
+		find_from = 1;
+	} else if (tw_sql_word_is(word, len, "insert") || tw_sql_word_is(word, len, "replace") || tw_sql_word_is(word, len, "update")) {
+		op = tolower(*word) == 'i' ? "insert" : (tolower(*word) == 'r' ? "replace" : "update");
+
+		/* Skip modifiers like LOW_PRIORITY, IGNORE, INTO or OR REPLACE */
+		while ((p = tw_sql_skip(p, end)) < end && TW_SQL_IS_WORD(*p)) {
+			word = p;
+			p = tw_sql_word(p, end, &len);
+
+			if (!tw_sql_word_is(word, len, "into") && !tw_sql_word_is(word, len, "ignore") &&
+					!tw_sql_word_is(word, len, "low_priority") && !tw_sql_word_is(word, len, "high_priority") &&
+					!tw_sql_word_is(word, len, "delayed") && !tw_sql_word_is(word, len, "only") &&
+					!tw_sql_word_is(word, len, "or") && !tw_sql_word_is(word, len, "replace") &&
+					!tw_sql_word_is(word, len, "rollback") && !tw_sql_word_is(word, len, "abort") &&
+					!tw_sql_word_is(word, len, "fail")) {
+				p = word;
+				break;
+			}
+		}
 
-	while (p) {
-		cur = p;
-		p = p->prev_hprof;
-		free(cur);
+		table_len = tw_sql_table(p, end, table, sizeof(table));
+	} else if (tw_sql_word_is(word, len, "commit") || tw_sql_word_is(word, len, "rollback")) {
+		op = tolower(*word) == 'c' ? "commit" : "rollback";
+	} else if (tw_sql_word_is(word, len, "begin") || tw_sql_word_is(word, len, "start")) {
+		op = "begin";
+	} else {
+		op = "other";
+	}
+
+	while (find_from && p < end) {
+		switch (*p) {
+			case '\'':
+			case '"':
+			case '`':
+			case '[':
+				p = tw_sql_skip_quoted(p, end);
+				break;
+			case '(':
+				depth++;
+				p++;
+				break;
+			case ')':
+				depth--;
+				p++;
+				break;
+			case '-':
+			case '#':
+			case '/':
+				word = tw_sql_skip(p, end);
+				p = word > p ? word : p + 1;
+				break;
+			default:
+				if (!TW_SQL_IS_WORD(*p)) {
+					p++;
+					break;
+				}
+
+				word = p;
+				p = tw_sql_word(p, end, &len);
+
+				if (depth == 0 && tw_sql_word_is(word, len, "from")) {
+					table_len = tw_sql_table(tw_sql_skip(p, end), end, table, sizeof(table));
+					find_from = 0;
+				}
+		}
+	}
+
+	if (table_len > 0) {
+		snprintf(buf, buf_len, "%s %s", op, table);
+	} else {
+		snprintf(buf, buf_len, "%s", op);
 	}
+
+	return strlen(buf);
 }
 
 /**
- * Fast allocate a hp_entry_t structure. Picks one from the
- * free list if available, else does an actual allocate.
- *
- * Doesn't bother initializing allocated memory.
- *
- * @author kannan
+ * Normalize an SQL statement for fingerprinting: comments are removed,
+ * whitespace is collapsed, string and number literals become "?" and
+ * parenthesized lists of literals like IN (1, 2, 3) become "(?)". The
+ * result is never longer than the statement, buf needs sql_len+1 bytes.
  */
-static hp_entry_t *hp_fast_alloc_hprof_entry(TSRMLS_D)
+static size_t tw_sql_normalize(const char *sql, size_t sql_len, char *buf)
 {
-	hp_entry_t *p;
+	const char *p = sql, *end = sql + sql_len, *next, *string_end = NULL;
+	size_t len = 0, list_start = 0, i;
+	int list = 0;
 
-	p = TWG(entry_free_list);
+	while (p < end) {
+		next = tw_sql_skip(p, end);
 
-	if (p) {
-		TWG(entry_free_list) = p->prev_hprof;
-		return p;
-	} else {
-		return (hp_entry_t *)malloc(sizeof(hp_entry_t));
+		if (next > p) {
+			if (len > 0 && buf[len - 1] != ' ') {
+				buf[len++] = ' ';
+			}
+			p = next;
+		} else if (*p == '\'') {
+			/* 'it''s' are two adjacent literals, only one placeholder */
+			if (p != string_end || len == 0 || buf[len - 1] != '?') {
+				buf[len++] = '?';
+			}
+			p = string_end = tw_sql_skip_quoted(p, end);
+		} else if (*p == '"' || *p == '`' || *p == '[') {
+			next = tw_sql_skip_quoted(p, end);
+			memcpy(buf + len, p, next - p);
+			len += next - p;
+			p = next;
+			list = 0;
+		} else if (*p >= '0' && *p <= '9' && (len == 0 || !TW_SQL_IS_WORD(buf[len - 1]))) {
+			while (p < end && (TW_SQL_IS_WORD(*p) || *p == '.')) {
+				p++;
+			}
+			buf[len++] = '?';
+		} else if (TW_SQL_IS_WORD(*p)) {
+			next = tw_sql_word(p, end, &i);
+			memcpy(buf + len, p, i);
+			len += i;
+			p = next;
+			list = 0;
+		} else if (*p == '(') {
+			list_start = len;
+			list = 1;
+			buf[len++] = *p++;
+		} else if (*p == ')') {
+			for (i = list_start; list && i < len && buf[i] != '?'; i++);
+
+			if (list && i < len) {
+				len = list_start;
+				buf[len++] = '(';
+				buf[len++] = '?';
+			}
+
+			buf[len++] = *p++;
+			list = 0;
+		} else {
+			if (*p != ',' && *p != '-' && *p != '+') {
+				list = 0;
+			}
+			buf[len++] = *p++;
+		}
+	}
+
+	while (len > 0 && buf[len - 1] == ' ') {
+		len--;
 	}
+
+	buf[len] = '\0';
+
+	return len;
 }
 
 /**
- * Fast free a hp_entry_t structure. Simply returns back
- * the hp_entry_t to a free list and doesn't actually
- * perform the free.
- *
- * @author kannan
+ * 64 bit FNV-1a hash of the normalized statement.
  */
-static void hp_fast_free_hprof_entry(hp_entry_t *p TSRMLS_DC)
+static uint64 tw_sql_fingerprint(const char *sql, size_t len)
 {
-	/* we use/overload the prev_hprof field in the structure to link entries in
-	 * the free list. */
-	p->prev_hprof = TWG(entry_free_list);
-	TWG(entry_free_list) = p;
+	uint64 hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)sql[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
 }
 
 /**
- * Increment the count of the given stat with the given count
- * If the stat was not set before, inits the stat to the given count
- *
- * @param  zval *counts   Zend hash table pointer
- * @param  char *name     Name of the stat
- * @param  long  count    Value of the stat to incr by
- * @return void
- * @author kannan
+ * Record an SQL span aggregated by the fingerprint of the normalized query.
+ * The span is titled with the summary of the query and flagged "n+1" when
+ * the fingerprint executes more than tideways.n_plus_one_threshold times
+ * below the same parent frame, other queries in between do not reset it.
+ * Prepares get their own span flagged "prepare" and are not counted.
  */
-void hp_inc_count(zval *counts, char *name, long count TSRMLS_DC)
+static long tw_sql_span_record(char *sql, size_t sql_len, int prepare TSRMLS_DC)
 {
-	HashTable *ht;
-	zval *data, val;
-
-	if (!counts) {
-		return;
-	}
+	char *normalized, summary[SCRATCH_BUF_LEN], key[sizeof("prepare:") + 16];
+	char *prefix = prepare ? "prepare:" : "sql:";
+	size_t normalized_len;
+	uint64 fingerprint;
+	long idx;
+	hp_entry_t *frame = TWG(entries);
+	tw_sql_repeat repeat, *repeat_ptr = NULL;
+#if PHP_VERSION_ID < 70000
+	long *idx_ptr = NULL;
+#else
+	zval zidx, *zidx_ptr;
+#endif
 
-	ht = HASH_OF(counts);
+	normalized = emalloc(sql_len + 1);
+	normalized_len = tw_sql_normalize(sql, sql_len, normalized);
+	fingerprint = tw_sql_fingerprint(normalized, normalized_len);
 
-	if (!ht) {
-		return;
-	}
+	snprintf(key, sizeof(key), "%s%08lx%08lx", prefix, (unsigned long)(fingerprint >> 32), (unsigned long)(fingerprint & 0xffffffff));
 
-	data = zend_compat_hash_find_const(ht, name, strlen(name));
-
-	if (data) {
-		ZVAL_LONG(data, Z_LVAL_P(data) + count);
+#if PHP_VERSION_ID < 70000
+	if (zend_hash_find(TWG(span_cache), key, strlen(key)+1, (void **)&idx_ptr) == SUCCESS) {
+		idx = *idx_ptr;
 	} else {
-#if PHP_VERSION_ID >= 70000
-		ZVAL_LONG(&val, count);
-		zend_hash_str_update(ht, name, strlen(name), &val);
+		idx = tw_span_create("sql", 3 TSRMLS_CC);
+		zend_hash_update(TWG(span_cache), key, strlen(key)+1, &idx, sizeof(long), NULL);
 #else
-		add_assoc_long(counts, name, count);
+	if (zidx_ptr = zend_hash_str_find(TWG(span_cache), key, strlen(key))) {
+		idx = Z_LVAL_P(zidx_ptr);
+	} else {
+		idx = tw_span_create("sql", 3 TSRMLS_CC);
+		ZVAL_LONG(&zidx, idx);
+		zend_hash_str_update(TWG(span_cache), key, strlen(key), &zidx);
 #endif
-	}
-}
+		tw_sql_summary(sql, sql_len, summary, sizeof(summary));
 
-/**
- * ***********************
- * High precision timer related functions.
- * ***********************
- */
+		tw_span_annotate_string(idx, "title", summary, 1 TSRMLS_CC);
+		tw_span_annotate_string(idx, "fp", key + strlen(prefix), 1 TSRMLS_CC);
 
-/**
- * Get the current wallclock timer
- *
- * @return 64 bit unsigned integer
- * @author cjiang
- */
-static uint64 cycle_timer(TSRMLS_D) {
-#if defined(PHP_WIN32)
+		if (prepare) {
+			tw_span_annotate_long(idx, "prepare", 1 TSRMLS_CC);
+		}
 
-    LARGE_INTEGER count;
+		if (normalized_len > 1000) {
+			normalized[1000] = '\0';
+		}
+		tw_span_annotate_string(idx, "sql", normalized, 1 TSRMLS_CC);
+	}
 
-    if (!QueryPerformanceCounter(&count)) {
-        return 0;
-    }
+	efree(normalized);
 
-    return (double)(count.QuadPart) / TWG(frequency);
-#else
-#ifdef __APPLE__
-	return mach_absolute_time();
-#else
-	struct timespec s;
-	clock_gettime(CLOCK_MONOTONIC, &s);
+	if (prepare) {
+		return idx;
+	}
 
-	return s.tv_sec * 1000000 + s.tv_nsec / 1000;
-#endif
+#if PHP_VERSION_ID < 70000
+	zend_hash_find(TWG(sql_repeats), key, strlen(key)+1, (void **)&repeat_ptr);
+#else
+	repeat_ptr = zend_hash_str_find_ptr(TWG(sql_repeats), key, strlen(key));
 #endif
-}
 
-/**
- * Get the current real CPU clock timer
- */
-static uint64 cpu_timer() {
-#if defined(CLOCK_PROCESS_CPUTIME_ID)
-	struct timespec s;
-	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s);
-
-	return s.tv_sec * 1000000 + s.tv_nsec / 1000;
+	if (repeat_ptr == NULL) {
+		memset(&repeat, 0, sizeof(tw_sql_repeat));
+#if PHP_VERSION_ID < 70000
+		zend_hash_update(TWG(sql_repeats), key, strlen(key)+1, &repeat, sizeof(tw_sql_repeat), (void **)&repeat_ptr);
 #else
-	struct rusage ru;
+		repeat_ptr = zend_hash_str_update_mem(TWG(sql_repeats), key, strlen(key), &repeat, sizeof(tw_sql_repeat));
+#endif
+	}
 
-	tw_getrusage(RUSAGE_SELF, &ru);
+	/* Entries are reused, the start time tells frames apart */
+	if (repeat_ptr->frame == frame && repeat_ptr->frame_start == (frame ? frame->tsc_start : 0)) {
+		repeat_ptr->count++;
+	} else {
+		repeat_ptr->frame = frame;
+		repeat_ptr->frame_start = frame ? frame->tsc_start : 0;
+		repeat_ptr->count = 1;
+	}
 
-	return ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec +
-		ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
-#endif
-}
+	if (repeat_ptr->count > TWG(n_plus_one_threshold) && repeat_ptr->count > repeat_ptr->max) {
+		repeat_ptr->max = repeat_ptr->count;
+		tw_span_annotate_long(idx, "n+1", repeat_ptr->count TSRMLS_CC);
+	}
 
-/**
- * Get time delta in microseconds.
- */
-static long get_us_interval(struct timeval *start, struct timeval *end)
-{
-	return (((end->tv_sec - start->tv_sec) * 1000000)
-			+ (end->tv_usec - start->tv_usec));
+	return idx;
 }
 
-/**
- * Convert from TSC counter values to equivalent microseconds.
- *
- * @param uint64 count, TSC count value
- * @return 64 bit unsigned integer
- *
- * @author cjiang
- */
-static inline double get_us_from_tsc(uint64 count TSRMLS_DC)
+long tw_trace_callback_record_sql(char *sql, size_t sql_len TSRMLS_DC)
 {
-	return count / TWG(timebase_factor);
+	return tw_sql_span_record(sql, sql_len, 0 TSRMLS_CC);
 }
 
 /**
- * Get the timebase factor necessary to divide by in cycle_timer()
+ * Remember the SQL of a prepared statement for the rest of the request,
+ * keyed by "h:<handle>" of a mysqli_stmt object or "pg:<connection>:<name>"
+ * of a pgsql statement, so that execute spans are recorded with their query.
+ * Handles of freed objects are reused, entries of a mysqli_stmt are dropped
+ * when it is closed and when a new statement object gets the handle.
  */
-static double get_timebase_factor()
+static void tw_sql_statement_store(char *key, zval *sql TSRMLS_DC)
 {
-#ifdef __APPLE__
-	mach_timebase_info_data_t sTimebaseInfo;
-	(void) mach_timebase_info(&sTimebaseInfo);
+#if PHP_VERSION_ID >= 70000
+	zval copy;
 
-	return (sTimebaseInfo.numer / sTimebaseInfo.denom) * 1000;
+	ZVAL_STRINGL(&copy, Z_STRVAL_P(sql), Z_STRLEN_P(sql));
+	zend_hash_str_update(TWG(sql_statements), key, strlen(key), &copy);
 #else
-	return 1.0;
+	zval *copy;
+
+	MAKE_STD_ZVAL(copy);
+	ZVAL_STRINGL(copy, Z_STRVAL_P(sql), Z_STRLEN_P(sql), 1);
+	zend_hash_update(TWG(sql_statements), key, strlen(key)+1, &copy, sizeof(zval*), NULL);
 #endif
 }
 
-/**
- * TIDEWAYS_MODE_HIERARCHICAL's begin function callback
- *
- * @author kannan
- */
-void hp_mode_hier_beginfn_cb(hp_entry_t **entries, hp_entry_t *current, zend_execute_data *data TSRMLS_DC)
+static void tw_sql_statement_forget(char *key TSRMLS_DC)
 {
-	hp_entry_t   *p;
-	tw_trace_callback *callback;
-	int    recurse_level = 0;
-
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0 && data != NULL) {
-#if PHP_VERSION_ID < 70000
-		if (zend_hash_find(TWG(trace_callbacks), current->name_hprof, strlen(current->name_hprof)+1, (void **)&callback) == SUCCESS) {
-			current->span_id = (*callback)(current->name_hprof, data TSRMLS_CC);
-		}
+#if PHP_VERSION_ID >= 70000
+	zend_hash_str_del(TWG(sql_statements), key, strlen(key));
 #else
-		callback = (tw_trace_callback*)zend_hash_str_find_ptr(TWG(trace_callbacks), current->name_hprof, strlen(current->name_hprof));
-
-		if (callback != NULL) {
-			current->span_id = (*callback)(current->name_hprof, data TSRMLS_CC);
-		}
+	zend_hash_del(TWG(sql_statements), key, strlen(key)+1);
 #endif
-	}
-
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_HIERACHICAL) == 0) {
-		if (TWG(func_hash_counters)[current->hash_code] > 0) {
-			/* Find this symbols recurse level */
-			for(p = (*entries); p; p = p->prev_hprof) {
-				if (!strcmp(current->name_hprof, p->name_hprof)) {
-					recurse_level = (p->rlvl_hprof) + 1;
-					break;
-				}
-			}
-		}
-		TWG(func_hash_counters)[current->hash_code]++;
-
-		/* Init current function's recurse level */
-		current->rlvl_hprof = recurse_level;
-
-		/* Get CPU usage */
-		if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
-			current->cpu_start = cpu_timer();
-		}
+}
 
-		/* Get memory usage */
-		if (TWG(tideways_flags) & TIDEWAYS_FLAGS_MEMORY) {
-			current->mu_start_hprof  = zend_memory_usage(0 TSRMLS_CC);
-			current->pmu_start_hprof = zend_memory_peak_usage(0 TSRMLS_CC);
-		}
+static long tw_sql_statement_record(char *key TSRMLS_DC)
+{
+	zval *sql = zend_compat_hash_find_const(TWG(sql_statements), key, strlen(key));
 
-		if (current->span_id >= 0) {
-			tw_span_annotate_string(current->span_id, "fn", current->name_hprof, 1 TSRMLS_CC);
-		}
+	if (sql == NULL || Z_TYPE_P(sql) != IS_STRING) {
+		return -1;
 	}
 
-	/* Get start tsc counter */
-	current->tsc_start = cycle_timer(TSRMLS_C);
+	return tw_trace_callback_record_sql(Z_STRVAL_P(sql), Z_STRLEN_P(sql) TSRMLS_CC);
 }
 
 /**
- * **********************************
- * TIDEWAYS END FUNCTION CALLBACKS
- * **********************************
+ * Resource id of the explicit connection argument of pg_* functions, 0 for
+ * the default connection.
  */
+static long tw_pgsql_connection(zend_execute_data *data)
+{
+	zval *connection = ZEND_CALL_NUM_ARGS(data) > 0 ? ZEND_CALL_ARG(data, 1) : NULL;
+
+	if (connection == NULL || Z_TYPE_P(connection) != IS_RESOURCE) {
+		return 0;
+	}
+
+	return _Z_RES_HANDLE_P(connection);
+}
 
 /**
- * TIDEWAYS_MODE_HIERARCHICAL's end function callback
- *
- * @author kannan
+ * pg_prepare([$connection,] $name, $query)
  */
-void hp_mode_hier_endfn_cb(hp_entry_t **entries, zend_execute_data *data TSRMLS_DC)
+long tw_trace_callback_pgsql_prepare(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	hp_entry_t      *top = (*entries);
-	zval            *counts, count_val;
-	char             symbol[SCRATCH_BUF_LEN] = "";
-	long int         mu_end;
-	long int         pmu_end;
-	uint64   tsc_end;
-	double   wt, cpu;
-	tw_trace_callback *callback;
-
-	/* Get end tsc counter */
-	tsc_end = cycle_timer(TSRMLS_C);
-	wt = get_us_from_tsc(tsc_end - top->tsc_start TSRMLS_CC);
+	zval *name, *query;
+	char key[SCRATCH_BUF_LEN];
+	int offset = ZEND_CALL_NUM_ARGS(data) >= 3 ? 1 : 0;
 
-	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
-		cpu = get_us_from_tsc(cpu_timer() - top->cpu_start TSRMLS_CC);
+	if (ZEND_CALL_NUM_ARGS(data) < 2) {
+		return -1;
 	}
 
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0 && top->span_id >= 0) {
-		double start = get_us_from_tsc(top->tsc_start - TWG(start_time) TSRMLS_CC);
-		double end = get_us_from_tsc(tsc_end - TWG(start_time) TSRMLS_CC);
-		tw_span_record_duration(top->span_id, start, end TSRMLS_CC);
-	}
+	name = ZEND_CALL_ARG(data, offset + 1);
+	query = ZEND_CALL_ARG(data, offset + 2);
 
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_HIERACHICAL) > 0) {
-		return;
+	if (name == NULL || query == NULL || Z_TYPE_P(name) != IS_STRING || Z_TYPE_P(query) != IS_STRING) {
+		return -1;
 	}
 
-	/* Get the stat array */
-	hp_get_function_stack(top, 2, symbol, sizeof(symbol));
+	snprintf(key, sizeof(key), "pg:%ld:%s", tw_pgsql_connection(data), Z_STRVAL_P(name));
+	tw_sql_statement_store(key, query TSRMLS_CC);
 
-	counts = zend_compat_hash_find_const(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol));
+	return -1;
+}
 
-	if (counts == NULL) {
-#if PHP_VERSION_ID >= 70000
-		counts = &count_val;
-		array_init(counts);
-		zend_hash_str_update(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol), counts);
-#else
-		MAKE_STD_ZVAL(counts);
-		array_init(counts);
-		zend_hash_update(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol)+1, &counts, sizeof(zval*), NULL);
-#endif
-	}
+long tw_trace_callback_pgsql_execute(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument_element;
+	char *summary, key[SCRATCH_BUF_LEN];
+	long idx;
+	int i;
+	int args_len = ZEND_CALL_NUM_ARGS(data);
 
-	/* Bump stats in the counts hashtable */
-	hp_inc_count(counts, "ct", 1  TSRMLS_CC);
-	hp_inc_count(counts, "wt", wt TSRMLS_CC);
+	for (i = 0; i < args_len; i++) {
+		argument_element = ZEND_CALL_ARG(data, i+1);
 
-	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
-		/* Bump CPU stats in the counts hashtable */
-		hp_inc_count(counts, "cpu", cpu TSRMLS_CC);
-	}
+		if (argument_element && Z_TYPE_P(argument_element) == IS_STRING && Z_STRLEN_P(argument_element) > 0) {
+			summary = Z_STRVAL_P(argument_element);
 
-	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_MEMORY) {
-		/* Get Memory usage */
-		mu_end  = zend_memory_usage(0 TSRMLS_CC);
-		pmu_end = zend_memory_peak_usage(0 TSRMLS_CC);
+			snprintf(key, sizeof(key), "pg:%ld:%s", tw_pgsql_connection(data), summary);
+			idx = tw_sql_statement_record(key TSRMLS_CC);
 
-		/* Bump Memory stats in the counts hashtable */
-		hp_inc_count(counts, "mu",  mu_end - top->mu_start_hprof    TSRMLS_CC);
-		hp_inc_count(counts, "pmu", pmu_end - top->pmu_start_hprof  TSRMLS_CC);
+			if (idx >= 0) {
+				return idx;
+			}
+
+			/* Prepared before profiling started, only the name is known */
+			return tw_trace_callback_record_with_cache("sql", 3, summary, strlen(summary), 1 TSRMLS_CC);
+		}
 	}
 
-	TWG(func_hash_counters)[top->hash_code]--;
+	return -1;
 }
 
+long tw_trace_callback_pgsql_query(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument_element;
+	int i;
+	int args_len = ZEND_CALL_NUM_ARGS(data);
 
-/**
- * ***************************
- * PHP EXECUTE/COMPILE PROXIES
- * ***************************
- */
+	for (i = 0; i < args_len; i++) {
+		argument_element = ZEND_CALL_ARG(data, i+1);
 
-/**
- * Tideways enable replaced the zend_execute function with this
- * new execute function. We can do whatever profiling we need to
- * before and after calling the actual zend_execute().
- *
- * @author hzhao, kannan
- */
-#if PHP_VERSION_ID >= 70000
-ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data) {
-	zend_execute_data *real_execute_data = execute_data;
-#elif PHP_VERSION_ID < 50500
-ZEND_DLEXPORT void hp_execute (zend_op_array *ops TSRMLS_DC) {
-	zend_execute_data *execute_data = EG(current_execute_data);
-	zend_execute_data *real_execute_data = execute_data;
-#else
-ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
-	zend_op_array *ops = execute_data->op_array;
-	zend_execute_data    *real_execute_data = execute_data->prev_execute_data;
-#endif
-	char          *func = NULL;
-	int hp_profile_flag = 1;
-
-	if (!TWG(enabled)) {
-#if PHP_VERSION_ID < 50500
-		_zend_execute(ops TSRMLS_CC);
-#else
-		_zend_execute_ex(execute_data TSRMLS_CC);
-#endif
-		return;
+		if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
+			return tw_trace_callback_record_sql(Z_STRVAL_P(argument_element), Z_STRLEN_P(argument_element) TSRMLS_CC);
+		}
 	}
 
-	func = hp_get_function_name(real_execute_data TSRMLS_CC);
+	return -1;
+}
 
-	if (!func) {
-#if PHP_VERSION_ID < 50500
-		_zend_execute(ops TSRMLS_CC);
-#else
-		_zend_execute_ex(execute_data TSRMLS_CC);
-#endif
-		return;
-	}
+long tw_trace_callback_smarty3_template(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument_element = ZEND_CALL_ARG(data, 1);
+	zval *obj;
+	zend_class_entry *smarty_ce;
+	char *template;
+	size_t template_len;
+	zval *__rv;
 
-	hp_detect_transaction_name(func, real_execute_data TSRMLS_CC);
+	if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
+		template = Z_STRVAL_P(argument_element);
+	} else {
+		zval *object = EX_OBJ(data);
 
-	if (TWG(exception_function) != NULL && strcmp(func, ZSTR_VAL(TWG(exception_function))) == 0) {
-		hp_detect_exception(func, real_execute_data TSRMLS_CC);
-	}
+		if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+			return -1;
+		}
 
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_USERLAND) > 0) {
-#if PHP_VERSION_ID < 50500
-		_zend_execute(ops TSRMLS_CC);
-#else
-		_zend_execute_ex(execute_data TSRMLS_CC);
-#endif
-		efree(func);
-		return;
-	}
+		smarty_ce = Z_OBJCE_P(object);
 
-	BEGIN_PROFILING(&TWG(entries), func, hp_profile_flag, real_execute_data);
-#if PHP_VERSION_ID < 50500
-	_zend_execute(ops TSRMLS_CC);
-#else
-	_zend_execute_ex(execute_data TSRMLS_CC);
-#endif
-	if (TWG(entries)) {
-		END_PROFILING(&TWG(entries), hp_profile_flag, real_execute_data);
+		argument_element = _zend_read_property(smarty_ce, object, "template_resource", sizeof("template_resource") - 1, 1, __rv);
+
+		if (Z_TYPE_P(argument_element) != IS_STRING) {
+			return -1;
+		}
+
+		template = Z_STRVAL_P(argument_element);
 	}
-	efree(func);
+
+	template_len = Z_STRLEN_P(argument_element);
+
+	return tw_trace_callback_record_with_cache("view", 4, template, template_len, 1 TSRMLS_CC);
 }
 
-#undef EX
-#define EX(element) ((execute_data)->element)
+long tw_trace_callback_doctrine_persister(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *property;
+	zend_class_entry *persister_ce, *metadata_ce;
+	zval *object = EX_OBJ(data);
+	zval *__rv;
 
-/**
- * Very similar to hp_execute. Proxy for zend_execute_internal().
- * Applies to zend builtin functions.
- *
- * @author hzhao, kannan
- */
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return -1;
+	}
 
-#if PHP_VERSION_ID >= 70000
-ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *return_value) {
-#elif PHP_VERSION_ID < 50500
-#define EX_T(offset) (*(temp_variable *)((char *) EX(Ts) + offset))
+	persister_ce = Z_OBJCE_P(object);
 
-ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data,
-                                       int ret TSRMLS_DC) {
-#else
-#define EX_T(offset) (*EX_TMP_VAR(execute_data, offset))
+	property = _zend_read_property(persister_ce, object, "class", sizeof("class") - 1, 1, __rv);
+	if (property == NULL) {
+		property = _zend_read_property(persister_ce, object, "_class", sizeof("_class") - 1, 1, __rv);
+	}
 
-ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data,
-                                       struct _zend_fcall_info *fci, int ret TSRMLS_DC) {
-#endif
-	char             *func = NULL;
-	int    hp_profile_flag = 1;
+	if (property != NULL && Z_TYPE_P(property) == IS_OBJECT) {
+		metadata_ce = Z_OBJCE_P(property);
 
-	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_BUILTINS) > 0) {
-#if PHP_MAJOR_VERSION == 7
-		execute_internal(execute_data, return_value TSRMLS_CC);
-#elif PHP_VERSION_ID < 50500
-		execute_internal(execute_data, ret TSRMLS_CC);
-#else
-		execute_internal(execute_data, fci, ret TSRMLS_CC);
-#endif
-		return;
+		property = _zend_read_property(metadata_ce, property, "name", sizeof("name") - 1, 1, __rv);
+
+		if (property == NULL) {
+			return -1;
+		}
+
+		return tw_trace_callback_record_with_cache("doctrine.load", 13, Z_STRVAL_P(property), Z_STRLEN_P(property), 1 TSRMLS_CC);
 	}
 
-	func = hp_get_function_name(execute_data TSRMLS_CC);
+	return -1;
+}
 
-	if (func) {
-		BEGIN_PROFILING(&TWG(entries), func, hp_profile_flag, execute_data);
+long tw_trace_callback_doctrine_query(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *property;
+	zend_class_entry *query_ce;
+	zval fname;
+	_DECLARE_ZVAL(retval_ptr);
+	zval *object = EX_OBJ(data);
+	char *summary, *className;
+	long idx = -1;
+	int keepQuery = 0;
+
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
 	}
 
-	if (!_zend_execute_internal) {
-#if PHP_VERSION_ID >= 70000
-		execute_internal(execute_data, return_value TSRMLS_CC);
-#elif PHP_VERSION_ID < 50500
-		execute_internal(execute_data, ret TSRMLS_CC);
-#else
-		execute_internal(execute_data, fci, ret TSRMLS_CC);
-#endif
+	query_ce = Z_OBJCE_P(object);
+	className = _ZCE_NAME(query_ce);
+
+	if (strcmp(className, "Doctrine\\ORM\\Query") == 0) {
+		_ZVAL_STRING(&fname, "getDQL");
+		keepQuery = 1;
+	} else if (strcmp(className, "Doctrine\\ORM\\NativeQuery") == 0) {
+		_ZVAL_STRING(&fname, "getSQL");
 	} else {
-		/* call the old override */
-#if PHP_VERSION_ID >= 70000
-		_zend_execute_internal(execute_data, return_value TSRMLS_CC);
-#elif PHP_VERSION_ID < 50500
-		_zend_execute_internal(execute_data, ret TSRMLS_CC);
-#else
-		_zend_execute_internal(execute_data, fci, ret TSRMLS_CC);
-#endif
+		return idx;
 	}
 
-	if (func) {
-		if (TWG(entries)) {
-			END_PROFILING(&TWG(entries), hp_profile_flag, execute_data);
+	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
+		if (Z_TYPE_P(retval_ptr) != IS_STRING) {
+			return idx;
 		}
-		efree(func);
+
+		idx = tw_span_create("doctrine.query", 14 TSRMLS_CC);
+		if (keepQuery) {
+			tw_span_annotate_string(idx, "title", "DQL", 1 TSRMLS_CC);
+			tw_span_annotate_string(idx, "sql", Z_STRVAL_P(retval_ptr), 1 TSRMLS_CC);
+		} else {
+			tw_span_annotate_string(idx, "title", "Native", 1 TSRMLS_CC);
+		}
+
+		hp_ptr_dtor(retval_ptr);
 	}
+#if PHP_VERSION_ID >= 70000
+	zend_string_release(Z_STR(fname));
+#endif
+
+	return idx;
+}
+
+#if PHP_VERSION_ID >= 70000
+static void hp_free_template_name(zval *zv)
+{
+	pefree(Z_PTR_P(zv), 1);
+}
+#else
+static void hp_free_template_name(void *p)
+{
+	pefree(*(char **)p, 1);
 }
+#endif
 
 /**
- * Proxy for zend_compile_file(). Used to profile PHP compilation time.
- *
- * @author kannan, hzhao
+ * Twig compiles every template into its own class, so the template name is
+ * remembered by class name for the lifetime of the worker.
  */
-ZEND_DLEXPORT zend_op_array* hp_compile_file(zend_file_handle *file_handle, int type TSRMLS_DC)
+static char *tw_template_name_find(zend_class_entry *ce TSRMLS_DC)
 {
-	zend_op_array  *ret;
-	uint64 start;
+#if PHP_VERSION_ID >= 70000
+	if (TWG(template_names) == NULL) {
+		return NULL;
+	}
 
-	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_COMPILE) > 0) {
-		return _zend_compile_file(file_handle, type TSRMLS_CC);
+	return zend_hash_str_find_ptr(TWG(template_names), _ZCE_NAME(ce), _ZCE_NAME_LENGTH(ce));
+#else
+	char **name;
+
+	if (TWG(template_names) == NULL || zend_hash_find(TWG(template_names), _ZCE_NAME(ce), _ZCE_NAME_LENGTH(ce)+1, (void **)&name) == FAILURE) {
+		return NULL;
 	}
 
-	start = cycle_timer(TSRMLS_C);
+	return *name;
+#endif
+}
 
-	TWG(compile_count)++;
+static void tw_template_name_store(zend_class_entry *ce, char *name, size_t name_len TSRMLS_DC)
+{
+	char *copy;
 
-	ret = _zend_compile_file(file_handle, type TSRMLS_CC);
+	if (TWG(template_names) == NULL) {
+		TWG(template_names) = pemalloc(sizeof(HashTable), 1);
+		zend_hash_init(TWG(template_names), 32, NULL, hp_free_template_name, 1);
+	}
 
-	TWG(compile_wt) += get_us_from_tsc(cycle_timer(TSRMLS_C) - start TSRMLS_CC);
+	if (zend_hash_num_elements(TWG(template_names)) >= TIDEWAYS_TEMPLATE_NAMES_SIZE) {
+		return;
+	}
 
-	return ret;
+	copy = pestrndup(name, name_len, 1);
+
+#if PHP_VERSION_ID >= 70000
+	zend_hash_str_update_ptr(TWG(template_names), _ZCE_NAME(ce), _ZCE_NAME_LENGTH(ce), copy);
+#else
+	zend_hash_update(TWG(template_names), _ZCE_NAME(ce), _ZCE_NAME_LENGTH(ce)+1, &copy, sizeof(char *), NULL);
+#endif
 }
 
-/**
- * Proxy for zend_compile_string(). Used to profile PHP eval compilation time.
- */
-ZEND_DLEXPORT zend_op_array* hp_compile_string(zval *source_string, char *filename TSRMLS_DC)
+long tw_trace_callback_twig_template(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	zend_op_array  *ret;
-	uint64 start;
+	long idx = -1;
+	char *name;
+	zval fname;
+	_DECLARE_ZVAL(retval_ptr);
+	zval *object = EX_OBJ(data);
 
-	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_COMPILE) > 0) {
-		return _zend_compile_string(source_string, filename TSRMLS_CC);
+	if (object == NULL || Z_TYPE_P(object) != IS_OBJECT) {
+		return idx;
 	}
 
-	start = cycle_timer(TSRMLS_C);
+	name = tw_template_name_find(Z_OBJCE_P(object) TSRMLS_CC);
 
-	TWG(compile_count)++;
+	if (name != NULL) {
+		return tw_trace_callback_record_with_cache("view", 4, name, strlen(name), 1 TSRMLS_CC);
+	}
 
-	ret = _zend_compile_string(source_string, filename TSRMLS_CC);
+	_ZVAL_STRING(&fname, "getTemplateName");
 
-	TWG(compile_wt) += get_us_from_tsc(cycle_timer(TSRMLS_C) - start TSRMLS_CC);
+	if (SUCCESS == tw_call_user_function_ex(EG(function_table), object, &fname, retval_ptr)) {
+		if (Z_TYPE_P(retval_ptr) == IS_STRING) {
+			tw_template_name_store(Z_OBJCE_P(object), Z_STRVAL_P(retval_ptr), Z_STRLEN_P(retval_ptr) TSRMLS_CC);
+			idx = tw_trace_callback_record_with_cache("view", 4, Z_STRVAL_P(retval_ptr), Z_STRLEN_P(retval_ptr), 1 TSRMLS_CC);
+		}
 
-	return ret;
+		hp_ptr_dtor(retval_ptr);
+	}
+#if PHP_VERSION_ID >= 70000
+	zend_string_release(Z_STR(fname));
+#endif
+
+	return idx;
 }
 
-/**
- * **************************
- * MAIN TIDEWAYS CALLBACKS
- * **************************
- */
+long tw_trace_callback_event_dispatchers2(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	long idx = -1, *idx_ptr;
+	zval *arg1 = ZEND_CALL_ARG(data, 1);
+	zval *arg2 = ZEND_CALL_ARG(data, 2);
+	char *event;
+	int len;
+
+	if (arg1 && arg2 && Z_TYPE_P(arg1) == IS_STRING && Z_TYPE_P(arg2) == IS_STRING) {
+		len = Z_STRLEN_P(arg1) + Z_STRLEN_P(arg2) + 3;
+		event = (char*)emalloc(len);
+		snprintf(event, len, "%s::%s", Z_STRVAL_P(arg1), Z_STRVAL_P(arg2));
+		event[len-1] = '\0';
+
+		idx = tw_trace_callback_record_with_cache("event", 5, event, len, 1 TSRMLS_CC);
+
+		efree(event);
+	}
+
+	return idx;
+}
+
+long tw_trace_callback_event_dispatchers(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	long idx = -1, *idx_ptr;
+	zval *argument_element = ZEND_CALL_ARG(data, 1);
+
+	if (argument_element && Z_TYPE_P(argument_element) == IS_STRING) {
+		idx = tw_trace_callback_record_with_cache("event", 5, Z_STRVAL_P(argument_element), Z_STRLEN_P(argument_element), 1 TSRMLS_CC);
+	}
+
+	return idx;
+}
 
 /**
- * This function gets called once when Tideways gets enabled.
- * It replaces all the functions like zend_execute, zend_execute_internal,
- * etc that needs to be instrumented with their corresponding proxies.
+ * Map an object or resource handle to a span, e.g. a PDOStatement to the span
+ * of its execute() so that fetch calls can be attributed to it.
  */
-static void hp_begin(long tideways_flags TSRMLS_DC)
+static void tw_span_map_store(HashTable *map, zend_ulong handle, long idx TSRMLS_DC)
 {
-	if (!TWG(enabled)) {
-		int hp_profile_flag = 1;
+#if PHP_VERSION_ID >= 70000
+	zval zidx;
 
-		TWG(enabled) = 1;
-		TWG(tideways_flags) = (uint32)tideways_flags;
+	ZVAL_LONG(&zidx, idx);
+	zend_hash_index_update(map, handle, &zidx);
+#else
+	zend_hash_index_update(map, handle, &idx, sizeof(long), NULL);
+#endif
+}
 
-		/* one time initializations */
-		hp_init_profiler_state(TSRMLS_C);
+static long tw_span_map_find(HashTable *map, zend_ulong handle TSRMLS_DC)
+{
+#if PHP_VERSION_ID >= 70000
+	zval *zidx;
 
-		/* start profiling from fictitious main() */
-		TWG(root) = estrdup(ROOT_SYMBOL);
-		TWG(start_time) = cycle_timer(TSRMLS_C);
+	if (map == NULL || (zidx = zend_hash_index_find(map, handle)) == NULL) {
+		return -1;
+	}
 
-		if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
-			TWG(cpu_start) = cpu_timer();
-		}
+	return Z_LVAL_P(zidx);
+#else
+	long *idx;
 
-		tw_span_create("app", 3 TSRMLS_CC);
-		tw_span_timer_start(0 TSRMLS_CC);
+	if (map == NULL || zend_hash_index_find(map, handle, (void **)&idx) == FAILURE) {
+		return -1;
+	}
 
-		BEGIN_PROFILING(&TWG(entries), TWG(root), hp_profile_flag, NULL);
+	return *idx;
+#endif
+}
+
+long tw_trace_callback_pdo_stmt_execute(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	long idx;
+
+#if PHP_VERSION_ID >= 70000
+	pdo_stmt_t *stmt = (pdo_stmt_t*) ((char*) Z_OBJ_P(EX_OBJ(data)) - Z_OBJ_HT_P(EX_OBJ(data))->offset);
+#else
+	pdo_stmt_t *stmt = (pdo_stmt_t*)zend_object_store_get_object_by_handle(Z_OBJ_HANDLE_P(EX_OBJ(data)) TSRMLS_CC);
+#endif
+	if (stmt->query_string == NULL) {
+		return -1;
 	}
+
+	idx = tw_trace_callback_record_sql(stmt->query_string, stmt->query_stringlen TSRMLS_CC);
+	tw_span_map_store(TWG(pdo_statements), Z_OBJ_HANDLE_P(EX_OBJ(data)), idx TSRMLS_CC);
+
+	return idx;
 }
 
 /**
- * Called at request shutdown time. Cleans the profiler's global state.
+ * PDOStatement::fetch(), fetchAll(), fetchColumn() and fetchObject() add
+ * their time and the number of rows to the span of the statement. They are
+ * summed up in pdo_fetches and only written to the span annotations by
+ * tw_pdo_fetch_flush().
  */
-static void hp_end(TSRMLS_D)
+void tw_trace_return_pdo_stmt_fetch(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
 {
-	/* Bail if not ever enabled */
-	if (!TWG(ever_enabled)) {
+	long idx = tw_span_map_find(TWG(pdo_statements), Z_OBJ_HANDLE_P(EX_OBJ(data)) TSRMLS_CC);
+	long rows = 0;
+	tw_pdo_fetch fetch, *fetch_ptr = NULL;
+
+	if (idx < 0) {
 		return;
 	}
 
-	/* Stop profiler if enabled */
-	if (TWG(enabled)) {
-		hp_stop(TSRMLS_C);
+	if (return_value != NULL && Z_TYPE_P(return_value) == IS_ARRAY && strcmp(entry->name_hprof, "PDOStatement::fetchAll") == 0) {
+		rows = zend_hash_num_elements(Z_ARRVAL_P(return_value));
+#if PHP_VERSION_ID >= 70000
+	} else if (return_value != NULL && Z_TYPE_P(return_value) != IS_FALSE) {
+#else
+	} else if (return_value != NULL && (Z_TYPE_P(return_value) != IS_BOOL || Z_LVAL_P(return_value))) {
+#endif
+		rows = 1;
 	}
 
-	/* Clean up state */
-	hp_clean_profiler_state(TSRMLS_C);
+#if PHP_VERSION_ID >= 70000
+	fetch_ptr = zend_hash_index_find_ptr(TWG(pdo_fetches), idx);
+#else
+	zend_hash_index_find(TWG(pdo_fetches), idx, (void **)&fetch_ptr);
+#endif
+
+	if (fetch_ptr == NULL) {
+		memset(&fetch, 0, sizeof(tw_pdo_fetch));
+#if PHP_VERSION_ID >= 70000
+		fetch_ptr = zend_hash_index_update_mem(TWG(pdo_fetches), idx, &fetch, sizeof(tw_pdo_fetch));
+#else
+		zend_hash_index_update(TWG(pdo_fetches), idx, &fetch, sizeof(tw_pdo_fetch), (void **)&fetch_ptr);
+#endif
+	}
+
+	fetch_ptr->tsc += cycle_timer(TSRMLS_C) - entry->tsc_start;
+	fetch_ptr->rows += rows;
 }
 
 /**
- * Called from tideways_disable(). Removes all the proxies setup by
- * hp_begin() and restores the original values.
+ * Write the fetch totals to the statement spans, before the spans are read.
  */
-static void hp_stop(TSRMLS_D)
+static void tw_pdo_fetch_flush(TSRMLS_D)
 {
-	int hp_profile_flag = 1;
+	tw_pdo_fetch *fetch;
+#if PHP_VERSION_ID >= 70000
+	zend_ulong idx;
+#else
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong idx;
+#endif
 
-	/* End any unfinished calls */
-	while (TWG(entries)) {
-		END_PROFILING(&TWG(entries), hp_profile_flag, NULL);
+	if (TWG(pdo_fetches) == NULL) {
+		return;
 	}
 
-	tw_span_timer_stop(0 TSRMLS_CC);
-
-	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
-		if ((GC_G(gc_runs) - TWG(gc_runs)) > 0) {
-			tw_span_annotate_long(0, "gc", GC_G(gc_runs) - TWG(gc_runs) TSRMLS_CC);
-			tw_span_annotate_long(0, "gcc", GC_G(collected) - TWG(gc_collected) TSRMLS_CC);
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_NUM_KEY_PTR(TWG(pdo_fetches), idx, fetch) {
+		tw_span_annotate_long(idx, "fetch_wt", (long)get_us_from_tsc(fetch->tsc TSRMLS_CC) TSRMLS_CC);
+		tw_span_annotate_long(idx, "rows", fetch->rows TSRMLS_CC);
+	} ZEND_HASH_FOREACH_END();
+#else
+	for (zend_hash_internal_pointer_reset_ex(TWG(pdo_fetches), &pos);
+			zend_hash_get_current_data_ex(TWG(pdo_fetches), (void **) &fetch, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(TWG(pdo_fetches), &pos)) {
+		if (zend_hash_get_current_key_ex(TWG(pdo_fetches), &key, &key_len, &idx, 0, &pos) != HASH_KEY_IS_LONG) {
+			continue;
 		}
 
-		if (TWG(compile_count) > 0) {
-			tw_span_annotate_long(0, "cct", TWG(compile_count) TSRMLS_CC);
-		}
-		if (TWG(compile_wt) > 0) {
-			tw_span_annotate_long(0, "cwt", TWG(compile_wt) TSRMLS_CC);
-		}
+		tw_span_annotate_long(idx, "fetch_wt", (long)get_us_from_tsc(fetch->tsc TSRMLS_CC) TSRMLS_CC);
+		tw_span_annotate_long(idx, "rows", fetch->rows TSRMLS_CC);
+	}
+#endif
+}
 
-		tw_span_annotate_long(0, "cpu", get_us_from_tsc(cpu_timer() - TWG(cpu_start) TSRMLS_CC) TSRMLS_CC);
+long tw_trace_callback_pdo_stmt_fetch(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	if (EX_OBJ(data) != NULL && tw_span_map_find(TWG(pdo_statements), Z_OBJ_HANDLE_P(EX_OBJ(data)) TSRMLS_CC) >= 0) {
+		TWG(pending_return_cb) = tw_trace_return_pdo_stmt_fetch;
 	}
 
-	if (TWG(root)) {
-		efree(TWG(root));
-		TWG(root) = NULL;
+	return -1;
+}
+
+/**
+ * The statement of mysqli_stmt_*($stmt, ...) functions and mysqli_stmt methods.
+ */
+static zval *tw_mysqli_stmt_object(char *symbol, zend_execute_data *data)
+{
+	zval *stmt;
+
+	if (strncmp(symbol, "mysqli_stmt_", sizeof("mysqli_stmt_") - 1) == 0) {
+		stmt = ZEND_CALL_NUM_ARGS(data) > 0 ? ZEND_CALL_ARG(data, 1) : NULL;
+	} else {
+		stmt = EX_OBJ(data);
 	}
 
-	/* Stop profiling */
-	TWG(enabled) = 0;
+	return (stmt != NULL && Z_TYPE_P(stmt) == IS_OBJECT) ? stmt : NULL;
 }
 
+long tw_trace_callback_mysqli_stmt_execute(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *stmt = tw_mysqli_stmt_object(symbol, data);
+	char key[32];
+	long idx = -1;
+
+	if (stmt != NULL) {
+		snprintf(key, sizeof(key), "h:%u", (unsigned int)Z_OBJ_HANDLE_P(stmt));
+		idx = tw_sql_statement_record(key TSRMLS_CC);
+	}
+
+	if (idx >= 0) {
+		return idx;
+	}
+
+	return tw_trace_callback_record_with_cache("sql", 3, "execute", 7, 1 TSRMLS_CC);
+}
 
 /**
- * *****************************
- * TIDEWAYS ZVAL UTILITY FUNCTIONS
- * *****************************
+ * mysqli_stmt_prepare($stmt, $query) and mysqli_stmt::prepare($query)
  */
+long tw_trace_callback_mysqli_stmt_prepare(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *stmt = tw_mysqli_stmt_object(symbol, data);
+	zval *query;
+	char key[32];
 
-/** Look in the PHP assoc array to find a key and return the zval associated
- *  with it.
- *
- *  @author mpal
- **/
-static zval *hp_zval_at_key(char *key, size_t size, zval *values)
+	query = ZEND_CALL_NUM_ARGS(data) > 0 ? ZEND_CALL_ARG(data, ZEND_CALL_NUM_ARGS(data)) : NULL;
+
+	if (stmt == NULL || query == NULL || Z_TYPE_P(query) != IS_STRING) {
+		return -1;
+	}
+
+	snprintf(key, sizeof(key), "h:%u", (unsigned int)Z_OBJ_HANDLE_P(stmt));
+	tw_sql_statement_store(key, query TSRMLS_CC);
+
+	return tw_sql_span_record(Z_STRVAL_P(query), Z_STRLEN_P(query), 1 TSRMLS_CC);
+}
+
+/**
+ * mysqli_stmt_close($stmt) and mysqli_stmt::close()
+ */
+long tw_trace_callback_mysqli_stmt_close(char *symbol, zend_execute_data *data TSRMLS_DC)
 {
-	if (Z_TYPE_P(values) == IS_ARRAY) {
-		HashTable *ht = Z_ARRVAL_P(values);
+	zval *stmt = tw_mysqli_stmt_object(symbol, data);
+	char key[32];
 
-		return zend_compat_hash_find_const(ht, key, size-1);
+	if (stmt != NULL) {
+		snprintf(key, sizeof(key), "h:%u", (unsigned int)Z_OBJ_HANDLE_P(stmt));
+		tw_sql_statement_forget(key TSRMLS_CC);
 	}
 
-	return NULL;
+	return -1;
 }
 
 /**
- *  Convert the PHP array of strings to an emalloced array of strings. Note,
- *  this method duplicates the string data in the PHP array.
- *
- *  @author mpal
- **/
-static char **hp_strings_in_zval(zval *values)
+ * A new mysqli_stmt from mysqli_stmt_init() or mysqli::stmt_init() may reuse
+ * the handle of a freed statement.
+ */
+void tw_trace_return_mysqli_stmt_init(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
 {
-	char   **result;
-	size_t   count;
-	size_t   ix = 0;
-#if PHP_VERSION_ID < 70000
-	char  *str;
-#else
-	zend_string *str;
-#endif
-	uint   len;
-	ulong  idx;
-	int    type;
-	zval **data, *val;
+	char key[32];
 
-	if (!values) {
-		return NULL;
+	if (return_value != NULL && Z_TYPE_P(return_value) == IS_OBJECT) {
+		snprintf(key, sizeof(key), "h:%u", (unsigned int)Z_OBJ_HANDLE_P(return_value));
+		tw_sql_statement_forget(key TSRMLS_CC);
 	}
+}
 
-	if (Z_TYPE_P(values) == IS_ARRAY) {
-		HashTable *ht;
+long tw_trace_callback_mysqli_stmt_init(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	TWG(pending_return_cb) = tw_trace_return_mysqli_stmt_init;
 
-		ht    = Z_ARRVAL_P(values);
-		count = zend_hash_num_elements(ht);
+	return -1;
+}
 
-		if((result =
-					(char**)emalloc(sizeof(char*) * (count + 1))) == NULL) {
-			return result;
-		}
+/**
+ * new mysqli_stmt($link [, $query])
+ */
+long tw_trace_callback_mysqli_stmt_construct(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *stmt = EX_OBJ(data);
+	zval *query = ZEND_CALL_NUM_ARGS(data) > 1 ? ZEND_CALL_ARG(data, 2) : NULL;
+	char key[32];
 
-#if PHP_VERSION_ID < 70000
-		for (zend_hash_internal_pointer_reset(ht);
-				zend_hash_has_more_elements(ht) == SUCCESS;
-				zend_hash_move_forward(ht)) {
+	if (stmt == NULL || Z_TYPE_P(stmt) != IS_OBJECT) {
+		return -1;
+	}
 
-			type = zend_hash_get_current_key_ex(ht, &str, &len, &idx, 0, NULL);
-			if (type == HASH_KEY_IS_LONG) {
-				if ((zend_hash_get_current_data(ht, (void**)&data) == SUCCESS) &&
-						Z_TYPE_PP(data) == IS_STRING &&
-						strcmp(Z_STRVAL_PP(data), ROOT_SYMBOL)) { /* do not ignore "main" */
-					result[ix] = estrdup(Z_STRVAL_PP(data));
-					ix++;
-				}
-			} else if (type == HASH_KEY_IS_STRING) {
-				result[ix] = estrdup(str);
-				ix++;
-			}
-		}
-#else
-		ZEND_HASH_FOREACH_KEY_VAL(ht, idx, str, val) {
-			if (str) {
-				result[ix] = estrdup(ZSTR_VAL(str));
+	snprintf(key, sizeof(key), "h:%u", (unsigned int)Z_OBJ_HANDLE_P(stmt));
+
+	if (query != NULL && Z_TYPE_P(query) == IS_STRING) {
+		tw_sql_statement_store(key, query TSRMLS_CC);
+		return tw_sql_span_record(Z_STRVAL_P(query), Z_STRLEN_P(query), 1 TSRMLS_CC);
+	}
+
+	tw_sql_statement_forget(key TSRMLS_CC);
+
+	return -1;
+}
+
+/**
+ * Map the mysqli_stmt returned by mysqli_prepare() and mysqli::prepare()
+ * to its query.
+ */
+void tw_trace_return_mysqli_prepare(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
+{
+	zval *query;
+	char key[32];
+
+	if (return_value == NULL || Z_TYPE_P(return_value) != IS_OBJECT) {
+		return;
+	}
+
+	query = ZEND_CALL_ARG(data, ZEND_CALL_NUM_ARGS(data));
+
+	if (query == NULL || Z_TYPE_P(query) != IS_STRING) {
+		return;
+	}
+
+	snprintf(key, sizeof(key), "h:%u", (unsigned int)Z_OBJ_HANDLE_P(return_value));
+	tw_sql_statement_store(key, query TSRMLS_CC);
+}
+
+long tw_trace_callback_sql_commit(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	return tw_trace_callback_record_with_cache("sql", 3, "commit", 3, 1 TSRMLS_CC);
+}
+
+long tw_trace_callback_sql_functions(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument_element;
+
+	if (strcmp(symbol, "mysqli_query") == 0) {
+		argument_element = ZEND_CALL_ARG(data, 2);
+	} else {
+		argument_element = ZEND_CALL_ARG(data, 1);
+	}
+
+	if (argument_element == NULL || Z_TYPE_P(argument_element) != IS_STRING) {
+		return -1;
+	}
+
+	return tw_trace_callback_record_sql(Z_STRVAL_P(argument_element), Z_STRLEN_P(argument_element) TSRMLS_CC);
+}
+
+/**
+ * PDO::query() executes right away, map the returned statement to the span.
+ * Statements from PDO::prepare() and unrecorded queries may reuse the handle
+ * of a freed statement and must not inherit its span.
+ */
+void tw_trace_return_pdo_query(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
+{
+	if (return_value == NULL || Z_TYPE_P(return_value) != IS_OBJECT) {
+		return;
+	}
+
+	if (entry->span_id >= 0) {
+		tw_span_map_store(TWG(pdo_statements), Z_OBJ_HANDLE_P(return_value), entry->span_id TSRMLS_CC);
+	} else {
+		zend_hash_index_del(TWG(pdo_statements), Z_OBJ_HANDLE_P(return_value));
+	}
+}
+
+long tw_trace_callback_pdo_query(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	long idx = -1;
+
+	if (strcmp(symbol, "PDO::query") == 0) {
+		idx = tw_trace_callback_sql_functions(symbol, data TSRMLS_CC);
+	}
+
+	TWG(pending_return_cb) = tw_trace_return_pdo_query;
+
+	return idx;
+}
+
+long tw_trace_callback_mysqli_prepare(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *query = ZEND_CALL_ARG(data, strcmp(symbol, "mysqli_prepare") == 0 ? 2 : 1);
+
+	if (query == NULL || Z_TYPE_P(query) != IS_STRING) {
+		return -1;
+	}
+
+	TWG(pending_return_cb) = tw_trace_return_mysqli_prepare;
+
+	return tw_sql_span_record(Z_STRVAL_P(query), Z_STRLEN_P(query), 1 TSRMLS_CC);
+}
+
+long tw_trace_callback_fastcgi_finish_request(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	// stop the main span, the request ended here
+	tw_span_timer_stop(0 TSRMLS_CC);
+	return -1;
+}
+
+/**
+ * Cache the URL summary of a curl handle for the rest of the request.
+ */
+static void tw_curl_handle_store(zval *handle, char *summary TSRMLS_DC)
+{
+#if PHP_VERSION_ID >= 70000
+	zval copy;
+
+	ZVAL_STRING(&copy, summary);
+	zend_hash_index_update(TWG(curl_handles), _Z_RES_HANDLE_P(handle), &copy);
+#else
+	zval *copy;
+
+	MAKE_STD_ZVAL(copy);
+	ZVAL_STRING(copy, summary, 1);
+	zend_hash_index_update(TWG(curl_handles), _Z_RES_HANDLE_P(handle), &copy, sizeof(zval*), NULL);
+#endif
+}
+
+static void tw_curl_handle_store_url(zval *handle, zval *url TSRMLS_DC)
+{
+	char *summary;
+
+	if (handle == NULL || url == NULL || Z_TYPE_P(handle) != IS_RESOURCE || Z_TYPE_P(url) != IS_STRING) {
+		return;
+	}
+
+	summary = hp_get_file_summary(Z_STRVAL_P(url), Z_STRLEN_P(url) TSRMLS_CC);
+	tw_curl_handle_store(handle, summary TSRMLS_CC);
+	efree(summary);
+}
+
+static zval *tw_curl_handle_find(zval *handle TSRMLS_DC)
+{
+	zval *summary = zend_compat_hash_index_find(TWG(curl_handles), _Z_RES_HANDLE_P(handle));
+
+	return (summary != NULL && Z_TYPE_P(summary) == IS_STRING) ? summary : NULL;
+}
+
+void tw_trace_return_curl_init(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
+{
+	tw_curl_handle_store_url(return_value, ZEND_CALL_ARG(data, 1) TSRMLS_CC);
+}
+
+void tw_trace_return_curl_copy_handle(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
+{
+	zval *handle = ZEND_CALL_ARG(data, 1);
+	zval *summary;
+
+	if (handle == NULL || Z_TYPE_P(handle) != IS_RESOURCE || return_value == NULL || Z_TYPE_P(return_value) != IS_RESOURCE) {
+		return;
+	}
+
+	summary = tw_curl_handle_find(handle TSRMLS_CC);
+
+	if (summary != NULL) {
+		tw_curl_handle_store(return_value, Z_STRVAL_P(summary) TSRMLS_CC);
+	}
+}
+
+long tw_trace_callback_curl_init(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	if (ZEND_CALL_NUM_ARGS(data) > 0) {
+		TWG(pending_return_cb) = strcmp(symbol, "curl_init") == 0 ? tw_trace_return_curl_init : tw_trace_return_curl_copy_handle;
+	}
+
+	return -1;
+}
+
+/**
+ * Track CURLOPT_URL set through curl_setopt() and curl_setopt_array().
+ */
+long tw_trace_callback_curl_setopt(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *option, *url;
+
+	if (ZEND_CALL_NUM_ARGS(data) < 2) {
+		return -1;
+	}
+
+	option = ZEND_CALL_ARG(data, 2);
+
+	if (option == NULL) {
+		return -1;
+	}
+
+	if (Z_TYPE_P(option) == IS_ARRAY) {
+		url = zend_compat_hash_index_find(Z_ARRVAL_P(option), TIDEWAYS_CURLOPT_URL);
+	} else if (Z_TYPE_P(option) == IS_LONG && Z_LVAL_P(option) == TIDEWAYS_CURLOPT_URL && ZEND_CALL_NUM_ARGS(data) >= 3) {
+		url = ZEND_CALL_ARG(data, 3);
+	} else {
+		return -1;
+	}
+
+	tw_curl_handle_store_url(ZEND_CALL_ARG(data, 1), url TSRMLS_CC);
+
+	return -1;
+}
+
+typedef void (*tw_curl_info_handler)(zval *handle, zval *info, long idx TSRMLS_DC);
+
+/**
+ * Call curl_getinfo() once for a handle and pass the resulting array to the
+ * handler. ext/curl does not expose its handle struct to other extensions.
+ */
+static void tw_curl_getinfo(zval *handle, tw_curl_info_handler handler, long idx TSRMLS_DC)
+{
+	zval fname;
+	zval ***params_array;
+	_DECLARE_ZVAL(retval_ptr);
+#if PHP_VERSION_ID >= 70000
+	zval params[1];
+#endif
+
+	_ZVAL_STRING(&fname, "curl_getinfo");
+
+#if PHP_VERSION_ID < 70000
+	params_array = (zval ***) emalloc(sizeof(zval **));
+	params_array[0] = &handle;
+
+	if (SUCCESS == call_user_function_ex(EG(function_table), NULL, &fname, &retval_ptr, 1, params_array, 1, NULL TSRMLS_CC)) {
+#else
+	ZVAL_RES(&params[0], Z_RES_P(handle));
+
+	if (SUCCESS == call_user_function_ex(EG(function_table), NULL, &fname, retval_ptr, 1, params, 1, NULL)) {
+#endif
+		if (Z_TYPE_P(retval_ptr) == IS_ARRAY) {
+			handler(handle, retval_ptr, idx TSRMLS_CC);
+		}
+
+		hp_ptr_dtor(retval_ptr);
+	}
+
+#if PHP_VERSION_ID < 70000
+	efree(params_array);
+#else
+	zend_string_release(Z_STR(fname));
+#endif
+}
+
+static void tw_curl_info_url(zval *handle, zval *info, long idx TSRMLS_DC)
+{
+	zval *option = zend_compat_hash_find_const(Z_ARRVAL_P(info), "url", sizeof("url")-1);
+	char *url;
+
+	if (option && Z_TYPE_P(option) == IS_STRING) {
+		url = hp_get_file_summary(Z_STRVAL_P(option), Z_STRLEN_P(option) TSRMLS_CC);
+		tw_curl_handle_store(handle, url TSRMLS_CC);
+		efree(url);
+	}
+}
+
+static double tw_curl_info_double(zval *info, const char *key, size_t key_len)
+{
+	zval *value = zend_compat_hash_find_const(Z_ARRVAL_P(info), key, key_len);
+
+	if (value == NULL) {
+		return 0;
+	} else if (Z_TYPE_P(value) == IS_DOUBLE) {
+		return Z_DVAL_P(value);
+	} else if (Z_TYPE_P(value) == IS_LONG) {
+		return (double)Z_LVAL_P(value);
+	}
+
+	return 0;
+}
+
+static long tw_curl_info_us(double from, double to)
+{
+	return to > from ? (long)((to - from) * 1000000) : 0;
+}
+
+/**
+ * Annotate an http span with the phases of the transfer, in microseconds:
+ * dns, connect, tls, ttfb (request sent until first byte) and transfer, plus
+ * bytes up/down, the status code and whether the connection was reused.
+ */
+static void tw_curl_info_timings(zval *handle, zval *info, long idx TSRMLS_DC)
+{
+	double namelookup = tw_curl_info_double(info, "namelookup_time", sizeof("namelookup_time")-1);
+	double connect = tw_curl_info_double(info, "connect_time", sizeof("connect_time")-1);
+	double appconnect = tw_curl_info_double(info, "appconnect_time", sizeof("appconnect_time")-1);
+	double pretransfer = tw_curl_info_double(info, "pretransfer_time", sizeof("pretransfer_time")-1);
+	double starttransfer = tw_curl_info_double(info, "starttransfer_time", sizeof("starttransfer_time")-1);
+	double total = tw_curl_info_double(info, "total_time", sizeof("total_time")-1);
+	long status = (long)tw_curl_info_double(info, "http_code", sizeof("http_code")-1);
+
+	tw_span_annotate_long(idx, "dns", tw_curl_info_us(0, namelookup) TSRMLS_CC);
+	tw_span_annotate_long(idx, "connect", tw_curl_info_us(namelookup, connect) TSRMLS_CC);
+	tw_span_annotate_long(idx, "tls", tw_curl_info_us(connect, appconnect > 0 ? appconnect : connect) TSRMLS_CC);
+	tw_span_annotate_long(idx, "ttfb", tw_curl_info_us(pretransfer, starttransfer) TSRMLS_CC);
+	tw_span_annotate_long(idx, "transfer", tw_curl_info_us(starttransfer, total) TSRMLS_CC);
+	tw_span_annotate_long(idx, "up", (long)tw_curl_info_double(info, "size_upload", sizeof("size_upload")-1) TSRMLS_CC);
+	tw_span_annotate_long(idx, "down", (long)tw_curl_info_double(info, "size_download", sizeof("size_download")-1) TSRMLS_CC);
+	tw_span_annotate_long(idx, "status", status TSRMLS_CC);
+	tw_span_annotate_long(idx, "reused", status > 0 && connect == 0 ? 1 : 0 TSRMLS_CC);
+}
+
+void tw_trace_return_curl_exec(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
+{
+	zval *argument = ZEND_CALL_ARG(data, 1);
+
+	if (entry->span_id >= 0 && argument != NULL && Z_TYPE_P(argument) == IS_RESOURCE) {
+		tw_curl_getinfo(argument, tw_curl_info_timings, entry->span_id TSRMLS_CC);
+	}
+}
+
+/**
+ * Find the cached URL summary of a handle, asking curl_getinfo() for handles
+ * created before profiling started.
+ */
+static zval *tw_curl_handle_summary(zval *handle TSRMLS_DC)
+{
+	zval *summary = tw_curl_handle_find(handle TSRMLS_CC);
+
+	if (summary == NULL) {
+		tw_curl_getinfo(handle, tw_curl_info_url, -1 TSRMLS_CC);
+		summary = tw_curl_handle_find(handle TSRMLS_CC);
+	}
+
+	return summary;
+}
+
+long tw_trace_callback_curl_exec(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument = ZEND_CALL_ARG(data, 1);
+	zval *summary;
+	long idx;
+
+	if (argument == NULL || Z_TYPE_P(argument) != IS_RESOURCE) {
+		return -1;
+	}
+
+	summary = tw_curl_handle_summary(argument TSRMLS_CC);
+
+	if (summary == NULL) {
+		return -1;
+	}
+
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(summary), 1 TSRMLS_CC);
+
+	if (TWG(http_timings)) {
+		TWG(pending_return_cb) = tw_trace_return_curl_exec;
+	}
+
+	return idx;
+}
+
+/**
+ * Requests running concurrently through curl_multi get a span each, timed
+ * from curl_multi_add_handle() until curl_multi_info_read() reports the
+ * transfer as done or the handle is removed.
+ */
+static void tw_curl_multi_finish(zval *handle TSRMLS_DC)
+{
+	long idx = tw_span_map_find(TWG(curl_multi_spans), _Z_RES_HANDLE_P(handle) TSRMLS_CC);
+
+	if (idx < 0) {
+		return;
+	}
+
+	zend_hash_index_del(TWG(curl_multi_spans), _Z_RES_HANDLE_P(handle));
+	tw_span_timer_stop(idx TSRMLS_CC);
+
+	if (TWG(http_timings)) {
+		tw_curl_getinfo(handle, tw_curl_info_timings, idx TSRMLS_CC);
+	}
+}
+
+/**
+ * Stop spans of transfers that were never reported finished, their handle
+ * zvals are gone by now so timings are not collected.
+ */
+static void tw_curl_multi_stop_all(TSRMLS_D)
+{
+#if PHP_VERSION_ID >= 70000
+	zval *zidx;
+
+	if (TWG(curl_multi_spans) == NULL) {
+		return;
+	}
+
+	ZEND_HASH_FOREACH_VAL(TWG(curl_multi_spans), zidx) {
+		tw_span_timer_stop(Z_LVAL_P(zidx) TSRMLS_CC);
+	} ZEND_HASH_FOREACH_END();
+#else
+	HashPosition pos;
+	long *idx;
+
+	if (TWG(curl_multi_spans) == NULL) {
+		return;
+	}
+
+	for (zend_hash_internal_pointer_reset_ex(TWG(curl_multi_spans), &pos);
+		zend_hash_get_current_data_ex(TWG(curl_multi_spans), (void **)&idx, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(TWG(curl_multi_spans), &pos)) {
+		tw_span_timer_stop(*idx TSRMLS_CC);
+	}
+#endif
+
+	zend_hash_clean(TWG(curl_multi_spans));
+}
+
+long tw_trace_callback_curl_multi_add_handle(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument, *summary;
+	long idx;
+
+	if (ZEND_CALL_NUM_ARGS(data) < 2) {
+		return -1;
+	}
+
+	argument = ZEND_CALL_ARG(data, 2);
+
+	if (argument == NULL || Z_TYPE_P(argument) != IS_RESOURCE) {
+		return -1;
+	}
+
+	/* Adding a handle twice restarts its span */
+	tw_curl_multi_finish(argument TSRMLS_CC);
+
+	summary = tw_curl_handle_summary(argument TSRMLS_CC);
+
+	if (summary == NULL) {
+		return -1;
+	}
+
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(summary), 1 TSRMLS_CC);
+	tw_span_timer_start(idx TSRMLS_CC);
+	tw_span_map_store(TWG(curl_multi_spans), _Z_RES_HANDLE_P(argument), idx TSRMLS_CC);
+
+	return -1;
+}
+
+long tw_trace_callback_curl_multi_remove_handle(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument;
+
+	if (ZEND_CALL_NUM_ARGS(data) < 2) {
+		return -1;
+	}
+
+	argument = ZEND_CALL_ARG(data, 2);
+
+	if (argument != NULL && Z_TYPE_P(argument) == IS_RESOURCE) {
+		tw_curl_multi_finish(argument TSRMLS_CC);
+	}
+
+	return -1;
+}
+
+void tw_trace_return_curl_multi_info_read(hp_entry_t *entry, zend_execute_data *data, zval *return_value TSRMLS_DC)
+{
+	zval *handle;
+
+	if (return_value == NULL || Z_TYPE_P(return_value) != IS_ARRAY) {
+		return;
+	}
+
+	handle = zend_compat_hash_find_const(Z_ARRVAL_P(return_value), "handle", sizeof("handle")-1);
+
+	if (handle != NULL && Z_TYPE_P(handle) == IS_RESOURCE) {
+		tw_curl_multi_finish(handle TSRMLS_CC);
+	}
+}
+
+long tw_trace_callback_curl_multi_info_read(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	if (zend_hash_num_elements(TWG(curl_multi_spans)) > 0) {
+		TWG(pending_return_cb) = tw_trace_return_curl_multi_info_read;
+	}
+
+	return -1;
+}
+
+long tw_trace_callback_soap_client_dorequest(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	char *summary;
+	zval *argument;
+	long idx = -1;
+
+	if (ZEND_CALL_NUM_ARGS(data) < 2) {
+		return -1;
+	}
+
+	argument = ZEND_CALL_ARG(data, 2);
+
+	if (Z_TYPE_P(argument) != IS_STRING) {
+		return idx;
+	}
+
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "method", "POST", 1 TSRMLS_CC);
+	tw_span_annotate_string(idx, "service", "soap", 1 TSRMLS_CC);
+
+	return idx;
+}
+
+long tw_trace_callback_file_get_contents(char *symbol, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument = ZEND_CALL_ARG(data, 1);
+	char *summary;
+	long idx = -1;
+
+	if (Z_TYPE_P(argument) != IS_STRING) {
+		return idx;
+	}
+
+	if (strncmp(Z_STRVAL_P(argument), "http", 4) != 0) {
+		return idx;
+	}
+
+	idx = tw_span_create("http", 4 TSRMLS_CC);
+	tw_span_annotate_string(idx, "url", Z_STRVAL_P(argument), 1 TSRMLS_CC);
+
+	return idx;
+}
+
+/**
+ * Request init callback.
+ *
+ * Check if Tideways.php exists in extension_dir and load it
+ * in request init. This makes class \Tideways\Profiler available
+ * for usage.
+ */
+PHP_RINIT_FUNCTION(tideways)
+{
+	char *extension_dir;
+	char *profiler_file;
+	int profiler_file_len;
+
+	TWG(prepend_overwritten) = 0;
+	TWG(backtrace) = NULL;
+	TWG(transaction_name) = NULL;
+	TWG(transaction_function) = NULL;
+#if PHP_VERSION_ID >= 70000
+	ZVAL_NULL(&TWG(spans));
+	ZVAL_NULL(&TWG(stats_count));
+	ZVAL_NULL(&TWG(exception));
+#else
+	TWG(exception) = NULL;
+#endif
+
+	if (INI_INT("tideways.auto_prepend_library") == 0) {
+		return SUCCESS;
+	}
+
+	extension_dir  = INI_STR("extension_dir");
+	profiler_file_len = strlen(extension_dir) + strlen("Tideways.php") + 2;
+	profiler_file = emalloc(profiler_file_len);
+	snprintf(profiler_file, profiler_file_len, "%s/%s", extension_dir, "Tideways.php");
+
+	if (PG(open_basedir) && php_check_open_basedir_ex(profiler_file, 0 TSRMLS_CC)) {
+		efree(profiler_file);
+		return SUCCESS;
+	}
+
+	if (VCWD_ACCESS(profiler_file, F_OK) == 0) {
+		PG(auto_prepend_file) = profiler_file;
+		TWG(prepend_overwritten) = 1;
+	} else {
+		efree(profiler_file);
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * Request shutdown callback. Stop profiling and return.
+ */
+PHP_RSHUTDOWN_FUNCTION(tideways)
+{
+	hp_end(TSRMLS_C);
+
+	if (TWG(prepend_overwritten) == 1) {
+		efree(PG(auto_prepend_file));
+		PG(auto_prepend_file) = NULL;
+		TWG(prepend_overwritten) = 0;
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * Module info callback. Returns the Tideways version.
+ */
+PHP_MINFO_FUNCTION(tideways)
+{
+	char *extension_dir;
+	char *profiler_file;
+	int profiler_file_len;
+
+	php_info_print_table_start();
+	php_info_print_table_header(2, "tideways", TIDEWAYS_VERSION);
+
+	php_info_print_table_row(2, "Connection (tideways.connection)", INI_STR("tideways.connection"));
+	php_info_print_table_row(2, "UDP Connection (tideways.udp_connection)", INI_STR("tideways.udp_connection"));
+	php_info_print_table_row(2, "Default API Key (tideways.api_key)", INI_STR("tideways.api_key"));
+	php_info_print_table_row(2, "Default Sample-Rate (tideways.sample_rate)", INI_STR("tideways.sample_rate"));
+	php_info_print_table_row(2, "Framework Detection (tideways.framework)", INI_STR("tideways.framework"));
+	php_info_print_table_row(2, "Automatically Start (tideways.auto_start)", INI_INT("tideways.auto_start") ? "Yes": "No");
+	php_info_print_table_row(2, "Tideways Collect Mode (tideways.collect)", INI_STR("tideways.collect"));
+	php_info_print_table_row(2, "Tideways Monitoring Mode (tideways.monitor)", INI_STR("tideways.monitor"));
+	php_info_print_table_row(2, "Allowed Distributed Tracing Hosts (tideways.distributed_tracing_hosts)", INI_STR("tideways.distributed_tracing_hosts"));
+	php_info_print_table_row(2, "Load PHP Library (tideways.auto_prepend_library)", INI_INT("tideways.auto_prepend_library") ? "Yes": "No");
+
+	extension_dir  = INI_STR("extension_dir");
+	profiler_file_len = strlen(extension_dir) + strlen("Tideways.php") + 2;
+	profiler_file = emalloc(profiler_file_len);
+	snprintf(profiler_file, profiler_file_len, "%s/%s", extension_dir, "Tideways.php");
+
+	if (VCWD_ACCESS(profiler_file, F_OK) == 0) {
+		php_info_print_table_row(2, "Tideways.php found", "Yes");
+	} else {
+		php_info_print_table_row(2, "Tideways.php found", "No");
+	}
+
+	efree(profiler_file);
+
+	php_info_print_table_end();
+}
+
+
+/**
+ * ***************************************************
+ * COMMON HELPER FUNCTION DEFINITIONS AND LOCAL MACROS
+ * ***************************************************
+ */
+
+static void hp_register_constants(INIT_FUNC_ARGS)
+{
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_CPU", TIDEWAYS_FLAGS_CPU, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_MEMORY", TIDEWAYS_FLAGS_MEMORY, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_BUILTINS", TIDEWAYS_FLAGS_NO_BUILTINS, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_USERLAND", TIDEWAYS_FLAGS_NO_USERLAND, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_COMPILE", TIDEWAYS_FLAGS_NO_COMPILE, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_SPANS", TIDEWAYS_FLAGS_NO_SPANS, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_NO_HIERACHICAL", TIDEWAYS_FLAGS_NO_HIERACHICAL, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_ALLOCATIONS", TIDEWAYS_FLAGS_ALLOCATIONS, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_HISTOGRAMS", TIDEWAYS_FLAGS_HISTOGRAMS, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_CCT", TIDEWAYS_FLAGS_CCT, CONST_CS | CONST_PERSISTENT);
+	REGISTER_LONG_CONSTANT("XHPROF_FLAGS_TRACE", TIDEWAYS_FLAGS_TRACE, CONST_CS | CONST_PERSISTENT);
+}
+
+/**
+ * A hash function to calculate a 8-bit hash code for a function name.
+ * This is based on a small modification to 'zend_inline_hash_func' by summing
+ * up all bytes of the ulong returned by 'zend_inline_hash_func'.
+ *
+ * @param str, char *, string to be calculated hash code for.
+ *
+ * @author cjiang
+ */
+static inline uint8 hp_inline_hash(char * arKey)
+{
+	size_t nKeyLength = strlen(arKey);
+	register uint8 hash = 0;
+
+	/* variant with the hash unrolled eight times */
+	for (; nKeyLength >= 8; nKeyLength -= 8) {
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+		hash = ((hash << 5) + hash) + *arKey++;
+	}
+	switch (nKeyLength) {
+		case 7: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
+		case 6: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
+		case 5: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
+		case 4: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
+		case 3: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
+		case 2: hash = ((hash << 5) + hash) + *arKey++; /* fallthrough... */
+		case 1: hash = ((hash << 5) + hash) + *arKey++; break;
+		case 0: break;
+EMPTY_SWITCH_DEFAULT_CASE()
+	}
+	return hash;
+}
+
+/**
+ * Parse the list of ignored functions from the zval argument.
+ *
+ * @author mpal
+ */
+static void hp_parse_options_from_arg(zval *args TSRMLS_DC)
+{
+	zval *zresult = NULL;
+
+	hp_clean_profiler_options_state(TSRMLS_C);
+
+	TWG(max_edges) = INI_INT("tideways.max_edges");
+	TWG(max_bytes) = INI_INT("tideways.max_bytes");
+	TWG(n_plus_one_threshold) = INI_INT("tideways.n_plus_one_threshold");
+	TWG(trace_buffer_size) = INI_INT("tideways.trace_buffer_size");
+	TWG(retention_threshold) = INI_INT("tideways.retention_threshold");
+	TWG(retention_spans) = INI_INT("tideways.retention_spans");
+	TWG(overhead_budget) = INI_FLT("tideways.overhead_budget");
+	TWG(calibrate) = INI_INT("tideways.calibrate");
+	TWG(http_timings) = INI_INT("tideways.http_timings");
+
+	if (args == NULL) {
+		return;
+	}
+
+	zresult = hp_zval_at_key("n_plus_one_threshold", sizeof("n_plus_one_threshold"), args);
+
+	if (zresult != NULL && Z_TYPE_P(zresult) == IS_LONG) {
+		TWG(n_plus_one_threshold) = Z_LVAL_P(zresult);
+	}
+
+	zresult = hp_zval_at_key("trace_buffer_size", sizeof("trace_buffer_size"), args);
+
+	if (zresult != NULL && Z_TYPE_P(zresult) == IS_LONG) {
+		TWG(trace_buffer_size) = Z_LVAL_P(zresult);
+	}
+
+	zresult = hp_zval_at_key("calibrate", sizeof("calibrate"), args);
+
+	if (zresult != NULL) {
+		TWG(calibrate) = zend_is_true(zresult);
+	}
+
+	zresult = hp_zval_at_key("http_timings", sizeof("http_timings"), args);
+
+	if (zresult != NULL) {
+		TWG(http_timings) = zend_is_true(zresult);
+	}
+
+	zresult = hp_zval_at_key("max_edges", sizeof("max_edges"), args);
+
+	if (zresult != NULL && Z_TYPE_P(zresult) == IS_LONG) {
+		TWG(max_edges) = Z_LVAL_P(zresult);
+	}
+
+	zresult = hp_zval_at_key("max_bytes", sizeof("max_bytes"), args);
+
+	if (zresult != NULL && Z_TYPE_P(zresult) == IS_LONG) {
+		TWG(max_bytes) = Z_LVAL_P(zresult);
+	}
+
+	/* The main() and (overflow) edges always need their place */
+	if (TWG(max_edges) > 0 && TWG(max_edges) < 2) {
+		TWG(max_edges) = 2;
+	}
+
+	zresult = hp_zval_at_key("ignored_functions", sizeof("ignored_functions"), args);
+
+	if (zresult == NULL) {
+		zresult = hp_zval_at_key("functions", sizeof("functions"), args);
+		if (zresult != NULL) {
+			TWG(filtered_type) = 2;
+		}
+	} else {
+		TWG(filtered_type) = 1;
+	}
+
+	TWG(filtered_functions) = hp_function_map_create(hp_strings_in_zval(zresult));
+
+	zresult = hp_zval_at_key("transaction_function", sizeof("transaction_function"), args);
+
+	if (zresult != NULL && Z_TYPE_P(zresult) == IS_STRING) {
+		TWG(transaction_function) = zend_string_copy(Z_STR_P(zresult));
+	}
+
+	zresult = hp_zval_at_key("exception_function", sizeof("exception_function"), args);
+
+	if (zresult != NULL && Z_TYPE_P(zresult) == IS_STRING) {
+		TWG(exception_function) = zend_string_copy(Z_STR_P(zresult));
+	}
+}
+
+static void hp_exception_function_clear(TSRMLS_D) {
+	if (TWG(exception_function) != NULL) {
+		zend_string_release(TWG(exception_function));
+		TWG(exception_function) = NULL;
+	}
+
+#if PHP_VERSION_ID >= 70000
+	hp_ptr_dtor(&TWG(exception));
+	ZVAL_NULL(&TWG(exception));
+#else 
+	if (TWG(exception) != NULL) {
+		hp_ptr_dtor(TWG(exception));
+		TWG(exception) = NULL;
+	}
+#endif
+}
+
+static void hp_transaction_function_clear(TSRMLS_D) {
+	if (TWG(transaction_function)) {
+		zend_string_release(TWG(transaction_function));
+		TWG(transaction_function) = NULL;
+	}
+}
+
+static inline hp_function_map *hp_function_map_create(char **names)
+{
+	hp_function_map *map;
+	int i = 0;
+
+	if (names == NULL) {
+		return NULL;
+	}
+
+	map = emalloc(sizeof(hp_function_map));
+	map->names = names;
+
+	memset(map->filter, 0, TIDEWAYS_FILTERED_FUNCTION_SIZE);
+
+	for(; names[i] != NULL; i++) {
+		char *str  = names[i];
+		uint8 hash = hp_inline_hash(str);
+		int   idx  = INDEX_2_BYTE(hash);
+		map->filter[idx] |= INDEX_2_BIT(hash);
+	}
+
+	return map;
+}
+
+static inline void hp_function_map_clear(hp_function_map *map) {
+	if (map == NULL) {
+		return;
+	}
+
+	hp_array_del(map->names);
+	map->names = NULL;
+
+	memset(map->filter, 0, TIDEWAYS_FILTERED_FUNCTION_SIZE);
+	efree(map);
+}
+
+static inline int hp_function_map_exists(hp_function_map *map, uint8 hash_code, char *curr_func)
+{
+	if (hp_function_map_filter_collision(map, hash_code)) {
+		int i = 0;
+		for (; map->names[i] != NULL; i++) {
+			char *name = map->names[i];
+			if (strcmp(curr_func, name) == 0) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static inline int hp_function_map_filter_collision(hp_function_map *map, uint8 hash)
+{
+	uint8 mask = INDEX_2_BIT(hash);
+	return map->filter[INDEX_2_BYTE(hash)] & mask;
+}
+
+#if PHP_VERSION_ID >= 70000
+static inline void hp_free_trace_cb(zval *zv) {
+	efree(Z_PTR_P(zv));
+}
+#else
+static inline void hp_free_trace_cb(void *p) {}
+#endif
+
+void hp_init_trace_callbacks(TSRMLS_D)
+{
+	tw_trace_callback cb;
+	char redis_method[64];
+	int i;
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
+		return;
+	}
+
+	TWG(trace_callbacks) = NULL;
+	TWG(trace_watch_callbacks) = NULL;
+	TWG(span_cache) = NULL;
+	TWG(sql_repeats) = NULL;
+	TWG(sql_statements) = NULL;
+	TWG(pdo_statements) = NULL;
+	TWG(pdo_fetches) = NULL;
+	TWG(span_counts) = NULL;
+	TWG(curl_handles) = NULL;
+	TWG(curl_multi_spans) = NULL;
+	TWG(mongo_objects) = NULL;
+	TWG(redis_batches) = NULL;
+
+	ALLOC_HASHTABLE(TWG(trace_callbacks));
+	zend_hash_init(TWG(trace_callbacks), 255, NULL, hp_free_trace_cb, 0);
+
+	ALLOC_HASHTABLE(TWG(span_cache));
+	zend_hash_init(TWG(span_cache), 255, NULL, NULL, 0);
+
+	ALLOC_HASHTABLE(TWG(sql_repeats));
+	zend_hash_init(TWG(sql_repeats), 32, NULL, hp_free_trace_cb, 0);
+
+	ALLOC_HASHTABLE(TWG(sql_statements));
+	zend_hash_init(TWG(sql_statements), 32, NULL, ZVAL_PTR_DTOR, 0);
+
+	ALLOC_HASHTABLE(TWG(pdo_statements));
+	zend_hash_init(TWG(pdo_statements), 32, NULL, NULL, 0);
+
+	ALLOC_HASHTABLE(TWG(pdo_fetches));
+	zend_hash_init(TWG(pdo_fetches), 16, NULL, hp_free_trace_cb, 0);
+
+	ALLOC_HASHTABLE(TWG(span_counts));
+	zend_hash_init(TWG(span_counts), 16, NULL, hp_free_trace_cb, 0);
+
+	ALLOC_HASHTABLE(TWG(curl_handles));
+	zend_hash_init(TWG(curl_handles), 32, NULL, ZVAL_PTR_DTOR, 0);
+	ALLOC_HASHTABLE(TWG(curl_multi_spans));
+	zend_hash_init(TWG(curl_multi_spans), 8, NULL, NULL, 0);
+
+	ALLOC_HASHTABLE(TWG(mongo_objects));
+	zend_hash_init(TWG(mongo_objects), 32, NULL, hp_free_trace_cb, 0);
+
+	ALLOC_HASHTABLE(TWG(redis_batches));
+	zend_hash_init(TWG(redis_batches), 8, NULL, hp_free_trace_cb, 0);
+
+	cb = tw_trace_callback_file_get_contents;
+	register_trace_callback("file_get_contents", cb);
+
+	cb = tw_trace_callback_php_call;
+	register_trace_callback("session_start", cb);
+	// Symfony
+	register_trace_callback("Symfony\\Component\\HttpKernel\\Kernel::boot", cb);
+	register_trace_callback("Symfony\\Component\\EventDispatcher\\ContainerAwareEventDispatcher::lazyLoad", cb);
+	register_trace_callback("Symfony\\Component\\HttpKernel\\HttpCache\\HttpCache::lock", cb);
+	register_trace_callback("Symfony\\Component\\HttpKernel\\HttpCache\\HttpCache::forward", cb);
+	// Wordpress
+	register_trace_callback("get_sidebar", cb);
+	register_trace_callback("get_header", cb);
+	register_trace_callback("get_footer", cb);
+	register_trace_callback("load_textdomain", cb);
+	register_trace_callback("setup_theme", cb);
+	// Doctrine
+	register_trace_callback("Doctrine\\ORM\\EntityManager::flush", cb);
+	register_trace_callback("Doctrine\\ODM\\CouchDB\\DocumentManager::flush", cb);
+	// Magento
+	register_trace_callback("Mage_Core_Model_App::_initModules", cb);
+	register_trace_callback("Mage_Core_Model_Config::loadModules", cb);
+	register_trace_callback("Mage_Core_Model_Config::loadDb", cb);
+	// Smarty&Twig Compiler
+	register_trace_callback("Smarty_Internal_TemplateCompilerBase::compileTemplate", cb);
+	register_trace_callback("Twig_Environment::compileSource", cb);
+	// Shopware Assets (very special, do we really need it?)
+	register_trace_callback("JSMin::minify", cb);
+	register_trace_callback("Less_Parser::getCss", cb);
+	// Laravel (4+5)
+	register_trace_callback("Illuminate\\Foundation\\Application::boot", cb);
+	register_trace_callback("Illuminate\\Foundation\\Application::dispatch", cb);
+	// Silex
+	register_trace_callback("Silex\\Application::mount", cb);
+
+	cb = tw_trace_callback_presta_controller;
+	register_trace_callback("ControllerCore::run", cb); // PrestaShop 1.6
+
+	cb = tw_trace_callback_doctrine_persister;
+	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::load", cb);
+	register_trace_callback("Doctrine\\ORM\\Persisters\\BasicEntityPersister::loadAll", cb);
+	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::load", cb);
+	register_trace_callback("Doctrine\\ORM\\Persisters\\Entity\\BasicEntityPersister::loadAll", cb);
+
+	cb = tw_trace_callback_doctrine_query;
+	register_trace_callback("Doctrine\\ORM\\AbstractQuery::execute", cb);
+
+	cb = tw_trace_callback_doctrine_couchdb_request;
+	register_trace_callback("Doctrine\\CouchDB\\HTTP\\SocketClient::request", cb);
+	register_trace_callback("Doctrine\\CouchDB\\HTTP\\StreamClient::request", cb);
+
+	cb = tw_trace_callback_curl_exec;
+	register_trace_callback("curl_exec", cb);
+
+	cb = tw_trace_callback_curl_init;
+	register_trace_callback("curl_init", cb);
+	register_trace_callback("curl_copy_handle", cb);
+
+	cb = tw_trace_callback_curl_setopt;
+	register_trace_callback("curl_setopt", cb);
+	register_trace_callback("curl_setopt_array", cb);
+
+	cb = tw_trace_callback_curl_multi_add_handle;
+	register_trace_callback("curl_multi_add_handle", cb);
+
+	cb = tw_trace_callback_curl_multi_remove_handle;
+	register_trace_callback("curl_multi_remove_handle", cb);
+
+	cb = tw_trace_callback_curl_multi_info_read;
+	register_trace_callback("curl_multi_info_read", cb);
+
+	cb = tw_trace_callback_sql_functions;
+	register_trace_callback("PDO::exec", cb);
+	register_trace_callback("mysql_query", cb);
+	register_trace_callback("mysqli_query", cb);
+	register_trace_callback("mysqli::query", cb);
+
+	cb = tw_trace_callback_mysqli_prepare;
+	register_trace_callback("mysqli::prepare", cb);
+	register_trace_callback("mysqli_prepare", cb);
+
+	cb = tw_trace_callback_mysqli_stmt_prepare;
+	register_trace_callback("mysqli_stmt_prepare", cb);
+	register_trace_callback("mysqli_stmt::prepare", cb);
+
+	cb = tw_trace_callback_mysqli_stmt_close;
+	register_trace_callback("mysqli_stmt_close", cb);
+	register_trace_callback("mysqli_stmt::close", cb);
+
+	cb = tw_trace_callback_mysqli_stmt_init;
+	register_trace_callback("mysqli_stmt_init", cb);
+	register_trace_callback("mysqli::stmt_init", cb);
+
+	cb = tw_trace_callback_mysqli_stmt_construct;
+	register_trace_callback("mysqli_stmt::__construct", cb);
+
+	cb = tw_trace_callback_sql_commit;
+	register_trace_callback("PDO::commit", cb);
+	register_trace_callback("mysqli::commit", cb);
+	register_trace_callback("mysqli_commit", cb);
+
+	cb = tw_trace_callback_pdo_query;
+	register_trace_callback("PDO::query", cb);
+	register_trace_callback("PDO::prepare", cb);
+
+	cb = tw_trace_callback_pdo_stmt_execute;
+	register_trace_callback("PDOStatement::execute", cb);
+
+	cb = tw_trace_callback_pdo_stmt_fetch;
+	register_trace_callback("PDOStatement::fetch", cb);
+	register_trace_callback("PDOStatement::fetchAll", cb);
+	register_trace_callback("PDOStatement::fetchColumn", cb);
+	register_trace_callback("PDOStatement::fetchObject", cb);
+
+	cb = tw_trace_callback_mysqli_stmt_execute;
+	register_trace_callback("mysqli_stmt_execute", cb);
+	register_trace_callback("mysqli_stmt::execute", cb);
+
+	cb = tw_trace_callback_pgsql_query;
+	register_trace_callback("pg_query", cb);
+	register_trace_callback("pg_query_params", cb);
+
+	cb = tw_trace_callback_pgsql_prepare;
+	register_trace_callback("pg_prepare", cb);
+	register_trace_callback("pg_send_prepare", cb);
+
+	cb = tw_trace_callback_pgsql_execute;
+	register_trace_callback("pg_execute", cb);
+	register_trace_callback("pg_send_execute", cb);
+
+	cb = tw_trace_callback_event_dispatchers;
+	register_trace_callback("Doctrine\\Common\\EventManager::dispatchEvent", cb);
+	register_trace_callback("Enlight_Event_EventManager::filter", cb);
+	register_trace_callback("Enlight_Event_EventManager::notify", cb);
+	register_trace_callback("Enlight_Event_EventManager::notifyUntil", cb);
+	register_trace_callback("Zend\\EventManager\\EventManager::trigger", cb);
+	register_trace_callback("do_action", cb);
+	register_trace_callback("drupal_alter", cb);
+	register_trace_callback("Mage::dispatchEvent", cb);
+	register_trace_callback("Magento\\Framework\\Event\\Manager::dispatch", cb);
+	register_trace_callback("Symfony\\Component\\EventDispatcher\\EventDispatcher::dispatch", cb);
+	register_trace_callback("Illuminate\\Events\\Dispatcher::fire", cb);
+	register_trace_callback("HookCore::exec", cb); // PrestaShop 1.6
+
+	cb = tw_trace_callback_event_dispatchers2;
+	register_trace_callback("HookCore::coreCallHook", cb); // PrestaShop 1.6
+	register_trace_callback("TYPO3\\Flow\\SignalSlot\\Dispatcher::dispatch", cb);
+	register_trace_callback("TYPO3\\CMS\\Extbase\\SignalSlot\\Dispatcher::dispatch", cb);
+
+	cb = tw_trace_callback_twig_template;
+	register_trace_callback("Twig_Template::render", cb);
+	register_trace_callback("Twig_Template::display", cb);
+
+	cb = tw_trace_callback_smarty3_template;
+	register_trace_callback("Smarty_Internal_TemplateBase::fetch", cb);
+
+	cb = tw_trace_callback_fastcgi_finish_request;
+	register_trace_callback("fastcgi_finish_request", cb);
+
+	cb = tw_trace_callback_soap_client_dorequest;
+	register_trace_callback("SoapClient::__doRequest", cb);
+
+	cb = tw_trace_callback_view_class;
+	register_trace_callback("Mage_Core_Block_Abstract::toHtml", cb);
+	register_trace_callback("Magento\\Framework\\View\\Element\\AbstractBlock::toHtml", cb);
+	register_trace_callback("TYPO3\\Flow\\Mvc\\View\\JsonView::render", cb);
+	register_trace_callback("TYPO3\\Fluid\\View\\AbstractTemplateView::render", cb);
+	register_trace_callback("TYPO3\\CMS\\Extbase\\Mvc\\View\\JsonView::render", cb);
+	register_trace_callback("TYPO3\\CMS\\Extbase\\Mvc\\View\\NotFoundView::render", cb);
+	register_trace_callback("TYPO3\\CMS\\Fluid\\View\\AbstractTemplateView::render", cb);
+
+	cb = tw_trace_callback_view_engine;
+	register_trace_callback("Zend_View_Abstract::render", cb);
+	register_trace_callback("Illuminate\\View\\Engines\\CompilerEngine::get", cb);
+	register_trace_callback("Smarty::fetch", cb);
+	register_trace_callback("load_template", cb);
+
+	cb = tw_trace_callback_zend1_dispatcher_families_tx;
+	register_trace_callback("Enlight_Controller_Action::dispatch", cb);
+	register_trace_callback("Mage_Core_Controller_Varien_Action::dispatch", cb);
+	register_trace_callback("Magento\\Framework\\App\\Action\\Action::dispatch", cb);
+	register_trace_callback("Zend_Controller_Action::dispatch", cb);
+	register_trace_callback("Illuminate\\Routing\\Controller::callAction", cb);
+
+	cb = tw_trace_callback_symfony_resolve_arguments_tx;
+	register_trace_callback("Symfony\\Component\\HttpKernel\\Controller\\ControllerResolver::getArguments", cb);
+
+	cb = tw_trace_callback_oxid_tx;
+	register_trace_callback("oxShopControl::_process", cb);
+
+	// Different versions of Memcache Extension have either MemcachePool or Memcache class, @todo investigate
+	cb = tw_trace_callback_memcache;
+	register_trace_callback("MemcachePool::get", cb);
+	register_trace_callback("MemcachePool::set", cb);
+	register_trace_callback("MemcachePool::delete", cb);
+	register_trace_callback("MemcachePool::flush", cb);
+	register_trace_callback("MemcachePool::replace", cb);
+	register_trace_callback("MemcachePool::increment", cb);
+	register_trace_callback("MemcachePool::decrement", cb);
+	register_trace_callback("Memcache::get", cb);
+	register_trace_callback("Memcache::set", cb);
+	register_trace_callback("Memcache::delete", cb);
+	register_trace_callback("Memcache::flush", cb);
+	register_trace_callback("Memcache::replace", cb);
+	register_trace_callback("Memcache::increment", cb);
+	register_trace_callback("Memcache::decrement", cb);
+
+	cb = tw_trace_callback_memcached;
+	register_trace_callback("Memcached::get", cb);
+	register_trace_callback("Memcached::getByKey", cb);
+	register_trace_callback("Memcached::getMulti", cb);
+	register_trace_callback("Memcached::getMultiByKey", cb);
+	register_trace_callback("Memcached::set", cb);
+	register_trace_callback("Memcached::setByKey", cb);
+	register_trace_callback("Memcached::setMulti", cb);
+	register_trace_callback("Memcached::setMultiByKey", cb);
+	register_trace_callback("Memcached::add", cb);
+	register_trace_callback("Memcached::addByKey", cb);
+	register_trace_callback("Memcached::replace", cb);
+	register_trace_callback("Memcached::replaceByKey", cb);
+	register_trace_callback("Memcached::cas", cb);
+	register_trace_callback("Memcached::casByKey", cb);
+	register_trace_callback("Memcached::append", cb);
+	register_trace_callback("Memcached::prepend", cb);
+	register_trace_callback("Memcached::touch", cb);
+	register_trace_callback("Memcached::delete", cb);
+	register_trace_callback("Memcached::deleteByKey", cb);
+	register_trace_callback("Memcached::deleteMulti", cb);
+	register_trace_callback("Memcached::deleteMultiByKey", cb);
+	register_trace_callback("Memcached::increment", cb);
+	register_trace_callback("Memcached::incrementByKey", cb);
+	register_trace_callback("Memcached::decrement", cb);
+	register_trace_callback("Memcached::decrementByKey", cb);
+	register_trace_callback("Memcached::flush", cb);
+
+	cb = tw_trace_callback_pheanstalk;
+	register_trace_callback("Pheanstalk_Pheanstalk::put", cb);
+	register_trace_callback("Pheanstalk\\Pheanstalk::put", cb);
+
+	cb = tw_trace_callback_phpampqlib;
+	register_trace_callback("PhpAmqpLib\\Channel\\AMQPChannel::basic_publish", cb);
+
+	cb = tw_trace_callback_mongo_collection;
+	register_trace_callback("MongoCollection::find", cb);
+	register_trace_callback("MongoCollection::findOne", cb);
+	register_trace_callback("MongoCollection::findAndModify", cb);
+	register_trace_callback("MongoCollection::insert", cb);
+	register_trace_callback("MongoCollection::remove", cb);
+	register_trace_callback("MongoCollection::save", cb);
+	register_trace_callback("MongoCollection::update", cb);
+	register_trace_callback("MongoCollection::group", cb);
+	register_trace_callback("MongoCollection::distinct", cb);
+	register_trace_callback("MongoCollection::batchInsert", cb);
+	register_trace_callback("MongoCollection::aggregate", cb);
+	register_trace_callback("MongoCollection::aggregateCursor", cb);
+
+	cb = tw_trace_callback_mongo_cursor_next;
+	register_trace_callback("MongoCursor::next", cb);
+	register_trace_callback("MongoCursor::hasNext", cb);
+	register_trace_callback("MongoCursor::getNext", cb);
+	register_trace_callback("MongoCommandCursor::next", cb);
+	register_trace_callback("MongoCommandCursor::hasNext", cb);
+	register_trace_callback("MongoCommandCursor::getNext", cb);
+
+	cb = tw_trace_callback_mongo_cursor_construct;
+	register_trace_callback("MongoCursor::__construct", cb);
+	register_trace_callback("MongoCommandCursor::__construct", cb);
+
+	cb = tw_trace_callback_mongo_cursor_io;
+	register_trace_callback("MongoCursor::rewind", cb);
+	register_trace_callback("MongoCursor::doQuery", cb);
+	register_trace_callback("MongoCursor::count", cb);
+
+	cb = tw_trace_callback_predis_call;
+	register_trace_callback("Predis\\Client::__call", cb);
+
+	cb = tw_trace_callback_redis_call;
+	for (i = 0; tw_redis_commands[i] != NULL; i++) {
+		snprintf(redis_method, sizeof(redis_method), "Redis::%s", tw_redis_commands[i]);
+		register_trace_callback_len(redis_method, strlen(redis_method), cb);
+		snprintf(redis_method, sizeof(redis_method), "RedisCluster::%s", tw_redis_commands[i]);
+		register_trace_callback_len(redis_method, strlen(redis_method), cb);
+	}
+
+	cb = tw_trace_callback_redis_multi;
+	register_trace_callback("Redis::multi", cb);
+	register_trace_callback("Redis::pipeline", cb);
+	register_trace_callback("RedisCluster::multi", cb);
+
+	cb = tw_trace_callback_redis_exec;
+	register_trace_callback("Redis::exec", cb);
+	register_trace_callback("Redis::discard", cb);
+	register_trace_callback("RedisCluster::exec", cb);
+	register_trace_callback("RedisCluster::discard", cb);
+
+	TWG(gc_runs) = GC_G(gc_runs);
+	TWG(gc_collected) = GC_G(collected);
+	TWG(compile_count) = 0;
+	TWG(compile_wt) = 0;
+}
+
+
+/**
+ * Reset the collected profile data, also after calibrating.
+ */
+static void hp_init_profile_data(TSRMLS_D)
+{
+#if PHP_VERSION_ID >= 70000
+	hp_ptr_dtor(&TWG(stats_count));
+	array_init(&TWG(stats_count));
+
+	hp_ptr_dtor(&TWG(spans));
+	array_init(&TWG(spans));
+#else
+
+	if (TWG(stats_count)) {
+		hp_ptr_dtor(TWG(stats_count));
+	}
+
+	_ALLOC_INIT_ZVAL(TWG(stats_count));
+	array_init(TWG(stats_count));
+
+	if (TWG(spans)) {
+		hp_ptr_dtor(TWG(spans));
+	}
+
+	_ALLOC_INIT_ZVAL(TWG(spans));
+	array_init(TWG(spans));
+#endif
+
+	TWG(stats_edges) = 0;
+	TWG(stats_bytes) = 0;
+	TWG(stats_overflow) = 0;
+	TWG(retention_reason) = TIDEWAYS_RETENTION_OFF;
+	TWG(overhead_tsc) = 0;
+
+	tw_span_breakdown_clear(TSRMLS_C);
+
+	tw_histograms_clear(TSRMLS_C);
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_HISTOGRAMS) {
+		ALLOC_HASHTABLE(TWG(histograms));
+		zend_hash_init(TWG(histograms), 64, NULL, hp_free_trace_cb, 0);
+	}
+
+	tw_cct_clear(TSRMLS_C);
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CCT) {
+		tw_cct_init(TSRMLS_C);
+	}
+
+	tw_trace_buffer_clear(TSRMLS_C);
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_TRACE) {
+		tw_trace_buffer_init(TSRMLS_C);
+	}
+}
+
+/**
+ * Initialize profiler state
+ *
+ * @author kannan, veeve
+ */
+void hp_init_profiler_state(TSRMLS_D)
+{
+	if (!TWG(ever_enabled)) {
+		TWG(ever_enabled) = 1;
+		TWG(entries) = NULL;
+	}
+
+	hp_init_profile_data(TSRMLS_C);
+
+	hp_init_trace_callbacks(TSRMLS_C);
+}
+
+/**
+ * Cleanup profiler state
+ *
+ * @author kannan, veeve
+ */
+void hp_clean_profiler_state(TSRMLS_D)
+{
+#if PHP_VERSION_ID >= 70000
+	hp_ptr_dtor(&TWG(stats_count));
+	ZVAL_NULL(&TWG(stats_count));
+	hp_ptr_dtor(&TWG(spans));
+	ZVAL_NULL(&TWG(spans));
+#else
+	if (TWG(stats_count)) {
+		hp_ptr_dtor(TWG(stats_count));
+		TWG(stats_count) = NULL;
+	}
+	if (TWG(spans)) {
+		hp_ptr_dtor(TWG(spans));
+		TWG(spans) = NULL;
+	}
+#endif
+
+	TWG(entries) = NULL;
+	TWG(ever_enabled) = 0;
+
+	if (TWG(span_stack)) {
+		efree(TWG(span_stack));
+		TWG(span_stack) = NULL;
+	}
+	TWG(span_stack_depth) = 0;
+	TWG(span_stack_size) = 0;
+
+	tw_span_breakdown_clear(TSRMLS_C);
+	tw_histograms_clear(TSRMLS_C);
+	tw_cct_clear(TSRMLS_C);
+	tw_trace_buffer_clear(TSRMLS_C);
+
+	hp_clean_profiler_options_state(TSRMLS_C);
+}
+
+static void hp_transaction_name_clear(TSRMLS_D)
+{
+	if (TWG(transaction_name)) {
+		zend_string_release(TWG(transaction_name));
+		TWG(transaction_name) = NULL;
+	}
+}
+
+static void hp_clean_profiler_options_state(TSRMLS_D)
+{
+	hp_function_map_clear(TWG(filtered_functions));
+	TWG(filtered_functions) = NULL;
+
+	hp_exception_function_clear(TSRMLS_C);
+	hp_transaction_function_clear(TSRMLS_C);
+	hp_transaction_name_clear(TSRMLS_C);
+
+	if (TWG(trace_callbacks)) {
+		zend_hash_destroy(TWG(trace_callbacks));
+		FREE_HASHTABLE(TWG(trace_callbacks));
+		TWG(trace_callbacks) = NULL;
+	}
+
+	if (TWG(trace_watch_callbacks)) {
+		zend_hash_destroy(TWG(trace_watch_callbacks));
+		FREE_HASHTABLE(TWG(trace_watch_callbacks));
+		TWG(trace_watch_callbacks) = NULL;
+	}
+
+	if (TWG(span_cache)) {
+		zend_hash_destroy(TWG(span_cache));
+		FREE_HASHTABLE(TWG(span_cache));
+		TWG(span_cache) = NULL;
+	}
+
+	if (TWG(sql_repeats)) {
+		zend_hash_destroy(TWG(sql_repeats));
+		FREE_HASHTABLE(TWG(sql_repeats));
+		TWG(sql_repeats) = NULL;
+	}
+
+	if (TWG(sql_statements)) {
+		zend_hash_destroy(TWG(sql_statements));
+		FREE_HASHTABLE(TWG(sql_statements));
+		TWG(sql_statements) = NULL;
+	}
+
+	if (TWG(pdo_statements)) {
+		zend_hash_destroy(TWG(pdo_statements));
+		FREE_HASHTABLE(TWG(pdo_statements));
+		TWG(pdo_statements) = NULL;
+	}
+
+	if (TWG(pdo_fetches)) {
+		zend_hash_destroy(TWG(pdo_fetches));
+		FREE_HASHTABLE(TWG(pdo_fetches));
+		TWG(pdo_fetches) = NULL;
+	}
+
+	if (TWG(span_counts)) {
+		zend_hash_destroy(TWG(span_counts));
+		FREE_HASHTABLE(TWG(span_counts));
+		TWG(span_counts) = NULL;
+	}
+
+	if (TWG(curl_handles)) {
+		zend_hash_destroy(TWG(curl_handles));
+		FREE_HASHTABLE(TWG(curl_handles));
+		TWG(curl_handles) = NULL;
+	}
+
+	if (TWG(curl_multi_spans)) {
+		zend_hash_destroy(TWG(curl_multi_spans));
+		FREE_HASHTABLE(TWG(curl_multi_spans));
+		TWG(curl_multi_spans) = NULL;
+	}
+
+	if (TWG(mongo_objects)) {
+		zend_hash_destroy(TWG(mongo_objects));
+		FREE_HASHTABLE(TWG(mongo_objects));
+		TWG(mongo_objects) = NULL;
+	}
+
+	if (TWG(redis_batches)) {
+		zend_hash_destroy(TWG(redis_batches));
+		FREE_HASHTABLE(TWG(redis_batches));
+		TWG(redis_batches) = NULL;
+	}
+}
+
+/*
+ * Start profiling - called just before calling the actual function
+ * NOTE:  PLEASE MAKE SURE TSRMLS_CC IS AVAILABLE IN THE CONTEXT
+ *        OF THE FUNCTION WHERE THIS MACRO IS CALLED.
+ *        TSRMLS_CC CAN BE MADE AVAILABLE VIA TSRMLS_DC IN THE
+ *        CALLING FUNCTION OR BY CALLING TSRMLS_FETCH()
+ *        TSRMLS_FETCH() IS RELATIVELY EXPENSIVE.
+ */
+#define BEGIN_PROFILING(entries, symbol, profile_curr, execute_data)			\
+	do {																		\
+		/* Use a hash code to filter most of the string comparisons. */			\
+		uint8 hash_code  = hp_inline_hash(symbol);								\
+		profile_curr = !hp_filter_entry(hash_code, symbol TSRMLS_CC);			\
+		if (profile_curr) {														\
+			uint64 overhead_start = cycle_timer(TSRMLS_C);						\
+			hp_entry_t *cur_entry = hp_fast_alloc_hprof_entry(TSRMLS_C);		\
+			(cur_entry)->hash_code = hash_code;									\
+			(cur_entry)->name_hprof = symbol;									\
+			(cur_entry)->prev_hprof = (*(entries));								\
+			(cur_entry)->span_id = -1;											\
+			(cur_entry)->return_cb = NULL;										\
+			(cur_entry)->cct_node = -1;											\
+			hp_mode_hier_beginfn_cb((entries), (cur_entry), execute_data TSRMLS_CC);			\
+			TWG(overhead_tsc) += (cur_entry)->tsc_start - overhead_start;		\
+			/* Update entries linked list */									\
+			(*(entries)) = (cur_entry);											\
+		}																		\
+	} while (0)
+
+/*
+ * Stop profiling - called just after calling the actual function
+ * NOTE:  PLEASE MAKE SURE TSRMLS_CC IS AVAILABLE IN THE CONTEXT
+ *        OF THE FUNCTION WHERE THIS MACRO IS CALLED.
+ *        TSRMLS_CC CAN BE MADE AVAILABLE VIA TSRMLS_DC IN THE
+ *        CALLING FUNCTION OR BY CALLING TSRMLS_FETCH()
+ *        TSRMLS_FETCH() IS RELATIVELY EXPENSIVE.
+ */
+#define END_PROFILING(entries, profile_curr, data)							\
+	do {																	\
+		if (profile_curr) {													\
+			uint64 overhead_start = cycle_timer(TSRMLS_C);					\
+			hp_entry_t *cur_entry;											\
+			hp_mode_hier_endfn_cb((entries), data TSRMLS_CC);				\
+			cur_entry = (*(entries));										\
+			/* Free top entry and update entries linked list */				\
+			(*(entries)) = (*(entries))->prev_hprof;						\
+			hp_fast_free_hprof_entry(cur_entry TSRMLS_CC);					\
+			TWG(overhead_tsc) += cycle_timer(TSRMLS_C) - overhead_start;	\
+		}																	\
+	} while (0)
+
+/**
+ * Returns formatted function name
+ *
+ * @param  entry        hp_entry
+ * @param  result_buf   ptr to result buf
+ * @param  result_len   max size of result buf
+ * @return total size of the function name returned in result_buf
+ * @author veeve
+ */
+size_t hp_get_entry_name(hp_entry_t  *entry, char *result_buf, size_t result_len)
+{
+	/* Validate result_len */
+	if (result_len <= 1) {
+		/* Insufficient result_bug. Bail! */
+		return 0;
+	}
+
+	/* Add '@recurse_level' if required */
+	/* NOTE:  Dont use snprintf's return val as it is compiler dependent */
+	if (entry->rlvl_hprof) {
+		snprintf(
+			result_buf,
+			result_len,
+			"%s@%d",
+			entry->name_hprof,
+			entry->rlvl_hprof
+		);
+	} else {
+		strncat(
+			result_buf,
+			entry->name_hprof,
+			result_len
+		);
+	}
+
+	/* Force null-termination at MAX */
+	result_buf[result_len - 1] = '\0';
+
+	return strlen(result_buf);
+}
+
+/**
+ * Check if this entry should be filtered (positive or negative), first with a
+ * conservative Bloomish filter then with an exact check against the function
+ * names.
+ *
+ * @author mpal
+ */
+static inline int hp_filter_entry(uint8 hash_code, char *curr_func TSRMLS_DC)
+{
+	int exists;
+
+	/* First check if ignoring functions is enabled */
+	if (TWG(filtered_functions) == NULL || TWG(filtered_type) == 0) {
+		return 0;
+	}
+
+	exists = hp_function_map_exists(TWG(filtered_functions), hash_code, curr_func);
+
+	if (TWG(filtered_type) == 2) {
+		// always include main() in profiling result.
+		return (strcmp(curr_func, ROOT_SYMBOL) == 0)
+			? 0
+			: abs(1 - exists);
+	}
+
+	return exists;
+}
+
+/**
+ * Build a caller qualified name for a callee.
+ *
+ * For example, if A() is caller for B(), then it returns "A==>B".
+ * Recursive invokations are denoted with @<n> where n is the recursion
+ * depth.
+ *
+ * For example, "foo==>foo@1", and "foo@2==>foo@3" are examples of direct
+ * recursion. And  "bar==>foo@1" is an example of an indirect recursive
+ * call to foo (implying the foo() is on the call stack some levels
+ * above).
+ *
+ * @author kannan, veeve
+ */
+size_t hp_get_function_stack(hp_entry_t *entry, int level, char *result_buf, size_t result_len)
+{
+	size_t         len = 0;
+
+	if (!entry->prev_hprof || (level <= 1)) {
+		return hp_get_entry_name(entry, result_buf, result_len);
+	}
+
+	len = hp_get_function_stack(entry->prev_hprof, level - 1, result_buf, result_len);
+
+	/* Append the delimiter */
+# define    HP_STACK_DELIM        "==>"
+# define    HP_STACK_DELIM_LEN    (sizeof(HP_STACK_DELIM) - 1)
+
+	if (result_len < (len + HP_STACK_DELIM_LEN)) {
+		return len;
+	}
+
+	if (len) {
+		strncat(result_buf + len, HP_STACK_DELIM, result_len - len);
+		len += HP_STACK_DELIM_LEN;
+	}
+
+# undef     HP_STACK_DELIM_LEN
+# undef     HP_STACK_DELIM
+
+	return len + hp_get_entry_name(entry, result_buf + len, result_len - len);
+}
+
+/**
+ * Takes an input of the form /a/b/c/d/foo.php and returns
+ * a pointer to one-level directory and basefile name
+ * (d/foo.php) in the same string.
+ */
+static char *hp_get_base_filename(char *filename)
+{
+	char *ptr;
+	int   found = 0;
+
+	if (!filename)
+		return "";
+
+	/* reverse search for "/" and return a ptr to the next char */
+	for (ptr = filename + strlen(filename) - 1; ptr >= filename; ptr--) {
+		if (*ptr == '/') {
+			found++;
+		}
+		if (found == 2) {
+			return ptr + 1;
+		}
+	}
+
+	/* no "/" char found, so return the whole string */
+	return filename;
+}
+
+/**
+ * Summarize an URL as scheme://host[:port]/path in a single pass, without
+ * credentials, query string and fragment. Anything without a scheme is
+ * summarized as an empty string.
+ */
+static char *hp_get_file_summary(char *filename, int filename_len TSRMLS_DC)
+{
+	char *end = filename + filename_len;
+	char *host, *host_end, *path_end, *p, *ret;
+	size_t scheme_len, host_len, path_len, len;
+
+	for (p = filename; p < end && (isalnum(*p) || *p == '+' || *p == '-' || *p == '.'); p++);
+
+	if (p == filename || end - p < 3 || memcmp(p, "://", 3) != 0) {
+		return estrdup("");
+	}
+
+	scheme_len = p - filename;
+	host = host_end = p + 3;
+
+	/* Authority ends at the path, query or fragment, credentials are dropped */
+	for (; host_end < end && *host_end != '/' && *host_end != '?' && *host_end != '#'; host_end++) {
+		if (*host_end == '@') {
+			host = host_end + 1;
+		}
+	}
+
+	for (path_end = host_end; path_end < end && *path_end != '?' && *path_end != '#'; path_end++);
+
+	host_len = host_end - host;
+	path_len = path_end - host_end;
+	len = MIN(scheme_len + 3 + host_len + path_len, TIDEWAYS_MAX_ARGUMENT_LEN - 1);
+
+	ret = emalloc(len + 1);
+	p = ret;
+
+	scheme_len = MIN(scheme_len + 3, len);
+	memcpy(p, filename, scheme_len);
+	p += scheme_len;
+
+	host_len = MIN(host_len, len - (p - ret));
+	memcpy(p, host, host_len);
+	p += host_len;
+
+	path_len = MIN(path_len, len - (p - ret));
+	memcpy(p, host_end, path_len);
+	p += path_len;
+
+	*p = '\0';
+
+	return ret;
+}
+
+static char *hp_concat_char(const char *s1, size_t len1, const char *s2, size_t len2, const char *seperator, size_t sep_len)
+{
+    char *result = emalloc(len1+len2+sep_len+1);
+
+    strcpy(result, s1);
+	strcat(result, seperator);
+    strcat(result, s2);
+	result[len1+len2+sep_len] = '\0';
+
+    return result;
+}
+
+static void hp_detect_exception(char *func_name, zend_execute_data *data TSRMLS_DC)
+{
+	int arg_count = ZEND_CALL_NUM_ARGS(data);
+	zval *argument_element;
+	int i;
+	zend_class_entry *default_ce, *exception_ce;
+
+	default_ce = zend_exception_get_default(TSRMLS_C);
+
+	for (i=0; i < arg_count; i++) {
+		argument_element = ZEND_CALL_ARG(data, i+1);
+
+		if (Z_TYPE_P(argument_element) == IS_OBJECT) {
+			exception_ce = Z_OBJCE_P(argument_element);
+
+			if (instanceof_function(exception_ce, default_ce TSRMLS_CC) == 1) {
+#if PHP_VERSION_ID >= 70000
+				ZVAL_COPY(&TWG(exception), argument_element);
+#else
+				Z_ADDREF_P(argument_element);
+				TWG(exception) = argument_element;
+#endif
+				return;
+			}
+		}
+	}
+}
+
+static void hp_detect_transaction_name(char *ret, zend_execute_data *data TSRMLS_DC)
+{
+	zval *argument_element;
+
+	if (!TWG(transaction_function) ||
+		TWG(transaction_name) ||
+		strcmp(ret, ZSTR_VAL(TWG(transaction_function))) != 0) {
+		return;
+	}
+
+	if (strcmp(ret, "Zend_Controller_Action::dispatch") == 0 ||
+			   strcmp(ret, "Enlight_Controller_Action::dispatch") == 0 ||
+			   strcmp(ret, "Mage_Core_Controller_Varien_Action::dispatch") == 0 ||
+			   strcmp(ret, "Illuminate\\Routing\\Controller::callAction") == 0) {
+		zval *obj = EX_OBJ(data);
+		zend_class_entry *ce;
+		int len;
+		char *ctrl;
+
+		argument_element = ZEND_CALL_ARG(data, 1);
+
+		if (Z_TYPE_P(argument_element) == IS_STRING) {
+			ce = Z_OBJCE_P(obj);
+
+			len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(argument_element) + 3;
+			ctrl = (char*)emalloc(len);
+			snprintf(ctrl, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(argument_element));
+			ctrl[len-1] = '\0';
+
+			TWG(transaction_name) = zend_string_init(ctrl, len-1, 0);
+			efree(ctrl);
+		}
+	} else if(strcmp(ret, "TYPO3\\CMS\\Extbase\\Mvc\\Controller\\ActionController::callActionMethod") == 0 ||
+			  strcmp(ret, "TYPO3\\Flow\\Mvc\\Controller\\ActionController::callActionMethod") == 0) {
+
+		zval *property;
+		zval *object = EX_OBJ(data);
+		zend_class_entry *ce = Z_OBJCE_P(object);
+		int len;
+		char *ctrl;
+
+		zval *__rv;
+		property = _zend_read_property(ce, object, "actionMethodName", sizeof("actionMethodName") - 1, 1, __rv);
+
+		if (property == NULL || Z_TYPE_P(property) != IS_STRING) {
+			return;
+		}
+
+		len = _ZCE_NAME_LENGTH(ce) + Z_STRLEN_P(property) + 3;
+		ctrl = (char*)emalloc(len);
+		snprintf(ctrl, len, "%s::%s", _ZCE_NAME(ce), Z_STRVAL_P(property));
+		ctrl[len-1] = '\0';
+
+		TWG(transaction_name) = zend_string_init(ctrl, len-1, 0);
+		efree(ctrl);
+	} else {
+		argument_element = ZEND_CALL_ARG(data, 1);
+
+		if (Z_TYPE_P(argument_element) == IS_STRING) {
+			TWG(transaction_name) = zend_string_copy(Z_STR_P(argument_element));
+		}
+	}
+
+	hp_transaction_function_clear(TSRMLS_C);
+}
+
+/**
+ * Get the name of the current function. The name is qualified with
+ * the class name if the function is in a class.
+ *
+ * @author kannan, hzhao
+ */
+static char *hp_get_function_name(zend_execute_data *data TSRMLS_DC)
+{
+	const char        *cls = NULL;
+	char              *ret = NULL;
+	zend_function      *curr_func;
+#if PHP_VERSION_ID < 70000
+	const char        *func = NULL;
+#else
+	zend_string *func = NULL;
+#endif
+
+	if (!data) {
+		return NULL;
+	}
+
+#if PHP_VERSION_ID < 70000
+	curr_func = data->function_state.function;
+	func = curr_func->common.function_name;
+
+	if (!func) {
+		// This branch includes execution of eval and include/require(_once) calls
+		// We assume it is not 1999 anymore and not much PHP code runs in the
+		// body of a file and if it is, we are ok with adding it to the caller's wt.
+		return NULL;
+	}
+
+	/* previously, the order of the tests in the "if" below was
+	 * flipped, leading to incorrect function names in profiler
+	 * reports. When a method in a super-type is invoked the
+	 * profiler should qualify the function name with the super-type
+	 * class name (not the class name based on the run-time type
+	 * of the object.
+	 */
+	if (curr_func->common.scope) {
+		cls = curr_func->common.scope->name;
+	} else if (data->object) {
+		cls = Z_OBJCE(*data->object)->name;
+	}
+
+	if (cls) {
+		char* sep = "::";
+		ret = hp_concat_char(cls, strlen(cls), func, strlen(func), sep, 2);
+	} else {
+		ret = estrdup(func);
+	}
+#else
+	curr_func = data->func;
+	func = curr_func->common.function_name;
+
+	if (!func) {
+		return NULL;
+	} else if (curr_func->common.scope != NULL) {
+		char* sep = "::";
+		cls = curr_func->common.scope->name->val;
+		ret = hp_concat_char(cls, curr_func->common.scope->name->len, func->val, func->len, sep, 2);
+	} else {
+		ret = emalloc(ZSTR_LEN(func)+1);
+		strcpy(ret, ZSTR_VAL(func));
+		ret[ZSTR_LEN(func)] = '\0';
+	}
+#endif
+
+	return ret;
+}
+
+/**
+ * Free any items in the free list.
+ */
+static void hp_free_the_free_list(TSRMLS_D)
+{
+	hp_entry_t *p = TWG(entry_free_list);
+	hp_entry_t *cur;
+
+	while (p) {
+		cur = p;
+		p = p->prev_hprof;
+		free(cur);
+	}
+}
+
+/**
+ * Fast allocate a hp_entry_t structure. Picks one from the
+ * free list if available, else does an actual allocate.
+ *
+ * Doesn't bother initializing allocated memory.
+ *
+ * @author kannan
+ */
+static hp_entry_t *hp_fast_alloc_hprof_entry(TSRMLS_D)
+{
+	hp_entry_t *p;
+
+	p = TWG(entry_free_list);
+
+	if (p) {
+		TWG(entry_free_list) = p->prev_hprof;
+		return p;
+	} else {
+		return (hp_entry_t *)malloc(sizeof(hp_entry_t));
+	}
+}
+
+/**
+ * Fast free a hp_entry_t structure. Simply returns back
+ * the hp_entry_t to a free list and doesn't actually
+ * perform the free.
+ *
+ * @author kannan
+ */
+static void hp_fast_free_hprof_entry(hp_entry_t *p TSRMLS_DC)
+{
+	/* we use/overload the prev_hprof field in the structure to link entries in
+	 * the free list. */
+	p->prev_hprof = TWG(entry_free_list);
+	TWG(entry_free_list) = p;
+}
+
+/**
+ * Increment the count of the given stat with the given count
+ * If the stat was not set before, inits the stat to the given count
+ *
+ * @param  zval *counts   Zend hash table pointer
+ * @param  char *name     Name of the stat
+ * @param  long  count    Value of the stat to incr by
+ * @return void
+ * @author kannan
+ */
+void hp_inc_count(zval *counts, char *name, long count TSRMLS_DC)
+{
+	HashTable *ht;
+	zval *data, val;
+
+	if (!counts) {
+		return;
+	}
+
+	ht = HASH_OF(counts);
+
+	if (!ht) {
+		return;
+	}
+
+	data = zend_compat_hash_find_const(ht, name, strlen(name));
+
+	if (data) {
+		ZVAL_LONG(data, Z_LVAL_P(data) + count);
+	} else {
+#if PHP_VERSION_ID >= 70000
+		ZVAL_LONG(&val, count);
+		zend_hash_str_update(ht, name, strlen(name), &val);
+#else
+		add_assoc_long(counts, name, count);
+#endif
+	}
+}
+
+/**
+ * Find the array stored at the given key, creating it if it does not exist.
+ */
+static zval *hp_zval_array_at_key(zval *values, char *key, size_t len)
+{
+	zval *data = zend_compat_hash_find_const(Z_ARRVAL_P(values), key, len);
+
+	if (data == NULL) {
+#if PHP_VERSION_ID >= 70000
+		zval val;
+
+		array_init(&val);
+		data = zend_hash_str_update(Z_ARRVAL_P(values), key, len, &val);
+#else
+		MAKE_STD_ZVAL(data);
+		array_init(data);
+		zend_hash_update(Z_ARRVAL_P(values), key, len+1, &data, sizeof(zval*), NULL);
+#endif
+	}
+
+	return data;
+}
+
+/**
+ * Add the metrics of one edge to the function it calls (inclusive and
+ * exclusive) or subtract them from the exclusive metrics of the function
+ * that made the call.
+ */
+static void hp_function_stats_add(zval *functions, char *name, size_t name_len, zval *metrics, int callee TSRMLS_DC)
+{
+	zval *function, *value;
+	char excl_key[SCRATCH_BUF_LEN];
+#if PHP_VERSION_ID >= 70000
+	zend_string *metric;
+#else
+	zval **data;
+	char *metric;
+	uint metric_len;
+	ulong idx;
+	HashPosition pos;
+#endif
+
+	function = hp_zval_array_at_key(functions, name, name_len);
+
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(metrics), metric, value) {
+		if (metric == NULL || Z_TYPE_P(value) != IS_LONG) {
+			continue;
+		}
+
+		if (callee) {
+			hp_inc_count(function, ZSTR_VAL(metric), Z_LVAL_P(value) TSRMLS_CC);
+		}
+
+		if (strcmp(ZSTR_VAL(metric), "ct") == 0) {
+			continue;
+		}
+
+		snprintf(excl_key, sizeof(excl_key), "excl_%s", ZSTR_VAL(metric));
+		hp_inc_count(function, excl_key, callee ? Z_LVAL_P(value) : -Z_LVAL_P(value) TSRMLS_CC);
+	} ZEND_HASH_FOREACH_END();
+#else
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(metrics), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(metrics), (void **) &data, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(metrics), &pos)) {
+		value = *data;
+
+		if (zend_hash_get_current_key_ex(Z_ARRVAL_P(metrics), &metric, &metric_len, &idx, 0, &pos) != HASH_KEY_IS_STRING ||
+				Z_TYPE_P(value) != IS_LONG) {
+			continue;
+		}
+
+		if (callee) {
+			hp_inc_count(function, metric, Z_LVAL_P(value) TSRMLS_CC);
+		}
+
+		if (strcmp(metric, "ct") == 0) {
+			continue;
+		}
+
+		snprintf(excl_key, sizeof(excl_key), "excl_%s", metric);
+		hp_inc_count(function, excl_key, callee ? Z_LVAL_P(value) : -Z_LVAL_P(value) TSRMLS_CC);
+	}
+#endif
+}
+
+/**
+ * Split a "parent==>child" edge and account its metrics to both functions.
+ */
+static void hp_function_stats_edge(zval *functions, char *symbol, zval *metrics TSRMLS_DC)
+{
+	char name[SCRATCH_BUF_LEN];
+	char *child = symbol;
+	char *delim = strstr(symbol, "==>");
+	size_t len;
+
+	if (delim != NULL) {
+		len = MIN(delim - symbol, SCRATCH_BUF_LEN - 1);
+		memcpy(name, symbol, len);
+		name[len] = '\0';
+
+		hp_function_stats_add(functions, name, len, metrics, 0 TSRMLS_CC);
+
+		child = delim + 3;
+	}
+
+	hp_function_stats_add(functions, child, strlen(child), metrics, 1 TSRMLS_CC);
+}
+
+/**
+ * Aggregate the edges of the hierarchical profile into per function
+ * metrics, inclusive and exclusive of all callees, summed over all callers.
+ * This is a single pass over the edge table, the order of edges does not
+ * matter.
+ */
+static void hp_function_stats(zval *functions TSRMLS_DC)
+{
+	HashTable *edges = TWG_ARRVAL(TWG(stats_count));
+	zval *metrics;
+#if PHP_VERSION_ID >= 70000
+	zend_string *symbol;
+#else
+	zval **data;
+	char *symbol;
+	uint symbol_len;
+	ulong idx;
+	HashPosition pos;
+#endif
+
+	array_init(functions);
+
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_STR_KEY_VAL(edges, symbol, metrics) {
+		if (symbol == NULL || Z_TYPE_P(metrics) != IS_ARRAY) {
+			continue;
+		}
+
+		hp_function_stats_edge(functions, ZSTR_VAL(symbol), metrics TSRMLS_CC);
+	} ZEND_HASH_FOREACH_END();
+#else
+	for (zend_hash_internal_pointer_reset_ex(edges, &pos);
+			zend_hash_get_current_data_ex(edges, (void **) &data, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(edges, &pos)) {
+		metrics = *data;
+
+		if (zend_hash_get_current_key_ex(edges, &symbol, &symbol_len, &idx, 0, &pos) != HASH_KEY_IS_STRING ||
+				Z_TYPE_P(metrics) != IS_ARRAY) {
+			continue;
+		}
+
+		hp_function_stats_edge(functions, symbol, metrics TSRMLS_CC);
+	}
+#endif
+}
+
+/**
+ * Map the shared function table, anonymous shared memory is inherited by
+ * the forked workers of FPM and mod_php.
+ */
+static void tw_shm_init(long size)
+{
+#ifdef TIDEWAYS_SHM
+	void *table;
+
+	if (size <= 0) {
+		return;
+	}
+
+	tw_shm_bytes = sizeof(tw_shm_table) + (size - 1) * sizeof(tw_shm_function);
+	table = mmap(NULL, tw_shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (table == MAP_FAILED) {
+		zend_error(E_WARNING, "tideways.shm_functions: Could not map %ld bytes of shared memory", (long)tw_shm_bytes);
+		tw_shm_bytes = 0;
+		return;
+	}
+
+	tw_shm = (tw_shm_table *) table;
+	tw_shm->size = size;
+#endif
+}
+
+static void tw_shm_shutdown()
+{
+#ifdef TIDEWAYS_SHM
+	if (tw_shm != NULL) {
+		munmap(tw_shm, tw_shm_bytes);
+		tw_shm = NULL;
+		tw_shm_bytes = 0;
+	}
+#endif
+}
+
+#ifdef TIDEWAYS_SHM
+/**
+ * Find the slot of a function by name hash with linear probing, claiming a
+ * free slot for new functions. Returns NULL when all probed slots are taken.
+ */
+static tw_shm_function *tw_shm_function_find(char *name, size_t len)
+{
+	zend_ulong hash;
+	tw_shm_function *function;
+	long i;
+	int spins;
+
+	len = MIN(len, TIDEWAYS_SHM_NAME_LEN - 1);
+	hash = zend_inline_hash_func(name, len);
+
+	if (hash == 0) {
+		hash = 1;
+	}
+
+	for (i = 0; i < TIDEWAYS_SHM_PROBES && i < tw_shm->size; i++) {
+		function = &tw_shm->functions[(hash + i) % tw_shm->size];
+
+		if (function->hash == 0 && __sync_bool_compare_and_swap(&function->hash, 0, hash)) {
+			memcpy(function->name, name, len);
+			function->name[len] = '\0';
+			__sync_synchronize();
+			function->ready = 1;
+
+			return function;
+		}
+
+		if (function->hash != hash) {
+			continue;
+		}
+
+		/* Another worker claimed the slot and is still copying the name */
+		for (spins = 0; !function->ready && spins < 1000; spins++) {
+			__sync_synchronize();
+		}
+
+		if (!function->ready) {
+			return NULL;
+		}
+
+		if (strncmp(function->name, name, len) == 0 && function->name[len] == '\0') {
+			return function;
+		}
+	}
+
+	return NULL;
+}
+
+static long tw_shm_metric(zval *metrics, char *key, size_t size)
+{
+	zval *value = hp_zval_at_key(key, size, metrics);
+
+	return value != NULL && Z_TYPE_P(value) == IS_LONG ? Z_LVAL_P(value) : 0;
+}
+
+/**
+ * Add one "parent==>child" edge to the shared table like
+ * hp_function_stats_edge(), the callee gets the inclusive metrics and the
+ * caller loses them from its exclusive ones.
+ */
+static void tw_shm_merge_edge(char *symbol, zval *metrics)
+{
+	tw_shm_function *function;
+	char *child = symbol;
+	char *delim = strstr(symbol, "==>");
+	long wt = tw_shm_metric(metrics, "wt", sizeof("wt"));
+	long cpu = tw_shm_metric(metrics, "cpu", sizeof("cpu"));
+
+	if (delim != NULL) {
+		function = tw_shm_function_find(symbol, delim - symbol);
+
+		if (function != NULL) {
+			__sync_fetch_and_sub(&function->excl_wt, wt);
+			__sync_fetch_and_sub(&function->excl_cpu, cpu);
+		} else {
+			__sync_fetch_and_add(&tw_shm->dropped, 1);
+		}
+
+		child = delim + 3;
+	}
+
+	function = tw_shm_function_find(child, strlen(child));
+
+	if (function == NULL) {
+		__sync_fetch_and_add(&tw_shm->dropped, 1);
+		return;
+	}
+
+	__sync_fetch_and_add(&function->ct, tw_shm_metric(metrics, "ct", sizeof("ct")));
+	__sync_fetch_and_add(&function->wt, wt);
+	__sync_fetch_and_add(&function->cpu, cpu);
+	__sync_fetch_and_add(&function->excl_wt, wt);
+	__sync_fetch_and_add(&function->excl_cpu, cpu);
+}
+#endif
+
+/**
+ * Merge the edges of the profile that just stopped into the shared
+ * function table, lock free with atomic adds.
+ */
+static void tw_shm_merge(TSRMLS_D)
+{
+#ifdef TIDEWAYS_SHM
+	HashTable *edges;
+	zval *metrics;
+#if PHP_VERSION_ID >= 70000
+	zend_string *symbol;
+#else
+	zval **data;
+	char *symbol;
+	uint symbol_len;
+	ulong idx;
+	HashPosition pos;
+#endif
+
+	if (tw_shm == NULL || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_HIERACHICAL) > 0) {
+		return;
+	}
+
+	edges = TWG_ARRVAL(TWG(stats_count));
+
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_STR_KEY_VAL(edges, symbol, metrics) {
+		if (symbol == NULL || Z_TYPE_P(metrics) != IS_ARRAY) {
+			continue;
+		}
+
+		tw_shm_merge_edge(ZSTR_VAL(symbol), metrics);
+	} ZEND_HASH_FOREACH_END();
+#else
+	for (zend_hash_internal_pointer_reset_ex(edges, &pos);
+			zend_hash_get_current_data_ex(edges, (void **) &data, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(edges, &pos)) {
+		metrics = *data;
+
+		if (zend_hash_get_current_key_ex(edges, &symbol, &symbol_len, &idx, 0, &pos) != HASH_KEY_IS_STRING ||
+				Z_TYPE_P(metrics) != IS_ARRAY) {
+			continue;
+		}
+
+		tw_shm_merge_edge(symbol, metrics);
+	}
+#endif
+
+	__sync_fetch_and_add(&tw_shm->profiles, 1);
+#endif
+}
+
+/**
+ * Whether a new edge with a key of len bytes fits into the budget while
+ * keeping reserve edges free. Bytes are estimated from the key length.
+ */
+static int hp_stats_budget_fits(size_t len, long reserve TSRMLS_DC)
+{
+	if (TWG(max_edges) > 0 && TWG(stats_edges) + reserve >= TWG(max_edges)) {
+		return 0;
+	}
+
+	if (TWG(max_bytes) > 0 && TWG(stats_bytes) + (reserve + 1) * TIDEWAYS_EDGE_BYTES + (long)len > TWG(max_bytes)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Report the size of the hierarchical profile against its budget.
+ */
+static void hp_profiler_stats(zval *stats TSRMLS_DC)
+{
+	add_assoc_long(stats, "edges", TWG(stats_edges));
+	add_assoc_long(stats, "bytes", TWG(stats_bytes));
+	add_assoc_long(stats, "overflow", TWG(stats_overflow));
+	add_assoc_long(stats, "max_edges", TWG(max_edges));
+	add_assoc_long(stats, "max_bytes", TWG(max_bytes));
+	add_assoc_long(stats, "overhead", (long)get_us_from_tsc(TWG(overhead_tsc) TSRMLS_CC));
+
+	if (TWG(calibration) != NULL) {
+		add_assoc_double(stats, "call_wt", TWG(calibration)->wt);
+		add_assoc_double(stats, "call_cpu", TWG(calibration)->cpu);
+	}
+}
+
+/**
+ * Edge and function bookkeeping for pruning the profile down to its most
+ * expensive edges, see hp_prune_stats().
+ */
+typedef struct hp_prune_edge {
+	char *symbol;
+	size_t symbol_len;
+	size_t parent_len;
+	zval *metrics;
+	long incl;
+	long weight;
+	int parent;
+	int child;
+	int keep;
+} hp_prune_edge;
+
+typedef struct hp_prune_function {
+	char *name;
+	size_t len;
+	long incl;
+	long out;
+	int heaviest;
+	int reached;
+} hp_prune_function;
+
+/**
+ * Read a numeric option, accepting longs, doubles and numeric strings.
+ */
+static double hp_zval_number(zval *value)
+{
+	switch (Z_TYPE_P(value)) {
+		case IS_LONG:
+			return (double)Z_LVAL_P(value);
+		case IS_DOUBLE:
+			return Z_DVAL_P(value);
+		case IS_STRING:
+			return strtod(Z_STRVAL_P(value), NULL);
+		default:
+			return zend_is_true(value) ? 1 : 0;
+	}
+}
+
+static long hp_metric_value(zval *metrics, char *metric, size_t len)
+{
+	zval *data = zend_compat_hash_find_const(Z_ARRVAL_P(metrics), metric, len);
+
+	return (data != NULL && Z_TYPE_P(data) == IS_LONG) ? Z_LVAL_P(data) : 0;
+}
+
+static int hp_prune_function_compare(const void *a, const void *b)
+{
+	const hp_prune_function *fa = a, *fb = b;
+	int cmp = memcmp(fa->name, fb->name, MIN(fa->len, fb->len));
+
+	if (cmp != 0) {
+		return cmp;
+	}
+
+	return fa->len < fb->len ? -1 : (fa->len > fb->len ? 1 : 0);
+}
+
+static int hp_prune_function_find(hp_prune_function *functions, int count, char *name, size_t len)
+{
+	hp_prune_function key, *found;
+
+	key.name = name;
+	key.len = len;
+
+	found = bsearch(&key, functions, count, sizeof(hp_prune_function), hp_prune_function_compare);
+
+	return found != NULL ? (int)(found - functions) : -1;
+}
+
+/**
+ * Partially order the candidate edges so that the k heaviest end up in
+ * front, in no particular order (like std::nth_element). Average O(n).
+ */
+static void hp_prune_select(hp_prune_edge *edges, int *order, int count, int k)
+{
+	int left = 0, right = count - 1, i, j, tmp;
+	long pivot;
+
+	while (left < right) {
+		pivot = edges[order[left + (right - left) / 2]].weight;
+		i = left;
+		j = right;
+
+		while (i <= j) {
+			while (edges[order[i]].weight > pivot) {
+				i++;
+			}
+			while (edges[order[j]].weight < pivot) {
+				j--;
+			}
+			if (i <= j) {
+				tmp = order[i];
+				order[i] = order[j];
+				order[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+
+		if (k - 1 <= j) {
+			right = j;
+		} else if (k - 1 >= i) {
+			left = i;
+		} else {
+			break;
+		}
+	}
+}
+
+/**
+ * Make sure the caller of a kept edge is reachable from main() by keeping
+ * its heaviest incoming edge, recursively up the call graph.
+ */
+static void hp_prune_connect(hp_prune_edge *edges, hp_prune_function *functions, int edge)
+{
+	int parent;
+
+	while (edge >= 0) {
+		parent = edges[edge].parent;
+
+		if (parent < 0 || functions[parent].reached) {
+			return;
+		}
+
+		functions[parent].reached = 1;
+		edge = functions[parent].heaviest;
+
+		if (edge >= 0) {
+			edges[edge].keep = 1;
+		}
+	}
+}
+
+static void hp_prune_copy_edge(zval *result, hp_prune_edge *edge)
+{
+#if PHP_VERSION_ID >= 70000
+	Z_TRY_ADDREF_P(edge->metrics);
+	zend_hash_str_update(Z_ARRVAL_P(result), edge->symbol, edge->symbol_len, edge->metrics);
+#else
+	Z_ADDREF_P(edge->metrics);
+	add_assoc_zval_ex(result, edge->symbol, edge->symbol_len + 1, edge->metrics);
+#endif
+}
+
+/**
+ * Fold the metrics of a dropped edge into the "parent==>(other)" edge.
+ */
+static void hp_prune_merge_edge(zval *result, hp_prune_edge *edge TSRMLS_DC)
+{
+	char *name;
+	size_t len = edge->parent_len + sizeof("==>(other)") - 1;
+	zval *other, *value;
+#if PHP_VERSION_ID >= 70000
+	zend_string *metric;
+#else
+	zval **data;
+	char *metric;
+	uint metric_len;
+	ulong idx;
+	HashPosition pos;
+#endif
+
+	name = emalloc(len + 1);
+	memcpy(name, edge->symbol, edge->parent_len);
+	memcpy(name + edge->parent_len, "==>(other)", sizeof("==>(other)"));
+
+	other = hp_zval_array_at_key(result, name, len);
+	efree(name);
+
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(edge->metrics), metric, value) {
+		if (metric != NULL && Z_TYPE_P(value) == IS_LONG) {
+			hp_inc_count(other, ZSTR_VAL(metric), Z_LVAL_P(value) TSRMLS_CC);
+		}
+	} ZEND_HASH_FOREACH_END();
+#else
+	for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(edge->metrics), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(edge->metrics), (void **) &data, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(edge->metrics), &pos)) {
+		value = *data;
+
+		if (zend_hash_get_current_key_ex(Z_ARRVAL_P(edge->metrics), &metric, &metric_len, &idx, 0, &pos) == HASH_KEY_IS_STRING &&
+				Z_TYPE_P(value) == IS_LONG) {
+			hp_inc_count(other, metric, Z_LVAL_P(value) TSRMLS_CC);
+		}
+	}
+#endif
+}
+
+/**
+ * Prune the hierarchical profile to its most expensive edges.
+ *
+ * Edges are ranked by the inclusive metric ("wt", "cpu", ...) or by the
+ * exclusive share of the callee ("excl_wt", "excl_cpu"), attributed to each
+ * caller in proportion to the inclusive time of the edge. Edges below
+ * min_share of the root's inclusive metric are dropped, of the rest only
+ * the top_n heaviest are kept. The heaviest incoming edges needed to keep
+ * them connected to main() are kept too, everything else below a reachable
+ * caller is merged into a "parent==>(other)" edge. Edges below callers
+ * that are no longer reachable are already accounted for in the inclusive
+ * metrics of such an edge further up and are dropped.
+ */
+static void hp_prune_stats(zval *result, long top_n, double min_share, char *metric TSRMLS_DC)
+{
+	HashTable *stats = TWG_ARRVAL(TWG(stats_count));
+	hp_prune_edge *edges;
+	hp_prune_function *functions;
+	int *order;
+	int edge_count = 0, function_count = 0, candidates = 0, i, j;
+	int exclusive = strncmp(metric, "excl_", sizeof("excl_") - 1) == 0;
+	char *incl_metric = exclusive ? metric + sizeof("excl_") - 1 : metric;
+	size_t incl_len = strlen(incl_metric);
+	long total = 0;
+	char *delim;
+	zval *metrics;
+#if PHP_VERSION_ID >= 70000
+	zend_string *symbol;
+#else
+	zval **data;
+	char *symbol;
+	uint symbol_len;
+	ulong idx;
+	HashPosition pos;
+#endif
+
+	array_init(result);
+
+	edges = safe_emalloc(zend_hash_num_elements(stats), sizeof(hp_prune_edge), 0);
+	functions = safe_emalloc(zend_hash_num_elements(stats), 2 * sizeof(hp_prune_function), 0);
+	order = safe_emalloc(zend_hash_num_elements(stats), sizeof(int), 0);
+
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_STR_KEY_VAL(stats, symbol, metrics) {
+		if (symbol == NULL || Z_TYPE_P(metrics) != IS_ARRAY) {
+			continue;
+		}
+
+		edges[edge_count].symbol = ZSTR_VAL(symbol);
+		edges[edge_count].symbol_len = ZSTR_LEN(symbol);
+#else
+	for (zend_hash_internal_pointer_reset_ex(stats, &pos);
+			zend_hash_get_current_data_ex(stats, (void **) &data, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(stats, &pos)) {
+		metrics = *data;
+
+		if (zend_hash_get_current_key_ex(stats, &symbol, &symbol_len, &idx, 0, &pos) != HASH_KEY_IS_STRING ||
+				Z_TYPE_P(metrics) != IS_ARRAY) {
+			continue;
+		}
+
+		edges[edge_count].symbol = symbol;
+		edges[edge_count].symbol_len = symbol_len - 1;
+#endif
+		delim = strstr(edges[edge_count].symbol, "==>");
+
+		edges[edge_count].metrics = metrics;
+		edges[edge_count].parent_len = delim != NULL ? delim - edges[edge_count].symbol : 0;
+		edges[edge_count].incl = hp_metric_value(metrics, incl_metric, incl_len);
+		edges[edge_count].weight = edges[edge_count].incl;
+		edges[edge_count].keep = delim == NULL;
+
+		if (delim == NULL) {
+			/* The (overflow) root is part of main() already */
+			if (strcmp(edges[edge_count].symbol, ROOT_SYMBOL) == 0) {
+				total += edges[edge_count].incl;
+			}
+		} else {
+			functions[function_count].name = edges[edge_count].symbol;
+			functions[function_count].len = edges[edge_count].parent_len;
+			function_count++;
+		}
+
+		functions[function_count].name = delim != NULL ? delim + 3 : edges[edge_count].symbol;
+		functions[function_count].len = edges[edge_count].symbol + edges[edge_count].symbol_len - functions[function_count].name;
+		function_count++;
+
+		edge_count++;
+#if PHP_VERSION_ID >= 70000
+	} ZEND_HASH_FOREACH_END();
+#else
+	}
+#endif
+
+	/* Unique function table, sorted by name for lookups */
+	qsort(functions, function_count, sizeof(hp_prune_function), hp_prune_function_compare);
+
+	for (i = 0, j = 0; i < function_count; i++) {
+		if (j == 0 || hp_prune_function_compare(&functions[j - 1], &functions[i]) != 0) {
+			functions[j] = functions[i];
+			functions[j].incl = 0;
+			functions[j].out = 0;
+			functions[j].heaviest = -1;
+			functions[j].reached = 0;
+			j++;
+		}
+	}
+	function_count = j;
+
+	for (i = 0; i < edge_count; i++) {
+		hp_prune_edge *edge = &edges[i];
+		char *child = edge->parent_len > 0 ? edge->symbol + edge->parent_len + 3 : edge->symbol;
+
+		edge->child = hp_prune_function_find(functions, function_count, child, edge->symbol + edge->symbol_len - child);
+		edge->parent = edge->parent_len > 0 ? hp_prune_function_find(functions, function_count, edge->symbol, edge->parent_len) : -1;
+
+		functions[edge->child].incl += edge->incl;
+
+		if (edge->parent >= 0) {
+			functions[edge->parent].out += edge->incl;
+
+			if (functions[edge->child].heaviest < 0 || edges[functions[edge->child].heaviest].incl < edge->incl) {
+				functions[edge->child].heaviest = i;
+			}
+		} else {
+			functions[edge->child].reached = 1;
+		}
+	}
+
+	for (i = 0; i < edge_count; i++) {
+		hp_prune_edge *edge = &edges[i];
+
+		if (exclusive && functions[edge->child].incl > 0) {
+			edge->weight = (long)((double)(functions[edge->child].incl - functions[edge->child].out) *
+				edge->incl / functions[edge->child].incl);
+		}
+
+		if (!edge->keep && (min_share <= 0 || edge->weight >= min_share * total)) {
+			order[candidates++] = i;
+		}
+	}
+
+	if (top_n >= 0 && candidates > top_n) {
+		if (top_n > 0) {
+			hp_prune_select(edges, order, candidates, (int)top_n);
+		}
+		candidates = (int)top_n;
+	}
+
+	for (i = 0; i < candidates; i++) {
+		edges[order[i]].keep = 1;
+		functions[edges[order[i]].child].reached = 1;
+	}
+
+	for (i = 0; i < candidates; i++) {
+		hp_prune_connect(edges, functions, order[i]);
+	}
+
+	for (i = 0; i < edge_count; i++) {
+		if (edges[i].keep) {
+			hp_prune_copy_edge(result, &edges[i]);
+		} else if (edges[i].parent >= 0 && functions[edges[i].parent].reached) {
+			hp_prune_merge_edge(result, &edges[i] TSRMLS_CC);
+		}
+	}
+
+	efree(order);
+	efree(functions);
+	efree(edges);
+}
+
+/**
+ * ***********************
+ * High precision timer related functions.
+ * ***********************
+ */
+
+/**
+ * Get the current wallclock timer
+ *
+ * @return 64 bit unsigned integer
+ * @author cjiang
+ */
+static uint64 cycle_timer(TSRMLS_D) {
+#if defined(PHP_WIN32)
+
+    LARGE_INTEGER count;
+
+    if (!QueryPerformanceCounter(&count)) {
+        return 0;
+    }
+
+    return (double)(count.QuadPart) / TWG(frequency);
+#else
+#ifdef __APPLE__
+	return mach_absolute_time();
+#else
+	struct timespec s;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+
+	return s.tv_sec * 1000000 + s.tv_nsec / 1000;
+#endif
+#endif
+}
+
+/**
+ * Get the current real CPU clock timer
+ */
+static uint64 cpu_timer() {
+#if defined(CLOCK_PROCESS_CPUTIME_ID)
+	struct timespec s;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s);
+
+	return s.tv_sec * 1000000 + s.tv_nsec / 1000;
+#else
+	struct rusage ru;
+
+	tw_getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec +
+		ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+#endif
+}
+
+/**
+ * Get time delta in microseconds.
+ */
+static long get_us_interval(struct timeval *start, struct timeval *end)
+{
+	return (((end->tv_sec - start->tv_sec) * 1000000)
+			+ (end->tv_usec - start->tv_usec));
+}
+
+/**
+ * Convert from TSC counter values to equivalent microseconds.
+ *
+ * @param uint64 count, TSC count value
+ * @return 64 bit unsigned integer
+ *
+ * @author cjiang
+ */
+static inline double get_us_from_tsc(uint64 count TSRMLS_DC)
+{
+	return count / TWG(timebase_factor);
+}
+
+/**
+ * Get the timebase factor necessary to divide by in cycle_timer()
+ */
+static double get_timebase_factor()
+{
+#ifdef __APPLE__
+	mach_timebase_info_data_t sTimebaseInfo;
+	(void) mach_timebase_info(&sTimebaseInfo);
+
+	return (sTimebaseInfo.numer / sTimebaseInfo.denom) * 1000;
+#else
+	return 1.0;
+#endif
+}
+
+/**
+ * TIDEWAYS_MODE_HIERARCHICAL's begin function callback
+ *
+ * @author kannan
+ */
+void hp_mode_hier_beginfn_cb(hp_entry_t **entries, hp_entry_t *current, zend_execute_data *data TSRMLS_DC)
+{
+	hp_entry_t   *p;
+	tw_trace_callback *callback;
+	int    recurse_level = 0;
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0 && data != NULL) {
+		TWG(pending_return_cb) = NULL;
+
+#if PHP_VERSION_ID < 70000
+		if (zend_hash_find(TWG(trace_callbacks), current->name_hprof, strlen(current->name_hprof)+1, (void **)&callback) == SUCCESS) {
+			current->span_id = (*callback)(current->name_hprof, data TSRMLS_CC);
+		}
+#else
+		callback = (tw_trace_callback*)zend_hash_str_find_ptr(TWG(trace_callbacks), current->name_hprof, strlen(current->name_hprof));
+
+		if (callback != NULL) {
+			current->span_id = (*callback)(current->name_hprof, data TSRMLS_CC);
+		}
+#endif
+
+		current->return_cb = TWG(pending_return_cb);
+		tw_span_push(current->span_id TSRMLS_CC);
+	}
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_HIERACHICAL) == 0) {
+		if (TWG(func_hash_counters)[current->hash_code] > 0) {
+			/* Find this symbols recurse level */
+			for(p = (*entries); p; p = p->prev_hprof) {
+				if (!strcmp(current->name_hprof, p->name_hprof)) {
+					recurse_level = (p->rlvl_hprof) + 1;
+					break;
+				}
+			}
+		}
+		TWG(func_hash_counters)[current->hash_code]++;
+		current->calls_start = ++TWG(calls);
+
+		/* Init current function's recurse level */
+		current->rlvl_hprof = recurse_level;
+
+		/* Get CPU usage */
+		if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
+			current->cpu_start = cpu_timer();
+		}
+
+		/* Get memory usage */
+		if (TWG(tideways_flags) & TIDEWAYS_FLAGS_MEMORY) {
+			current->mu_start_hprof  = zend_memory_usage(0 TSRMLS_CC);
+			current->pmu_start_hprof = zend_memory_peak_usage(0 TSRMLS_CC);
+		}
+
+		if (TWG(cct_nodes) != NULL) {
+			current->cct_node = tw_cct_enter(*entries ? (*entries)->cct_node : -1, *entries == NULL, current->name_hprof TSRMLS_CC);
+		}
+
+		if (current->span_id >= 0) {
+			tw_span_annotate_string(current->span_id, "fn", current->name_hprof, 1 TSRMLS_CC);
+		}
+	}
+
+	if (TWG(trace_records) != NULL) {
+		current->trace_function = tw_trace_function_id(current->name_hprof, current->hash_code TSRMLS_CC);
+	}
+
+	/* After the context tree, span and trace bookkeeping, which allocate */
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_ALLOCATIONS) {
+		current->alloc_bytes_start = TWG(alloc_bytes);
+		current->alloc_count_start = TWG(alloc_count);
+	}
+
+	/* Get start tsc counter */
+	current->tsc_start = cycle_timer(TSRMLS_C);
+
+	if (TWG(trace_records) != NULL) {
+		tw_trace_record_call(current->trace_function, current->tsc_start TSRMLS_CC);
+	}
+}
+
+/**
+ * **********************************
+ * TIDEWAYS END FUNCTION CALLBACKS
+ * **********************************
+ */
+
+/**
+ * TIDEWAYS_MODE_HIERARCHICAL's end function callback
+ *
+ * @author kannan
+ */
+void hp_mode_hier_endfn_cb(hp_entry_t **entries, zend_execute_data *data TSRMLS_DC)
+{
+	hp_entry_t      *top = (*entries);
+	zval            *counts, count_val;
+	char             symbol[SCRATCH_BUF_LEN] = "";
+	size_t           len;
+	long int         mu_end;
+	long             headroom;
+	long int         pmu_end;
+	uint64   tsc_end;
+	uint64   alloc_bytes, alloc_count;
+	double   wt, cpu;
+	tw_trace_callback *callback;
+
+	/* Get end tsc counter */
+	tsc_end = cycle_timer(TSRMLS_C);
+	wt = get_us_from_tsc(tsc_end - top->tsc_start TSRMLS_CC);
+
+	if (TWG(trace_records) != NULL) {
+		tw_trace_record_call(top->trace_function | TIDEWAYS_TRACE_EXIT, tsc_end TSRMLS_CC);
+	}
+
+	/* Before the profiler allocates anything itself */
+	alloc_bytes = TWG(alloc_bytes) - top->alloc_bytes_start;
+	alloc_count = TWG(alloc_count) - top->alloc_count_start;
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
+		cpu = get_us_from_tsc(cpu_timer() - top->cpu_start TSRMLS_CC);
+	}
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0 && top->span_id >= 0) {
+		double start = get_us_from_tsc(top->tsc_start - TWG(start_time) TSRMLS_CC);
+		double end = get_us_from_tsc(tsc_end - TWG(start_time) TSRMLS_CC);
+		tw_span_record_duration(top->span_id, start, end TSRMLS_CC);
+		tw_span_pop(top->span_id TSRMLS_CC);
+	}
+
+	if (TWG(histograms) != NULL) {
+		tw_histogram_record_function(top->name_hprof, (long)wt TSRMLS_CC);
+	}
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_HIERACHICAL) > 0) {
+		return;
+	}
+
+	/* The calling context tree replaces the edge profile */
+	if (TWG(cct_nodes) != NULL) {
+		if (top->cct_node >= 0) {
+			tw_cct_node *node = &TWG(cct_nodes)[top->cct_node];
+
+			node->ct++;
+			node->wt += (long)wt;
+
+			if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
+				node->cpu += (long)cpu;
+			}
+		}
+
+		TWG(func_hash_counters)[top->hash_code]--;
+		return;
+	}
+
+	/* Get the stat array */
+	hp_get_function_stack(top, 2, symbol, sizeof(symbol));
+
+	counts = zend_compat_hash_find_const(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol));
+
+	/* Once the budget is exhausted new edges are folded into the callers
+	 * (overflow) edge, using a tenth of the budget as headroom, and then into
+	 * a single (overflow) edge. The last two edges are kept for that and
+	 * main(), existing edges keep updating. */
+	headroom = TWG(max_edges) > 0 ? TWG(max_edges) / 10 : TWG(max_bytes) / TIDEWAYS_EDGE_BYTES / 10;
+
+	if (counts == NULL && top->prev_hprof != NULL &&
+			!hp_stats_budget_fits(strlen(symbol), headroom + 2 TSRMLS_CC)) {
+		symbol[0] = '\0';
+		len = hp_get_function_stack(top->prev_hprof, 1, symbol, sizeof(symbol) - sizeof("==>(overflow)"));
+		memcpy(symbol + len, "==>(overflow)", sizeof("==>(overflow)"));
+
+		TWG(stats_overflow)++;
+		counts = zend_compat_hash_find_const(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol));
+
+		if (counts == NULL && !hp_stats_budget_fits(strlen(symbol), 2 TSRMLS_CC)) {
+			memcpy(symbol, "(overflow)", sizeof("(overflow)"));
+			counts = zend_compat_hash_find_const(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol));
+		}
+	}
+
+	if (counts == NULL) {
+#if PHP_VERSION_ID >= 70000
+		counts = &count_val;
+		array_init(counts);
+		zend_hash_str_update(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol), counts);
+#else
+		MAKE_STD_ZVAL(counts);
+		array_init(counts);
+		zend_hash_update(TWG_ARRVAL(TWG(stats_count)), symbol, strlen(symbol)+1, &counts, sizeof(zval*), NULL);
+#endif
+		TWG(stats_edges)++;
+		TWG(stats_bytes) += strlen(symbol) + TIDEWAYS_EDGE_BYTES;
+	}
+
+	/* Bump stats in the counts hashtable */
+	hp_inc_count(counts, "ct", 1  TSRMLS_CC);
+	hp_inc_count(counts, "wt", wt TSRMLS_CC);
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
+		/* Bump CPU stats in the counts hashtable */
+		hp_inc_count(counts, "cpu", cpu TSRMLS_CC);
+	}
+
+	if (TWG(calibration) != NULL) {
+		/* Remove the cost of profiling the calls made below this one */
+		double calls = (double)(TWG(calls) - top->calls_start);
+
+		hp_inc_count(counts, "corr_wt", MAX(wt - calls * TWG(calibration)->wt, 0) TSRMLS_CC);
+
+		if (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) {
+			hp_inc_count(counts, "corr_cpu", MAX(cpu - calls * TWG(calibration)->cpu, 0) TSRMLS_CC);
+		}
+	}
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_MEMORY) {
+		/* Get Memory usage */
+		mu_end  = zend_memory_usage(0 TSRMLS_CC);
+		pmu_end = zend_memory_peak_usage(0 TSRMLS_CC);
+
+		/* Bump Memory stats in the counts hashtable */
+		hp_inc_count(counts, "mu",  mu_end - top->mu_start_hprof    TSRMLS_CC);
+		hp_inc_count(counts, "pmu", pmu_end - top->pmu_start_hprof  TSRMLS_CC);
+	}
+
+	if (TWG(tideways_flags) & TIDEWAYS_FLAGS_ALLOCATIONS) {
+		hp_inc_count(counts, "alloc_bytes", alloc_bytes TSRMLS_CC);
+		hp_inc_count(counts, "alloc_count", alloc_count TSRMLS_CC);
+	}
+
+	TWG(func_hash_counters)[top->hash_code]--;
+}
+
+
+/**
+ * ***************************
+ * PHP EXECUTE/COMPILE PROXIES
+ * ***************************
+ */
+
+/**
+ * Tideways enable replaced the zend_execute function with this
+ * new execute function. We can do whatever profiling we need to
+ * before and after calling the actual zend_execute().
+ *
+ * @author hzhao, kannan
+ */
+#if PHP_VERSION_ID >= 70000
+ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data) {
+	zend_execute_data *real_execute_data = execute_data;
+#elif PHP_VERSION_ID < 50500
+ZEND_DLEXPORT void hp_execute (zend_op_array *ops TSRMLS_DC) {
+	zend_execute_data *execute_data = EG(current_execute_data);
+	zend_execute_data *real_execute_data = execute_data;
+#else
+ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
+	zend_op_array *ops = execute_data->op_array;
+	zend_execute_data    *real_execute_data = execute_data->prev_execute_data;
+#endif
+	char          *func = NULL;
+	int hp_profile_flag = 1;
+
+	if (!TWG(enabled)) {
+#if PHP_VERSION_ID < 50500
+		_zend_execute(ops TSRMLS_CC);
+#else
+		_zend_execute_ex(execute_data TSRMLS_CC);
+#endif
+		return;
+	}
+
+	func = hp_get_function_name(real_execute_data TSRMLS_CC);
+
+	if (!func) {
+#if PHP_VERSION_ID < 50500
+		_zend_execute(ops TSRMLS_CC);
+#else
+		_zend_execute_ex(execute_data TSRMLS_CC);
+#endif
+		return;
+	}
+
+	hp_detect_transaction_name(func, real_execute_data TSRMLS_CC);
+
+	if (TWG(exception_function) != NULL && strcmp(func, ZSTR_VAL(TWG(exception_function))) == 0) {
+		hp_detect_exception(func, real_execute_data TSRMLS_CC);
+	}
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_USERLAND) > 0) {
+#if PHP_VERSION_ID < 50500
+		_zend_execute(ops TSRMLS_CC);
+#else
+		_zend_execute_ex(execute_data TSRMLS_CC);
+#endif
+		efree(func);
+		return;
+	}
+
+	BEGIN_PROFILING(&TWG(entries), func, hp_profile_flag, real_execute_data);
+#if PHP_VERSION_ID < 50500
+	_zend_execute(ops TSRMLS_CC);
+#else
+	_zend_execute_ex(execute_data TSRMLS_CC);
+#endif
+	if (TWG(entries)) {
+		END_PROFILING(&TWG(entries), hp_profile_flag, real_execute_data);
+	}
+	efree(func);
+}
+
+#undef EX
+#define EX(element) ((execute_data)->element)
+
+/**
+ * Very similar to hp_execute. Proxy for zend_execute_internal().
+ * Applies to zend builtin functions.
+ *
+ * @author hzhao, kannan
+ */
+
+#if PHP_VERSION_ID >= 70000
+ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *return_value) {
+#elif PHP_VERSION_ID < 50500
+#define EX_T(offset) (*(temp_variable *)((char *) EX(Ts) + offset))
+
+ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data,
+                                       int ret TSRMLS_DC) {
+#else
+#define EX_T(offset) (*EX_TMP_VAR(execute_data, offset))
+
+ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data,
+                                       struct _zend_fcall_info *fci, int ret TSRMLS_DC) {
+#endif
+	char             *func = NULL;
+	int    hp_profile_flag = 1;
+
+	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_BUILTINS) > 0) {
+#if PHP_MAJOR_VERSION == 7
+		execute_internal(execute_data, return_value TSRMLS_CC);
+#elif PHP_VERSION_ID < 50500
+		execute_internal(execute_data, ret TSRMLS_CC);
+#else
+		execute_internal(execute_data, fci, ret TSRMLS_CC);
+#endif
+		return;
+	}
+
+	func = hp_get_function_name(execute_data TSRMLS_CC);
+
+	if (func) {
+		BEGIN_PROFILING(&TWG(entries), func, hp_profile_flag, execute_data);
+	}
+
+	if (!_zend_execute_internal) {
+#if PHP_VERSION_ID >= 70000
+		execute_internal(execute_data, return_value TSRMLS_CC);
+#elif PHP_VERSION_ID < 50500
+		execute_internal(execute_data, ret TSRMLS_CC);
+#else
+		execute_internal(execute_data, fci, ret TSRMLS_CC);
+#endif
+	} else {
+		/* call the old override */
+#if PHP_VERSION_ID >= 70000
+		_zend_execute_internal(execute_data, return_value TSRMLS_CC);
+#elif PHP_VERSION_ID < 50500
+		_zend_execute_internal(execute_data, ret TSRMLS_CC);
+#else
+		_zend_execute_internal(execute_data, fci, ret TSRMLS_CC);
+#endif
+	}
+
+	if (func) {
+		if (TWG(entries)) {
+			if (hp_profile_flag && TWG(entries)->return_cb != NULL && !EG(exception)) {
+#if PHP_VERSION_ID >= 70000
+				TWG(entries)->return_cb(TWG(entries), execute_data, return_value TSRMLS_CC);
+#elif PHP_VERSION_ID < 50400
+				TWG(entries)->return_cb(TWG(entries), execute_data, EX_T(execute_data->opline->result.u.var).var.ptr TSRMLS_CC);
+#elif PHP_VERSION_ID < 50500
+				TWG(entries)->return_cb(TWG(entries), execute_data, EX_T(execute_data->opline->result.var).var.ptr TSRMLS_CC);
+#else
+				TWG(entries)->return_cb(TWG(entries), execute_data, fci != NULL ? *fci->retval_ptr_ptr : EX_T(execute_data->opline->result.var).var.ptr TSRMLS_CC);
+#endif
+			}
+
+			END_PROFILING(&TWG(entries), hp_profile_flag, execute_data);
+		}
+		efree(func);
+	}
+}
+
+/**
+ * Proxy for zend_compile_file(). Used to profile PHP compilation time.
+ *
+ * @author kannan, hzhao
+ */
+ZEND_DLEXPORT zend_op_array* hp_compile_file(zend_file_handle *file_handle, int type TSRMLS_DC)
+{
+	zend_op_array  *ret;
+	uint64 start;
+
+	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_COMPILE) > 0) {
+		return _zend_compile_file(file_handle, type TSRMLS_CC);
+	}
+
+	start = cycle_timer(TSRMLS_C);
+
+	TWG(compile_count)++;
+
+	ret = _zend_compile_file(file_handle, type TSRMLS_CC);
+
+	TWG(compile_wt) += get_us_from_tsc(cycle_timer(TSRMLS_C) - start TSRMLS_CC);
+
+	return ret;
+}
+
+/**
+ * Proxy for zend_compile_string(). Used to profile PHP eval compilation time.
+ */
+ZEND_DLEXPORT zend_op_array* hp_compile_string(zval *source_string, char *filename TSRMLS_DC)
+{
+	zend_op_array  *ret;
+	uint64 start;
+
+	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_COMPILE) > 0) {
+		return _zend_compile_string(source_string, filename TSRMLS_CC);
+	}
+
+	start = cycle_timer(TSRMLS_C);
+
+	TWG(compile_count)++;
+
+	ret = _zend_compile_string(source_string, filename TSRMLS_CC);
+
+	TWG(compile_wt) += get_us_from_tsc(cycle_timer(TSRMLS_C) - start TSRMLS_CC);
+
+	return ret;
+}
+
+/**
+ * **************************
+ * MAIN TIDEWAYS CALLBACKS
+ * **************************
+ */
+
+/**
+ * This function gets called once when Tideways gets enabled.
+ * It replaces all the functions like zend_execute, zend_execute_internal,
+ * etc that needs to be instrumented with their corresponding proxies.
+ */
+#if PHP_VERSION_ID >= 70300
+/**
+ * Zend MM handlers installed with TIDEWAYS_FLAGS_ALLOCATIONS. Every
+ * allocation is counted, frees are passed through: net memory usage hides
+ * churn, these counters do not. Handlers of another extension are chained.
+ */
+static void *tw_alloc_malloc(size_t size)
+{
+	TWG(alloc_bytes) += size;
+	TWG(alloc_count)++;
+
+	if (TWG(mm_malloc)) {
+		return TWG(mm_malloc)(size);
+	}
+
+	return _zend_mm_alloc(TWG(mm_heap), size ZEND_FILE_LINE_CC ZEND_FILE_LINE_EMPTY_CC);
+}
+
+static void tw_alloc_free(void *ptr)
+{
+	if (TWG(mm_free)) {
+		TWG(mm_free)(ptr);
+		return;
+	}
+
+	_zend_mm_free(TWG(mm_heap), ptr ZEND_FILE_LINE_CC ZEND_FILE_LINE_EMPTY_CC);
+}
+
+static void *tw_alloc_realloc(void *ptr, size_t size)
+{
+	TWG(alloc_bytes) += size;
+	TWG(alloc_count)++;
+
+	if (TWG(mm_realloc)) {
+		return TWG(mm_realloc)(ptr, size);
+	}
+
+	return _zend_mm_realloc(TWG(mm_heap), ptr, size ZEND_FILE_LINE_CC ZEND_FILE_LINE_EMPTY_CC);
+}
+#endif
+
+static void tw_alloc_hooks_install(TSRMLS_D)
+{
+	TWG(alloc_bytes) = 0;
+	TWG(alloc_count) = 0;
+
+#if PHP_VERSION_ID >= 70300
+	if (TWG(mm_heap) != NULL) {
+		return;
+	}
+
+	TWG(mm_heap) = zend_mm_get_heap();
+	zend_mm_get_custom_handlers(TWG(mm_heap), &TWG(mm_malloc), &TWG(mm_free), &TWG(mm_realloc));
+	zend_mm_set_custom_handlers(TWG(mm_heap), tw_alloc_malloc, tw_alloc_free, tw_alloc_realloc);
+#endif
+}
+
+static void tw_alloc_hooks_remove(TSRMLS_D)
+{
+#if PHP_VERSION_ID >= 70300
+	if (TWG(mm_heap) == NULL) {
+		return;
+	}
+
+	/* NULL handlers switch the custom heap off again */
+	zend_mm_set_custom_handlers(TWG(mm_heap), TWG(mm_malloc), TWG(mm_free), TWG(mm_realloc));
+
+	TWG(mm_heap) = NULL;
+	TWG(mm_malloc) = NULL;
+	TWG(mm_free) = NULL;
+	TWG(mm_realloc) = NULL;
+#endif
+}
+
+static const char *tw_retention_reasons[] = {NULL, NULL, "latency", "error", "spans"};
+
+static int tw_request_has_error(TSRMLS_D)
+{
+	if (TWG(backtrace) != NULL) {
+		return 1;
+	}
+
+#if PHP_VERSION_ID >= 70000
+	if (Z_TYPE(TWG(exception)) == IS_OBJECT) {
+		return 1;
+	}
+#else
+	if (TWG(exception) != NULL) {
+		return 1;
+	}
+#endif
+
+	if (PG(last_error_message) == NULL ||
+			(PG(last_error_type) & (E_ERROR | E_CORE_ERROR | E_COMPILE_ERROR | E_USER_ERROR | E_RECOVERABLE_ERROR)) == 0) {
+		return 0;
+	}
+
+	/* Only errors raised while profiling, the message is reallocated for
+	 * every error and may get the same address back */
+	return PG(last_error_message) != TWG(error_message_start) ||
+		PG(last_error_type) != TWG(error_type_start) ||
+		(int)PG(last_error_lineno) != TWG(error_lineno_start);
+}
+
+/**
+ * Replaces the edges with the main() edge only and the spans with the root
+ * span only, which carries the breakdown and request annotations.
+ */
+static void tw_retention_drop(TSRMLS_D)
+{
+#if PHP_VERSION_ID >= 70000
+	zval stats, spans, *root;
+
+	array_init(&stats);
+	root = zend_hash_str_find(Z_ARRVAL(TWG(stats_count)), ROOT_SYMBOL, sizeof(ROOT_SYMBOL) - 1);
+	if (root != NULL) {
+		Z_TRY_ADDREF_P(root);
+		zend_hash_str_update(Z_ARRVAL(stats), ROOT_SYMBOL, sizeof(ROOT_SYMBOL) - 1, root);
+	}
+	hp_ptr_dtor(&TWG(stats_count));
+	ZVAL_COPY_VALUE(&TWG(stats_count), &stats);
+
+	array_init(&spans);
+	root = zend_hash_index_find(Z_ARRVAL(TWG(spans)), 0);
+	if (root != NULL) {
+		Z_TRY_ADDREF_P(root);
+		zend_hash_index_update(Z_ARRVAL(spans), 0, root);
+	}
+	hp_ptr_dtor(&TWG(spans));
+	ZVAL_COPY_VALUE(&TWG(spans), &spans);
+#else
+	zval *stats, *spans, **root;
+
+	MAKE_STD_ZVAL(stats);
+	array_init(stats);
+	if (zend_hash_find(Z_ARRVAL_P(TWG(stats_count)), ROOT_SYMBOL, sizeof(ROOT_SYMBOL), (void **)&root) == SUCCESS) {
+		Z_ADDREF_PP(root);
+		zend_hash_update(Z_ARRVAL_P(stats), ROOT_SYMBOL, sizeof(ROOT_SYMBOL), root, sizeof(zval*), NULL);
+	}
+	hp_ptr_dtor(TWG(stats_count));
+	TWG(stats_count) = stats;
+
+	MAKE_STD_ZVAL(spans);
+	array_init(spans);
+	if (zend_hash_index_find(Z_ARRVAL_P(TWG(spans)), 0, (void **)&root) == SUCCESS) {
+		Z_ADDREF_PP(root);
+		zend_hash_index_update(Z_ARRVAL_P(spans), 0, root, sizeof(zval*), NULL);
+	}
+	hp_ptr_dtor(TWG(spans));
+	TWG(spans) = spans;
+#endif
+}
+
+/**
+ * Tail based retention: with tideways.retention_threshold (ms) set the full
+ * profile is only kept for requests that were slow, had an error while
+ * profiling or created at least tideways.retention_spans spans besides the
+ * root span. Other requests keep the main() edge, the root span and the
+ * histograms.
+ */
+static void tw_retention_decide(TSRMLS_D)
+{
+	double wt;
+
+	if (TWG(retention_threshold) <= 0) {
+		TWG(retention_reason) = TIDEWAYS_RETENTION_OFF;
+		return;
+	}
+
+	wt = get_us_from_tsc(cycle_timer(TSRMLS_C) - TWG(start_time) TSRMLS_CC);
+
+	if (tw_request_has_error(TSRMLS_C)) {
+		TWG(retention_reason) = TIDEWAYS_RETENTION_ERROR;
+	} else if (wt >= TWG(retention_threshold) * 1000.0) {
+		TWG(retention_reason) = TIDEWAYS_RETENTION_LATENCY;
+	} else if (TWG(retention_spans) > 0 && zend_hash_num_elements(TWG_ARRVAL(TWG(spans))) - 1 >= TWG(retention_spans)) {
+		TWG(retention_reason) = TIDEWAYS_RETENTION_SPANS;
+	} else {
+		TWG(retention_reason) = TIDEWAYS_RETENTION_DROPPED;
+		tw_retention_drop(TSRMLS_C);
+		return;
+	}
+
+	tw_span_annotate_string(0, "retain", (char *)tw_retention_reasons[TWG(retention_reason)], 1 TSRMLS_CC);
+}
+
+/**
+ * Degrades the flags of the next profile while the decayed overhead of the
+ * previous ones exceeds tideways.overhead_budget, one step per profile,
+ * and recovers once it dropped below half the budget.
+ */
+static void tw_overhead_adapt(TSRMLS_D)
+{
+	if (TWG(overhead_budget) <= 0) {
+		TWG(overhead_level) = TIDEWAYS_OVERHEAD_FULL;
+		return;
+	}
+
+	if (TWG(overhead_ewma) > TWG(overhead_budget) && TWG(overhead_level) < TIDEWAYS_OVERHEAD_SPANS_ONLY) {
+		TWG(overhead_level)++;
+	} else if (TWG(overhead_ewma) < TWG(overhead_budget) / 2 && TWG(overhead_level) > TIDEWAYS_OVERHEAD_FULL) {
+		TWG(overhead_level)--;
+	}
+
+	if (TWG(overhead_level) >= TIDEWAYS_OVERHEAD_NO_BUILTINS) {
+		TWG(tideways_flags) |= TIDEWAYS_FLAGS_NO_BUILTINS;
+	}
+
+	if (TWG(overhead_level) >= TIDEWAYS_OVERHEAD_SPANS_ONLY) {
+		TWG(tideways_flags) |= TIDEWAYS_FLAGS_NO_HIERACHICAL;
+	}
+}
+
+/**
+ * Folds the overhead of the profile that just stopped into the decayed
+ * average and returns it in microseconds.
+ */
+static long tw_overhead_update(TSRMLS_D)
+{
+	double wt = get_us_from_tsc(cycle_timer(TSRMLS_C) - TWG(start_time) TSRMLS_CC);
+	double overhead = get_us_from_tsc(TWG(overhead_tsc) TSRMLS_CC);
+	double percent;
+
+	if (wt <= 0) {
+		return (long)overhead;
+	}
+
+	percent = MIN(overhead * 100 / wt, 100);
+
+	if (TWG(overhead_ewma) == 0) {
+		TWG(overhead_ewma) = percent;
+	} else {
+		TWG(overhead_ewma) = TIDEWAYS_OVERHEAD_DECAY * percent + (1 - TIDEWAYS_OVERHEAD_DECAY) * TWG(overhead_ewma);
+	}
+
+	return (long)overhead;
+}
+
+/**
+ * Measures what one profiled call costs its callers: a frame makes
+ * TIDEWAYS_CALIBRATION_CALLS calls to an empty function through the regular
+ * callbacks and the cheapest of TIDEWAYS_CALIBRATION_ROUNDS rounds is kept.
+ * Runs on the first profile of each flag combination in this worker, the
+ * flags are only known once profiling is enabled.
+ */
+static tw_calibration *tw_calibration_get(TSRMLS_D)
+{
+	uint32 flags = TWG(tideways_flags) & TIDEWAYS_CALIBRATION_FLAGS;
+	tw_calibration *calibration;
+	uint64 wt_start, cpu_start;
+	double wt, cpu;
+	int profile_curr, call_curr, filtered_type, round, i;
+
+	for (i = 0; i < TWG(calibrations_count); i++) {
+		if (TWG(calibrations)[i].flags == flags) {
+			return &TWG(calibrations)[i];
+		}
+	}
+
+	if (TWG(calibrations_count) < TIDEWAYS_CALIBRATIONS) {
+		calibration = &TWG(calibrations)[TWG(calibrations_count)++];
+	} else {
+		calibration = &TWG(calibrations)[TIDEWAYS_CALIBRATIONS - 1];
+	}
+
+	calibration->flags = flags;
+	calibration->wt = 0;
+	calibration->cpu = 0;
+
+	/* Ignored functions must not skip the calibration frames */
+	filtered_type = TWG(filtered_type);
+	TWG(filtered_type) = 0;
+
+	for (round = 0; round < TIDEWAYS_CALIBRATION_ROUNDS; round++) {
+		BEGIN_PROFILING(&TWG(entries), "tideways_calibrate", profile_curr, NULL);
+
+		wt_start = cycle_timer(TSRMLS_C);
+		cpu_start = cpu_timer();
+
+		for (i = 0; i < TIDEWAYS_CALIBRATION_CALLS; i++) {
+			BEGIN_PROFILING(&TWG(entries), "tideways_calibrate_call", call_curr, NULL);
+			END_PROFILING(&TWG(entries), call_curr, NULL);
+		}
+
+		wt = get_us_from_tsc(cycle_timer(TSRMLS_C) - wt_start TSRMLS_CC) / TIDEWAYS_CALIBRATION_CALLS;
+		cpu = get_us_from_tsc(cpu_timer() - cpu_start TSRMLS_CC) / TIDEWAYS_CALIBRATION_CALLS;
+
+		END_PROFILING(&TWG(entries), profile_curr, NULL);
+
+		if (round == 0 || wt < calibration->wt) {
+			calibration->wt = wt;
+		}
+
+		if (round == 0 || cpu < calibration->cpu) {
+			calibration->cpu = cpu;
+		}
+	}
+
+	TWG(filtered_type) = filtered_type;
+
+	/* Throw away the edges, nodes and records of the calibration frames */
+	hp_init_profile_data(TSRMLS_C);
+
+	return calibration;
+}
+
+/**
+ * splitmix64 step of the trace id generator, kept apart from mt_rand() so
+ * that seeded userland sequences stay repeatable.
+ */
+static uint64 tw_trace_id_next(TSRMLS_D)
+{
+	uint64 z = (TWG(trace_id_state) += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+	return z ^ (z >> 31);
+}
+
+/**
+ * Wall clock start of the request and a random trace id for span exports.
+ * Trace ids name the dump files of all workers, so they come from the system
+ * CSPRNG or a private generator seeded per process, never from rand().
+ */
+static void tw_trace_id_init(TSRMLS_D)
+{
+	struct timeval now;
+	uint64 bits = 0;
+	int i;
+
+	gettimeofday(&now, NULL);
+	TWG(start_timestamp) = (uint64)now.tv_sec * 1000000 + now.tv_usec;
+
+#if PHP_VERSION_ID >= 70100
+	if (php_random_bytes_silent(TWG(trace_id), sizeof(TWG(trace_id))) == SUCCESS) {
+		return;
+	}
+#endif
+
+	/* Mixed in on every profile, processes forked after the state was used
+	 * still diverge by pid */
+	TWG(trace_id_state) ^= TWG(start_timestamp) ^ ((uint64)getpid() << 32) ^ (uint64)(zend_uintptr_t)&now;
+
+	for (i = 0; i < (int)sizeof(TWG(trace_id)); i++) {
+		if (i % 8 == 0) {
+			bits = tw_trace_id_next(TSRMLS_C);
+		}
+
+		TWG(trace_id)[i] = (unsigned char)(bits & 0xFF);
+		bits >>= 8;
+	}
+}
+
+static void hp_begin(long tideways_flags TSRMLS_DC)
+{
+	if (!TWG(enabled)) {
+		int hp_profile_flag = 1;
+
+		TWG(enabled) = 1;
+		TWG(tideways_flags) = (uint32)tideways_flags;
+
+#if PHP_VERSION_ID < 70300
+		/* Zend MM handlers can only be replaced and removed again from
+		 * PHP 7.3, before that NULL handlers do not turn the custom heap off */
+		TWG(tideways_flags) &= ~TIDEWAYS_FLAGS_ALLOCATIONS;
+#endif
+
+		tw_overhead_adapt(TSRMLS_C);
+
+		/* one time initializations */
+		hp_init_profiler_state(TSRMLS_C);
+
+		TWG(calibration) = TWG(calibrate) ? tw_calibration_get(TSRMLS_C) : NULL;
+
+		/* start profiling from fictitious main() */
+		TWG(root) = estrdup(ROOT_SYMBOL);
+		TWG(start_time) = cycle_timer(TSRMLS_C);
+		TWG(span_stack_depth) = 0;
+		tw_trace_id_init(TSRMLS_C);
+
+		TWG(error_message_start) = PG(last_error_message);
+		TWG(error_type_start) = PG(last_error_type);
+		TWG(error_lineno_start) = (int)PG(last_error_lineno);
+
+		if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
+			TWG(cpu_start) = cpu_timer();
+		}
+
+		tw_span_create("app", 3 TSRMLS_CC);
+		tw_span_timer_start(0 TSRMLS_CC);
+
+		if (TWG(tideways_flags) & TIDEWAYS_FLAGS_ALLOCATIONS) {
+			tw_alloc_hooks_install(TSRMLS_C);
+		}
+
+		BEGIN_PROFILING(&TWG(entries), TWG(root), hp_profile_flag, NULL);
+	}
+}
+
+/**
+ * Called at request shutdown time. Cleans the profiler's global state.
+ */
+static void hp_end(TSRMLS_D)
+{
+	/* Bail if not ever enabled */
+	if (!TWG(ever_enabled)) {
+		return;
+	}
+
+	/* Stop profiler if enabled */
+	if (TWG(enabled)) {
+		hp_stop(TSRMLS_C);
+	}
+
+	/* Clean up state */
+	hp_clean_profiler_state(TSRMLS_C);
+}
+
+/**
+ * Called from tideways_disable(). Removes all the proxies setup by
+ * hp_begin() and restores the original values.
+ */
+static void hp_stop(TSRMLS_D)
+{
+	int hp_profile_flag = 1;
+	char key[SCRATCH_BUF_LEN];
+	long overhead;
+	int i;
+
+	/* End any unfinished calls */
+	while (TWG(entries)) {
+		END_PROFILING(&TWG(entries), hp_profile_flag, NULL);
+	}
+
+	overhead = tw_overhead_update(TSRMLS_C);
+
+	tw_alloc_hooks_remove(TSRMLS_C);
+
+	tw_curl_multi_stop_all(TSRMLS_C);
+	tw_span_timer_stop(0 TSRMLS_CC);
+
+	if ((TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) == 0) {
+		if ((GC_G(gc_runs) - TWG(gc_runs)) > 0) {
+			tw_span_annotate_long(0, "gc", GC_G(gc_runs) - TWG(gc_runs) TSRMLS_CC);
+			tw_span_annotate_long(0, "gcc", GC_G(collected) - TWG(gc_collected) TSRMLS_CC);
+		}
+
+		if (TWG(compile_count) > 0) {
+			tw_span_annotate_long(0, "cct", TWG(compile_count) TSRMLS_CC);
+		}
+		if (TWG(compile_wt) > 0) {
+			tw_span_annotate_long(0, "cwt", TWG(compile_wt) TSRMLS_CC);
+		}
+
+		tw_span_annotate_long(0, "cpu", get_us_from_tsc(cpu_timer() - TWG(cpu_start) TSRMLS_CC) TSRMLS_CC);
+
+		/* Only profiles kept within a budget report their overhead on the
+		 * root span, the profiler stats always have it */
+		if (TWG(overhead_budget) > 0) {
+			tw_span_annotate_long(0, "overhead", overhead TSRMLS_CC);
+
+			if (TWG(overhead_level) != TIDEWAYS_OVERHEAD_FULL) {
+				tw_span_annotate_long(0, "overhead_level", TWG(overhead_level) TSRMLS_CC);
+			}
+		}
+
+		tw_pdo_fetch_flush(TSRMLS_C);
+		tw_span_counts_flush(TSRMLS_C);
+		tw_span_breakdown_compute(TSRMLS_C);
+
+		for (i = 0; i < TWG(span_categories_count); i++) {
+			snprintf(key, sizeof(key), "%s.wt", TWG(span_categories)[i].name);
+			tw_span_annotate_long(0, key, TWG(span_categories)[i].wt TSRMLS_CC);
+		}
+	}
+
+	/* Before retention, the shared table counts every profile in full */
+	tw_shm_merge(TSRMLS_C);
+
+	tw_retention_decide(TSRMLS_C);
+
+	if (TWG(root)) {
+		efree(TWG(root));
+		TWG(root) = NULL;
+	}
+
+	/* Stop profiling */
+	TWG(enabled) = 0;
+}
+
+
+/**
+ * *****************************
+ * TIDEWAYS ZVAL UTILITY FUNCTIONS
+ * *****************************
+ */
+
+/** Look in the PHP assoc array to find a key and return the zval associated
+ *  with it.
+ *
+ *  @author mpal
+ **/
+static zval *hp_zval_at_key(char *key, size_t size, zval *values)
+{
+	if (Z_TYPE_P(values) == IS_ARRAY) {
+		HashTable *ht = Z_ARRVAL_P(values);
+
+		return zend_compat_hash_find_const(ht, key, size-1);
+	}
+
+	return NULL;
+}
+
+/**
+ *  Convert the PHP array of strings to an emalloced array of strings. Note,
+ *  this method duplicates the string data in the PHP array.
+ *
+ *  @author mpal
+ **/
+static char **hp_strings_in_zval(zval *values)
+{
+	char   **result;
+	size_t   count;
+	size_t   ix = 0;
+#if PHP_VERSION_ID < 70000
+	char  *str;
+#else
+	zend_string *str;
+#endif
+	uint   len;
+	ulong  idx;
+	int    type;
+	zval **data, *val;
+
+	if (!values) {
+		return NULL;
+	}
+
+	if (Z_TYPE_P(values) == IS_ARRAY) {
+		HashTable *ht;
+
+		ht    = Z_ARRVAL_P(values);
+		count = zend_hash_num_elements(ht);
+
+		if((result =
+					(char**)emalloc(sizeof(char*) * (count + 1))) == NULL) {
+			return result;
+		}
+
+#if PHP_VERSION_ID < 70000
+		for (zend_hash_internal_pointer_reset(ht);
+				zend_hash_has_more_elements(ht) == SUCCESS;
+				zend_hash_move_forward(ht)) {
+
+			type = zend_hash_get_current_key_ex(ht, &str, &len, &idx, 0, NULL);
+			if (type == HASH_KEY_IS_LONG) {
+				if ((zend_hash_get_current_data(ht, (void**)&data) == SUCCESS) &&
+						Z_TYPE_PP(data) == IS_STRING &&
+						strcmp(Z_STRVAL_PP(data), ROOT_SYMBOL)) { /* do not ignore "main" */
+					result[ix] = estrdup(Z_STRVAL_PP(data));
+					ix++;
+				}
+			} else if (type == HASH_KEY_IS_STRING) {
+				result[ix] = estrdup(str);
+				ix++;
+			}
+		}
+#else
+		ZEND_HASH_FOREACH_KEY_VAL(ht, idx, str, val) {
+			if (str) {
+				result[ix] = estrdup(ZSTR_VAL(str));
 			} else {
 				result[ix] = estrdup(Z_STRVAL_P(val));
 			}
@@ -3229,371 +7714,889 @@ static char **hp_strings_in_zval(zval *values)
 		} ZEND_HASH_FOREACH_END();
 #endif
 
-	} else if(Z_TYPE_P(values) == IS_STRING) {
-		if((result = (char**)emalloc(sizeof(char*) * 2)) == NULL) {
-			return result;
-		}
-		result[0] = estrdup(Z_STRVAL_P(values));
-		ix = 1;
-	} else {
-		result = NULL;
+	} else if(Z_TYPE_P(values) == IS_STRING) {
+		if((result = (char**)emalloc(sizeof(char*) * 2)) == NULL) {
+			return result;
+		}
+		result[0] = estrdup(Z_STRVAL_P(values));
+		ix = 1;
+	} else {
+		result = NULL;
+	}
+
+	/* NULL terminate the array */
+	if (result != NULL) {
+		result[ix] = NULL;
+	}
+
+	return result;
+}
+
+/* Free this memory at the end of profiling */
+static inline void hp_array_del(char **name_array)
+{
+	if (name_array != NULL) {
+		int i = 0;
+		for(; name_array[i] != NULL && i < TIDEWAYS_MAX_FILTERED_FUNCTIONS; i++) {
+			efree(name_array[i]);
+		}
+		efree(name_array);
+	}
+}
+
+#if PHP_VERSION_ID >= 70000
+int tw_gc_collect_cycles(void)
+{
+	int ret;
+	long spanId;
+
+	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
+		return tw_original_gc_collect_cycles();
+	}
+
+	spanId = tw_span_create("gc", 2 TSRMLS_CC);
+	tw_span_timer_start(spanId TSRMLS_CC);
+	tw_span_push(spanId TSRMLS_CC);
+
+	if (TWG(entries)) {
+		tw_span_annotate_string(spanId, "title", TWG(entries)->name_hprof, 1 TSRMLS_CC);
+	}
+
+	ret = tw_original_gc_collect_cycles();
+
+	tw_span_pop(spanId TSRMLS_CC);
+	tw_span_timer_stop(spanId TSRMLS_CC);
+
+	return ret;
+}
+#endif
+
+#if PHP_VERSION_ID < 70000
+void tideways_error_cb(int type, const char *error_filename, const uint error_lineno, const char *format, va_list args)
+{
+	error_handling_t  error_handling;
+	zval *backtrace;
+	TSRMLS_FETCH();
+
+#if (PHP_MAJOR_VERSION == 5 && PHP_MINOR_VERSION >= 3) || PHP_MAJOR_VERSION >= 6
+	error_handling  = EG(error_handling);
+#else
+	error_handling  = PG(error_handling);
+#endif
+
+	if (error_handling == EH_NORMAL) {
+		switch (type) {
+			case E_ERROR:
+			case E_CORE_ERROR:
+				ALLOC_INIT_ZVAL(backtrace);
+
+#if PHP_VERSION_ID <= 50399
+				zend_fetch_debug_backtrace(backtrace, 1, 0 TSRMLS_CC);
+#else
+				zend_fetch_debug_backtrace(backtrace, 1, 0, 0 TSRMLS_CC);
+#endif
+
+				TWG(backtrace) = backtrace;
+		}
+}
+
+	tideways_original_error_cb(type, error_filename, error_lineno, format, args);
+}
+#else
+static void tideways_throw_exception_hook(zval *exception TSRMLS_DC)
+{
+	zend_class_entry *exception_ce, *ex;
+
+	if (!exception) {
+		return;
+	}
+
+	exception_ce = Z_OBJCE_P(exception);
+	if (instanceof_function(exception_ce, zend_ce_error)) {
+		ZVAL_COPY(&TWG(exception), exception);
+	}
+}
+#endif
+
+PHP_FUNCTION(tideways_span_watch)
+{
+	char *func = NULL, *category = NULL;
+	strsize_t func_len, category_len;
+	tw_trace_callback cb;
+
+	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
+		return;
+	}
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s!", &func, &func_len, &category, &category_len) == FAILURE) {
+		return;
+	}
+
+	if (category != NULL && strcmp(category, "view") == 0) {
+		cb = tw_trace_callback_view_engine;
+	} else if (category != NULL && strcmp(category, "event") == 0) {
+		cb = tw_trace_callback_event_dispatchers;
+	} else {
+		cb = tw_trace_callback_php_call;
+	}
+
+	register_trace_callback_len(func, func_len, cb);
+}
+
+#if PHP_VERSION_ID >= 70000
+static void free_tw_watch_callback(zval *zv)
+{
+	tw_watch_callback *twcb = (tw_watch_callback*)Z_PTR_P(zv);
+	if (Z_TYPE(twcb->fci.function_name) != IS_UNDEF) {
+		zval_ptr_dtor(&twcb->fci.function_name);
+	}
+	if (twcb->fci.object) {
+		zend_object_release(twcb->fci.object);
+	}
+	efree(twcb);
+}
+#else
+static void free_tw_watch_callback(void *twcb)
+{
+	tw_watch_callback *_twcb = *((tw_watch_callback **)twcb);
+	if (_twcb->fci.function_name) {
+		zval_ptr_dtor((zval **)&_twcb->fci.function_name);
+	}
+	if (_twcb->fci.object_ptr) {
+		zval_ptr_dtor((zval **)&_twcb->fci.object_ptr);
+	}
+
+	efree(_twcb);
+}
+#endif
+
+static void tideways_add_callback_watch(zend_fcall_info fci, zend_fcall_info_cache fcic, char *func, int func_len TSRMLS_DC)
+{
+	tw_watch_callback *twcb;
+	tw_trace_callback cb;
+
+	twcb = emalloc(sizeof(tw_watch_callback));
+	twcb->fci = fci;
+	twcb->fcic = fcic;
+
+	if (TWG(trace_watch_callbacks) == NULL) {
+		ALLOC_HASHTABLE(TWG(trace_watch_callbacks));
+		zend_hash_init(TWG(trace_watch_callbacks), 255, NULL, free_tw_watch_callback, 0);
+	}
+
+#if PHP_VERSION_ID < 70000
+	zend_hash_update(TWG(trace_watch_callbacks), func, func_len+1, &twcb, sizeof(tw_watch_callback*), NULL);
+#else
+	zend_hash_str_update_mem(TWG(trace_watch_callbacks), func, func_len, twcb, sizeof(tw_watch_callback));
+	efree(twcb); // zend_hash_str_update_mem makes a copy
+#endif
+	cb = tw_trace_callback_watch;
+	register_trace_callback_len(func, func_len, cb);
+}
+
+PHP_FUNCTION(tideways_span_callback)
+{
+	zend_fcall_info fci = empty_fcall_info;
+	zend_fcall_info_cache fcic = empty_fcall_info_cache;
+	char *func;
+	strsize_t func_len;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sf", &func, &func_len, &fci, &fcic) == FAILURE) {
+		zend_error(E_ERROR, "tideways_callback_watch() expects a string as a first and a callback as a second argument");
+		return;
+	}
+
+#if PHP_VERSION_ID < 70000
+	if (fci.size) {
+		Z_ADDREF_P(fci.function_name);
+		if (fci.object_ptr) {
+			Z_ADDREF_P(fci.object_ptr);
+		}
+	}
+#else
+	if (fci.size > 0) {
+		Z_TRY_ADDREF(fci.function_name);
+
+		if (fci.object != NULL) {
+			GC_REFCOUNT(fci.object)++;
+		}
+	}
+#endif
+
+	tideways_add_callback_watch(fci, fcic, func, func_len TSRMLS_CC);
+}
+
+/**
+ * **********************************
+ * PHP EXTENSION FUNCTION DEFINITIONS
+ * **********************************
+ */
+
+/**
+ * Start Tideways profiling in hierarchical mode.
+ *
+ * @param  long $flags  flags for hierarchical mode
+ * @return void
+ * @author kannan
+ */
+PHP_FUNCTION(xhprof_enable)
+{
+	zend_long tideways_flags = 0;
+	zval *optional_array = NULL;
+#if defined(PHP_WIN32)
+	unsigned __int64 frequency;
+#endif
+
+	if (TWG(enabled)) {
+		hp_stop(TSRMLS_C);
+	}
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+				"|lz", &tideways_flags, &optional_array) == FAILURE) {
+		return;
+	}
+
+	hp_parse_options_from_arg(optional_array TSRMLS_CC);
+
+#if defined(PHP_WIN32)
+	if (!QueryPerformanceFrequency( (LARGE_INTEGER*)&frequency)) {
+		zend_error(E_ERROR, "QueryPerformanceFrequency");
+	}
+	TWG(frequency) = (double)frequency/1000000.0;
+#endif
+
+	hp_begin(tideways_flags TSRMLS_CC);
+}
+
+/**
+ * Stops Tideways from profiling  and returns the profile info.
+ *
+ * Passing array('functions' => true) as options returns an array with the
+ * edges under the key "edges" and per function inclusive and exclusive
+ * metrics under the key "functions". With array('profiler' => true) the
+ * memory used by the profiler and the edge budget are returned under the
+ * key "profiler".
+ *
+ * Profiles enabled with the "calibrate" option or tideways.calibrate
+ * additionally carry corr_wt and corr_cpu on every edge, the raw times
+ * minus the calibrated profiler cost of all calls made below the edge.
+ *
+ * The options "top_n" and "min_share" prune the edges to the most expensive
+ * ones ranked by "metric" (wt, cpu, excl_wt, excl_cpu, defaults to wt),
+ * see hp_prune_stats().
+ *
+ * @param  array $options
+ * @return array  hash-array of Tideways's profile info
+ * @author cjiang
+ */
+PHP_FUNCTION(xhprof_disable)
+{
+	zval *options = NULL, *option;
+	long top_n = -1;
+	double min_share = 0;
+	char *metric = "wt";
+	int prune = 0, with_functions, with_profiler;
+#if PHP_VERSION_ID >= 70000
+	zval edges, functions, profiler;
+#else
+	zval *edges, *functions, *profiler;
+#endif
+
+	if (!TWG(enabled)) {
+		return;
 	}
 
-	/* NULL terminate the array */
-	if (result != NULL) {
-		result[ix] = NULL;
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|a!", &options) == FAILURE) {
+		return;
 	}
 
-	return result;
-}
+	hp_stop(TSRMLS_C);
 
-/* Free this memory at the end of profiling */
-static inline void hp_array_del(char **name_array)
-{
-	if (name_array != NULL) {
-		int i = 0;
-		for(; name_array[i] != NULL && i < TIDEWAYS_MAX_FILTERED_FUNCTIONS; i++) {
-			efree(name_array[i]);
+	if (options != NULL) {
+		option = hp_zval_at_key("top_n", sizeof("top_n"), options);
+		if (option != NULL && Z_TYPE_P(option) != IS_NULL) {
+			top_n = (long)hp_zval_number(option);
+			prune = 1;
 		}
-		efree(name_array);
-	}
-}
 
-#if PHP_VERSION_ID >= 70000
-int tw_gc_collect_cycles(void)
-{
-	int ret;
-	long spanId;
+		option = hp_zval_at_key("min_share", sizeof("min_share"), options);
+		if (option != NULL && Z_TYPE_P(option) != IS_NULL) {
+			min_share = hp_zval_number(option);
+			prune = 1;
+		}
 
-	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
-		return tw_original_gc_collect_cycles();
+		option = hp_zval_at_key("metric", sizeof("metric"), options);
+		if (option != NULL && Z_TYPE_P(option) == IS_STRING) {
+			metric = Z_STRVAL_P(option);
+		}
 	}
 
-	spanId = tw_span_create("gc", 2 TSRMLS_CC);
-	tw_span_timer_start(spanId TSRMLS_CC);
-
-	if (TWG(entries)) {
-		tw_span_annotate_string(spanId, "title", TWG(entries)->name_hprof, 1 TSRMLS_CC);
+#if PHP_VERSION_ID >= 70000
+	if (prune) {
+		hp_prune_stats(&edges, top_n, min_share, metric TSRMLS_CC);
+	} else {
+		ZVAL_COPY(&edges, &TWG(stats_count));
+	}
+#else
+	if (prune) {
+		MAKE_STD_ZVAL(edges);
+		hp_prune_stats(edges, top_n, min_share, metric TSRMLS_CC);
+	} else {
+		edges = TWG(stats_count);
+		Z_ADDREF_P(edges);
 	}
+#endif
 
-	ret = tw_original_gc_collect_cycles();
+	option = options != NULL ? hp_zval_at_key("functions", sizeof("functions"), options) : NULL;
+	with_functions = option != NULL && zend_is_true(option);
 
-	tw_span_timer_stop(spanId TSRMLS_CC);
+	option = options != NULL ? hp_zval_at_key("profiler", sizeof("profiler"), options) : NULL;
+	with_profiler = option != NULL && zend_is_true(option);
 
-	return ret;
-}
+	if (!with_functions && !with_profiler) {
+#if PHP_VERSION_ID >= 70000
+		RETURN_ZVAL(&edges, 0, 0);
+#else
+		RETURN_ZVAL(edges, 1, 1);
 #endif
+	}
 
-#if PHP_VERSION_ID < 70000
-void tideways_error_cb(int type, const char *error_filename, const uint error_lineno, const char *format, va_list args)
-{
-	error_handling_t  error_handling;
-	zval *backtrace;
-	TSRMLS_FETCH();
+	array_init(return_value);
 
-#if (PHP_MAJOR_VERSION == 5 && PHP_MINOR_VERSION >= 3) || PHP_MAJOR_VERSION >= 6
-	error_handling  = EG(error_handling);
+#if PHP_VERSION_ID >= 70000
+	add_assoc_zval(return_value, "edges", &edges);
 #else
-	error_handling  = PG(error_handling);
+	add_assoc_zval(return_value, "edges", edges);
 #endif
 
-	if (error_handling == EH_NORMAL) {
-		switch (type) {
-			case E_ERROR:
-			case E_CORE_ERROR:
-				ALLOC_INIT_ZVAL(backtrace);
+	if (with_functions) {
+#if PHP_VERSION_ID >= 70000
+		hp_function_stats(&functions TSRMLS_CC);
+		add_assoc_zval(return_value, "functions", &functions);
+#else
+		MAKE_STD_ZVAL(functions);
+		hp_function_stats(functions TSRMLS_CC);
+		add_assoc_zval(return_value, "functions", functions);
+#endif
+	}
 
-#if PHP_VERSION_ID <= 50399
-				zend_fetch_debug_backtrace(backtrace, 1, 0 TSRMLS_CC);
+	if (with_profiler) {
+#if PHP_VERSION_ID >= 70000
+		array_init(&profiler);
+		hp_profiler_stats(&profiler TSRMLS_CC);
+		add_assoc_zval(return_value, "profiler", &profiler);
 #else
-				zend_fetch_debug_backtrace(backtrace, 1, 0, 0 TSRMLS_CC);
+		MAKE_STD_ZVAL(profiler);
+		array_init(profiler);
+		hp_profiler_stats(profiler TSRMLS_CC);
+		add_assoc_zval(return_value, "profiler", profiler);
 #endif
+	}
+}
 
-				TWG(backtrace) = backtrace;
-		}
+PHP_FUNCTION(tideways_transaction_name)
+{
+	if (TWG(transaction_name)) {
+		RETURN_STR_COPY(TWG(transaction_name));
+	}
 }
 
-	tideways_original_error_cb(type, error_filename, error_lineno, format, args);
+PHP_FUNCTION(tideways_prepend_overwritten)
+{
+	RETURN_BOOL(TWG(prepend_overwritten));
 }
-#else
-static void tideways_throw_exception_hook(zval *exception TSRMLS_DC)
+
+PHP_FUNCTION(tideways_fatal_backtrace)
 {
-	zend_class_entry *exception_ce, *ex;
+	if (TWG(backtrace) != NULL) {
+		RETURN_ZVAL(TWG(backtrace), 1, 1);
+	}
+}
 
-	if (!exception) {
+PHP_FUNCTION(tideways_last_detected_exception)
+{
+#if PHP_VERSION_ID >= 70000
+	RETURN_ZVAL(&TWG(exception), 1, 0);
+#else
+	if (TWG(exception) != NULL) {
+		RETURN_ZVAL(TWG(exception), 1, 0);
+	}
+#endif
+}
+
+PHP_FUNCTION(tideways_last_fatal_error)
+{
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "") == FAILURE) {
 		return;
 	}
 
-	exception_ce = Z_OBJCE_P(exception);
-	if (instanceof_function(exception_ce, zend_ce_error)) {
-		ZVAL_COPY(&TWG(exception), exception);
+	if (PG(last_error_message)) {
+		array_init(return_value);
+#if PHP_VERSION_ID < 70000
+		add_assoc_long_ex(return_value, "type", sizeof("type"), PG(last_error_type));
+		add_assoc_string_ex(return_value, "message", sizeof("message"), PG(last_error_message), 1);
+		add_assoc_string_ex(return_value, "file", sizeof("file"), PG(last_error_file)?PG(last_error_file):"-", 1 );
+		add_assoc_long_ex(return_value, "line", sizeof("line"), PG(last_error_lineno));
+#else
+		add_assoc_long_ex(return_value, "type", sizeof("type")-1, PG(last_error_type));
+		_add_assoc_string_ex(return_value, "message", sizeof("message"), PG(last_error_message), 1);
+		_add_assoc_string_ex(return_value, "file", sizeof("file"), PG(last_error_file)?PG(last_error_file):"-", 1);
+		add_assoc_long_ex(return_value, "line", sizeof("line")-1, PG(last_error_lineno));
+#endif
 	}
 }
+
+#if PHP_VERSION_ID < 70000
+static int tw_convert_to_string(void *pDest TSRMLS_DC)
+{
+	zval **zv = (zval **) pDest;
+#else
+static int tw_convert_to_string(zval *pDest TSRMLS_DC)
+{
+	zval *zv = pDest;
 #endif
 
-PHP_FUNCTION(tideways_span_watch)
+	convert_to_string_ex(zv);
+
+	return ZEND_HASH_APPLY_KEEP;
+}
+
+PHP_FUNCTION(tideways_span_create)
 {
-	char *func = NULL, *category = NULL;
-	strsize_t func_len, category_len;
-	tw_trace_callback cb;
+	char *category = NULL;
+	strsize_t category_len;
 
-	if (!TWG(enabled) || (TWG(tideways_flags) & TIDEWAYS_FLAGS_NO_SPANS) > 0) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &category, &category_len) == FAILURE) {
 		return;
 	}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s!", &func, &func_len, &category, &category_len) == FAILURE) {
+	if (TWG(enabled) == 0) {
 		return;
 	}
 
-	if (category != NULL && strcmp(category, "view") == 0) {
-		cb = tw_trace_callback_view_engine;
-	} else if (category != NULL && strcmp(category, "event") == 0) {
-		cb = tw_trace_callback_event_dispatchers;
-	} else {
-		cb = tw_trace_callback_php_call;
-	}
-
-	register_trace_callback_len(func, func_len, cb);
+	RETURN_LONG(tw_span_create(category, category_len TSRMLS_CC));
 }
 
-#if PHP_VERSION_ID >= 70000
-static void free_tw_watch_callback(zval *zv)
+PHP_FUNCTION(tideways_get_spans)
 {
-	tw_watch_callback *twcb = (tw_watch_callback*)Z_PTR_P(zv);
-	if (Z_TYPE(twcb->fci.function_name) != IS_UNDEF) {
-		zval_ptr_dtor(&twcb->fci.function_name);
-	}
-	if (twcb->fci.object) {
-		zend_object_release(twcb->fci.object);
+	tw_pdo_fetch_flush(TSRMLS_C);
+	tw_span_counts_flush(TSRMLS_C);
+
+#if PHP_VERSION_ID >= 70000
+    RETURN_ZVAL(&TWG(spans), 1, 0);
+#else
+	if (TWG(spans)) {
+		RETURN_ZVAL(TWG(spans), 1, 0);
 	}
-	efree(twcb);
+#endif
 }
-#else
-static void free_tw_watch_callback(void *twcb)
+
+/**
+ * Returns the wall time in microseconds spent per span category, computed
+ * when the profiler was stopped. Overlapping spans of the same category
+ * are only counted once.
+ */
+PHP_FUNCTION(tideways_span_breakdown)
 {
-	tw_watch_callback *_twcb = *((tw_watch_callback **)twcb);
-	if (_twcb->fci.function_name) {
-		zval_ptr_dtor((zval **)&_twcb->fci.function_name);
+	int i;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "") == FAILURE) {
+		return;
 	}
-	if (_twcb->fci.object_ptr) {
-		zval_ptr_dtor((zval **)&_twcb->fci.object_ptr);
+
+	array_init(return_value);
+
+	for (i = 0; i < TWG(span_categories_count); i++) {
+		add_assoc_long(return_value, TWG(span_categories)[i].name, TWG(span_categories)[i].wt);
 	}
 
-	efree(_twcb);
+	if (TWG(compile_count) > 0) {
+		add_assoc_long(return_value, "compile", TWG(compile_wt));
+	}
 }
-#endif
 
-static void tideways_add_callback_watch(zend_fcall_info fci, zend_fcall_info_cache fcic, char *func, int func_len TSRMLS_DC)
+/**
+ * Returns count, p50, p95, p99 and max wall time in microseconds per function
+ * (with XHPROF_FLAGS_HISTOGRAMS) and per span category.
+ */
+PHP_FUNCTION(tideways_get_histograms)
 {
-	tw_watch_callback *twcb;
-	tw_trace_callback cb;
-
-	twcb = emalloc(sizeof(tw_watch_callback));
-	twcb->fci = fci;
-	twcb->fcic = fcic;
+	_DECLARE_ZVAL(functions);
+	_DECLARE_ZVAL(spans);
+	tw_histogram *histogram;
 
-	if (TWG(trace_watch_callbacks) == NULL) {
-		ALLOC_HASHTABLE(TWG(trace_watch_callbacks));
-		zend_hash_init(TWG(trace_watch_callbacks), 255, NULL, free_tw_watch_callback, 0);
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "") == FAILURE) {
+		return;
 	}
 
+	array_init(return_value);
+
 #if PHP_VERSION_ID < 70000
-	zend_hash_update(TWG(trace_watch_callbacks), func, func_len+1, &twcb, sizeof(tw_watch_callback*), NULL);
+	MAKE_STD_ZVAL(functions);
+	MAKE_STD_ZVAL(spans);
+#endif
+	array_init(functions);
+	array_init(spans);
+
+	if (TWG(histograms) != NULL) {
+#if PHP_VERSION_ID >= 70000
+		zend_string *name;
+
+		ZEND_HASH_FOREACH_STR_KEY_PTR(TWG(histograms), name, histogram) {
+			tw_histogram_add_summary(functions, ZSTR_VAL(name), ZSTR_LEN(name), histogram TSRMLS_CC);
+		} ZEND_HASH_FOREACH_END();
 #else
-	zend_hash_str_update_mem(TWG(trace_watch_callbacks), func, func_len, twcb, sizeof(tw_watch_callback));
-	efree(twcb); // zend_hash_str_update_mem makes a copy
+		HashPosition pos;
+		char *name;
+		uint name_len;
+		ulong num_key;
+
+		for (zend_hash_internal_pointer_reset_ex(TWG(histograms), &pos);
+			zend_hash_get_current_data_ex(TWG(histograms), (void **)&histogram, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(TWG(histograms), &pos)) {
+			if (zend_hash_get_current_key_ex(TWG(histograms), &name, &name_len, &num_key, 0, &pos) == HASH_KEY_IS_STRING) {
+				tw_histogram_add_summary(functions, name, name_len - 1, histogram TSRMLS_CC);
+			}
+		}
 #endif
-	cb = tw_trace_callback_watch;
-	register_trace_callback_len(func, func_len, cb);
+	}
+
+	tw_histograms_spans(spans TSRMLS_CC);
+
+	add_assoc_zval(return_value, "functions", functions);
+	add_assoc_zval(return_value, "spans", spans);
 }
 
-PHP_FUNCTION(tideways_span_callback)
+/**
+ * Returns an export as string, or writes it to path and returns true.
+ * Takes ownership of out.
+ */
+static void tw_export_result(smart_str *out, char *path, zval *return_value TSRMLS_DC)
 {
-	zend_fcall_info fci = empty_fcall_info;
-	zend_fcall_info_cache fcic = empty_fcall_info_cache;
-	char *func;
-	strsize_t func_len;
+	php_stream *stream;
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sf", &func, &func_len, &fci, &fcic) == FAILURE) {
-		zend_error(E_ERROR, "tideways_callback_watch() expects a string as a first and a callback as a second argument");
-		return;
-	}
+	smart_str_0(out);
 
-#if PHP_VERSION_ID < 70000
-	if (fci.size) {
-		Z_ADDREF_P(fci.function_name);
-		if (fci.object_ptr) {
-			Z_ADDREF_P(fci.object_ptr);
+	if (path == NULL) {
+#if PHP_VERSION_ID >= 70000
+		if (out->s == NULL) {
+			RETURN_EMPTY_STRING();
+		}
+		RETURN_STR(out->s);
+#else
+		if (out->c == NULL) {
+			RETURN_EMPTY_STRING();
 		}
+		RETURN_STRINGL(out->c, out->len, 0);
+#endif
 	}
-#else
-	if (fci.size > 0) {
-		Z_TRY_ADDREF(fci.function_name);
 
-		if (fci.object != NULL) {
-			GC_REFCOUNT(fci.object)++;
-		}
+	stream = php_stream_open_wrapper(path, "wb", REPORT_ERRORS, NULL);
+
+	if (stream == NULL) {
+		smart_str_free(out);
+		RETURN_FALSE;
 	}
-#endif
 
-	tideways_add_callback_watch(fci, fcic, func, func_len TSRMLS_CC);
+	php_stream_write(stream, TW_SMART_STR_VAL(*out), TW_SMART_STR_LEN(*out));
+	php_stream_close(stream);
+	smart_str_free(out);
+
+	RETURN_TRUE;
 }
 
 /**
- * **********************************
- * PHP EXTENSION FUNCTION DEFINITIONS
- * **********************************
+ * Exports the calling context tree recorded with XHPROF_FLAGS_CCT as
+ * "collapsed" stacks (flamegraph.pl), "callgrind" (KCachegrind) or "pprof"
+ * (gzip'd profile.proto). Returns the profile, or writes it to $path
+ * and returns true.
  */
+PHP_FUNCTION(tideways_cct_export)
+{
+	char *format, *path = NULL;
+	strsize_t format_len, path_len = 0;
+	long *self_wt, *self_cpu;
+	int with_cpu = (TWG(tideways_flags) & TIDEWAYS_FLAGS_CPU) > 0;
+	smart_str out = {0}, profile = {0};
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s", &format, &format_len, &path, &path_len) == FAILURE) {
+		return;
+	}
+
+	if (TWG(cct_nodes) == NULL || TWG(cct_count) == 0) {
+		zend_error(E_WARNING, "tideways_cct_export(): No calling context tree recorded, enable profiling with XHPROF_FLAGS_CCT");
+		RETURN_FALSE;
+	}
+
+	self_wt = emalloc(sizeof(long) * TWG(cct_count));
+	self_cpu = emalloc(sizeof(long) * TWG(cct_count));
+	tw_cct_self(TWG(cct_nodes), TWG(cct_count), self_wt, self_cpu);
+
+	if (strcmp(format, "collapsed") == 0) {
+		tw_cct_collapsed(TWG(cct_nodes), TWG(cct_count), self_wt, &out);
+	} else if (strcmp(format, "callgrind") == 0) {
+		tw_cct_callgrind(TWG(cct_nodes), TWG(cct_count), self_wt, self_cpu, with_cpu, &out);
+	} else if (strcmp(format, "pprof") == 0) {
+		tw_cct_pprof(TWG(cct_nodes), TWG(cct_count), self_wt, self_cpu, with_cpu, TWG(cct_nodes)[0].wt, &profile);
+		tw_gzip_stored(TW_SMART_STR_VAL(profile), TW_SMART_STR_LEN(profile), &out);
+		smart_str_free(&profile);
+	} else {
+		zend_error(E_WARNING, "tideways_cct_export(): Unknown format '%s', expected collapsed, callgrind or pprof", format);
+		efree(self_wt);
+		efree(self_cpu);
+		RETURN_FALSE;
+	}
+
+	efree(self_wt);
+	efree(self_cpu);
+
+	tw_export_result(&out, path, return_value TSRMLS_CC);
+}
 
 /**
- * Start Tideways profiling in hierarchical mode.
- *
- * @param  long $flags  flags for hierarchical mode
- * @return void
- * @author kannan
+ * Exports the spans as "chrome" trace event JSON or "otlp" protobuf
+ * (ExportTraceServiceRequest). Options for otlp are trace_id (32 hex
+ * digits), parent_span_id (16 hex digits) and service_name. Returns the
+ * export, or writes it to $path and returns true.
  */
-PHP_FUNCTION(xhprof_enable)
+PHP_FUNCTION(tideways_span_export)
 {
-	zend_long tideways_flags = 0;
-	zval *optional_array = NULL;
-#if defined(PHP_WIN32)
-	unsigned __int64 frequency;
-#endif
-
-	if (TWG(enabled)) {
-		hp_stop(TSRMLS_C);
+	char *format, *path = NULL, *service = "php";
+	strsize_t format_len, path_len = 0;
+	zval *options = NULL, *option;
+	tw_span_interval *intervals;
+	unsigned char trace_id[16];
+	char parent_span_id[8];
+	int count, has_parent = 0;
+	smart_str out = {0};
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s!a", &format, &format_len, &path, &path_len, &options) == FAILURE) {
+		return;
 	}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
-				"|lz", &tideways_flags, &optional_array) == FAILURE) {
-		return;
+	memcpy(trace_id, TWG(trace_id), sizeof(trace_id));
+
+	if (options != NULL) {
+		option = hp_zval_at_key("trace_id", sizeof("trace_id"), options);
+
+		if (option != NULL && (Z_TYPE_P(option) != IS_STRING || !tw_hex_decode(Z_STRVAL_P(option), Z_STRLEN_P(option), trace_id, sizeof(trace_id)))) {
+			zend_error(E_WARNING, "tideways_span_export(): trace_id must be 32 hex digits");
+			RETURN_FALSE;
+		}
+
+		option = hp_zval_at_key("parent_span_id", sizeof("parent_span_id"), options);
+
+		if (option != NULL) {
+			if (Z_TYPE_P(option) != IS_STRING || !tw_hex_decode(Z_STRVAL_P(option), Z_STRLEN_P(option), (unsigned char *)parent_span_id, sizeof(parent_span_id))) {
+				zend_error(E_WARNING, "tideways_span_export(): parent_span_id must be 16 hex digits");
+				RETURN_FALSE;
+			}
+			has_parent = 1;
+		}
+
+		option = hp_zval_at_key("service_name", sizeof("service_name"), options);
+
+		if (option != NULL && Z_TYPE_P(option) == IS_STRING) {
+			service = Z_STRVAL_P(option);
+		}
 	}
 
-	hp_parse_options_from_arg(optional_array TSRMLS_CC);
+	tw_pdo_fetch_flush(TSRMLS_C);
+	tw_span_counts_flush(TSRMLS_C);
 
-#if defined(PHP_WIN32)
-	if (!QueryPerformanceFrequency( (LARGE_INTEGER*)&frequency)) {
-		zend_error(E_ERROR, "QueryPerformanceFrequency");
+	count = tw_span_intervals(&intervals, 1 TSRMLS_CC);
+
+	if (strcmp(format, "chrome") == 0) {
+		tw_span_export_chrome(intervals, count, &out TSRMLS_CC);
+	} else if (strcmp(format, "otlp") == 0) {
+		tw_span_export_otlp(intervals, count, trace_id, has_parent ? parent_span_id : NULL, service, &out TSRMLS_CC);
+	} else {
+		zend_error(E_WARNING, "tideways_span_export(): Unknown format '%s', expected chrome or otlp", format);
+
+		if (intervals != NULL) {
+			efree(intervals);
+		}
+		RETURN_FALSE;
 	}
-	TWG(frequency) = (double)frequency/1000000.0;
-#endif
 
-	hp_begin(tideways_flags TSRMLS_CC);
+	if (intervals != NULL) {
+		efree(intervals);
+	}
+
+	tw_export_result(&out, path, return_value TSRMLS_CC);
 }
 
 /**
- * Stops Tideways from profiling  and returns the profile info.
- *
- * @param  void
- * @return array  hash-array of Tideways's profile info
- * @author cjiang
+ * Dumps the trace ring buffer recorded with XHPROF_FLAGS_TRACE, see
+ * tw_trace_dump() for the format. Writes to $path and returns true, without
+ * $path writes into xhprof.output_dir and returns the file name, or returns
+ * the dump when xhprof.output_dir is not set.
  */
-PHP_FUNCTION(xhprof_disable)
+PHP_FUNCTION(tideways_trace_dump)
 {
-	if (!TWG(enabled)) {
+	char *path = NULL, *output_dir, *generated;
+	strsize_t path_len = 0;
+	char trace_id[33];
+	smart_str out = {0};
+	int i;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|s!", &path, &path_len) == FAILURE) {
 		return;
 	}
 
-	hp_stop(TSRMLS_C);
+	if (TWG(trace_records) == NULL) {
+		zend_error(E_WARNING, "tideways_trace_dump(): No trace recorded, enable profiling with XHPROF_FLAGS_TRACE");
+		RETURN_FALSE;
+	}
+
+	tw_trace_dump(&out TSRMLS_CC);
+
+	output_dir = INI_STR("xhprof.output_dir");
 
+	if (path != NULL || output_dir == NULL || output_dir[0] == '\0') {
+		tw_export_result(&out, path, return_value TSRMLS_CC);
+		return;
+	}
+
+	for (i = 0; i < 16; i++) {
+		snprintf(trace_id + 2 * i, 3, "%02x", TWG(trace_id)[i]);
+	}
+
+	spprintf(&generated, 0, "%s%c%s.tideways_trace", output_dir, DEFAULT_SLASH, trace_id);
+	tw_export_result(&out, generated, return_value TSRMLS_CC);
+
+	if (zend_is_true(return_value TSRMLS_CC)) {
 #if PHP_VERSION_ID >= 70000
-    RETURN_ZVAL(&TWG(stats_count), 1, 0);
+		RETVAL_STRING(generated);
 #else
-	RETURN_ZVAL(TWG(stats_count), 1, 0);
+		RETVAL_STRING(generated, 1);
 #endif
+	}
+
+	efree(generated);
 }
 
-PHP_FUNCTION(tideways_transaction_name)
+/**
+ * Why the full profile was kept with tideways.retention_threshold set:
+ * "error", "latency" or "spans", false when it was reduced to the summary
+ * and null without retention.
+ */
+PHP_FUNCTION(tideways_retention_reason)
 {
-	if (TWG(transaction_name)) {
-		RETURN_STR_COPY(TWG(transaction_name));
+	const char *reason;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "") == FAILURE) {
+		return;
 	}
-}
 
-PHP_FUNCTION(tideways_prepend_overwritten)
-{
-	RETURN_BOOL(TWG(prepend_overwritten));
-}
+	if (TWG(retention_reason) == TIDEWAYS_RETENTION_OFF) {
+		RETURN_NULL();
+	}
 
-PHP_FUNCTION(tideways_fatal_backtrace)
-{
-	if (TWG(backtrace) != NULL) {
-		RETURN_ZVAL(TWG(backtrace), 1, 1);
+	if (TWG(retention_reason) == TIDEWAYS_RETENTION_DROPPED) {
+		RETURN_FALSE;
 	}
-}
 
-PHP_FUNCTION(tideways_last_detected_exception)
-{
+	reason = tw_retention_reasons[TWG(retention_reason)];
+
 #if PHP_VERSION_ID >= 70000
-	RETURN_ZVAL(&TWG(exception), 1, 0);
+	RETURN_STRING(reason);
 #else
-	if (TWG(exception) != NULL) {
-		RETURN_ZVAL(TWG(exception), 1, 0);
-	}
+	RETURN_STRING(reason, 1);
 #endif
 }
 
-PHP_FUNCTION(tideways_last_fatal_error)
+/**
+ * Profiler overhead of the current or last profile in microseconds, the
+ * decayed overhead of this worker in percent, the budget and the resulting
+ * degradation level. sample_rate is tideways.sample_rate lowered by the
+ * share the overhead exceeds the budget.
+ */
+PHP_FUNCTION(tideways_overhead)
 {
+	long sample_rate = INI_INT("tideways.sample_rate");
+
 	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "") == FAILURE) {
 		return;
 	}
 
-	if (PG(last_error_message)) {
-		array_init(return_value);
-#if PHP_VERSION_ID < 70000
-		add_assoc_long_ex(return_value, "type", sizeof("type"), PG(last_error_type));
-		add_assoc_string_ex(return_value, "message", sizeof("message"), PG(last_error_message), 1);
-		add_assoc_string_ex(return_value, "file", sizeof("file"), PG(last_error_file)?PG(last_error_file):"-", 1 );
-		add_assoc_long_ex(return_value, "line", sizeof("line"), PG(last_error_lineno));
-#else
-		add_assoc_long_ex(return_value, "type", sizeof("type")-1, PG(last_error_type));
-		_add_assoc_string_ex(return_value, "message", sizeof("message"), PG(last_error_message), 1);
-		_add_assoc_string_ex(return_value, "file", sizeof("file"), PG(last_error_file)?PG(last_error_file):"-", 1);
-		add_assoc_long_ex(return_value, "line", sizeof("line")-1, PG(last_error_lineno));
-#endif
+	if (TWG(overhead_budget) > 0 && TWG(overhead_ewma) > TWG(overhead_budget)) {
+		sample_rate = (long)(sample_rate * TWG(overhead_budget) / TWG(overhead_ewma));
 	}
+
+	array_init(return_value);
+	add_assoc_long(return_value, "overhead", (long)get_us_from_tsc(TWG(overhead_tsc) TSRMLS_CC));
+	add_assoc_double(return_value, "ewma", TWG(overhead_ewma));
+	add_assoc_double(return_value, "budget", TWG(overhead_budget));
+	add_assoc_long(return_value, "level", TWG(overhead_level));
+	add_assoc_long(return_value, "sample_rate", sample_rate);
 }
 
-#if PHP_VERSION_ID < 70000
-static int tw_convert_to_string(void *pDest TSRMLS_DC)
+/**
+ * Per function metrics summed over all profiles of all workers sharing the
+ * table of tideways.shm_functions, false when there is no table.
+ */
+PHP_FUNCTION(tideways_shm_stats)
 {
-	zval **zv = (zval **) pDest;
+#if PHP_VERSION_ID >= 70000
+	zval functions, function;
 #else
-static int tw_convert_to_string(zval *pDest TSRMLS_DC)
-{
-	zval *zv = pDest;
+	zval *functions, *function;
 #endif
+	tw_shm_function *slot;
+	long i;
 
-	convert_to_string_ex(zv);
-
-	return ZEND_HASH_APPLY_KEEP;
-}
-
-PHP_FUNCTION(tideways_span_create)
-{
-	char *category = NULL;
-	strsize_t category_len;
-
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &category, &category_len) == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "") == FAILURE) {
 		return;
 	}
 
-	if (TWG(enabled) == 0) {
-		return;
+	if (tw_shm == NULL) {
+		RETURN_FALSE;
 	}
 
-	RETURN_LONG(tw_span_create(category, category_len TSRMLS_CC));
-}
+	array_init(return_value);
+	add_assoc_long(return_value, "size", tw_shm->size);
+	add_assoc_long(return_value, "profiles", (long)tw_shm->profiles);
+	add_assoc_long(return_value, "dropped", (long)tw_shm->dropped);
 
-PHP_FUNCTION(tideways_get_spans)
-{
 #if PHP_VERSION_ID >= 70000
-    RETURN_ZVAL(&TWG(spans), 1, 0);
+	array_init(&functions);
 #else
-	if (TWG(spans)) {
-		RETURN_ZVAL(TWG(spans), 1, 0);
+	MAKE_STD_ZVAL(functions);
+	array_init(functions);
+#endif
+
+	for (i = 0; i < tw_shm->size; i++) {
+		slot = &tw_shm->functions[i];
+
+		if (!slot->ready) {
+			continue;
+		}
+
+#if PHP_VERSION_ID >= 70000
+		array_init(&function);
+		add_assoc_long(&function, "ct", (long)slot->ct);
+		add_assoc_long(&function, "wt", (long)slot->wt);
+		add_assoc_long(&function, "cpu", (long)slot->cpu);
+		add_assoc_long(&function, "excl_wt", (long)slot->excl_wt);
+		add_assoc_long(&function, "excl_cpu", (long)slot->excl_cpu);
+		add_assoc_zval(&functions, slot->name, &function);
+#else
+		MAKE_STD_ZVAL(function);
+		array_init(function);
+		add_assoc_long(function, "ct", (long)slot->ct);
+		add_assoc_long(function, "wt", (long)slot->wt);
+		add_assoc_long(function, "cpu", (long)slot->cpu);
+		add_assoc_long(function, "excl_wt", (long)slot->excl_wt);
+		add_assoc_long(function, "excl_cpu", (long)slot->excl_cpu);
+		add_assoc_zval(functions, slot->name, function);
+#endif
 	}
+
+#if PHP_VERSION_ID >= 70000
+	add_assoc_zval(return_value, "functions", &functions);
+#else
+	add_assoc_zval(return_value, "functions", functions);
 #endif
 }
 
@@ -3610,6 +8613,7 @@ PHP_FUNCTION(tideways_span_timer_start)
 	}
 
 	tw_span_timer_start(spanId TSRMLS_CC);
+	tw_span_push(spanId TSRMLS_CC);
 }
 
 PHP_FUNCTION(tideways_span_timer_stop)
@@ -3624,6 +8628,7 @@ PHP_FUNCTION(tideways_span_timer_stop)
 		return;
 	}
 
+	tw_span_pop(spanId TSRMLS_CC);
 	tw_span_timer_stop(spanId TSRMLS_CC);
 }
 
@@ -3642,7 +8647,183 @@ PHP_FUNCTION(tideways_span_annotate)
 
 PHP_FUNCTION(tideways_sql_minify)
 {
-	RETURN_EMPTY_STRING();
+	char *sql, summary[SCRATCH_BUF_LEN];
+	strsize_t sql_len;
+	size_t len;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &sql, &sql_len) == FAILURE) {
+		return;
+	}
+
+	len = tw_sql_summary(sql, sql_len, summary, sizeof(summary));
+
+#if PHP_VERSION_ID >= 70000
+	RETURN_STRINGL(summary, len);
+#else
+	RETURN_STRINGL(summary, len, 1);
+#endif
+}
+
+/* Live objects of one class counted by tideways_object_census() */
+typedef struct tw_census_class {
+	zend_class_entry *ce;
+	long count;
+	long bytes;
+} tw_census_class;
+
+static int tw_census_class_compare(const void *a, const void *b)
+{
+	const tw_census_class *ca = a, *cb = b;
+
+	if (ca->bytes != cb->bytes) {
+		return ca->bytes < cb->bytes ? 1 : -1;
+	}
+
+	return ca->count < cb->count ? 1 : (ca->count > cb->count ? -1 : 0);
+}
+
+/**
+ * Approximate size of an object: the object itself, its declared property
+ * slots and the table of dynamic properties. Memory owned by internal
+ * classes and property values are not included.
+ */
+#if PHP_VERSION_ID >= 70000
+static long tw_census_object_size(zend_object *obj)
+{
+	long size = sizeof(zend_object);
+
+	if (obj->ce->default_properties_count > 1) {
+		size += sizeof(zval) * (obj->ce->default_properties_count - 1);
+	}
+
+	if (obj->properties != NULL) {
+		size += sizeof(HashTable) + obj->properties->nTableSize * sizeof(Bucket);
+	}
+
+	return size;
+}
+#else
+static long tw_census_object_size(zend_object *obj)
+{
+	long size = sizeof(zend_object);
+
+#if PHP_VERSION_ID >= 50400
+	size += obj->ce->default_properties_count * (sizeof(zval *) + sizeof(zval));
+#endif
+
+	if (obj->properties != NULL) {
+		size += sizeof(HashTable) + obj->properties->nTableSize * (sizeof(Bucket) + sizeof(Bucket *));
+	}
+
+	return size;
+}
+#endif
+
+/**
+ * Counts the live objects in the object store by class, returns up to $limit
+ * classes (0 for all) with the most bytes: array(class => array(count, bytes)).
+ */
+PHP_FUNCTION(tideways_object_census)
+{
+	zend_long limit = 20;
+	zend_object *obj;
+	uint32_t i;
+	HashTable classes;
+	tw_census_class empty, *class_ptr, *sorted;
+	int count = 0;
+	_DECLARE_ZVAL(entry);
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &limit) == FAILURE) {
+		return;
+	}
+
+	zend_hash_init(&classes, 64, NULL, NULL, 0);
+	memset(&empty, 0, sizeof(tw_census_class));
+
+	for (i = 1; i < EG(objects_store).top; i++) {
+#if PHP_VERSION_ID >= 70000
+		obj = EG(objects_store).object_buckets[i];
+
+		if (!IS_OBJ_VALID(obj) || obj->ce == NULL) {
+			continue;
+		}
+
+		class_ptr = zend_hash_index_find_ptr(&classes, (zend_ulong)obj->ce);
+
+		if (class_ptr == NULL) {
+			empty.ce = obj->ce;
+			class_ptr = zend_hash_index_update_mem(&classes, (zend_ulong)obj->ce, &empty, sizeof(tw_census_class));
+		}
+#else
+		if (!EG(objects_store).object_buckets[i].valid) {
+			continue;
+		}
+
+		obj = (zend_object *) EG(objects_store).object_buckets[i].bucket.obj.object;
+
+		if (obj == NULL || obj->ce == NULL) {
+			continue;
+		}
+
+		if (zend_hash_index_find(&classes, (ulong)obj->ce, (void **)&class_ptr) == FAILURE) {
+			empty.ce = obj->ce;
+			zend_hash_index_update(&classes, (ulong)obj->ce, &empty, sizeof(tw_census_class), (void **)&class_ptr);
+		}
+#endif
+
+		class_ptr->count++;
+		class_ptr->bytes += tw_census_object_size(obj);
+	}
+
+	sorted = safe_emalloc(zend_hash_num_elements(&classes) + 1, sizeof(tw_census_class), 0);
+
+#if PHP_VERSION_ID >= 70000
+	ZEND_HASH_FOREACH_PTR(&classes, class_ptr) {
+		sorted[count++] = *class_ptr;
+	} ZEND_HASH_FOREACH_END();
+
+	/* Entries were allocated by zend_hash_index_update_mem() */
+	ZEND_HASH_FOREACH_PTR(&classes, class_ptr) {
+		efree(class_ptr);
+	} ZEND_HASH_FOREACH_END();
+#else
+	{
+		HashPosition pos;
+
+		for (zend_hash_internal_pointer_reset_ex(&classes, &pos);
+			zend_hash_get_current_data_ex(&classes, (void **)&class_ptr, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(&classes, &pos)) {
+			sorted[count++] = *class_ptr;
+		}
+	}
+#endif
+
+	zend_hash_destroy(&classes);
+
+	qsort(sorted, count, sizeof(tw_census_class), tw_census_class_compare);
+
+	if (limit > 0 && count > limit) {
+		count = (int)limit;
+	}
+
+	array_init(return_value);
+
+	for (i = 0; i < (uint32_t)count; i++) {
+#if PHP_VERSION_ID < 70000
+		MAKE_STD_ZVAL(entry);
+#endif
+		array_init(entry);
+		add_assoc_long(entry, "count", sorted[i].count);
+		add_assoc_long(entry, "bytes", sorted[i].bytes);
+
+#if PHP_VERSION_ID >= 70000
+		zend_hash_update(Z_ARRVAL_P(return_value), sorted[i].ce->name, entry);
+#else
+		add_assoc_zval_ex(return_value, sorted[i].ce->name, sorted[i].ce->name_length + 1, entry);
+#endif
+	}
+
+	efree(sorted);
 }
 
 #ifdef PHP_WIN32